@@ -0,0 +1,278 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "MappedFile.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Single file asset pack ////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Layout:  [PackHeader] [PackEntry x entryCount, sorted by hash] [names] [blobs, each aligned to PackAlignment]
+// The whole pack is memory mapped, lookups are a binary search over the hashes, and every asset is handed out as a
+// pointer straight into the mapping so shaders and images are read without any extra copies or file opens.
+// Every entry remembers the size and modification time of the file it was packed from. When that file is still around
+// and no longer matches, find() leaves the entry alone so the caller loads the file instead: an edited shader is used
+// right away rather than the copy in a pack nobody rebuilt. Without the loose file (a shipped build) the pack is used.
+
+enum AssetType
+{
+    ASSET_RAW = 0,
+    ASSET_SHADER = 1,
+    ASSET_TEXTURE = 2,
+    ASSET_MESH = 3
+};
+
+const uint32_t PackMagic = 0x4B434150; // "PACK"
+const uint32_t PackVersion = 2;
+const uint64_t PackAlignment = 64;
+
+struct PackHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t reserved;
+    uint64_t namesOffset;
+    uint64_t namesSize;
+};
+
+struct PackEntry
+{
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t sourceSize;    // of the packed file, 0 when there was none
+    int64_t sourceTime;
+    uint32_t type;
+    uint32_t nameOffset;
+};
+
+struct AssetView
+{
+    const unsigned char* data;
+    size_t size;
+    AssetType type;
+};
+
+// Asset names are relative paths, hashed case insensitive with forward slashes so "Resources\Textures\Floor.jpg"
+// and "resources/textures/floor.jpg" find the same entry, just like they would on Windows.
+inline std::string normalizeAssetName(const std::string& name)
+{
+    std::string result = name;
+    for (size_t i = 0; i < result.size(); i++)
+    {
+        char c = result[i];
+        if (c == '\\')
+            c = '/';
+        if (c >= 'A' && c <= 'Z')
+            c = (char)(c - 'A' + 'a');
+        result[i] = c;
+    }
+    while (result.compare(0, 2, "./") == 0)
+        result.erase(0, 2);
+    return result;
+}
+
+// 64 bit FNV-1a
+inline uint64_t hashAssetName(const std::string& name)
+{
+    std::string normalized = normalizeAssetName(name);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < normalized.size(); i++)
+    {
+        hash ^= (unsigned char)normalized[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Size and modification time of a file, false if it doesn't exist
+inline bool assetSourceStamp(const std::string& path, uint64_t& size, int64_t& time)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+    size = (uint64_t)info.st_size;
+    time = (int64_t)info.st_mtime;
+    return true;
+}
+
+/////////////////////////////////////// Runtime reader ///////////////////////////////////////////////////
+class AssetPack
+{
+public:
+    AssetPack() : header(NULL), entries(NULL) {}
+
+    bool open(const char* path)
+    {
+        header = NULL;
+        entries = NULL;
+        if (!file.open(path))
+            return false;
+        if (file.length() < sizeof(PackHeader))
+        {
+            std::cout << "Asset pack " << path << " is truncated" << std::endl;
+            file.close();
+            return false;
+        }
+        const PackHeader* candidate = (const PackHeader*)file.bytes();
+        if (candidate->magic != PackMagic || candidate->version != PackVersion ||
+            sizeof(PackHeader) + (uint64_t)candidate->entryCount * sizeof(PackEntry) > file.length())
+        {
+            std::cout << "Asset pack " << path << " has an unknown format" << std::endl;
+            file.close();
+            return false;
+        }
+        header = candidate;
+        entries = (const PackEntry*)(file.bytes() + sizeof(PackHeader));
+        return true;
+    }
+
+    bool isOpen() const { return header != NULL; }
+
+    // Returns false if the pack isn't open or doesn't contain the asset
+    bool find(const std::string& name, AssetView& view) const
+    {
+        if (!header)
+            return false;
+        uint64_t hash = hashAssetName(name);
+        const PackEntry* end = entries + header->entryCount;
+        const PackEntry* entry = std::lower_bound(entries, end, hash, [](const PackEntry& e, uint64_t h) { return e.hash < h; });
+        if (entry == end || entry->hash != hash || entry->offset + entry->size > file.length())
+            return false;
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        if (entry->sourceSize && assetSourceStamp(name, sourceSize, sourceTime) &&
+            (sourceSize != entry->sourceSize || sourceTime != entry->sourceTime))
+        {
+            std::cout << "Asset pack copy of " << name << " is out of date, using the file" << std::endl;
+            return false;
+        }
+        view.data = file.bytes() + entry->offset;
+        view.size = (size_t)entry->size;
+        view.type = (AssetType)entry->type;
+        return true;
+    }
+
+    uint32_t count() const { return header ? header->entryCount : 0; }
+    size_t sizeInBytes() const { return file.length(); }
+
+private:
+    MappedFile file;
+    const PackHeader* header;
+    const PackEntry* entries;
+};
+
+/////////////////////////////////////// Offline writer (used by the AssetPacker tool) ////////////////////////
+class AssetPackWriter
+{
+public:
+    // sourceSize and sourceTime stamp the file the bytes came from, see AssetPack::find
+    void add(const std::string& name, AssetType type, const std::vector<unsigned char>& bytes, uint64_t sourceSize = 0,
+        int64_t sourceTime = 0)
+    {
+        Item item;
+        item.name = normalizeAssetName(name);
+        item.hash = hashAssetName(name);
+        item.type = type;
+        item.bytes = bytes;
+        item.sourceSize = sourceSize;
+        item.sourceTime = sourceTime;
+        items.push_back(item);
+    }
+
+    bool write(const char* path)
+    {
+        std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.hash < b.hash; });
+        for (size_t i = 1; i < items.size(); i++)
+        {
+            if (items[i].hash == items[i - 1].hash)
+            {
+                std::cout << "Asset pack hash collision between " << items[i - 1].name << " and " << items[i].name << std::endl;
+                return false;
+            }
+        }
+
+        std::string names;
+        std::vector<PackEntry> table(items.size());
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            table[i].nameOffset = (uint32_t)names.size();
+            names += items[i].name;
+            names.push_back('\0');
+        }
+
+        PackHeader header;
+        header.magic = PackMagic;
+        header.version = PackVersion;
+        header.entryCount = (uint32_t)items.size();
+        header.reserved = 0;
+        header.namesOffset = sizeof(PackHeader) + items.size() * sizeof(PackEntry);
+        header.namesSize = names.size();
+
+        // blobs are laid out back to back in hash order, so loading everything is one sequential read
+        uint64_t offset = align(header.namesOffset + header.namesSize);
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            table[i].hash = items[i].hash;
+            table[i].offset = offset;
+            table[i].size = items[i].bytes.size();
+            table[i].sourceSize = items[i].sourceSize;
+            table[i].sourceTime = items[i].sourceTime;
+            table[i].type = items[i].type;
+            offset = align(offset + items[i].bytes.size());
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            std::cout << "Could not create asset pack " << path << std::endl;
+            return false;
+        }
+        out.write((const char*)&header, sizeof(header));
+        if (!table.empty())
+            out.write((const char*)table.data(), table.size() * sizeof(PackEntry));
+        out.write(names.data(), names.size());
+        uint64_t written = header.namesOffset + header.namesSize;
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            pad(out, written, table[i].offset);
+            if (!items[i].bytes.empty())
+                out.write((const char*)items[i].bytes.data(), items[i].bytes.size());
+            written += items[i].bytes.size();
+        }
+        pad(out, written, align(written));
+        return (bool)out;
+    }
+
+private:
+    struct Item
+    {
+        std::string name;
+        uint64_t hash;
+        AssetType type;
+        std::vector<unsigned char> bytes;
+        uint64_t sourceSize;
+        int64_t sourceTime;
+    };
+    std::vector<Item> items;
+
+    static uint64_t align(uint64_t value) { return (value + PackAlignment - 1) & ~(PackAlignment - 1); }
+
+    static void pad(std::ofstream& out, uint64_t& written, uint64_t target)
+    {
+        static const char zeros[PackAlignment] = {};
+        while (written < target)
+        {
+            uint64_t count = std::min<uint64_t>(target - written, PackAlignment);
+            out.write(zeros, (std::streamsize)count);
+            written += count;
+        }
+    }
+};
@@ -0,0 +1,94 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////// Project: Windows Renderer - Asset Packer                                                                   ////////////////
+//////////////// Description: Bundles shaders, textures and meshes into the single memory mapped pack the renderer loads.   ////////////////
+////////////////              Usage: AssetPacker [output.pack] [file | @manifest.txt]...                                    ////////////////
+////////////////              With no arguments it packs everything listed in assets.txt into Assets.pack                  ////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "AssetPack.h"
+
+// Picks the asset type from the file extension
+AssetType assetTypeFor(const std::string& path)
+{
+    std::string name = normalizeAssetName(path);
+    size_t dot = name.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : name.substr(dot + 1);
+    if (extension == "vs" || extension == "fs" || extension == "glsl")
+        return ASSET_SHADER;
+    if (extension == "png" || extension == "jpg" || extension == "jpeg" || extension == "tga" || extension == "bmp")
+        return ASSET_TEXTURE;
+    if (extension == "obj" || extension == "gltf" || extension == "glb" || extension == "bin" || extension == "mesh")
+        return ASSET_MESH;
+    return ASSET_RAW;
+}
+
+// Reads a manifest with one asset path per line, blank lines and lines starting with # are skipped
+bool readManifest(const std::string& path, std::vector<std::string>& files)
+{
+    std::ifstream manifest(path);
+    if (!manifest)
+    {
+        std::cout << "Could not open manifest " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+        files.push_back(line);
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string output = "Assets.pack";
+    std::vector<std::string> files;
+    if (argc > 1)
+        output = argv[1];
+    for (int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg[0] == '@')
+        {
+            if (!readManifest(arg.substr(1), files))
+                return -1;
+        }
+        else
+        {
+            files.push_back(arg);
+        }
+    }
+    if (argc <= 2 && !readManifest("assets.txt", files))
+        return -1;
+
+    AssetPackWriter writer;
+    size_t totalBytes = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        std::ifstream file(files[i], std::ios::binary);
+        if (!file)
+        {
+            std::cout << "Could not open " << files[i] << std::endl;
+            return -1;
+        }
+        std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        totalBytes += bytes.size();
+        uint64_t sourceSize = 0;
+        int64_t sourceTime = 0;
+        assetSourceStamp(files[i], sourceSize, sourceTime);
+        writer.add(files[i], assetTypeFor(files[i]), bytes, sourceSize, sourceTime);
+        std::cout << "  " << files[i] << " (" << bytes.size() << " bytes)" << std::endl;
+    }
+    if (!writer.write(output.c_str()))
+        return -1;
+    std::cout << "Packed " << files.size() << " assets (" << totalBytes << " bytes) into " << output << std::endl;
+    return 0;
+}
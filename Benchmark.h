@@ -0,0 +1,85 @@
+#pragma once
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <functional>
+#include <glad/glad.h>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Timing helpers for the --bench modes /////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Run the program with "--bench <name>" to run a benchmark instead of the interactive scene. Every benchmark prints one
+// table row per configuration with the CPU time spent issuing the work and the GPU time measured with a timer query.
+
+class CpuTimer
+{
+public:
+    CpuTimer() { reset(); }
+    void reset() { start = std::chrono::steady_clock::now(); }
+    double milliseconds() const { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+// GL_TIME_ELAPSED query around a block of GL commands, reading the result waits for the GPU
+class GpuTimer
+{
+public:
+    GpuTimer() { glGenQueries(1, &query); }
+    ~GpuTimer() { glDeleteQueries(1, &query); }
+    void begin() { glBeginQuery(GL_TIME_ELAPSED, query); }
+    void end() { glEndQuery(GL_TIME_ELAPSED); }
+    double milliseconds() const
+    {
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+        return nanoseconds / 1.0e6;
+    }
+
+private:
+    GpuTimer(const GpuTimer&);
+    GpuTimer& operator=(const GpuTimer&);
+    unsigned int query;
+};
+
+// Prints the header for a benchmark table, columns are set up by the caller with printBenchmarkCell
+inline void printBenchmarkHeader(const std::string& title, const char* const* columns, int columnCount)
+{
+    std::cout << "---------------- " << title << " ----------------" << std::endl;
+    for (int i = 0; i < columnCount; i++)
+        std::cout << std::setw(16) << columns[i];
+    std::cout << std::endl;
+}
+
+inline void printBenchmarkCell(double value, int precision = 3)
+{
+    std::cout << std::setw(16) << std::fixed << std::setprecision(precision) << value;
+}
+
+// Clears and runs submit() frames + 1 times, the first frame warms up and isn't counted.
+// Returns the average CPU time spent in submit() and the average GPU time of the work it issued.
+inline void timeFrames(int frames, const std::function<void()>& submit, double& cpuMilliseconds, double& gpuMilliseconds)
+{
+    GpuTimer gpuTimer;
+    cpuMilliseconds = 0.0;
+    gpuMilliseconds = 0.0;
+    for (int frame = 0; frame <= frames; frame++)
+    {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        CpuTimer cpuTimer;
+        gpuTimer.begin();
+        submit();
+        gpuTimer.end();
+        double cpu = cpuTimer.milliseconds();
+        double gpu = gpuTimer.milliseconds();
+        if (frame > 0)
+        {
+            cpuMilliseconds += cpu;
+            gpuMilliseconds += gpu;
+        }
+    }
+    cpuMilliseconds /= frames;
+    gpuMilliseconds /= frames;
+}
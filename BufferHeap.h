@@ -0,0 +1,593 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <glad/glad.h>
+#include "GpuMemory.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Suballocator for large GL buffers ////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A few large immutable buffers ("arenas") are reserved up front and handed out in ranges by a TLSF allocator
+// (two level segregated fit: constant time allocate and free, bounded fragmentation). Ranges are aligned for their use:
+//   vertex   a multiple of the vertex stride (so BaseVertex = offset / stride) and of 16 bytes
+//   index    16 bytes
+//   indirect 16 bytes
+//   uniform  GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+//   storage  GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT
+// Freed ranges are held back behind a fence until the GPU is done with them. compact() moves live ranges down into
+// holes with glCopyNamedBufferSubData a few at a time, so it can run every frame within a byte budget, and reports
+// each move through a callback. Allocations are referred to by handles, which stay valid when their data moves.
+
+enum BufferUsage
+{
+    BUFFER_USAGE_VERTEX,
+    BUFFER_USAGE_INDEX,
+    BUFFER_USAGE_UNIFORM,
+    BUFFER_USAGE_STORAGE,
+    BUFFER_USAGE_INDIRECT
+};
+
+struct BufferAllocation
+{
+    unsigned int Handle;
+    unsigned int Arena;
+    unsigned int Buffer;    // GL buffer of the arena
+    size_t Offset;
+    size_t Size;
+};
+
+struct BufferHeapStats
+{
+    size_t Arenas;
+    size_t ReservedBytes;
+    size_t UsedBytes;
+    size_t FreeBytes;
+    size_t PendingBytes;        // freed or moved, waiting on the GPU
+    size_t LargestFreeBlock;
+    size_t FreeBlocks;
+    size_t Allocations;
+    size_t BytesMoved;          // by compaction, since the heap was created
+
+    // 0 when all free space is one block, towards 1 as it splinters
+    float fragmentation() const { return FreeBytes ? 1.0f - (float)LargestFreeBlock / (float)FreeBytes : 0.0f; }
+
+    void print(std::ostream& out) const
+    {
+        const double mb = 1024.0 * 1024.0;
+        out << std::fixed << std::setprecision(2) << "  " << Allocations << " allocations in " << Arenas << " arenas, "
+            << UsedBytes / mb << " of " << ReservedBytes / mb << " MB used, " << PendingBytes / mb << " MB pending free" << std::endl
+            << "  " << FreeBlocks << " free blocks, largest " << LargestFreeBlock / mb << " MB, fragmentation "
+            << fragmentation() * 100.0f << "%, " << BytesMoved / mb << " MB moved by compaction" << std::endl;
+    }
+};
+
+class BufferHeap
+{
+public:
+    // Called after compaction moved an allocation, with its new placement and the offset it had in its old arena
+    typedef std::function<void(const BufferAllocation& allocation, size_t oldOffset)> RelocationCallback;
+
+    ///////////////////////// Constructor Function ////////////////////////////////////////////////
+    BufferHeap(size_t arenaSize = 64 * 1024 * 1024, GpuMemoryCategory category = GPU_MEMORY_VERTEX_DATA)
+        : arenaSize(roundUp(arenaSize, Granularity)), category(category), arenasCreated(0), flBitmap(0), bytesMoved(0)
+    {
+        for (int fl = 0; fl < FirstLevels; fl++)
+        {
+            slBitmap[fl] = 0;
+            for (int sl = 0; sl < SecondLevels; sl++)
+                heads[fl][sl] = -1;
+        }
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        uniformAlignment = lcm(Granularity, (size_t)std::max(alignment, 1));
+        alignment = 256;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        storageAlignment = lcm(Granularity, (size_t)std::max(alignment, 1));
+    }
+
+    ~BufferHeap()
+    {
+        for (size_t i = 0; i < retired.size(); i++)
+            glDeleteSync(retired[i].fence);
+        for (size_t i = 0; i < arenas.size(); i++)
+            if (arenas[i].buffer)
+                gpuDeleteBuffers(1, &arenas[i].buffer);
+    }
+
+    size_t alignmentFor(BufferUsage usage, size_t stride = 0) const
+    {
+        switch (usage)
+        {
+        case BUFFER_USAGE_VERTEX: return stride ? lcm(Granularity, stride) : Granularity;
+        case BUFFER_USAGE_UNIFORM: return uniformAlignment;
+        case BUFFER_USAGE_STORAGE: return storageAlignment;
+        default: return Granularity;
+        }
+    }
+
+    // stride is only used for vertex ranges. Opens a new arena when no existing one has room.
+    bool allocate(size_t size, BufferUsage usage, size_t stride, BufferAllocation& allocation)
+    {
+        size = roundUp(std::max<size_t>(size, 1), Granularity);
+        size_t alignment = alignmentFor(usage, stride);
+        size_t search = size + alignment - Granularity;
+        int block = findFree(search);
+        if (block < 0)
+        {
+            if (!createArena(std::max(arenaSize, roundUp(search, Granularity))))
+                return false;
+            block = findFree(search);
+            if (block < 0)
+                return false;
+        }
+        block = place(block, size, alignment);
+
+        unsigned int handle;
+        if (!freeHandles.empty())
+        {
+            handle = freeHandles.back();
+            freeHandles.pop_back();
+            handles[handle] = block;
+        }
+        else
+        {
+            handle = (unsigned int)handles.size();
+            handles.push_back(block);
+        }
+        blocks[block].handle = handle;
+        allocation = get(handle);
+        return true;
+    }
+
+    // The range stays reserved until the GPU has finished every command issued so far
+    void free(unsigned int handle)
+    {
+        if (handle >= handles.size() || handles[handle] < 0)
+            return;
+        retire(handles[handle]);
+        handles[handle] = -1;
+        freeHandles.push_back(handle);
+    }
+
+    BufferAllocation get(unsigned int handle) const
+    {
+        const Block& b = blocks[handles[handle]];
+        BufferAllocation allocation = { handle, b.arena, arenas[b.arena].buffer, b.offset, b.size };
+        return allocation;
+    }
+
+    void upload(unsigned int handle, const void* data, size_t size, size_t offset = 0)
+    {
+        BufferAllocation allocation = get(handle);
+        glNamedBufferSubData(allocation.Buffer, allocation.Offset + offset, size, data);
+    }
+
+    // Returns ranges the GPU is done with to the free lists and releases arenas that became empty. Call once a frame.
+    void update()
+    {
+        for (size_t i = 0; i < retired.size();)
+        {
+            GLenum status = glClientWaitSync(retired[i].fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            {
+                i++;
+                continue;
+            }
+            glDeleteSync(retired[i].fence);
+            releaseBlock(retired[i].block);
+            retired[i] = retired.back();
+            retired.pop_back();
+        }
+
+        // the first arena is kept so the heap doesn't thrash around an empty state
+        for (size_t a = 1; a < arenas.size(); a++)
+        {
+            Arena& arena = arenas[a];
+            if (!arena.buffer)
+                continue;
+            const Block& first = blocks[arena.firstBlock];
+            if (first.state == Free && first.nextPhys < 0)
+            {
+                removeFree(arena.firstBlock);
+                recycleBlock(arena.firstBlock);
+                gpuDeleteBuffers(1, &arena.buffer);
+                arena.buffer = 0;
+                arena.generation = 0;
+                arena.firstBlock = -1;
+            }
+        }
+    }
+
+    // Moves live allocations into the lowest hole that fits, in an earlier arena or further down their own, until
+    // maxBytes have been copied. Later arenas are emptied first so update() can release them. Returns the bytes moved.
+    size_t compact(size_t maxBytes, const RelocationCallback& moved)
+    {
+        size_t budget = 0;
+        for (size_t a = arenas.size(); a-- > 0 && budget < maxBytes;)
+        {
+            if (!arenas[a].buffer)
+                continue;
+            // live allocations from the top of the arena down
+            std::vector<int> used;
+            for (int b = arenas[a].firstBlock; b >= 0; b = blocks[b].nextPhys)
+                if (blocks[b].state == Used)
+                    used.push_back(b);
+            for (size_t u = used.size(); u-- > 0 && budget < maxBytes;)
+            {
+                int source = used[u];
+                int target = lowestFit(a, blocks[source].offset, blocks[source].size, blocks[source].alignment);
+                if (target < 0)
+                    continue;
+                Block copy = blocks[source];
+                int destination = place(target, copy.size, copy.alignment);
+                glCopyNamedBufferSubData(arenas[copy.arena].buffer, arenas[blocks[destination].arena].buffer,
+                    copy.offset, blocks[destination].offset, copy.size);
+                blocks[destination].handle = copy.handle;
+                handles[copy.handle] = destination;
+                retire(source);
+                budget += copy.size;
+                bytesMoved += copy.size;
+                if (moved)
+                    moved(get(copy.handle), copy.offset);
+            }
+        }
+        return budget;
+    }
+
+    BufferHeapStats stats() const
+    {
+        BufferHeapStats s = {};
+        for (size_t a = 0; a < arenas.size(); a++)
+        {
+            if (!arenas[a].buffer)
+                continue;
+            s.Arenas++;
+            s.ReservedBytes += arenas[a].size;
+            for (int b = arenas[a].firstBlock; b >= 0; b = blocks[b].nextPhys)
+            {
+                const Block& block = blocks[b];
+                if (block.state == Used)
+                {
+                    s.UsedBytes += block.size;
+                    s.Allocations++;
+                }
+                else if (block.state == Retired)
+                    s.PendingBytes += block.size;
+                else
+                {
+                    s.FreeBytes += block.size;
+                    s.FreeBlocks++;
+                    s.LargestFreeBlock = std::max(s.LargestFreeBlock, block.size);
+                }
+            }
+        }
+        s.BytesMoved = bytesMoved;
+        return s;
+    }
+
+    size_t arenaCount() const { return arenas.size(); }
+    unsigned int arenaBuffer(unsigned int arena) const { return arenas[arena].buffer; }
+    // Changes whenever the arena's slot gets a new buffer, 0 while it has none. GL often hands a deleted buffer's name
+    // straight back, so state built on the old buffer (a VAO) has to compare this rather than the name.
+    unsigned int arenaGeneration(unsigned int arena) const { return arenas[arena].generation; }
+
+private:
+    // owns GL objects
+    BufferHeap(const BufferHeap&);
+    BufferHeap& operator=(const BufferHeap&);
+
+    static const size_t Granularity = 16;
+    static const int SecondLevelBits = 4;
+    static const int SecondLevels = 1 << SecondLevelBits;
+    static const int FirstLevels = 48;
+
+    enum BlockState
+    {
+        Free,
+        Used,
+        Retired
+    };
+
+    struct Block
+    {
+        size_t offset;
+        size_t size;
+        size_t alignment;
+        unsigned int arena;
+        unsigned int handle;
+        int prevPhys, nextPhys;     // neighbours in the arena, by offset
+        int prevFree, nextFree;     // neighbours in the segregated free list
+        BlockState state;
+    };
+
+    struct Arena
+    {
+        unsigned int buffer;
+        unsigned int generation;
+        size_t size;
+        int firstBlock;
+    };
+
+    struct RetiredBlock
+    {
+        int block;
+        GLsync fence;
+    };
+
+    size_t arenaSize;
+    GpuMemoryCategory category;
+    unsigned int arenasCreated;
+    size_t uniformAlignment;
+    size_t storageAlignment;
+    std::vector<Arena> arenas;
+    std::vector<Block> blocks;
+    std::vector<int> unusedBlocks;
+    std::vector<int> handles;               // handle -> block, -1 once freed
+    std::vector<unsigned int> freeHandles;
+    std::vector<RetiredBlock> retired;
+    uint64_t flBitmap;
+    uint32_t slBitmap[FirstLevels];
+    int heads[FirstLevels][SecondLevels];
+    size_t bytesMoved;
+
+    static size_t roundUp(size_t value, size_t multiple) { return (value + multiple - 1) / multiple * multiple; }
+    static size_t gcd(size_t a, size_t b) { while (b) { size_t t = a % b; a = b; b = t; } return a; }
+    static size_t lcm(size_t a, size_t b) { return a / gcd(a, b) * b; }
+
+    static int highestBit(uint64_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return (int)index;
+#else
+        return 63 - __builtin_clzll(value);
+#endif
+    }
+
+    static int lowestBit(uint64_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, value);
+        return (int)index;
+#else
+        return __builtin_ctzll(value);
+#endif
+    }
+
+    ///////////////////////////////////// TLSF size classes ////////////////////////////////////////////
+    static void mapping(size_t size, int& fl, int& sl)
+    {
+        uint64_t units = size / Granularity;
+        fl = highestBit(units);
+        if (fl < SecondLevelBits)
+            sl = (int)((units << (SecondLevelBits - fl)) - SecondLevels);
+        else
+            sl = (int)((units >> (fl - SecondLevelBits)) - SecondLevels);
+    }
+
+    // Rounds the size up to the next class so any block found there is big enough
+    static void mappingSearch(size_t size, int& fl, int& sl)
+    {
+        uint64_t units = size / Granularity;
+        int level = highestBit(units);
+        if (level >= SecondLevelBits)
+            units += ((uint64_t)1 << (level - SecondLevelBits)) - 1;
+        mapping(units * Granularity, fl, sl);
+    }
+
+    int findFree(size_t size) const
+    {
+        int fl, sl;
+        mappingSearch(size, fl, sl);
+        if (fl >= FirstLevels)
+            return -1;
+        uint32_t slMap = slBitmap[fl] & (~0u << sl);
+        if (!slMap)
+        {
+            uint64_t flMap = fl + 1 < 64 ? flBitmap & (~(uint64_t)0 << (fl + 1)) : 0;
+            if (!flMap)
+                return -1;
+            fl = lowestBit(flMap);
+            slMap = slBitmap[fl];
+        }
+        sl = lowestBit(slMap);
+        return heads[fl][sl];
+    }
+
+    void insertFree(int index)
+    {
+        Block& b = blocks[index];
+        int fl, sl;
+        mapping(b.size, fl, sl);
+        b.state = Free;
+        b.prevFree = -1;
+        b.nextFree = heads[fl][sl];
+        if (b.nextFree >= 0)
+            blocks[b.nextFree].prevFree = index;
+        heads[fl][sl] = index;
+        flBitmap |= (uint64_t)1 << fl;
+        slBitmap[fl] |= 1u << sl;
+    }
+
+    void removeFree(int index)
+    {
+        Block& b = blocks[index];
+        int fl, sl;
+        mapping(b.size, fl, sl);
+        if (b.prevFree >= 0)
+            blocks[b.prevFree].nextFree = b.nextFree;
+        else
+            heads[fl][sl] = b.nextFree;
+        if (b.nextFree >= 0)
+            blocks[b.nextFree].prevFree = b.prevFree;
+        if (heads[fl][sl] < 0)
+        {
+            slBitmap[fl] &= ~(1u << sl);
+            if (!slBitmap[fl])
+                flBitmap &= ~((uint64_t)1 << fl);
+        }
+        b.prevFree = b.nextFree = -1;
+    }
+
+    ///////////////////////////////////// Blocks ///////////////////////////////////////////////////////
+    int newBlock()
+    {
+        if (!unusedBlocks.empty())
+        {
+            int index = unusedBlocks.back();
+            unusedBlocks.pop_back();
+            return index;
+        }
+        blocks.push_back(Block());
+        return (int)blocks.size() - 1;
+    }
+
+    void recycleBlock(int index)
+    {
+        unusedBlocks.push_back(index);
+    }
+
+    bool createArena(size_t size)
+    {
+        Arena arena;
+        glGenBuffers(1, &arena.buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, arena.buffer);
+        gpuBufferStorage(arena.buffer, GL_COPY_WRITE_BUFFER, size, NULL, GL_DYNAMIC_STORAGE_BIT, category);
+        if (glGetError() == GL_OUT_OF_MEMORY)
+        {
+            std::cout << "Failed to reserve a " << size / (1024 * 1024) << " MB buffer heap arena" << std::endl;
+            gpuDeleteBuffers(1, &arena.buffer);
+            return false;
+        }
+        arena.size = size;
+        arena.generation = ++arenasCreated;
+        arena.firstBlock = newBlock();
+
+        // reuse the slot of an arena that was released
+        unsigned int index = (unsigned int)arenas.size();
+        for (size_t a = 0; a < arenas.size(); a++)
+            if (!arenas[a].buffer)
+                index = (unsigned int)a;
+        if (index == arenas.size())
+            arenas.push_back(arena);
+        else
+            arenas[index] = arena;
+
+        Block& b = blocks[arena.firstBlock];
+        b.offset = 0;
+        b.size = size;
+        b.alignment = Granularity;
+        b.arena = index;
+        b.handle = 0;
+        b.prevPhys = b.nextPhys = -1;
+        insertFree(arena.firstBlock);
+        return true;
+    }
+
+    // Cuts `size` bytes at the start of block index off into a new block placed before it
+    int splitFront(int index, size_t size)
+    {
+        int front = newBlock();
+        Block& b = blocks[index];
+        Block& f = blocks[front];
+        f = b;
+        f.size = size;
+        f.nextPhys = index;
+        if (f.prevPhys >= 0)
+            blocks[f.prevPhys].nextPhys = front;
+        else
+            arenas[f.arena].firstBlock = front;
+        b.prevPhys = front;
+        b.offset += size;
+        b.size -= size;
+        return front;
+    }
+
+    // Takes an aligned range of size bytes out of free block index, the rest goes back on the free lists
+    int place(int index, size_t size, size_t alignment)
+    {
+        removeFree(index);
+        size_t aligned = roundUp(blocks[index].offset, alignment);
+        size_t padding = aligned - blocks[index].offset;
+        if (padding > 0)
+            insertFree(splitFront(index, padding));
+        if (blocks[index].size - size >= Granularity)
+        {
+            // keep the front, free the tail
+            int front = splitFront(index, size);
+            insertFree(index);
+            index = front;
+        }
+        blocks[index].state = Used;
+        blocks[index].alignment = alignment;
+        return index;
+    }
+
+    void retire(int index)
+    {
+        blocks[index].state = Retired;
+        RetiredBlock r = { index, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) };
+        retired.push_back(r);
+    }
+
+    // Marks a block free and merges it with free neighbours
+    void releaseBlock(int index)
+    {
+        Block& b = blocks[index];
+        int prev = b.prevPhys;
+        if (prev >= 0 && blocks[prev].state == Free)
+        {
+            removeFree(prev);
+            b.offset = blocks[prev].offset;
+            b.size += blocks[prev].size;
+            b.prevPhys = blocks[prev].prevPhys;
+            if (b.prevPhys >= 0)
+                blocks[b.prevPhys].nextPhys = index;
+            else
+                arenas[b.arena].firstBlock = index;
+            recycleBlock(prev);
+        }
+        int next = b.nextPhys;
+        if (next >= 0 && blocks[next].state == Free)
+        {
+            removeFree(next);
+            b.size += blocks[next].size;
+            b.nextPhys = blocks[next].nextPhys;
+            if (b.nextPhys >= 0)
+                blocks[b.nextPhys].prevPhys = index;
+            recycleBlock(next);
+        }
+        insertFree(index);
+    }
+
+    // Lowest free block that can hold an aligned range of size bytes, in an arena before `arena` or in `arena`
+    // below offset `below`
+    int lowestFit(size_t arena, size_t below, size_t size, size_t alignment) const
+    {
+        for (size_t a = 0; a <= arena; a++)
+        {
+            if (!arenas[a].buffer)
+                continue;
+            size_t limit = a < arena ? arenas[a].size : below;
+            for (int b = arenas[a].firstBlock; b >= 0 && blocks[b].offset < limit; b = blocks[b].nextPhys)
+            {
+                const Block& block = blocks[b];
+                if (block.state != Free)
+                    continue;
+                size_t aligned = roundUp(block.offset, alignment);
+                if (aligned + size <= block.offset + block.size && aligned + size <= limit)
+                    return b;
+            }
+        }
+        return -1;
+    }
+};
@@ -0,0 +1,808 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <iostream>
+#include <cfloat>
+#include <cmath>
+#include <glm.hpp>
+#include "Geometry.h"
+#include "Simd.h"
+#include "JobPool.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Bounding volume hierarchy over scene objects //////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A four wide tree over the boxes of a set of objects, numbered 0..count-1 by the caller. Each node keeps the boxes of its
+// four children as arrays of x, y and z bounds, so one node is tested against a frustum, ray or box with a handful of SSE
+// instructions and fits in two cache lines. The tree is built top down with the surface area heuristic on binned
+// centroids: a split is only made when the expected cost of visiting both halves is lower than testing the objects
+// directly, and up to three splits are collapsed into every node.
+//
+// Moving objects only need setBounds(), update() then refits the leaves they are in and every node above them. Refitting
+// keeps the tree valid but lets it grow worse as objects drift away from where the build put them, so every so often
+// update() compares the tree's SAH cost with what it was after the build and rebuilds when it got too far. The top of a
+// rebuild is split on the calling thread, the subtrees below it are built in parallel.
+
+// Which object a ray hit and how far along the ray, in units of the direction's length
+struct BvhHit
+{
+    unsigned int Object;
+    float Distance;
+};
+
+// 128 bytes, the boxes of four children followed by what they are
+struct BvhNode
+{
+    float MinX[4], MinY[4], MinZ[4];
+    float MaxX[4], MaxY[4], MaxZ[4];
+    // >= 0 an inner node, below zero a leaf holding Count[i] objects from ~Child[i] on in the object order.
+    // Unused slots are leaves with no objects and an empty box, which every test rejects.
+    int Child[4];
+    unsigned int Count[4];
+};
+
+namespace BvhDetail
+{
+    // SAH weights of stepping into a node and of testing one object, relative to each other
+    const float TraversalCost = 1.0f;
+    const float IntersectCost = 1.0f;
+    const float RebuildThreshold = 1.3f;
+    const unsigned int NoParent = 0xffffffffu;
+
+    // What the build sorts, copied out of the object arrays so splitting a range reads memory in order
+    struct Item
+    {
+        Aabb box;
+        glm::vec3 centroid;
+        unsigned int object;
+    };
+
+    // A box grown one item at a time during the build, two registers with SSE2. The loads read a fourth float past each
+    // corner, which the item layout keeps inside the item, and that lane is never looked at.
+    struct Bounds
+    {
+#ifdef SIMD_SSE2
+        __m128 low, high;
+
+        Bounds() : low(_mm_set1_ps(FLT_MAX)), high(_mm_set1_ps(-FLT_MAX)) {}
+        void extend(const Item& item)
+        {
+            low = _mm_min_ps(low, _mm_loadu_ps(&item.box.Min.x));
+            high = _mm_max_ps(high, _mm_loadu_ps(&item.box.Max.x));
+        }
+        void extend(const Bounds& bounds)
+        {
+            low = _mm_min_ps(low, bounds.low);
+            high = _mm_max_ps(high, bounds.high);
+        }
+        Aabb box() const
+        {
+            float l[4], h[4];
+            _mm_storeu_ps(l, low);
+            _mm_storeu_ps(h, high);
+            return Aabb(glm::vec3(l[0], l[1], l[2]), glm::vec3(h[0], h[1], h[2]));
+        }
+        float surfaceArea() const
+        {
+            // (dx dy, dy dz, dz dx) summed, an empty box has no size
+            __m128 d = _mm_max_ps(_mm_sub_ps(high, low), _mm_setzero_ps());
+            __m128 products = _mm_mul_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(3, 0, 2, 1)));
+            __m128 sum = _mm_add_ss(_mm_add_ss(products, _mm_shuffle_ps(products, products, 1)), _mm_movehl_ps(products, products));
+            return 2.0f * _mm_cvtss_f32(sum);
+        }
+#else
+        Aabb bounds;
+
+        void extend(const Item& item) { bounds.extend(item.box); }
+        void extend(const Bounds& other) { bounds.extend(other.bounds); }
+        Aabb box() const { return bounds; }
+        float surfaceArea() const { return bounds.surfaceArea(); }
+#endif
+    };
+
+    // A run of the items with the box around their boxes and the box around their centroids
+    struct Range
+    {
+        unsigned int begin, end;
+        Aabb bounds;
+        Aabb centroids;
+    };
+
+    // A subtree left for another thread, and the slot of the node that will point at it
+    struct Task
+    {
+        Range range;
+        unsigned int depth;
+        int node;
+        int slot;
+    };
+
+    struct RayData
+    {
+        glm::vec3 origin;
+        // 1 / direction, with zero components nudged so the slab distances stay finite
+        glm::vec3 inverse;
+    };
+
+    inline RayData makeRay(const glm::vec3& origin, const glm::vec3& direction)
+    {
+        RayData ray;
+        ray.origin = origin;
+        for (int i = 0; i < 3; i++)
+        {
+            float d = direction[i];
+            if (std::fabs(d) < 1e-20f)
+                d = d < 0.0f ? -1e-20f : 1e-20f;
+            ray.inverse[i] = 1.0f / d;
+        }
+        return ray;
+    }
+
+    inline bool intersectBox(const RayData& ray, const Aabb& box, float maxDistance, float& distance)
+    {
+        float enter = 0.0f, exit = maxDistance;
+        for (int i = 0; i < 3; i++)
+        {
+            float nearPlane = ray.inverse[i] >= 0.0f ? box.Min[i] : box.Max[i];
+            float farPlane = ray.inverse[i] >= 0.0f ? box.Max[i] : box.Min[i];
+            enter = std::max(enter, (nearPlane - ray.origin[i]) * ray.inverse[i]);
+            exit = std::min(exit, (farPlane - ray.origin[i]) * ray.inverse[i]);
+        }
+        distance = enter;
+        return enter <= exit;
+    }
+}
+
+class Bvh
+{
+public:
+    // objects a leaf holds at most, unless the tree got too deep to split further
+    static const unsigned int MaxLeafSize = 4;
+    static const unsigned int MaxDepth = 48;
+    static const int BinCount = 16;
+    // builds below this many objects stay on one thread, and the least a parallel subtree gets
+    static const size_t ParallelThreshold = 16384;
+    static const size_t MinTaskSize = 2048;
+    // update() checks the tree's quality every so many refits and rebuilds when the cost grew by BvhDetail::RebuildThreshold since the build
+    static const unsigned int RebuildCheckInterval = 30;
+
+    explicit Bvh(unsigned int threads = 0)
+        : threadCount(threads ? threads : std::max(1u, std::thread::hardware_concurrency())), builtCost(0.0f), currentCost(0.0f),
+        refitsSinceCheck(0), rebuildCount(0)
+    {
+    }
+
+    // Builds the tree over boxes[object], replacing whatever was there
+    void build(const std::vector<Aabb>& boxes)
+    {
+        objectBoxes = boxes;
+        rebuild();
+    }
+
+    // From scratch over the current boxes, also what update() does when refitting has degraded the tree
+    void rebuild()
+    {
+        nodes.clear();
+        items.resize(objectBoxes.size());
+        for (size_t i = 0; i < objectBoxes.size(); i++)
+        {
+            items[i].box = objectBoxes[i];
+            items[i].centroid = objectBoxes[i].empty() ? glm::vec3(0.0f) : objectBoxes[i].center();
+            items[i].object = (unsigned int)i;
+        }
+
+        BvhDetail::Range all = rangeOf(0, (unsigned int)items.size());
+        size_t taskSize = 0;
+        if (threadCount > 1 && items.size() >= ParallelThreshold)
+            taskSize = std::max<size_t>((size_t)MinTaskSize, items.size() / (threadCount * 8));
+        std::vector<BvhDetail::Task> tasks;
+        buildNode(all, 0, nodes, taskSize, tasks);
+
+        // the subtrees left for later go after the top of the tree, so a child still always comes after its parent
+        std::vector<std::vector<BvhNode>> subtrees(tasks.size());
+        forEachTask(tasks.size(), [&](size_t t)
+        {
+            std::vector<BvhDetail::Task> none;
+            buildNode(tasks[t].range, tasks[t].depth, subtrees[t], 0, none);
+        });
+        for (size_t t = 0; t < tasks.size(); t++)
+        {
+            int offset = (int)nodes.size();
+            for (size_t n = 0; n < subtrees[t].size(); n++)
+            {
+                BvhNode node = subtrees[t][n];
+                for (int i = 0; i < 4; i++)
+                    if (node.Child[i] >= 0)
+                        node.Child[i] += offset;
+                nodes.push_back(node);
+            }
+            nodes[tasks[t].node].Child[tasks[t].slot] = offset;
+        }
+
+        order.resize(items.size());
+        for (size_t i = 0; i < items.size(); i++)
+            order[i] = items[i].object;
+        std::vector<BvhDetail::Item>().swap(items);
+        linkNodes();
+        builtCost = currentCost = sahCost();
+        refitsSinceCheck = 0;
+        rebuildCount++;
+    }
+
+    // The object's new box, the tree catches up in the next update()
+    void setBounds(unsigned int object, const Aabb& box)
+    {
+        objectBoxes[object] = box;
+        unsigned int node = objectSlots[object] >> 2;
+        if (!nodeDirty[node])
+        {
+            nodeDirty[node] = 1;
+            dirtyNodes.push_back(node);
+        }
+    }
+
+    // Refits the nodes above objects that moved, rebuilding once in a while if that has made the tree too slow
+    void update()
+    {
+        if (dirtyNodes.empty())
+            return;
+        refit();
+        if (++refitsSinceCheck < RebuildCheckInterval)
+            return;
+        refitsSinceCheck = 0;
+        currentCost = sahCost();
+        if (currentCost > builtCost * BvhDetail::RebuildThreshold)
+            rebuild();
+    }
+
+    // Only the leaves holding objects that moved and the nodes above them are recomputed, children before parents
+    void refit()
+    {
+        if (dirtyNodes.empty())
+            return;
+        for (size_t i = 0; i < dirtyNodes.size(); i++)
+        {
+            unsigned int parent = parents[dirtyNodes[i]];
+            if (parent != BvhDetail::NoParent && !nodeDirty[parent])
+            {
+                nodeDirty[parent] = 1;
+                dirtyNodes.push_back(parent);
+            }
+        }
+        std::sort(dirtyNodes.begin(), dirtyNodes.end(), [](unsigned int a, unsigned int b) { return a > b; });
+        for (size_t i = 0; i < dirtyNodes.size(); i++)
+        {
+            BvhNode& node = nodes[dirtyNodes[i]];
+            for (int slot = 0; slot < 4; slot++)
+            {
+                Aabb box;
+                if (node.Child[slot] >= 0)
+                    box = nodeBounds(nodes[node.Child[slot]]);
+                else
+                    for (unsigned int o = ~node.Child[slot]; o < ~node.Child[slot] + node.Count[slot]; o++)
+                        box.extend(objectBoxes[order[o]]);
+                setSlot(node, slot, box);
+            }
+            nodeDirty[dirtyNodes[i]] = 0;
+        }
+        dirtyNodes.clear();
+    }
+
+    // Appends every object whose box is at least partly inside the frustum. Nodes entirely inside are taken whole.
+    void queryFrustum(const Frustum& frustum, std::vector<unsigned int>& out) const
+    {
+        if (nodes.empty())
+            return;
+        // each plane tests the box corner furthest along its normal (outside when that is behind it) and the nearest one
+        // (the box crosses the plane when that is behind it)
+        unsigned int stack[StackSize];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            unsigned int entry = stack[--top];
+            const BvhNode& node = nodes[entry >> 1];
+            int visible = 0xf, inside = 0xf;
+            if (!(entry & 1))
+                frustumMasks(node, frustum, visible, inside);
+            for (int slot = 0; slot < 4; slot++)
+            {
+                if (!(visible & (1 << slot)))
+                    continue;
+                unsigned int whole = (entry & 1) | ((inside >> slot) & 1);
+                if (node.Child[slot] >= 0)
+                {
+                    stack[top++] = ((unsigned int)node.Child[slot] << 1) | whole;
+                    continue;
+                }
+                unsigned int first = ~node.Child[slot];
+                for (unsigned int o = first; o < first + node.Count[slot]; o++)
+                    if (whole || frustum.intersectsAabb(objectBoxes[order[o]]))
+                        out.push_back(order[o]);
+            }
+        }
+    }
+
+    // Appends every object whose box overlaps box
+    void queryAabb(const Aabb& box, std::vector<unsigned int>& out) const
+    {
+        if (nodes.empty())
+            return;
+        unsigned int stack[StackSize];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const BvhNode& node = nodes[stack[--top]];
+            int overlap = overlapMask(node, box);
+            for (int slot = 0; slot < 4; slot++)
+            {
+                if (!(overlap & (1 << slot)))
+                    continue;
+                if (node.Child[slot] >= 0)
+                {
+                    stack[top++] = (unsigned int)node.Child[slot];
+                    continue;
+                }
+                unsigned int first = ~node.Child[slot];
+                for (unsigned int o = first; o < first + node.Count[slot]; o++)
+                    if (objectBoxes[order[o]].overlaps(box))
+                        out.push_back(order[o]);
+            }
+        }
+    }
+
+    // The closest object along the ray within maxDistance. intersect(object, closest) is called for every object whose
+    // box the ray enters before the closest hit so far, and returns the distance to the object itself or a negative
+    // value when the ray misses it. Children are visited nearest first, so most boxes behind the first hit are skipped.
+    template <typename Intersect>
+    bool raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, const Intersect& intersect, BvhHit& hit) const
+    {
+        return raycastLeaves(origin, direction, maxDistance, [&](unsigned int first, unsigned int count, float closest, unsigned int& object)
+        {
+            float nearest = -1.0f;
+            for (unsigned int o = first; o < first + count; o++)
+            {
+                float distance = intersect(order[o], closest);
+                if (distance >= 0.0f && distance < closest)
+                {
+                    closest = nearest = distance;
+                    object = order[o];
+                }
+            }
+            return nearest;
+        }, hit);
+    }
+
+    // raycast() a leaf at a time, for callers that test a leaf's objects together. intersect(first, count, closest, object)
+    // gets the leaf's objects as positions first..first + count - 1 of objectAt(), and returns the distance to the
+    // closest one it hits before closest with its object, or a negative value.
+    template <typename IntersectLeaf>
+    bool raycastLeaves(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, const IntersectLeaf& intersect, BvhHit& hit) const
+    {
+        hit.Object = 0xffffffffu;
+        hit.Distance = maxDistance;
+        if (nodes.empty())
+            return false;
+        BvhDetail::RayData ray = BvhDetail::makeRay(origin, direction);
+        struct Entry
+        {
+            unsigned int node;
+            float distance;
+        };
+        Entry stack[StackSize];
+        int top = 0;
+        stack[top].node = 0;
+        stack[top++].distance = 0.0f;
+        while (top > 0)
+        {
+            Entry entry = stack[--top];
+            if (entry.distance > hit.Distance)
+                continue;
+            const BvhNode& node = nodes[entry.node];
+            float distances[4];
+            int mask = rayMask(node, ray, hit.Distance, distances);
+            Entry children[4];
+            int childCount = 0;
+            for (int slot = 0; slot < 4; slot++)
+            {
+                if (!(mask & (1 << slot)))
+                    continue;
+                if (node.Child[slot] >= 0)
+                {
+                    children[childCount].node = (unsigned int)node.Child[slot];
+                    children[childCount++].distance = distances[slot];
+                    continue;
+                }
+                unsigned int object = 0xffffffffu;
+                float distance = intersect((unsigned int)~node.Child[slot], node.Count[slot], hit.Distance, object);
+                if (distance >= 0.0f && distance < hit.Distance)
+                {
+                    hit.Distance = distance;
+                    hit.Object = object;
+                }
+            }
+            // furthest pushed first so the nearest comes off the stack next
+            for (int i = 1; i < childCount; i++)
+                for (int j = i; j > 0 && children[j].distance > children[j - 1].distance; j--)
+                    std::swap(children[j], children[j - 1]);
+            for (int i = 0; i < childCount; i++)
+                stack[top++] = children[i];
+        }
+        return hit.Object != 0xffffffffu;
+    }
+
+    // The closest object box along the ray
+    bool raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, BvhHit& hit) const
+    {
+        BvhDetail::RayData ray = BvhDetail::makeRay(origin, direction);
+        return raycast(origin, direction, maxDistance, [&](unsigned int object, float closest)
+        {
+            float distance;
+            return BvhDetail::intersectBox(ray, objectBoxes[object], closest, distance) ? distance : -1.0f;
+        }, hit);
+    }
+
+    // Expected cost of a query relative to testing the root box: every node's area times its cost, over the root's area
+    float sahCost() const
+    {
+        if (nodes.empty())
+            return 0.0f;
+        float rootArea = nodeBounds(nodes[0]).surfaceArea();
+        if (rootArea <= 0.0f)
+            return 0.0f;
+        float cost = 0.0f;
+        for (size_t n = 0; n < nodes.size(); n++)
+        {
+            const BvhNode& node = nodes[n];
+            for (int slot = 0; slot < 4; slot++)
+            {
+                Aabb box(glm::vec3(node.MinX[slot], node.MinY[slot], node.MinZ[slot]), glm::vec3(node.MaxX[slot], node.MaxY[slot], node.MaxZ[slot]));
+                float area = box.surfaceArea();
+                cost += node.Child[slot] >= 0 ? area * BvhDetail::TraversalCost : area * node.Count[slot] * BvhDetail::IntersectCost;
+            }
+        }
+        return cost / rootArea;
+    }
+
+    const Aabb& bounds(unsigned int object) const { return objectBoxes[object]; }
+    size_t size() const { return objectBoxes.size(); }
+    // The object at a position of the leaf order, leaves hold consecutive positions. Changes when the tree is rebuilt.
+    unsigned int objectAt(unsigned int position) const { return order[position]; }
+    size_t nodeCount() const { return nodes.size(); }
+    // How many times the tree has been built, the leaf order only changes when this does
+    unsigned int buildCount() const { return rebuildCount; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << objectBoxes.size() << " objects in " << nodes.size() << " nodes (" << nodes.size() * sizeof(BvhNode) / 1024
+            << " KB), SAH cost " << currentCost << " (" << builtCost << " when built), " << rebuildCount << " builds" << std::endl;
+    }
+
+private:
+    // three pushes per level at most, with the depth limit the stack can't overflow
+    static const int StackSize = 3 * MaxDepth + 8;
+
+    unsigned int threadCount;
+    std::vector<Aabb> objectBoxes;
+    // only alive during a build
+    std::vector<BvhDetail::Item> items;
+    // objects in leaf order, leaves point at runs of it
+    std::vector<unsigned int> order;
+    std::vector<BvhNode> nodes;
+    std::vector<unsigned int> parents;
+    // node * 4 + slot of the leaf holding each object
+    std::vector<unsigned int> objectSlots;
+    std::vector<unsigned char> nodeDirty;
+    std::vector<unsigned int> dirtyNodes;
+    float builtCost;
+    float currentCost;
+    unsigned int refitsSinceCheck;
+    unsigned int rebuildCount;
+
+    BvhDetail::Range rangeOf(unsigned int begin, unsigned int end) const
+    {
+        BvhDetail::Range range;
+        range.begin = begin;
+        range.end = end;
+        BvhDetail::Bounds bounds;
+        glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+        for (unsigned int i = begin; i < end; i++)
+        {
+            bounds.extend(items[i]);
+            low = glm::min(low, items[i].centroid);
+            high = glm::max(high, items[i].centroid);
+        }
+        range.bounds = bounds.box();
+        range.centroids = Aabb(low, high);
+        return range;
+    }
+
+    // Binned SAH over all three axes. Returns false when the range is better off as a leaf (which it can only be while
+    // it's small enough), otherwise partitions the items and fills left and right.
+    bool split(const BvhDetail::Range& range, BvhDetail::Range& left, BvhDetail::Range& right)
+    {
+        unsigned int count = range.end - range.begin;
+        // small ranges don't need as many bins, and all three axes are binned in one pass over the objects
+        int binCount = (int)std::min<unsigned int>(BinCount, std::max(4u, count));
+        glm::vec3 low = range.centroids.Min;
+        float toBin[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float extent = range.centroids.Max[axis] - low[axis];
+            toBin[axis] = extent > 0.0f ? binCount * (1.0f - 1e-5f) / extent : 0.0f;
+        }
+        BvhDetail::Bounds bins[3][BinCount];
+        unsigned int counts[3][BinCount] = {};
+        for (unsigned int i = range.begin; i < range.end; i++)
+        {
+            const BvhDetail::Item& item = items[i];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                int bin = (int)((item.centroid[axis] - low[axis]) * toBin[axis]);
+                bins[axis][bin].extend(item);
+                counts[axis][bin]++;
+            }
+        }
+
+        float bestCost = FLT_MAX;
+        int bestAxis = -1, bestBin = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (toBin[axis] == 0.0f)
+                continue;
+            // areas and counts to the left of every boundary, then sweep from the right
+            float leftArea[BinCount];
+            unsigned int leftCount[BinCount];
+            BvhDetail::Bounds sweep;
+            unsigned int sum = 0;
+            for (int b = 0; b < binCount - 1; b++)
+            {
+                sweep.extend(bins[axis][b]);
+                sum += counts[axis][b];
+                leftArea[b] = sweep.surfaceArea();
+                leftCount[b] = sum;
+            }
+            sweep = BvhDetail::Bounds();
+            sum = 0;
+            for (int b = binCount - 1; b > 0; b--)
+            {
+                sweep.extend(bins[axis][b]);
+                sum += counts[axis][b];
+                if (leftCount[b - 1] == 0 || sum == 0)
+                    continue;
+                float cost = leftArea[b - 1] * leftCount[b - 1] + sweep.surfaceArea() * sum;
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        float area = range.bounds.surfaceArea();
+        float splitCost = BvhDetail::TraversalCost + (area > 0.0f ? bestCost / area : 0.0f) * BvhDetail::IntersectCost;
+        float leafCost = count * BvhDetail::IntersectCost;
+        if (count <= MaxLeafSize && (bestAxis < 0 || leafCost <= splitCost))
+            return false;
+
+        unsigned int middle;
+        if (bestAxis < 0)
+        {
+            // every centroid in the same place, any half will do
+            middle = range.begin + count / 2;
+        }
+        else
+        {
+            BvhDetail::Item* mid = std::partition(items.data() + range.begin, items.data() + range.end, [&](const BvhDetail::Item& item)
+            {
+                return (int)((item.centroid[bestAxis] - low[bestAxis]) * toBin[bestAxis]) < bestBin;
+            });
+            middle = (unsigned int)(mid - items.data());
+        }
+        left = rangeOf(range.begin, middle);
+        right = rangeOf(middle, range.end);
+        return true;
+    }
+
+    // Adds the node for range to out and everything below it, splitting the largest child until there are four. Children
+    // of at most taskSize objects are left as tasks to build separately.
+    int buildNode(const BvhDetail::Range& range, unsigned int depth, std::vector<BvhNode>& out, size_t taskSize, std::vector<BvhDetail::Task>& tasks)
+    {
+        int index = (int)out.size();
+        out.push_back(BvhNode());
+        BvhDetail::Range children[4];
+        bool open[4];
+        int childCount = 1;
+        children[0] = range;
+        open[0] = range.end - range.begin > 1 && depth < MaxDepth;
+        while (childCount < 4)
+        {
+            int largest = -1;
+            for (int i = 0; i < childCount; i++)
+                if (open[i] && (largest < 0 || children[i].bounds.surfaceArea() > children[largest].bounds.surfaceArea()))
+                    largest = i;
+            if (largest < 0)
+                break;
+            BvhDetail::Range left, right;
+            if (!split(children[largest], left, right))
+            {
+                open[largest] = false;
+                continue;
+            }
+            children[largest] = left;
+            children[childCount] = right;
+            open[largest] = left.end - left.begin > 1;
+            open[childCount] = right.end - right.begin > 1;
+            childCount++;
+        }
+
+        BvhNode node;
+        for (int slot = 0; slot < 4; slot++)
+        {
+            node.Child[slot] = ~0;
+            node.Count[slot] = 0;
+            setSlot(node, slot, slot < childCount ? children[slot].bounds : Aabb());
+        }
+        for (int slot = 0; slot < childCount; slot++)
+        {
+            const BvhDetail::Range& child = children[slot];
+            unsigned int count = child.end - child.begin;
+            if (!open[slot] || depth + 1 >= MaxDepth)
+            {
+                node.Child[slot] = ~(int)child.begin;
+                node.Count[slot] = count;
+            }
+            else if (count <= taskSize)
+            {
+                BvhDetail::Task task = { child, depth + 1, index, slot };
+                tasks.push_back(task);
+                node.Child[slot] = 0;
+            }
+            else
+            {
+                node.Child[slot] = buildNode(child, depth + 1, out, taskSize, tasks);
+            }
+        }
+        out[index] = node;
+        return index;
+    }
+
+    // Parent links and where each object ended up, for refitting
+    void linkNodes()
+    {
+        parents.assign(nodes.size(), BvhDetail::NoParent);
+        objectSlots.assign(objectBoxes.size(), 0);
+        nodeDirty.assign(nodes.size(), 0);
+        dirtyNodes.clear();
+        for (size_t n = 0; n < nodes.size(); n++)
+        {
+            const BvhNode& node = nodes[n];
+            for (int slot = 0; slot < 4; slot++)
+            {
+                if (node.Child[slot] >= 0)
+                {
+                    parents[node.Child[slot]] = (unsigned int)n;
+                    continue;
+                }
+                unsigned int first = ~node.Child[slot];
+                for (unsigned int o = first; o < first + node.Count[slot]; o++)
+                    objectSlots[order[o]] = (unsigned int)(n * 4 + slot);
+            }
+        }
+    }
+
+    static void setSlot(BvhNode& node, int slot, const Aabb& box)
+    {
+        node.MinX[slot] = box.Min.x;
+        node.MinY[slot] = box.Min.y;
+        node.MinZ[slot] = box.Min.z;
+        node.MaxX[slot] = box.Max.x;
+        node.MaxY[slot] = box.Max.y;
+        node.MaxZ[slot] = box.Max.z;
+    }
+
+    static Aabb nodeBounds(const BvhNode& node)
+    {
+        Aabb box;
+        for (int slot = 0; slot < 4; slot++)
+            box.extend(Aabb(glm::vec3(node.MinX[slot], node.MinY[slot], node.MinZ[slot]), glm::vec3(node.MaxX[slot], node.MaxY[slot], node.MaxZ[slot])));
+        return box;
+    }
+
+    // visible: the slots not entirely outside any plane, inside: the slots entirely inside every plane
+    static void frustumMasks(const BvhNode& node, const Frustum& frustum, int& visible, int& inside)
+    {
+        int outside = 0, crossing = 0;
+        for (int i = 0; i < Frustum::PLANE_COUNT; i++)
+        {
+            const glm::vec4& plane = frustum.Planes[i];
+            const float* farX = plane.x > 0.0f ? node.MaxX : node.MinX;
+            const float* farY = plane.y > 0.0f ? node.MaxY : node.MinY;
+            const float* farZ = plane.z > 0.0f ? node.MaxZ : node.MinZ;
+            const float* nearX = plane.x > 0.0f ? node.MinX : node.MaxX;
+            const float* nearY = plane.y > 0.0f ? node.MinY : node.MaxY;
+            const float* nearZ = plane.z > 0.0f ? node.MinZ : node.MaxZ;
+#ifdef SIMD_SSE2
+            __m128 nx = _mm_set1_ps(plane.x), ny = _mm_set1_ps(plane.y), nz = _mm_set1_ps(plane.z), w = _mm_set1_ps(plane.w);
+            __m128 farDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(farX)), _mm_mul_ps(ny, _mm_loadu_ps(farY))),
+                _mm_add_ps(_mm_mul_ps(nz, _mm_loadu_ps(farZ)), w));
+            __m128 nearDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(nearX)), _mm_mul_ps(ny, _mm_loadu_ps(nearY))),
+                _mm_add_ps(_mm_mul_ps(nz, _mm_loadu_ps(nearZ)), w));
+            outside |= _mm_movemask_ps(_mm_cmplt_ps(farDistance, _mm_setzero_ps()));
+            crossing |= _mm_movemask_ps(_mm_cmplt_ps(nearDistance, _mm_setzero_ps()));
+#else
+            for (int slot = 0; slot < 4; slot++)
+            {
+                if (plane.x * farX[slot] + plane.y * farY[slot] + plane.z * farZ[slot] + plane.w < 0.0f)
+                    outside |= 1 << slot;
+                if (plane.x * nearX[slot] + plane.y * nearY[slot] + plane.z * nearZ[slot] + plane.w < 0.0f)
+                    crossing |= 1 << slot;
+            }
+#endif
+        }
+        visible = ~outside & 0xf;
+        inside = ~crossing & 0xf;
+    }
+
+    static int overlapMask(const BvhNode& node, const Aabb& box)
+    {
+#ifdef SIMD_SSE2
+        __m128 miss = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(_mm_loadu_ps(node.MinX), _mm_set1_ps(box.Max.x)),
+            _mm_cmpgt_ps(_mm_loadu_ps(node.MinY), _mm_set1_ps(box.Max.y))), _mm_cmpgt_ps(_mm_loadu_ps(node.MinZ), _mm_set1_ps(box.Max.z)));
+        miss = _mm_or_ps(miss, _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(_mm_loadu_ps(node.MaxX), _mm_set1_ps(box.Min.x)),
+            _mm_cmplt_ps(_mm_loadu_ps(node.MaxY), _mm_set1_ps(box.Min.y))), _mm_cmplt_ps(_mm_loadu_ps(node.MaxZ), _mm_set1_ps(box.Min.z))));
+        return ~_mm_movemask_ps(miss) & 0xf;
+#else
+        int mask = 0;
+        for (int slot = 0; slot < 4; slot++)
+            if (node.MinX[slot] <= box.Max.x && node.MinY[slot] <= box.Max.y && node.MinZ[slot] <= box.Max.z &&
+                node.MaxX[slot] >= box.Min.x && node.MaxY[slot] >= box.Min.y && node.MaxZ[slot] >= box.Min.z)
+                mask |= 1 << slot;
+        return mask;
+#endif
+    }
+
+    // Slab test of the ray against the four boxes, the slots it enters before maxDistance and where it enters them
+    static int rayMask(const BvhNode& node, const BvhDetail::RayData& ray, float maxDistance, float* distances)
+    {
+        const float* nearX = ray.inverse.x >= 0.0f ? node.MinX : node.MaxX;
+        const float* nearY = ray.inverse.y >= 0.0f ? node.MinY : node.MaxY;
+        const float* nearZ = ray.inverse.z >= 0.0f ? node.MinZ : node.MaxZ;
+        const float* farX = ray.inverse.x >= 0.0f ? node.MaxX : node.MinX;
+        const float* farY = ray.inverse.y >= 0.0f ? node.MaxY : node.MinY;
+        const float* farZ = ray.inverse.z >= 0.0f ? node.MaxZ : node.MinZ;
+#ifdef SIMD_SSE2
+        __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+        __m128 ix = _mm_set1_ps(ray.inverse.x), iy = _mm_set1_ps(ray.inverse.y), iz = _mm_set1_ps(ray.inverse.z);
+        __m128 enter = _mm_max_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearX), ox), ix), _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearY), oy), iy)),
+            _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearZ), oz), iz), _mm_setzero_ps()));
+        __m128 exit = _mm_min_ps(_mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farX), ox), ix), _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farY), oy), iy)),
+            _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farZ), oz), iz), _mm_set1_ps(maxDistance)));
+        _mm_storeu_ps(distances, enter);
+        return _mm_movemask_ps(_mm_cmple_ps(enter, exit));
+#else
+        int mask = 0;
+        for (int slot = 0; slot < 4; slot++)
+        {
+            float enter = std::max(std::max((nearX[slot] - ray.origin.x) * ray.inverse.x, (nearY[slot] - ray.origin.y) * ray.inverse.y),
+                std::max((nearZ[slot] - ray.origin.z) * ray.inverse.z, 0.0f));
+            float exit = std::min(std::min((farX[slot] - ray.origin.x) * ray.inverse.x, (farY[slot] - ray.origin.y) * ray.inverse.y),
+                std::min((farZ[slot] - ray.origin.z) * ray.inverse.z, maxDistance));
+            distances[slot] = enter;
+            if (enter <= exit)
+                mask |= 1 << slot;
+        }
+        return mask;
+#endif
+    }
+
+    // Runs work(task) for every task on the pool's threads
+    template <typename Work>
+    void forEachTask(size_t count, const Work& work)
+    {
+        JobPool::shared().forEach(count, threadCount, work);
+    }
+};
@@ -7,6 +7,7 @@
 #include <gtc/matrix_transform.hpp>
 
 #include <vector>
+#include "Geometry.h"
 
 
 
@@ -105,8 +106,6 @@ public:
 
             setRoll(-RollSpeed * deltaTime);
         }
-        if (Position.y < 0.5)
-            Position.y = 0.5;
         updateCameraVectors();
     }
 
@@ -167,6 +166,21 @@ public:
     }
 
 
+    // The world space ray through a point of the framebuffer, x and y in framebuffer pixels from the top left. Cursor
+    // positions come in window coordinates, scale them by the framebuffer size over the window size first (they differ
+    // on high DPI displays). projection is the one the frame was drawn with.
+    Ray Unproject(float x, float y, int framebufferWidth, int framebufferHeight, const glm::mat4& projection) const
+    {
+        float ndcX = 2.0f * x / (float)framebufferWidth - 1.0f;
+        float ndcY = 1.0f - 2.0f * y / (float)framebufferHeight;
+        glm::mat4 inverse = glm::inverse(projection * Transform);
+        glm::vec4 nearPoint = inverse * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+        glm::vec4 farPoint = inverse * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+        glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+        glm::vec3 target = glm::vec3(farPoint) / farPoint.w;
+        return Ray(origin, glm::normalize(target - origin));
+    }
+
     // processes input received from a mouse scroll-wheel event. Only requires input on the vertical wheel-axis
     void ProcessMouseScroll(float yoffset)
     {
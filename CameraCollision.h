@@ -0,0 +1,377 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <glm.hpp>
+#include "Geometry.h"
+#include "Bvh.h"
+#include "Picking.h"
+#include "Benchmark.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Camera collision /////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The camera is a sphere swept from where it was to where the input wants it. Broadphase is the same two levels as
+// picking: the scene Bvh finds the objects whose boxes touch the box around the whole move, and each object's TriangleBvh,
+// queried with that box in model space, finds the triangles. Those are moved to world space once and the sweep runs
+// against the short list:
+//  - the earliest time the sphere touches a triangle's face, or failing that one of its corners or edges (Fauerby,
+//    "Improved Collision detection and Response");
+//  - the sphere stops just short of the contact and the rest of the move slides along the plane the contact normal
+//    spans, up to MaxSlides times.
+// Triangles the sphere already overlaps push it out first, so it can't get stuck in geometry that moved into it, and
+// the broadphase box reaches a Radius further than the move to take in what that push can reach. The ground is a
+// height function: the start is lifted GroundClearance above it before anything else, and the ground under the box goes
+// into the sweep as a grid of triangles lifted GroundClearance - Radius, so the camera slides over it like over any
+// other surface instead of being clamped up into whatever it just stopped short of.
+
+namespace CameraCollisionDetail
+{
+    // how far short of a contact the sphere stops
+    const float Skin = 1e-3f;
+    // spacing of the ground samples the sweep sees, and the most of them per side of one move's box
+    const float GroundCell = 0.5f;
+    const int MaxGroundCells = 64;
+}
+
+struct CollisionStats
+{
+    size_t Objects;         // whose boxes the move touched
+    size_t Triangles;       // taken into the sweep
+    int Slides;
+    double Microseconds;
+};
+
+class CameraCollision
+{
+public:
+    static const int MaxSlides = 4;
+
+    float Radius;
+    float GroundClearance;
+
+    explicit CameraCollision(float radius = 0.25f, float groundClearance = 0.5f) : Radius(radius), GroundClearance(groundClearance)
+    {
+        frameStats = CollisionStats();
+    }
+
+    // The ground's height at (x, z), the camera never goes below it plus GroundClearance
+    void setGround(const std::function<float(float, float)>& heightAt) { ground = heightAt; }
+
+    // Where the camera ends up moving from towards to. meshOf(object) and transformOf(object) are as for pick().
+    template <typename MeshOf, typename TransformOf>
+    glm::vec3 move(const Bvh& objects, const glm::vec3& from, const glm::vec3& to, const MeshOf& meshOf, const TransformOf& transformOf)
+    {
+        CpuTimer timer;
+        frameStats = CollisionStats();
+        glm::vec3 position = from;
+        if (ground)
+            position.y = std::max(position.y, ground(position.x, position.z) + GroundClearance);
+        glm::vec3 remaining = to - position;
+        gather(objects, position, glm::length(remaining), meshOf, transformOf);
+
+        depenetrate(position);
+        for (int slide = 0; slide < MaxSlides; slide++)
+        {
+            if (glm::dot(remaining, remaining) < 1e-12f)
+                break;
+            float time;
+            glm::vec3 normal;
+            if (!sweep(position, remaining, time, normal))
+            {
+                position += remaining;
+                break;
+            }
+            frameStats.Slides++;
+            // stop a little short so the next sweep doesn't start touching, then slide what's left along the contact
+            position += remaining * time + normal * CameraCollisionDetail::Skin;
+            remaining *= 1.0f - time;
+            remaining -= normal * glm::dot(remaining, normal);
+        }
+        frameStats.Microseconds = timer.milliseconds() * 1000.0;
+        return position;
+    }
+
+    const CollisionStats& stats() const { return frameStats; }
+
+    // Closest point of the triangle to p (Ericson, Real-Time Collision Detection 5.1.5)
+    static glm::vec3 closestPoint(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+    {
+        glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+        float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+        if (d1 <= 0.0f && d2 <= 0.0f)
+            return a;
+        glm::vec3 bp = p - b;
+        float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+        if (d3 >= 0.0f && d4 <= d3)
+            return b;
+        float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+            return a + ab * (d1 / (d1 - d3));
+        glm::vec3 cp = p - c;
+        float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+        if (d6 >= 0.0f && d5 <= d6)
+            return c;
+        float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+            return a + ac * (d2 / (d2 - d6));
+        float va = d3 * d6 - d5 * d4;
+        if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+            return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+        float denominator = 1.0f / (va + vb + vc);
+        float v = vb * denominator;
+        float w = vc * denominator;
+        return a + ab * v + ac * w;
+    }
+
+    void print(std::ostream& out) const
+    {
+        out << "  radius " << Radius << ", last move: " << frameStats.Objects << " objects, " << frameStats.Triangles << " triangles, "
+            << frameStats.Slides << " slides in " << frameStats.Microseconds << " us" << std::endl;
+    }
+
+private:
+    struct Triangle
+    {
+        glm::vec3 a, b, c;
+    };
+
+    std::function<float(float, float)> ground;
+    std::vector<Triangle> triangles;
+    std::vector<unsigned int> objectScratch;
+    std::vector<unsigned int> triangleScratch;
+    std::vector<glm::vec3> groundScratch;
+    CollisionStats frameStats;
+
+    // The world space triangles within distance + 2 Radius of center: the sweep reaches distance + Radius, and
+    // depenetration can first move the sphere up to another Radius
+    template <typename MeshOf, typename TransformOf>
+    void gather(const Bvh& objects, const glm::vec3& center, float distance, const MeshOf& meshOf, const TransformOf& transformOf)
+    {
+        triangles.clear();
+        objectScratch.clear();
+        glm::vec3 reach(distance + 2.0f * Radius + CameraCollisionDetail::Skin);
+        Aabb box(center - reach, center + reach);
+        objects.queryAabb(box, objectScratch);
+        frameStats.Objects = objectScratch.size();
+        for (size_t i = 0; i < objectScratch.size(); i++)
+        {
+            const TriangleBvh* mesh = meshOf(objectScratch[i]);
+            if (!mesh)
+                continue;
+            glm::mat4 model = transformOf(objectScratch[i]);
+            triangleScratch.clear();
+            mesh->bvh().queryAabb(box.transformed(glm::inverse(model)), triangleScratch);
+            for (size_t t = 0; t < triangleScratch.size(); t++)
+            {
+                glm::vec3 a, b, c;
+                mesh->triangle(triangleScratch[t], a, b, c);
+                Triangle world = { glm::vec3(model * glm::vec4(a, 1.0f)), glm::vec3(model * glm::vec4(b, 1.0f)), glm::vec3(model * glm::vec4(c, 1.0f)) };
+                triangles.push_back(world);
+            }
+        }
+        if (ground)
+            gatherGround(box);
+        frameStats.Triangles = triangles.size();
+    }
+
+    // The ground under box as two triangles per cell, lifted so that a sphere resting on them is GroundClearance above
+    // the samples. Cells entirely above or below the box are left out.
+    void gatherGround(const Aabb& box)
+    {
+        using namespace CameraCollisionDetail;
+        glm::vec3 size = box.Max - box.Min;
+        int cellsX = std::min(MaxGroundCells, std::max(1, (int)std::ceil(size.x / GroundCell)));
+        int cellsZ = std::min(MaxGroundCells, std::max(1, (int)std::ceil(size.z / GroundCell)));
+        float stepX = size.x / cellsX;
+        float stepZ = size.z / cellsZ;
+        float lift = GroundClearance - Radius;
+        groundScratch.resize((size_t)(cellsX + 1) * (cellsZ + 1));
+        for (int z = 0; z <= cellsZ; z++)
+            for (int x = 0; x <= cellsX; x++)
+            {
+                float px = box.Min.x + x * stepX;
+                float pz = box.Min.z + z * stepZ;
+                groundScratch[(size_t)z * (cellsX + 1) + x] = glm::vec3(px, ground(px, pz) + lift, pz);
+            }
+        for (int z = 0; z < cellsZ; z++)
+            for (int x = 0; x < cellsX; x++)
+            {
+                const glm::vec3& a = groundScratch[(size_t)z * (cellsX + 1) + x];
+                const glm::vec3& b = groundScratch[(size_t)z * (cellsX + 1) + x + 1];
+                const glm::vec3& c = groundScratch[(size_t)(z + 1) * (cellsX + 1) + x];
+                const glm::vec3& d = groundScratch[(size_t)(z + 1) * (cellsX + 1) + x + 1];
+                float low = std::min(std::min(a.y, b.y), std::min(c.y, d.y));
+                float high = std::max(std::max(a.y, b.y), std::max(c.y, d.y));
+                if (high < box.Min.y || low > box.Max.y)
+                    continue;
+                Triangle first = { a, c, b };
+                Triangle second = { b, c, d };
+                triangles.push_back(first);
+                triangles.push_back(second);
+            }
+    }
+
+    // Pushes the sphere out of every triangle it overlaps, along the line from the closest point to its center
+    void depenetrate(glm::vec3& position) const
+    {
+        for (size_t i = 0; i < triangles.size(); i++)
+        {
+            glm::vec3 closest = closestPoint(position, triangles[i].a, triangles[i].b, triangles[i].c);
+            glm::vec3 away = position - closest;
+            float distance = glm::length(away);
+            if (distance >= Radius || distance < 1e-6f)
+                continue;
+            position += away * ((Radius + CameraCollisionDetail::Skin - distance) / distance);
+        }
+    }
+
+    // The earliest fraction of velocity at which the sphere at position touches a triangle, and the contact normal
+    bool sweep(const glm::vec3& position, const glm::vec3& velocity, float& time, glm::vec3& normal) const
+    {
+        time = 1.0f;
+        bool found = false;
+        glm::vec3 contact;
+        for (size_t i = 0; i < triangles.size(); i++)
+        {
+            glm::vec3 point;
+            if (sweepTriangle(position, velocity, triangles[i], time, point))
+            {
+                found = true;
+                contact = point;
+            }
+        }
+        if (!found)
+            return false;
+        normal = position + velocity * time - contact;
+        float length = glm::length(normal);
+        normal = length > 1e-6f ? normal / length : -glm::normalize(velocity);
+        return true;
+    }
+
+    // Lowers time to when the sphere first touches the triangle if that is sooner, with the point it touches
+    bool sweepTriangle(const glm::vec3& base, const glm::vec3& velocity, const Triangle& triangle, float& time, glm::vec3& contact) const
+    {
+        glm::vec3 n = glm::cross(triangle.b - triangle.a, triangle.c - triangle.a);
+        float area = glm::length(n);
+        if (area < 1e-12f)
+            return false;
+        n /= area;
+        // both sides collide, face the plane towards the sphere but keep the winding's normal for the inside test
+        glm::vec3 winding = n;
+        float signedDistance = glm::dot(n, base - triangle.a);
+        if (signedDistance < 0.0f)
+        {
+            n = -n;
+            signedDistance = -signedDistance;
+        }
+        float approach = -glm::dot(n, velocity);
+        float t0, t1;
+        bool embedded = false;
+        if (std::fabs(approach) < 1e-8f)
+        {
+            if (signedDistance >= Radius)
+                return false;
+            embedded = true;
+            t0 = 0.0f;
+            t1 = 1.0f;
+        }
+        else
+        {
+            t0 = (signedDistance - Radius) / approach;
+            t1 = (signedDistance + Radius) / approach;
+            if (t0 > t1)
+                std::swap(t0, t1);
+            if (t0 > 1.0f || t1 < 0.0f)
+                return false;
+            t0 = std::max(t0, 0.0f);
+        }
+
+        // the face first: where the sphere meets the plane, if that is inside the triangle nothing else comes sooner
+        if (!embedded && approach > 0.0f)
+        {
+            glm::vec3 onPlane = base + velocity * t0 - n * Radius;
+            if (insideTriangle(onPlane, triangle, winding))
+            {
+                if (t0 >= time)
+                    return false;
+                time = t0;
+                contact = onPlane;
+                return true;
+            }
+        }
+
+        // then the corners and edges
+        bool found = false;
+        float velocitySquared = glm::dot(velocity, velocity);
+        const glm::vec3* corners[3] = { &triangle.a, &triangle.b, &triangle.c };
+        for (int k = 0; k < 3; k++)
+        {
+            const glm::vec3& p = *corners[k];
+            float root;
+            if (lowestRoot(velocitySquared, 2.0f * glm::dot(velocity, base - p), glm::dot(p - base, p - base) - Radius * Radius, time, root))
+            {
+                time = root;
+                contact = p;
+                found = true;
+            }
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            const glm::vec3& p1 = *corners[k];
+            const glm::vec3& p2 = *corners[(k + 1) % 3];
+            glm::vec3 edge = p2 - p1;
+            glm::vec3 baseToVertex = p1 - base;
+            float edgeSquared = glm::dot(edge, edge);
+            float edgeDotVelocity = glm::dot(edge, velocity);
+            float edgeDotBaseToVertex = glm::dot(edge, baseToVertex);
+            float a = edgeSquared * -velocitySquared + edgeDotVelocity * edgeDotVelocity;
+            float b = edgeSquared * 2.0f * glm::dot(velocity, baseToVertex) - 2.0f * edgeDotVelocity * edgeDotBaseToVertex;
+            float c = edgeSquared * (Radius * Radius - glm::dot(baseToVertex, baseToVertex)) + edgeDotBaseToVertex * edgeDotBaseToVertex;
+            float root;
+            if (!lowestRoot(a, b, c, time, root))
+                continue;
+            float along = (edgeDotVelocity * root - edgeDotBaseToVertex) / edgeSquared;
+            if (along < 0.0f || along > 1.0f)
+                continue;
+            time = root;
+            contact = p1 + edge * along;
+            found = true;
+        }
+        return found;
+    }
+
+    // The smallest root of a t^2 + b t + c in (0, limit)
+    static bool lowestRoot(float a, float b, float c, float limit, float& root)
+    {
+        if (std::fabs(a) < 1e-12f)
+            return false;
+        float determinant = b * b - 4.0f * a * c;
+        if (determinant < 0.0f)
+            return false;
+        float s = std::sqrt(determinant);
+        float r1 = (-b - s) / (2.0f * a);
+        float r2 = (-b + s) / (2.0f * a);
+        if (r1 > r2)
+            std::swap(r1, r2);
+        if (r1 > 0.0f && r1 < limit)
+        {
+            root = r1;
+            return true;
+        }
+        if (r2 > 0.0f && r2 < limit)
+        {
+            root = r2;
+            return true;
+        }
+        return false;
+    }
+
+    static bool insideTriangle(const glm::vec3& p, const Triangle& triangle, const glm::vec3& n)
+    {
+        return glm::dot(glm::cross(triangle.b - triangle.a, p - triangle.a), n) >= 0.0f
+            && glm::dot(glm::cross(triangle.c - triangle.b, p - triangle.b), n) >= 0.0f
+            && glm::dot(glm::cross(triangle.a - triangle.c, p - triangle.c), n) >= 0.0f;
+    }
+};
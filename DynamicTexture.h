@@ -0,0 +1,182 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iostream>
+#include <glad/glad.h>
+#include "GpuMemory.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Texture whose contents are streamed in every frame ////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Frames are written into a ring of slots inside one persistently mapped pixel unpack buffer. Any thread can produce
+// frames with beginWrite()/endWrite(), the render thread calls update() which starts an asynchronous
+// glTexSubImage2D from the newest finished slot. A fence per slot keeps producers from overwriting a slot the GPU
+// is still reading, so neither side ever waits on the driver.
+class DynamicTexture
+{
+public:
+    unsigned int ID;
+    int Width;
+    int Height;
+
+    ///////////////////////// Constructor Function ////////////////////////////////////////////////
+    DynamicTexture(int width, int height, int slotCount = 3)
+        : Width(width), Height(height), slotSize((size_t)width * height * 4), writing(-1), latest(-1),
+          uploadedFrames(0), droppedFrames(0)
+    {
+        glGenTextures(1, &ID);
+        glBindTexture(GL_TEXTURE_2D, ID);
+        gpuTexStorage2D(ID, 1, GL_RGBA8, Width, Height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        // one immutable buffer that stays mapped for the lifetime of the texture
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        gpuBufferStorage(pbo, GL_PIXEL_UNPACK_BUFFER, slotSize * slotCount, NULL, flags, GPU_MEMORY_STREAMING);
+        mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slotSize * slotCount, flags);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (!mapped)
+            std::cout << "Failed to map the dynamic texture upload buffer" << std::endl;
+
+        slots.resize(slotCount);
+    }
+
+    ~DynamicTexture()
+    {
+        for (size_t i = 0; i < slots.size(); i++)
+            if (slots[i].fence)
+                glDeleteSync(slots[i].fence);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        gpuDeleteBuffers(1, &pbo);
+        gpuDeleteTextures(1, &ID);
+    }
+
+    ////////////////////////// Producer side, callable from any thread ///////////////////////////
+    // False when the upload buffer couldn't be mapped, beginWrite() then always fails and producers should stop
+    bool writable() const { return mapped != NULL; }
+
+    // Returns Width*Height RGBA8 pixels to fill, or NULL when every slot is still in flight and the timeout expired.
+    // Only one frame can be written at a time.
+    unsigned char* beginWrite(int timeoutMilliseconds = 0)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!mapped || writing >= 0)
+            return NULL;
+        int slot = -1;
+        freed.wait_for(lock, std::chrono::milliseconds(timeoutMilliseconds), [this, &slot]
+        {
+            slot = findFreeSlot();
+            return slot >= 0;
+        });
+        if (slot < 0)
+            return NULL;
+        slots[slot].state = Writing;
+        writing = slot;
+        return mapped + slotSize * slot;
+    }
+
+    // Publishes the frame written since beginWrite, a newer frame replaces it if the renderer hasn't picked it up yet
+    void endWrite()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (writing < 0)
+            return;
+        if (latest >= 0)
+        {
+            slots[latest].state = Free;
+            droppedFrames++;
+        }
+        slots[writing].state = Ready;
+        latest = writing;
+        writing = -1;
+        freed.notify_all();
+    }
+
+    ////////////////////////// Render thread ////////////////////////////////////////////////////
+    // Recycles slots the GPU has finished with and uploads the newest frame. Returns true if a new frame was uploaded.
+    bool update()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        bool anyFreed = false;
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if (slots[i].state != Uploading)
+                continue;
+            GLenum status = glClientWaitSync(slots[i].fence, 0, 0);
+            if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+            {
+                glDeleteSync(slots[i].fence);
+                slots[i].fence = 0;
+                slots[i].state = Free;
+                anyFreed = true;
+            }
+        }
+
+        int slot = latest;
+        latest = -1;
+        if (slot >= 0)
+            slots[slot].state = Uploading;
+        lock.unlock();
+        if (anyFreed)
+            freed.notify_all();
+        if (slot < 0)
+            return false;
+
+        // the copy reads from the buffer on the GPU timeline, this call returns immediately
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        glBindTexture(GL_TEXTURE_2D, ID);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, Width, Height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)(slotSize * slot));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        lock.lock();
+        slots[slot].fence = fence;
+        uploadedFrames++;
+        return true;
+    }
+
+    unsigned long long framesUploaded() const { return uploadedFrames; }
+    unsigned long long framesDropped() const { return droppedFrames; }
+
+private:
+    enum SlotState
+    {
+        Free,
+        Writing,
+        Ready,
+        Uploading
+    };
+    struct Slot
+    {
+        SlotState state = Free;
+        GLsync fence = 0;
+    };
+
+    unsigned int pbo;
+    unsigned char* mapped;
+    size_t slotSize;
+    std::vector<Slot> slots;
+    int writing;
+    int latest;
+    unsigned long long uploadedFrames;
+    unsigned long long droppedFrames;
+    std::mutex mutex;
+    std::condition_variable freed;
+
+    int findFreeSlot() const
+    {
+        for (size_t i = 0; i < slots.size(); i++)
+            if (slots[i].state == Free)
+                return (int)i;
+        return -1;
+    }
+};
@@ -0,0 +1,156 @@
+#pragma once
+#include <iostream>
+#include <algorithm>
+#include <glad/glad.h>
+#include <glm.hpp>
+#include "BufferHeap.h"
+#include "GpuMemory.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Per frame dynamic data //////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// One buffer is mapped once for the life of the program (persistent and coherent) and split into three regions, one per
+// frame in flight. Between beginFrame() and endFrame() anything that changes every frame (uniform blocks, transforms,
+// indirect commands) is bump allocated from the current region and written straight through the pointer, with no GL calls.
+// endFrame() puts a fence behind the region, and beginFrame() only waits on it when the GPU is three frames behind.
+
+const GLuint FrameUniformBinding = 0;
+
+// Matches the std140 Frame block in shader.vs
+struct FrameUniforms
+{
+    glm::mat4 View;
+    glm::mat4 Projection;
+};
+
+struct FrameAllocation
+{
+    void* Data;         // NULL when the region ran out of room
+    GLintptr Offset;    // from the start of the buffer
+    GLsizeiptr Size;
+};
+
+class FrameAllocator
+{
+public:
+    static const int Regions = 3;
+    unsigned int ID;
+
+    ///////////////////////// Constructor Function ////////////////////////////////////////////////
+    FrameAllocator(size_t regionSize = 4 * 1024 * 1024)
+        : regionSize(regionSize), region(0), cursor(0), peak(0), stalls(0), overflowed(false)
+    {
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        uniformAlignment = std::max(alignment, 16);
+        alignment = 256;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        storageAlignment = std::max(alignment, 16);
+        // regions start on an alignment every use accepts
+        size_t regionAlignment = std::max<size_t>(256, std::max(uniformAlignment, storageAlignment));
+        this->regionSize = (regionSize + regionAlignment - 1) / regionAlignment * regionAlignment;
+
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &ID);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ID);
+        gpuBufferStorage(ID, GL_COPY_WRITE_BUFFER, this->regionSize * Regions, NULL, flags, GPU_MEMORY_STREAMING);
+        mapped = (unsigned char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, this->regionSize * Regions, flags);
+        if (!mapped)
+            std::cout << "Failed to map the frame allocator's buffer" << std::endl;
+        for (int i = 0; i < Regions; i++)
+            fences[i] = 0;
+    }
+
+    ~FrameAllocator()
+    {
+        for (int i = 0; i < Regions; i++)
+            if (fences[i])
+                glDeleteSync(fences[i]);
+        glUnmapNamedBuffer(ID);
+        gpuDeleteBuffers(1, &ID);
+    }
+
+    // Waits until the GPU has finished the frame that last used this region, then starts filling it from the top
+    void beginFrame()
+    {
+        GLsync& fence = fences[region];
+        if (fence)
+        {
+            GLenum status = glClientWaitSync(fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED)
+            {
+                stalls++;
+                while (status == GL_TIMEOUT_EXPIRED)
+                    status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            }
+            glDeleteSync(fence);
+            fence = 0;
+        }
+        cursor = 0;
+    }
+
+    // Fences the region behind every command that reads from it and moves on to the next one
+    void endFrame()
+    {
+        peak = std::max(peak, cursor);
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        region = (region + 1) % Regions;
+    }
+
+    // size bytes of the current region, aligned for usage. Data is NULL if the region is full.
+    FrameAllocation allocate(size_t size, BufferUsage usage)
+    {
+        size_t alignment = usage == BUFFER_USAGE_UNIFORM ? uniformAlignment : usage == BUFFER_USAGE_STORAGE ? storageAlignment : 16;
+        size_t start = (cursor + alignment - 1) / alignment * alignment;
+        FrameAllocation allocation = { NULL, 0, (GLsizeiptr)size };
+        if (!mapped || start + size > regionSize)
+        {
+            if (!overflowed)
+                std::cout << "Frame allocator region of " << regionSize / 1024 << " KB is full" << std::endl;
+            overflowed = true;
+            return allocation;
+        }
+        cursor = start + size;
+        allocation.Offset = (GLintptr)(region * regionSize + start);
+        allocation.Data = mapped + allocation.Offset;
+        return allocation;
+    }
+
+    template <typename T>
+    FrameAllocation allocate(const T& value, BufferUsage usage)
+    {
+        FrameAllocation allocation = allocate(sizeof(T), usage);
+        if (allocation.Data)
+            *(T*)allocation.Data = value;
+        return allocation;
+    }
+
+    // Binds an allocation to an indexed target (GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER)
+    void bind(GLenum target, GLuint index, const FrameAllocation& allocation) const
+    {
+        if (allocation.Data)
+            glBindBufferRange(target, index, ID, allocation.Offset, allocation.Size);
+    }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << Regions << " regions of " << regionSize / 1024 << " KB, peak " << peak / 1024.0 << " KB in a frame, "
+            << stalls << " frames waited on the GPU" << std::endl;
+    }
+
+private:
+    // owns a mapped GL object
+    FrameAllocator(const FrameAllocator&);
+    FrameAllocator& operator=(const FrameAllocator&);
+
+    size_t regionSize;
+    size_t uniformAlignment;
+    size_t storageAlignment;
+    unsigned char* mapped;
+    GLsync fences[Regions];
+    int region;
+    size_t cursor;
+    size_t peak;
+    size_t stalls;
+    bool overflowed;
+};
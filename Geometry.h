@@ -0,0 +1,186 @@
+#pragma once
+#include <cmath>
+#include <cfloat>
+#include <cstddef>
+#include <algorithm>
+#include <glm.hpp>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Bounding volumes and view frustum tests ///////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Axis aligned box, a default constructed one is empty (Min above Max) and grows with extend()
+struct Aabb
+{
+    glm::vec3 Min;
+    glm::vec3 Max;
+
+    Aabb() : Min(FLT_MAX), Max(-FLT_MAX) {}
+    Aabb(const glm::vec3& min, const glm::vec3& max) : Min(min), Max(max) {}
+
+    bool empty() const { return Min.x > Max.x || Min.y > Max.y || Min.z > Max.z; }
+    glm::vec3 center() const { return (Min + Max) * 0.5f; }
+    glm::vec3 extent() const { return (Max - Min) * 0.5f; }
+
+    void extend(const glm::vec3& point)
+    {
+        Min = glm::min(Min, point);
+        Max = glm::max(Max, point);
+    }
+
+    void extend(const Aabb& box)
+    {
+        Min = glm::min(Min, box.Min);
+        Max = glm::max(Max, box.Max);
+    }
+
+    float surfaceArea() const
+    {
+        if (empty())
+            return 0.0f;
+        glm::vec3 d = Max - Min;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    bool overlaps(const Aabb& box) const
+    {
+        return Min.x <= box.Max.x && Max.x >= box.Min.x && Min.y <= box.Max.y && Max.y >= box.Min.y && Min.z <= box.Max.z && Max.z >= box.Min.z;
+    }
+
+    bool contains(const glm::vec3& point) const
+    {
+        return point.x >= Min.x && point.x <= Max.x && point.y >= Min.y && point.y <= Max.y && point.z >= Min.z && point.z <= Max.z;
+    }
+
+    // The box around this box after an affine transform, the extent along each axis is the sum of the transformed extents
+    Aabb transformed(const glm::mat4& m) const
+    {
+        if (empty())
+            return *this;
+        glm::vec3 c = center();
+        glm::vec3 e = extent();
+        glm::vec3 center(m[0][0] * c.x + m[1][0] * c.y + m[2][0] * c.z + m[3][0],
+            m[0][1] * c.x + m[1][1] * c.y + m[2][1] * c.z + m[3][1],
+            m[0][2] * c.x + m[1][2] * c.y + m[2][2] * c.z + m[3][2]);
+        glm::vec3 half(std::fabs(m[0][0]) * e.x + std::fabs(m[1][0]) * e.y + std::fabs(m[2][0]) * e.z,
+            std::fabs(m[0][1]) * e.x + std::fabs(m[1][1]) * e.y + std::fabs(m[2][1]) * e.z,
+            std::fabs(m[0][2]) * e.x + std::fabs(m[1][2]) * e.y + std::fabs(m[2][2]) * e.z);
+        return Aabb(center - half, center + half);
+    }
+};
+
+// Half line from Origin along Direction, Direction is unit length when it comes from Camera::Unproject
+struct Ray
+{
+    glm::vec3 Origin;
+    glm::vec3 Direction;
+
+    Ray() {}
+    Ray(const glm::vec3& origin, const glm::vec3& direction) : Origin(origin), Direction(direction) {}
+    glm::vec3 at(float distance) const { return Origin + Direction * distance; }
+};
+
+// Six planes facing inwards, a point p is inside plane i when dot(Planes[i].xyz, p) + Planes[i].w >= 0
+struct Frustum
+{
+    enum { LEFT, RIGHT, BOTTOM, TOP, NEAR_PLANE, FAR_PLANE, PLANE_COUNT };
+    glm::vec4 Planes[PLANE_COUNT];
+
+    // Planes of a projection * view (* model) matrix, in the space the matrix transforms from. The planes are normalized,
+    // distances to them stay in that space's units as long as the matrix has no non-uniform scale.
+    static Frustum fromMatrix(const glm::mat4& m)
+    {
+        Frustum frustum;
+        glm::vec4 rows[4];
+        for (int r = 0; r < 4; r++)
+            rows[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+        frustum.Planes[LEFT] = rows[3] + rows[0];
+        frustum.Planes[RIGHT] = rows[3] - rows[0];
+        frustum.Planes[BOTTOM] = rows[3] + rows[1];
+        frustum.Planes[TOP] = rows[3] - rows[1];
+        frustum.Planes[NEAR_PLANE] = rows[3] + rows[2];
+        frustum.Planes[FAR_PLANE] = rows[3] - rows[2];
+        for (int i = 0; i < PLANE_COUNT; i++)
+        {
+            glm::vec4& plane = frustum.Planes[i];
+            float length = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+            if (length > 0.0f)
+                plane = plane / length;
+        }
+        return frustum;
+    }
+
+    bool intersectsSphere(const glm::vec3& center, float radius) const
+    {
+        for (int i = 0; i < PLANE_COUNT; i++)
+            if (Planes[i].x * center.x + Planes[i].y * center.y + Planes[i].z * center.z + Planes[i].w < -radius)
+                return false;
+        return true;
+    }
+
+    // Conservative, a box outside no single plane but still outside the frustum near a corner passes
+    bool intersectsAabb(const Aabb& box) const
+    {
+        for (int i = 0; i < PLANE_COUNT; i++)
+        {
+            // the corner furthest along the plane's normal
+            const glm::vec4& plane = Planes[i];
+            float x = plane.x > 0.0f ? box.Max.x : box.Min.x;
+            float y = plane.y > 0.0f ? box.Max.y : box.Min.y;
+            float z = plane.z > 0.0f ? box.Max.z : box.Min.z;
+            if (plane.x * x + plane.y * y + plane.z * z + plane.w < 0.0f)
+                return false;
+        }
+        return true;
+    }
+};
+
+// Sphere around a set of points, not the smallest but close (Ritter's two pass method)
+inline void boundingSphere(const float* positions, size_t count, size_t stride, glm::vec3& center, float& radius)
+{
+    center = glm::vec3(0.0f);
+    radius = 0.0f;
+    if (count == 0)
+        return;
+    auto point = [&](size_t i) { const float* p = positions + i * stride; return glm::vec3(p[0], p[1], p[2]); };
+    // the point furthest from the first, then the point furthest from that one span the starting sphere
+    glm::vec3 a = point(0);
+    glm::vec3 b = a;
+    float best = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        glm::vec3 d = point(i) - a;
+        float distance = glm::dot(d, d);
+        if (distance > best)
+        {
+            best = distance;
+            b = point(i);
+        }
+    }
+    glm::vec3 c = b;
+    best = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        glm::vec3 d = point(i) - b;
+        float distance = glm::dot(d, d);
+        if (distance > best)
+        {
+            best = distance;
+            c = point(i);
+        }
+    }
+    center = (b + c) * 0.5f;
+    radius = std::sqrt(best) * 0.5f;
+    // grow it over whatever is still outside
+    for (size_t i = 0; i < count; i++)
+    {
+        glm::vec3 d = point(i) - center;
+        float distance = std::sqrt(glm::dot(d, d));
+        if (distance > radius)
+        {
+            float grown = (radius + distance) * 0.5f;
+            center = center + d * ((grown - radius) / distance);
+            radius = grown;
+        }
+    }
+}
@@ -0,0 +1,228 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <glad/glad.h>
+#include "Mesh.h"
+#include "VertexLayout.h"
+#include "BufferHeap.h"
+#include "Simplifier.h"
+#include "GpuMemory.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Shared storage for every static mesh /////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// All meshes use the same VertexLayout and are suballocated from the arenas of one BufferHeap, each mesh taking a single
+// range with its vertices followed by its indices. Every arena gets one VAO with the arena as both vertex and index
+// buffer, so any set of meshes in an arena can go out in a single glMultiDrawElementsIndirect. A MeshRange says where a
+// mesh ended up; meshes can be removed, and update() compacts the heap a little every frame, after which ranges have to
+// be fetched again with range(). A mesh can carry a chain of LODs, index lists over the same vertices stored back to back,
+// and lod() gives the range of one of them.
+
+struct MeshRange
+{
+    unsigned int Id;
+    unsigned int Arena;
+    GLuint FirstIndex;
+    GLuint IndexCount;
+    GLint BaseVertex;
+    GLuint VertexCount;
+    VertexQuantization Quantization;
+
+    MeshRange() : Id(0), Arena(0), FirstIndex(0), IndexCount(0), BaseVertex(0), VertexCount(0) {}
+};
+
+// One level of detail of a mesh, FirstIndex counts from the mesh's first index
+struct LodRange
+{
+    GLuint FirstIndex;
+    GLuint IndexCount;
+    float Error;        // in mesh units, see Simplifier.h
+};
+
+class GeometryBuffer
+{
+public:
+    ///////////////////////// Constructor Function ////////////////////////////////////////////////
+    GeometryBuffer(const VertexLayout& layout, size_t arenaBytes = 64 * 1024 * 1024)
+        : vertexLayout(layout), stride(layout.stride()), heap(arenaBytes, GPU_MEMORY_VERTEX_DATA)
+    {
+    }
+
+    ~GeometryBuffer()
+    {
+        for (size_t i = 0; i < vertexArrays.size(); i++)
+            glDeleteVertexArrays(1, &vertexArrays[i].vao);
+    }
+
+    // Encodes the mesh with the buffer's layout and adds it
+    MeshRange add(const Mesh& mesh)
+    {
+        VertexQuantization quantization;
+        std::vector<unsigned char> vertices = vertexLayout.encode(mesh, quantization);
+        return addEncoded(vertices.data(), mesh.vertexCount(), mesh.Indices.data(), mesh.Indices.size(), quantization);
+    }
+
+    // Adds the mesh's vertices once with the index lists of every LOD after them, LOD 0 first
+    MeshRange add(const Mesh& mesh, const std::vector<MeshLod>& chain)
+    {
+        std::vector<unsigned int> indices;
+        std::vector<LodRange> lods;
+        for (size_t i = 0; i < chain.size(); i++)
+        {
+            LodRange lod = { (GLuint)indices.size(), (GLuint)chain[i].Indices.size(), chain[i].Error };
+            lods.push_back(lod);
+            indices.insert(indices.end(), chain[i].Indices.begin(), chain[i].Indices.end());
+        }
+        VertexQuantization quantization;
+        std::vector<unsigned char> vertices = vertexLayout.encode(mesh, quantization);
+        return addEncoded(vertices.data(), mesh.vertexCount(), indices.data(), indices.size(), quantization, lods);
+    }
+
+    // Adds vertices that are already in the buffer's layout, indices are relative to the mesh's first vertex. Without
+    // lods all the indices are one LOD. Returns an empty range if the heap couldn't make room.
+    MeshRange addEncoded(const void* vertices, size_t meshVertexCount, const unsigned int* indices, size_t meshIndexCount,
+        const VertexQuantization& quantization, const std::vector<LodRange>& lods = std::vector<LodRange>())
+    {
+        size_t vertexBytes = meshVertexCount * stride;
+        size_t indexBytes = meshIndexCount * sizeof(unsigned int);
+        size_t indexOffset = (vertexBytes + 15) & ~(size_t)15;
+        BufferAllocation allocation;
+        if (!heap.allocate(indexOffset + indexBytes, BUFFER_USAGE_VERTEX, stride, allocation))
+            return MeshRange();
+        heap.upload(allocation.Handle, vertices, vertexBytes);
+        heap.upload(allocation.Handle, indices, indexBytes, indexOffset);
+
+        Entry entry;
+        entry.handle = allocation.Handle;
+        entry.indexOffset = indexOffset;
+        entry.live = true;
+        entry.range.VertexCount = (GLuint)meshVertexCount;
+        entry.range.Quantization = quantization;
+        entry.lods = lods;
+        if (entry.lods.empty())
+        {
+            LodRange all = { 0, (GLuint)meshIndexCount, 0.0f };
+            entry.lods.push_back(all);
+        }
+        entry.range.IndexCount = entry.lods[0].IndexCount;
+        if (!freeIds.empty())
+        {
+            entry.range.Id = freeIds.back();
+            freeIds.pop_back();
+            meshes[entry.range.Id] = entry;
+        }
+        else
+        {
+            entry.range.Id = (unsigned int)meshes.size();
+            meshes.push_back(entry);
+        }
+        if (allocation.Handle >= meshOfHandle.size())
+            meshOfHandle.resize(allocation.Handle + 1);
+        meshOfHandle[allocation.Handle] = entry.range.Id;
+        place(meshes[entry.range.Id], allocation);
+        return meshes[entry.range.Id].range;
+    }
+
+    // The mesh's storage is reused once the GPU is done with it
+    void remove(const MeshRange& mesh)
+    {
+        if (mesh.Id >= meshes.size() || !meshes[mesh.Id].live)
+            return;
+        heap.free(meshes[mesh.Id].handle);
+        meshes[mesh.Id].live = false;
+        freeIds.push_back(mesh.Id);
+    }
+
+    // Where the mesh is now, compaction may have moved it since it was added
+    const MeshRange& range(unsigned int id) const { return meshes[id].range; }
+
+    // The range of one LOD of the mesh, level is clamped to the ones it has
+    MeshRange lod(unsigned int id, int level) const
+    {
+        const Entry& entry = meshes[id];
+        const LodRange& lod = entry.lods[std::min(std::max(level, 0), (int)entry.lods.size() - 1)];
+        MeshRange range = entry.range;
+        range.FirstIndex += lod.FirstIndex;
+        range.IndexCount = lod.IndexCount;
+        return range;
+    }
+
+    const std::vector<LodRange>& lods(unsigned int id) const { return meshes[id].lods; }
+
+    // Reclaims freed storage and moves up to compactionBudget bytes of meshes into holes. Call once a frame;
+    // returns true when meshes moved, so draws built from old MeshRanges have to be rebuilt.
+    bool update(size_t compactionBudget)
+    {
+        heap.update();
+        if (compactionBudget == 0)
+            return false;
+        return heap.compact(compactionBudget, [&](const BufferAllocation& allocation, size_t)
+        {
+            place(meshes[meshOfHandle[allocation.Handle]], allocation);
+        }) > 0;
+    }
+
+    // Binds the VAO of one arena of the heap
+    void bind(unsigned int arena = 0)
+    {
+        if (arena >= vertexArrays.size())
+            vertexArrays.resize(arena + 1, VertexArray());
+        VertexArray& vertexArray = vertexArrays[arena];
+        unsigned int buffer = arena < heap.arenaCount() ? heap.arenaBuffer(arena) : 0;
+        unsigned int generation = arena < heap.arenaCount() ? heap.arenaGeneration(arena) : 0;
+        if (!vertexArray.vao || vertexArray.generation != generation)
+        {
+            // first use of the arena, or its slot was released and reused
+            if (!vertexArray.vao)
+                glGenVertexArrays(1, &vertexArray.vao);
+            glBindVertexArray(vertexArray.vao);
+            glBindBuffer(GL_ARRAY_BUFFER, buffer);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+            vertexLayout.apply();
+            vertexArray.generation = generation;
+        }
+        glBindVertexArray(vertexArray.vao);
+    }
+
+    // The buffer behind an arena, for drawing a mesh's vertices with indices from somewhere else
+    unsigned int arenaBuffer(unsigned int arena) const { return heap.arenaBuffer(arena); }
+    const VertexLayout& layout() const { return vertexLayout; }
+    BufferHeapStats stats() const { return heap.stats(); }
+
+private:
+    // owns GL objects
+    GeometryBuffer(const GeometryBuffer&);
+    GeometryBuffer& operator=(const GeometryBuffer&);
+
+    struct Entry
+    {
+        MeshRange range;
+        std::vector<LodRange> lods;
+        unsigned int handle;
+        size_t indexOffset;     // from the start of the allocation
+        bool live;
+    };
+
+    struct VertexArray
+    {
+        unsigned int vao;
+        unsigned int generation;    // of the arena buffer the VAO points at, see BufferHeap::arenaGeneration
+        VertexArray() : vao(0), generation(0) {}
+    };
+
+    VertexLayout vertexLayout;
+    GLsizei stride;
+    BufferHeap heap;
+    std::vector<Entry> meshes;
+    std::vector<unsigned int> freeIds;
+    std::vector<unsigned int> meshOfHandle;
+    std::vector<VertexArray> vertexArrays;
+
+    // vertex allocations are aligned to the stride, so the mesh's first vertex has a whole vertex index
+    void place(Entry& entry, const BufferAllocation& allocation)
+    {
+        entry.range.Arena = allocation.Arena;
+        entry.range.BaseVertex = (GLint)(allocation.Offset / stride);
+        entry.range.FirstIndex = (GLuint)((allocation.Offset + entry.indexOffset) / sizeof(unsigned int));
+    }
+};
@@ -0,0 +1,270 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <glad/glad.h>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Tracks how much GPU memory our OpenGL resources use ///////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Textures, buffers and renderbuffers are created through the gpu* wrappers below, which record the bytes of every
+// allocation against a category. The tracker keeps the running total and high-water mark per category and calls the
+// budget callback once when the total goes over the configured budget, and again only after it has dropped back
+// under. Sizes are what we asked for (including mips), drivers may pad a little on top. Only used from the thread that
+// owns the GL context.
+
+enum GpuMemoryCategory
+{
+    GPU_MEMORY_TEXTURES,
+    GPU_MEMORY_VERTEX_DATA,
+    GPU_MEMORY_INDEX_DATA,
+    GPU_MEMORY_RENDER_TARGETS,
+    GPU_MEMORY_STREAMING,     // upload and readback buffers
+    GPU_MEMORY_OTHER,
+    GPU_MEMORY_CATEGORY_COUNT
+};
+
+inline const char* gpuMemoryCategoryName(GpuMemoryCategory category)
+{
+    switch (category)
+    {
+    case GPU_MEMORY_TEXTURES: return "Textures";
+    case GPU_MEMORY_VERTEX_DATA: return "Vertex data";
+    case GPU_MEMORY_INDEX_DATA: return "Index data";
+    case GPU_MEMORY_RENDER_TARGETS: return "Render targets";
+    case GPU_MEMORY_STREAMING: return "Streaming";
+    default: return "Other";
+    }
+}
+
+class GpuMemoryTracker
+{
+public:
+    // Called with the tracker, the new total and the budget when an allocation pushes the total over budget, not for
+    // the allocations after it until the total is back within budget
+    typedef std::function<void(const GpuMemoryTracker&, size_t used, size_t budget)> BudgetCallback;
+
+    enum ResourceKind
+    {
+        Texture = 1,
+        Buffer = 2,
+        Renderbuffer = 3
+    };
+
+    GpuMemoryTracker() : total(0), totalHighWater(0), budget(0), overBudget(false)
+    {
+        for (int i = 0; i < GPU_MEMORY_CATEGORY_COUNT; i++)
+        {
+            used[i] = 0;
+            highWater[i] = 0;
+        }
+    }
+
+    // Records (or re-records, if the resource is reallocated) the size of a GL object
+    void allocate(ResourceKind kind, unsigned int name, GpuMemoryCategory category, size_t bytes)
+    {
+        // a reallocation's old size goes without re-arming the callback, the total only dips for a moment
+        forget(kind, name);
+        Allocation allocation;
+        allocation.category = category;
+        allocation.bytes = bytes;
+        allocations[key(kind, name)] = allocation;
+        used[category] += bytes;
+        total += bytes;
+        if (used[category] > highWater[category])
+            highWater[category] = used[category];
+        if (total > totalHighWater)
+            totalHighWater = total;
+        if (budget > 0 && total > budget && !overBudget)
+        {
+            overBudget = true;
+            if (onOverBudget)
+                onOverBudget(*this, total, budget);
+        }
+    }
+
+    void release(ResourceKind kind, unsigned int name)
+    {
+        forget(kind, name);
+        if (total <= budget)
+            overBudget = false;
+    }
+
+    void setBudget(size_t bytes, BudgetCallback callback)
+    {
+        budget = bytes;
+        onOverBudget = callback;
+        overBudget = false;
+    }
+
+    size_t bytesUsed() const { return total; }
+    size_t bytesUsed(GpuMemoryCategory category) const { return used[category]; }
+    size_t peakBytes() const { return totalHighWater; }
+    size_t peakBytes(GpuMemoryCategory category) const { return highWater[category]; }
+    size_t budgetBytes() const { return budget; }
+    size_t resourceCount() const { return allocations.size(); }
+
+    void print(std::ostream& out) const
+    {
+        out << "GPU memory (" << allocations.size() << " resources)" << std::endl;
+        for (int i = 0; i < GPU_MEMORY_CATEGORY_COUNT; i++)
+        {
+            out << "  " << std::left << std::setw(16) << gpuMemoryCategoryName((GpuMemoryCategory)i) << std::right
+                << std::setw(10) << std::fixed << std::setprecision(2) << megabytes(used[i]) << " MB   peak "
+                << std::setw(10) << megabytes(highWater[i]) << " MB" << std::endl;
+        }
+        out << "  " << std::left << std::setw(16) << "Total" << std::right << std::setw(10) << megabytes(total) << " MB   peak "
+            << std::setw(10) << megabytes(totalHighWater) << " MB";
+        if (budget > 0)
+            out << "   budget " << megabytes(budget) << " MB";
+        out << std::endl;
+    }
+
+    static double megabytes(size_t bytes) { return bytes / (1024.0 * 1024.0); }
+
+private:
+    struct Allocation
+    {
+        GpuMemoryCategory category;
+        size_t bytes;
+    };
+
+    std::unordered_map<uint64_t, Allocation> allocations;
+    size_t used[GPU_MEMORY_CATEGORY_COUNT];
+    size_t highWater[GPU_MEMORY_CATEGORY_COUNT];
+    size_t total;
+    size_t totalHighWater;
+    size_t budget;
+    BudgetCallback onOverBudget;
+    bool overBudget;            // the callback has fired since the total last went over
+
+    static uint64_t key(ResourceKind kind, unsigned int name) { return ((uint64_t)kind << 32) | name; }
+
+    void forget(ResourceKind kind, unsigned int name)
+    {
+        std::unordered_map<uint64_t, Allocation>::iterator it = allocations.find(key(kind, name));
+        if (it == allocations.end())
+            return;
+        used[it->second.category] -= it->second.bytes;
+        total -= it->second.bytes;
+        allocations.erase(it);
+    }
+};
+
+// The one tracker every allocation goes through
+inline GpuMemoryTracker& gpuMemory()
+{
+    static GpuMemoryTracker tracker;
+    return tracker;
+}
+
+/////////////////////////////////////// Sizes ///////////////////////////////////////////////////////////
+inline size_t gpuBytesPerTexel(GLenum internalFormat)
+{
+    switch (internalFormat)
+    {
+    case GL_R8: return 1;
+    case GL_RG8: case GL_R16F: case GL_R16: case GL_DEPTH_COMPONENT16: return 2;
+    case GL_RGB8: case GL_SRGB8: return 4; // drivers pad 24 bit texels to 32
+    case GL_RGBA8: case GL_SRGB8_ALPHA8: case GL_RGBA8UI: case GL_RG16F: case GL_RG16: case GL_R32F: case GL_R32UI:
+    case GL_RGB10_A2: case GL_R11F_G11F_B10F: case GL_DEPTH_COMPONENT24: case GL_DEPTH24_STENCIL8: case GL_DEPTH_COMPONENT32F:
+        return 4;
+    case GL_RGBA16F: case GL_RGBA16: case GL_RGBA16UI: case GL_RG32F: case GL_RG32UI: return 8;
+    case GL_RGB32F: return 12;
+    case GL_RGBA32F: case GL_RGBA32UI: return 16;
+    default: return 4;
+    }
+}
+
+// Bytes of a full or partial mip chain
+inline size_t gpuTextureBytes(GLenum internalFormat, GLsizei levels, GLsizei width, GLsizei height, GLsizei layers = 1)
+{
+    size_t bytes = 0;
+    for (GLsizei level = 0; level < levels; level++)
+    {
+        bytes += (size_t)width * height * layers * gpuBytesPerTexel(internalFormat);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    return bytes;
+}
+
+// Number of levels in a complete mip chain
+inline GLsizei gpuMipLevels(GLsizei width, GLsizei height)
+{
+    GLsizei levels = 1;
+    while ((width | height) >> levels)
+        levels++;
+    return levels;
+}
+
+/////////////////////////////////////// Tracked allocation wrappers /////////////////////////////////////
+// texture has to be bound to GL_TEXTURE_2D
+inline void gpuTexStorage2D(unsigned int texture, GLsizei levels, GLenum internalFormat, GLsizei width, GLsizei height,
+    GpuMemoryCategory category = GPU_MEMORY_TEXTURES)
+{
+    glTexStorage2D(GL_TEXTURE_2D, levels, internalFormat, width, height);
+    gpuMemory().allocate(GpuMemoryTracker::Texture, texture, category, gpuTextureBytes(internalFormat, levels, width, height));
+}
+
+// Mutable level 0 storage, texture has to be bound to GL_TEXTURE_2D. Pass mipmapped = true when glGenerateMipmap follows.
+inline void gpuTexImage2D(unsigned int texture, GLenum internalFormat, GLsizei width, GLsizei height, GLenum format, GLenum type,
+    const void* data, bool mipmapped, GpuMemoryCategory category = GPU_MEMORY_TEXTURES)
+{
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, data);
+    GLsizei levels = mipmapped ? gpuMipLevels(width, height) : 1;
+    gpuMemory().allocate(GpuMemoryTracker::Texture, texture, category, gpuTextureBytes(internalFormat, levels, width, height));
+}
+
+// texture has to be bound to target (GL_TEXTURE_2D_ARRAY or GL_TEXTURE_3D style targets with depth as layers)
+inline void gpuTexStorage3D(unsigned int texture, GLenum target, GLsizei levels, GLenum internalFormat, GLsizei width, GLsizei height,
+    GLsizei layers, GpuMemoryCategory category = GPU_MEMORY_TEXTURES)
+{
+    glTexStorage3D(target, levels, internalFormat, width, height, layers);
+    gpuMemory().allocate(GpuMemoryTracker::Texture, texture, category, gpuTextureBytes(internalFormat, levels, width, height, layers));
+}
+
+// buffer has to be bound to target
+inline void gpuBufferData(unsigned int buffer, GLenum target, GLsizeiptr size, const void* data, GLenum usage, GpuMemoryCategory category)
+{
+    glBufferData(target, size, data, usage);
+    gpuMemory().allocate(GpuMemoryTracker::Buffer, buffer, category, (size_t)size);
+}
+
+// buffer has to be bound to target
+inline void gpuBufferStorage(unsigned int buffer, GLenum target, GLsizeiptr size, const void* data, GLbitfield flags, GpuMemoryCategory category)
+{
+    glBufferStorage(target, size, data, flags);
+    gpuMemory().allocate(GpuMemoryTracker::Buffer, buffer, category, (size_t)size);
+}
+
+// renderbuffer has to be bound to GL_RENDERBUFFER
+inline void gpuRenderbufferStorage(unsigned int renderbuffer, GLenum internalFormat, GLsizei width, GLsizei height)
+{
+    glRenderbufferStorage(GL_RENDERBUFFER, internalFormat, width, height);
+    gpuMemory().allocate(GpuMemoryTracker::Renderbuffer, renderbuffer, GPU_MEMORY_RENDER_TARGETS, gpuTextureBytes(internalFormat, 1, width, height));
+}
+
+inline void gpuDeleteTextures(GLsizei count, const unsigned int* textures)
+{
+    for (GLsizei i = 0; i < count; i++)
+        gpuMemory().release(GpuMemoryTracker::Texture, textures[i]);
+    glDeleteTextures(count, textures);
+}
+
+inline void gpuDeleteBuffers(GLsizei count, const unsigned int* buffers)
+{
+    for (GLsizei i = 0; i < count; i++)
+        gpuMemory().release(GpuMemoryTracker::Buffer, buffers[i]);
+    glDeleteBuffers(count, buffers);
+}
+
+inline void gpuDeleteRenderbuffers(GLsizei count, const unsigned int* renderbuffers)
+{
+    for (GLsizei i = 0; i < count; i++)
+        gpuMemory().release(GpuMemoryTracker::Renderbuffer, renderbuffers[i]);
+    glDeleteRenderbuffers(count, renderbuffers);
+}
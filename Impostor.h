@@ -0,0 +1,314 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm.hpp>
+#include <gtc/matrix_transform.hpp>
+#include "Geometry.h"
+#include "GeometryBuffer.h"
+#include "FrameAllocator.h"
+#include "GpuMemory.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Impostors: distant objects as one textured quad /////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Each mesh is baked once into a layer of two texture arrays, color and depth, as seen from Views x Views directions laid
+// out on an octahedron: a direction maps to the square by folding its lower half over the upper one, and every tile of
+// the layer holds the orthographic view of the mesh's bounding sphere from the direction at the tile's center.
+//
+// An instance far enough away that the sphere covers fewer than SwitchPixels pixels (the tile size, so a view has all the
+// detail the mesh could show) is drawn as a quad facing the camera instead. impostor.vs picks the tile of the direction to
+// the camera in the instance's model space, so the view turns with the object, and impostor.fs writes the baked depth so
+// impostors still intersect the ground and each other. Every instance of a layer is one instanced draw of four vertices
+// each, the instance indices going to the shader through ImpostorListBinding. The encoding here and in impostor.vs match.
+
+const GLuint ImpostorListBinding = 3;   // shader storage block of instance indices
+
+namespace ImpostorDetail
+{
+    inline float signNotZero(float value) { return value >= 0.0f ? 1.0f : -1.0f; }
+
+    // Unit direction to [-1, 1]^2, +y in the middle and -y in the corners
+    inline glm::vec2 octEncode(const glm::vec3& direction)
+    {
+        float norm = std::fabs(direction.x) + std::fabs(direction.y) + std::fabs(direction.z);
+        glm::vec2 p(direction.x / norm, direction.z / norm);
+        if (direction.y < 0.0f)
+            p = glm::vec2((1.0f - std::fabs(p.y)) * signNotZero(p.x), (1.0f - std::fabs(p.x)) * signNotZero(p.y));
+        return p;
+    }
+
+    inline glm::vec3 octDecode(const glm::vec2& p)
+    {
+        glm::vec3 direction(p.x, 1.0f - std::fabs(p.x) - std::fabs(p.y), p.y);
+        if (direction.y < 0.0f)
+        {
+            float x = direction.x;
+            direction.x = (1.0f - std::fabs(direction.z)) * signNotZero(x);
+            direction.z = (1.0f - std::fabs(x)) * signNotZero(direction.z);
+        }
+        return glm::normalize(direction);
+    }
+
+    // The image axes of the view looking back along direction, up stays as close to +y as it can
+    inline void viewBasis(const glm::vec3& direction, glm::vec3& right, glm::vec3& up)
+    {
+        glm::vec3 reference = std::fabs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, -1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        right = glm::normalize(glm::cross(reference, direction));
+        up = glm::cross(direction, right);
+    }
+}
+
+struct ImpostorStats
+{
+    size_t Candidates;          // visible instances that had a layer
+    size_t Impostors;           // of those, drawn as a quad
+    size_t Draws;
+    size_t MeshVertices;        // the vertices the impostors' meshes would have had
+    size_t ImpostorVertices;
+};
+
+class ImpostorAtlas
+{
+public:
+    unsigned int ColorArray;    // RGBA8, a few mips
+    unsigned int DepthArray;    // R16, 0 at the near side of the bounding sphere, 1 at the far side
+    int Views;                  // per side of the octahedral grid
+    int TileSize;               // texels per side of one view
+    int MaxLayers;
+    float SwitchPixels;
+
+    ///////////////////////// Constructor Function ////////////////////////////////////////////////
+    ImpostorAtlas(int maxLayers, int views = 8, int tileSize = 64)
+        : Views(views), TileSize(tileSize), MaxLayers(maxLayers), SwitchPixels((float)tileSize)
+    {
+        // mips down to 8 texel tiles, below that they bleed into each other
+        int size = Views * TileSize;
+        colorLevels = 1;
+        while ((TileSize >> colorLevels) >= 8)
+            colorLevels++;
+        glGenTextures(1, &ColorArray);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, ColorArray);
+        gpuTexStorage3D(ColorArray, GL_TEXTURE_2D_ARRAY, colorLevels, GL_RGBA8, size, size, MaxLayers);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        glGenTextures(1, &DepthArray);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, DepthArray);
+        gpuTexStorage3D(DepthArray, GL_TEXTURE_2D_ARRAY, 1, GL_R16, size, size, MaxLayers);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        // the quads make their corners from gl_VertexID, but a draw still needs a vertex array bound
+        glGenVertexArrays(1, &emptyVao);
+        resetStats();
+    }
+
+    ~ImpostorAtlas()
+    {
+        gpuDeleteTextures(1, &ColorArray);
+        gpuDeleteTextures(1, &DepthArray);
+        glDeleteVertexArrays(1, &emptyVao);
+    }
+
+    ////////////////////////// Baking ///////////////////////////////////////////////////////////////
+    // Renders the mesh from every view into a new layer with bakeShader (impostor_bake.vs/fs), which samples whatever
+    // textures the mesh is drawn with, so bind them first. Returns the layer, or -1 when every layer is taken.
+    // Changes the vertex array and program, the framebuffer and viewport are put back.
+    template <typename ShaderType>
+    int bake(ShaderType& bakeShader, GeometryBuffer& geometry, const MeshRange& mesh)
+    {
+        if ((int)layers.size() >= MaxLayers)
+            return -1;
+        int layer = (int)layers.size();
+        Layer baked;
+        // the mesh's vertices were quantized into this box, a sphere around it holds the mesh from any side. A texel of
+        // border keeps the sphere's silhouette off the edges of the tile.
+        baked.Center = mesh.Quantization.Offset;
+        baked.Extent = glm::length(mesh.Quantization.Scale) * (float)TileSize / (float)(TileSize - 2);
+        baked.VertexCount = mesh.VertexCount;
+        layers.push_back(baked);
+        lists.resize(layers.size());
+
+        GLint previousFramebuffer, previousViewport[4];
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        glGetIntegerv(GL_VIEWPORT, previousViewport);
+
+        int size = Views * TileSize;
+        unsigned int framebuffer, depthBuffer;
+        glGenRenderbuffers(1, &depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        gpuRenderbufferStorage(depthBuffer, GL_DEPTH_COMPONENT24, size, size);
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, ColorArray, 0, layer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, DepthArray, 0, layer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        const GLenum attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, attachments);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Impostor bake framebuffer is not complete" << std::endl;
+
+        // nothing is transparent and far away where no view covers the mesh
+        const GLfloat clearColor[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        const GLfloat clearDepth[4] = { 1.0f, 0.0f, 0.0f, 0.0f };
+        glViewport(0, 0, size, size);
+        glClearBufferfv(GL_COLOR, 0, clearColor);
+        glClearBufferfv(GL_COLOR, 1, clearDepth);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glEnable(GL_DEPTH_TEST);
+
+        bakeShader.use();
+        geometry.bind(mesh.Arena);
+        float extent = baked.Extent;
+        glm::mat4 projection = glm::ortho(-extent, extent, -extent, extent, extent, 3.0f * extent);
+        for (int y = 0; y < Views; y++)
+        {
+            for (int x = 0; x < Views; x++)
+            {
+                glm::vec3 direction = viewDirection(x, y);
+                glm::vec3 right, up;
+                ImpostorDetail::viewBasis(direction, right, up);
+                glm::mat4 view = glm::lookAt(baked.Center + direction * (2.0f * extent), baked.Center, up);
+                bakeShader.setMat4("bakeMatrix", projection * view * mesh.Quantization.matrix());
+                glViewport(x * TileSize, y * TileSize, TileSize, TileSize);
+                glDrawElementsBaseVertex(GL_TRIANGLES, mesh.IndexCount, GL_UNSIGNED_INT, (const void*)(mesh.FirstIndex * sizeof(unsigned int)),
+                    mesh.BaseVertex);
+            }
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, (GLuint)previousFramebuffer);
+        glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+        glDeleteFramebuffers(1, &framebuffer);
+        gpuDeleteRenderbuffers(1, &depthBuffer);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, ColorArray);
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        return layer;
+    }
+
+    int layerCount() const { return (int)layers.size(); }
+
+    ////////////////////////// Per frame /////////////////////////////////////////////////////////////
+    // Takes the instances small enough on screen out of instances, keeping the order of the rest, and queues them as
+    // impostors. layerOf(instance) is the layer baked for the instance's mesh, or -1 for none, boundsOf(instance) its box
+    // in world space.
+    template <typename LayerOf, typename BoundsOf>
+    void select(std::vector<unsigned int>& instances, const glm::vec3& eye, float pixelsPerRadian, const LayerOf& layerOf,
+        const BoundsOf& boundsOf)
+    {
+        clear();
+        size_t kept = 0;
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+            unsigned int instance = instances[i];
+            int layer = layerOf(instance);
+            if (layer >= 0 && layer < (int)layers.size())
+            {
+                frameStats.Candidates++;
+                Aabb bounds = boundsOf(instance);
+                float radius = glm::length(bounds.extent());
+                float distance = glm::length(bounds.center() - eye);
+                if (distance > radius && 2.0f * radius * pixelsPerRadian < SwitchPixels * distance)
+                {
+                    lists[layer].push_back(instance);
+                    frameStats.Impostors++;
+                    frameStats.MeshVertices += layers[layer].VertexCount;
+                    continue;
+                }
+            }
+            instances[kept++] = instance;
+        }
+        instances.resize(kept);
+    }
+
+    // Drops the impostors queued by select()
+    void clear()
+    {
+        for (size_t l = 0; l < lists.size(); l++)
+            lists[l].clear();
+        resetStats();
+    }
+
+    size_t impostorCount() const { return frameStats.Impostors; }
+
+    // Binds the arrays and sets the uniforms impostor.vs/fs share between layers
+    template <typename ShaderType>
+    void bind(ShaderType& shader, int colorUnit, int depthUnit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + colorUnit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, ColorArray);
+        glActiveTexture(GL_TEXTURE0 + depthUnit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, DepthArray);
+        shader.setInt("impostorColor", colorUnit);
+        shader.setInt("impostorDepth", depthUnit);
+        shader.setInt("impostorViews", Views);
+    }
+
+    // One instanced draw of a quad per layer with impostors queued, with shader in use and bind() done
+    template <typename ShaderType>
+    void draw(ShaderType& shader, FrameAllocator& frameData)
+    {
+        glBindVertexArray(emptyVao);
+        for (size_t l = 0; l < lists.size(); l++)
+        {
+            if (lists[l].empty())
+                continue;
+            FrameAllocation list = frameData.allocate(lists[l].size() * sizeof(GLuint), BUFFER_USAGE_STORAGE);
+            if (!list.Data)
+                continue;
+            std::memcpy(list.Data, lists[l].data(), lists[l].size() * sizeof(GLuint));
+            frameData.bind(GL_SHADER_STORAGE_BUFFER, ImpostorListBinding, list);
+            shader.setInt("impostorLayer", (int)l);
+            shader.setVec4("impostorBounds", glm::vec4(layers[l].Center, layers[l].Extent));
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)lists[l].size());
+            frameStats.Draws++;
+            frameStats.ImpostorVertices += 4 * lists[l].size();
+        }
+    }
+
+    const ImpostorStats& stats() const { return frameStats; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << layers.size() << " meshes baked, " << Views << " x " << Views << " views of " << TileSize << " texels" << std::endl;
+        out << "  " << frameStats.Impostors << " of " << frameStats.Candidates << " objects as impostors in " << frameStats.Draws
+            << " draws, " << frameStats.ImpostorVertices << " vertices instead of " << frameStats.MeshVertices << std::endl;
+    }
+
+private:
+    // owns GL objects
+    ImpostorAtlas(const ImpostorAtlas&);
+    ImpostorAtlas& operator=(const ImpostorAtlas&);
+
+    struct Layer
+    {
+        glm::vec3 Center;       // of the bounding sphere, in model space
+        float Extent;           // half size of a view, the sphere's radius and a texel of border
+        GLuint VertexCount;
+    };
+
+    std::vector<Layer> layers;
+    std::vector<std::vector<GLuint> > lists;    // per layer, the instances drawn as impostors this frame
+    ImpostorStats frameStats;
+    unsigned int emptyVao;
+    int colorLevels;
+
+    // The direction from the mesh towards the viewer for the tile at x, y
+    glm::vec3 viewDirection(int x, int y) const
+    {
+        return ImpostorDetail::octDecode(glm::vec2(((float)x + 0.5f) / (float)Views * 2.0f - 1.0f, ((float)y + 0.5f) / (float)Views * 2.0f - 1.0f));
+    }
+
+    void resetStats()
+    {
+        ImpostorStats empty = {};
+        frameStats = empty;
+    }
+};
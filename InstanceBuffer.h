@@ -0,0 +1,85 @@
+#pragma once
+#include <vector>
+#include <glad/glad.h>
+#include <glm.hpp>
+#include "GpuMemory.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Per-instance data for instanced draws /////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Instances live in a shader storage buffer bound at InstanceBufferBinding. shader.vs reads instances[gl_InstanceID]
+// when its `instanced` uniform is set, so any number of copies of a mesh go out in one glDrawElementsInstanced.
+
+const GLuint InstanceBufferBinding = 0;
+
+// Matches the std430 Instance struct in shader.vs, 80 bytes
+struct InstanceData
+{
+    glm::mat4 Model;
+    unsigned int Material;
+    unsigned int Padding[3];
+};
+static_assert(sizeof(InstanceData) == 80, "InstanceData has to match the std430 layout in shader.vs");
+
+class InstanceBuffer
+{
+public:
+    unsigned int ID;
+
+    InstanceBuffer() : capacity(0), count(0)
+    {
+        glGenBuffers(1, &ID);
+    }
+
+    ~InstanceBuffer()
+    {
+        gpuDeleteBuffers(1, &ID);
+    }
+
+    // Replaces every instance, the storage only grows
+    void upload(const std::vector<InstanceData>& instances)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ID);
+        if (instances.size() > capacity)
+        {
+            capacity = instances.size();
+            gpuBufferData(ID, GL_SHADER_STORAGE_BUFFER, capacity * sizeof(InstanceData), NULL, GL_DYNAMIC_DRAW, GPU_MEMORY_VERTEX_DATA);
+        }
+        if (!instances.empty())
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, instances.size() * sizeof(InstanceData), instances.data());
+        count = instances.size();
+    }
+
+    // Updates a range of instances that were uploaded before
+    void update(size_t first, const InstanceData* instances, size_t instanceCount)
+    {
+        if (first + instanceCount > count)
+            return;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ID);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(InstanceData), instanceCount * sizeof(InstanceData), instances);
+    }
+
+    // The same from instances already written into another buffer, a FrameAllocator region for one. The copy runs on the
+    // GPU in order with the draws, nothing goes through the driver's staging memory.
+    void update(size_t first, GLuint source, GLintptr sourceOffset, size_t instanceCount)
+    {
+        if (first + instanceCount > count)
+            return;
+        glCopyNamedBufferSubData(source, ID, sourceOffset, (GLintptr)(first * sizeof(InstanceData)), (GLsizeiptr)(instanceCount * sizeof(InstanceData)));
+    }
+
+    void bind() const
+    {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, InstanceBufferBinding, ID);
+    }
+
+    size_t size() const { return count; }
+
+private:
+    // owns a GL object
+    InstanceBuffer(const InstanceBuffer&);
+    InstanceBuffer& operator=(const InstanceBuffer&);
+
+    size_t capacity;
+    size_t count;
+};
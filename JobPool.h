@@ -0,0 +1,144 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Persistent worker threads for parallel loops ////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// One pool for the whole program, started on first use with a thread per core but one. forEach() runs work(i) for every i
+// below count: the calling thread takes items too, each thread takes the next item until none are left, and it returns
+// once all of them are done. Waking the sleeping workers costs microseconds where starting threads costs tens of them
+// each, so per frame loops (scene levels, meshlet and depth tiles) can use it.
+// One loop runs at a time. A loop started while another is running, from another thread or from inside a work item,
+// runs on its caller alone rather than waiting.
+
+class JobPool
+{
+public:
+    // The pool everything shares
+    static JobPool& shared()
+    {
+        static JobPool pool;
+        return pool;
+    }
+
+    // threads counts the thread calling forEach(), 0 = one per core
+    explicit JobPool(unsigned int threads = 0) : current(NULL), generation(0), stopping(false)
+    {
+        unsigned int total = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned int i = 1; i < total; i++)
+            workers.push_back(std::thread(&JobPool::workerLoop, this));
+    }
+
+    ~JobPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    // Threads a loop can run on, the caller's included
+    unsigned int threadCount() const { return (unsigned int)workers.size() + 1; }
+
+    // work(i) for i in [0, count) on up to maxThreads threads, the caller's included
+    template <typename Work>
+    void forEach(size_t count, size_t maxThreads, const Work& work)
+    {
+        size_t threads = std::min<size_t>(std::min<size_t>(maxThreads, count), threadCount());
+        std::unique_lock<std::mutex> submit;
+        if (threads > 1)
+            submit = std::unique_lock<std::mutex>(submitMutex, std::try_to_lock);
+        if (threads <= 1 || !submit.owns_lock())
+        {
+            for (size_t i = 0; i < count; i++)
+                work(i);
+            return;
+        }
+
+        Job job;
+        job.work = &work;
+        job.invoke = &invokeWork<Work>;
+        job.count = count;
+        job.next = 0;
+        job.helpers = threads - 1;
+        job.active = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = &job;
+            generation++;
+        }
+        wake.notify_all();
+        run(job);
+
+        // workers that haven't joined by now never will, wait for the ones that did
+        std::unique_lock<std::mutex> lock(mutex);
+        current = NULL;
+        done.wait(lock, [&job]() { return job.active == 0; });
+    }
+
+private:
+    JobPool(const JobPool&);
+    JobPool& operator=(const JobPool&);
+
+    struct Job
+    {
+        const void* work;
+        void (*invoke)(const void* work, size_t item);
+        size_t count;
+        std::atomic<size_t> next;
+        size_t helpers;         // workers that may still join, guarded by mutex
+        size_t active;          // workers inside run(), guarded by mutex
+    };
+
+    std::vector<std::thread> workers;
+    std::mutex submitMutex;     // held by the thread whose loop is running
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    Job* current;
+    unsigned int generation;
+    bool stopping;
+
+    template <typename Work>
+    static void invokeWork(const void* work, size_t item)
+    {
+        (*(const Work*)work)(item);
+    }
+
+    static void run(Job& job)
+    {
+        for (size_t i = job.next++; i < job.count; i = job.next++)
+            job.invoke(job.work, i);
+    }
+
+    void workerLoop()
+    {
+        unsigned int seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [&]() { return stopping || (current && generation != seen); });
+            if (stopping)
+                return;
+            seen = generation;
+            Job& job = *current;
+            if (job.helpers == 0)
+                continue;
+            job.helpers--;
+            job.active++;
+            lock.unlock();
+            run(job);
+            lock.lock();
+            if (--job.active == 0)
+                done.notify_all();
+        }
+    }
+};
@@ -0,0 +1,332 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Baseline JPEG encoder for generated test images //////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Writes baseline (sequential, Huffman coded) JFIF data so the decoder can be checked on images the repo doesn't ship:
+// any size, grayscale or YCbCr with 4:4:4, 4:2:2 or 4:2:0 chroma, any IJG quality. Quantization and Huffman tables are
+// the example ones of the standard (Annex K). The forward DCT is the plain separable matrix product, it is meant for
+// test corpora and not for speed. Partial MCUs at the right and bottom edges repeat the last column and row.
+
+enum JpegSubsampling
+{
+    JPEG_SUBSAMPLING_444,
+    JPEG_SUBSAMPLING_422,   // half the chroma columns
+    JPEG_SUBSAMPLING_420    // half the chroma columns and rows
+};
+
+namespace JpegEncoderDetail
+{
+    const unsigned char ZigZag[64] = {
+        0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+    const unsigned char LuminanceQuantization[64] = {
+        16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92, 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99 };
+    const unsigned char ChrominanceQuantization[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99 };
+
+    // code counts per length 1..16, then the symbols in code order
+    const unsigned char LuminanceDcBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+    const unsigned char ChrominanceDcBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+    const unsigned char DcSymbols[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    const unsigned char LuminanceAcBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+    const unsigned char LuminanceAcSymbols[162] = {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81,
+        0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18,
+        0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+        0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99,
+        0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5,
+        0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa };
+    const unsigned char ChrominanceAcBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+    const unsigned char ChrominanceAcSymbols[162] = {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08,
+        0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25,
+        0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47,
+        0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+        0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+        0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+        0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4,
+        0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa };
+
+    struct HuffmanTable
+    {
+        unsigned short code[256];
+        unsigned char length[256];
+
+        HuffmanTable(const unsigned char* bits, const unsigned char* symbols)
+        {
+            std::fill(length, length + 256, 0);
+            unsigned int next = 0;
+            int k = 0;
+            for (int size = 1; size <= 16; size++)
+            {
+                for (int i = 0; i < bits[size - 1]; i++, k++)
+                {
+                    code[symbols[k]] = (unsigned short)next++;
+                    length[symbols[k]] = (unsigned char)size;
+                }
+                next <<= 1;
+            }
+        }
+    };
+
+    // Entropy coded bytes, 0xff is followed by a stuffed 0
+    class BitWriter
+    {
+    public:
+        explicit BitWriter(std::vector<unsigned char>& out) : out(out), buffer(0), count(0) {}
+
+        void write(unsigned int bits, int length)
+        {
+            buffer = (buffer << length) | (bits & ((1u << length) - 1));
+            count += length;
+            while (count >= 8)
+            {
+                unsigned char byte = (unsigned char)(buffer >> (count - 8));
+                out.push_back(byte);
+                if (byte == 0xff)
+                    out.push_back(0);
+                count -= 8;
+            }
+        }
+
+        // pads the last byte with ones
+        void flush()
+        {
+            if (count > 0)
+                write(0x7f, 8 - count);
+        }
+
+    private:
+        std::vector<unsigned char>& out;
+        unsigned int buffer;
+        int count;
+    };
+
+    inline void writeWord(std::vector<unsigned char>& out, unsigned int value)
+    {
+        out.push_back((unsigned char)(value >> 8));
+        out.push_back((unsigned char)value);
+    }
+
+    inline void writeHuffmanTable(std::vector<unsigned char>& out, int tableClass, int id, const unsigned char* bits, const unsigned char* symbols)
+    {
+        int count = 0;
+        for (int i = 0; i < 16; i++)
+            count += bits[i];
+        out.push_back(0xff);
+        out.push_back(0xc4);
+        writeWord(out, 2 + 1 + 16 + count);
+        out.push_back((unsigned char)(tableClass << 4 | id));
+        out.insert(out.end(), bits, bits + 16);
+        out.insert(out.end(), symbols, symbols + count);
+    }
+
+    // Magnitude category of a coefficient and the bits that follow its code
+    inline int category(int value, unsigned int& bits)
+    {
+        int magnitude = value < 0 ? -value : value;
+        int size = 0;
+        while (magnitude >> size)
+            size++;
+        bits = value < 0 ? (unsigned int)(value - 1) : (unsigned int)value;
+        return size;
+    }
+
+    // Forward DCT of a level shifted block, quantized and in zigzag order
+    inline void transformBlock(const float* samples, const unsigned char* quantization, int* coefficients)
+    {
+        static float basis[8][8];
+        static bool ready = false;
+        if (!ready)
+        {
+            for (int u = 0; u < 8; u++)
+                for (int x = 0; x < 8; x++)
+                    basis[u][x] = (u == 0 ? std::sqrt(0.125f) : 0.5f) * std::cos((2 * x + 1) * u * 3.14159265f / 16.0f);
+            ready = true;
+        }
+        float rows[64];
+        for (int y = 0; y < 8; y++)
+            for (int u = 0; u < 8; u++)
+            {
+                float sum = 0.0f;
+                for (int x = 0; x < 8; x++)
+                    sum += basis[u][x] * samples[y * 8 + x];
+                rows[y * 8 + u] = sum;
+            }
+        for (int k = 0; k < 64; k++)
+        {
+            int natural = ZigZag[k];
+            int u = natural % 8, v = natural / 8;
+            float sum = 0.0f;
+            for (int y = 0; y < 8; y++)
+                sum += basis[v][y] * rows[y * 8 + u];
+            int value = (int)std::floor(sum / quantization[natural] + 0.5f);
+            // baseline codes at most 11 bit DC differences and 10 bit AC values
+            coefficients[k] = std::max(-1023, std::min(1023, value));
+        }
+    }
+
+    inline void encodeBlock(BitWriter& writer, const int* coefficients, int& previousDc, const HuffmanTable& dc, const HuffmanTable& ac)
+    {
+        unsigned int bits;
+        int size = category(coefficients[0] - previousDc, bits);
+        previousDc = coefficients[0];
+        writer.write(dc.code[size], dc.length[size]);
+        if (size)
+            writer.write(bits, size);
+
+        int run = 0;
+        for (int k = 1; k < 64; k++)
+        {
+            if (coefficients[k] == 0)
+            {
+                run++;
+                continue;
+            }
+            while (run >= 16)
+            {
+                writer.write(ac.code[0xf0], ac.length[0xf0]);
+                run -= 16;
+            }
+            size = category(coefficients[k], bits);
+            int symbol = run << 4 | size;
+            writer.write(ac.code[symbol], ac.length[symbol]);
+            writer.write(bits, size);
+            run = 0;
+        }
+        if (run > 0)
+            writer.write(ac.code[0], ac.length[0]);
+    }
+}
+
+// Appends a JPEG of width x height pixels with 1 (gray) or 3 (RGB) interleaved channels to out. quality is 1-100 as in
+// libjpeg, subsampling only matters for RGB.
+inline void encodeJpeg(std::vector<unsigned char>& out, const unsigned char* pixels, int width, int height, int channels, int quality,
+    JpegSubsampling subsampling = JPEG_SUBSAMPLING_420)
+{
+    using namespace JpegEncoderDetail;
+    quality = std::max(1, std::min(100, quality));
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    unsigned char tables[2][64];
+    for (int i = 0; i < 64; i++)
+    {
+        tables[0][i] = (unsigned char)std::max(1, std::min(255, (LuminanceQuantization[i] * scale + 50) / 100));
+        tables[1][i] = (unsigned char)std::max(1, std::min(255, (ChrominanceQuantization[i] * scale + 50) / 100));
+    }
+    int components = channels == 1 ? 1 : 3;
+    int columns = components == 1 || subsampling == JPEG_SUBSAMPLING_444 ? 1 : 2;
+    int rows = components == 3 && subsampling == JPEG_SUBSAMPLING_420 ? 2 : 1;
+
+    out.push_back(0xff);
+    out.push_back(0xd8);
+    for (int t = 0; t < (components == 1 ? 1 : 2); t++)
+    {
+        out.push_back(0xff);
+        out.push_back(0xdb);
+        writeWord(out, 2 + 65);
+        out.push_back((unsigned char)t);
+        for (int k = 0; k < 64; k++)
+            out.push_back(tables[t][ZigZag[k]]);
+    }
+    out.push_back(0xff);
+    out.push_back(0xc0);
+    writeWord(out, 8 + 3 * components);
+    out.push_back(8);
+    writeWord(out, height);
+    writeWord(out, width);
+    out.push_back((unsigned char)components);
+    for (int c = 0; c < components; c++)
+    {
+        out.push_back((unsigned char)(c + 1));
+        out.push_back(c == 0 ? (unsigned char)(columns << 4 | rows) : 0x11);
+        out.push_back(c == 0 ? 0 : 1);
+    }
+    writeHuffmanTable(out, 0, 0, LuminanceDcBits, DcSymbols);
+    writeHuffmanTable(out, 1, 0, LuminanceAcBits, LuminanceAcSymbols);
+    if (components == 3)
+    {
+        writeHuffmanTable(out, 0, 1, ChrominanceDcBits, DcSymbols);
+        writeHuffmanTable(out, 1, 1, ChrominanceAcBits, ChrominanceAcSymbols);
+    }
+    out.push_back(0xff);
+    out.push_back(0xda);
+    writeWord(out, 6 + 2 * components);
+    out.push_back((unsigned char)components);
+    for (int c = 0; c < components; c++)
+    {
+        out.push_back((unsigned char)(c + 1));
+        out.push_back(c == 0 ? 0x00 : 0x11);
+    }
+    out.push_back(0);
+    out.push_back(63);
+    out.push_back(0);
+
+    HuffmanTable dcTables[2] = { HuffmanTable(LuminanceDcBits, DcSymbols), HuffmanTable(ChrominanceDcBits, DcSymbols) };
+    HuffmanTable acTables[2] = { HuffmanTable(LuminanceAcBits, LuminanceAcSymbols), HuffmanTable(ChrominanceAcBits, ChrominanceAcSymbols) };
+    BitWriter writer(out);
+    int previousDc[3] = { 0, 0, 0 };
+    int mcuWidth = 8 * columns, mcuHeight = 8 * rows;
+
+    // the MCU's samples per component, full resolution luma and averaged chroma, level shifted
+    std::vector<float> planes[3];
+    for (int c = 0; c < components; c++)
+        planes[c].resize((size_t)mcuWidth * mcuHeight);
+    float block[64];
+    int coefficients[64];
+    for (int my = 0; my < height; my += mcuHeight)
+        for (int mx = 0; mx < width; mx += mcuWidth)
+        {
+            for (int y = 0; y < mcuHeight; y++)
+                for (int x = 0; x < mcuWidth; x++)
+                {
+                    const unsigned char* p = pixels + ((size_t)std::min(my + y, height - 1) * width + std::min(mx + x, width - 1)) * channels;
+                    size_t i = (size_t)y * mcuWidth + x;
+                    if (components == 1)
+                    {
+                        planes[0][i] = p[0] - 128.0f;
+                        continue;
+                    }
+                    float r = p[0], g = p[1], b = p[2];
+                    planes[0][i] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+                    planes[1][i] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                    planes[2][i] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+                }
+
+            for (int by = 0; by < rows; by++)
+                for (int bx = 0; bx < columns; bx++)
+                {
+                    for (int y = 0; y < 8; y++)
+                        for (int x = 0; x < 8; x++)
+                            block[y * 8 + x] = planes[0][(size_t)(by * 8 + y) * mcuWidth + bx * 8 + x];
+                    transformBlock(block, tables[0], coefficients);
+                    encodeBlock(writer, coefficients, previousDc[0], dcTables[0], acTables[0]);
+                }
+            for (int c = 1; c < components; c++)
+            {
+                for (int y = 0; y < 8; y++)
+                    for (int x = 0; x < 8; x++)
+                    {
+                        float sum = 0.0f;
+                        for (int sy = 0; sy < rows; sy++)
+                            for (int sx = 0; sx < columns; sx++)
+                                sum += planes[c][(size_t)(y * rows + sy) * mcuWidth + x * columns + sx];
+                        block[y * 8 + x] = sum / (rows * columns);
+                    }
+                transformBlock(block, tables[1], coefficients);
+                encodeBlock(writer, coefficients, previousDc[c], dcTables[1], acTables[1]);
+            }
+        }
+    writer.flush();
+    out.push_back(0xff);
+    out.push_back(0xd9);
+}
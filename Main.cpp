@@ -8,6 +8,16 @@
 
 
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <climits>
 #include "glad/glad.h"
 #include "GLFW/glfw3.h"
 #define STB_IMAGE_IMPLEMENTATION
@@ -19,18 +29,120 @@
 
 #include "Shader.h"
 #include "Camera.h"
+#include "VirtualTexture.h"
+#include "AssetPack.h"
+#include "DynamicTexture.h"
+#include "GpuMemory.h"
+#include "MeshOptimizer.h"
+#include "Simplifier.h"
+#include "VertexLayout.h"
+#include "MeshLoader.h"
+#include "InstanceBuffer.h"
+#include "Benchmark.h"
+#include "JpegEncoder.h"
+#include "GeometryBuffer.h"
+#include "MultiDraw.h"
+#include "FrameAllocator.h"
+#include "Terrain.h"
+#include "Meshlets.h"
+#include "Scene.h"
+#include "Bvh.h"
+#include "OcclusionCuller.h"
+#include "OcclusionQueries.h"
+#include "RenderQueue.h"
+#include "Picking.h"
+#include "CameraCollision.h"
+#include "VisibilityCache.h"
+#include "WorldStreamer.h"
+#include "Impostor.h"
 
 void windowSizeCallback(GLFWwindow* window, int width, int height);
 void windowCloseCallback(GLFWwindow* window);
 void keyboardInput(GLFWwindow* window);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
+void printStats(const GeometryBuffer& geometry, const FrameAllocator& frameData, const ClipmapTerrain& terrain, const Scene& scene, const Bvh& sceneBvh,
+    const OcclusionCuller& occlusion, const OcclusionQueries& occlusionQueries, const RenderQueue& renderQueue,
+    const CameraCollision& cameraCollision, const VisibilityCache& visibilityCache, const WorldStreamer& world, const ImpostorAtlas& impostors);
 void framebufferSizeCallback(GLFWwindow* window, int width, int height);
+Shader loadShader(const char* vertexPath, const char* fragmentPath);
+unsigned char* loadImage(const char* path, int* width, int* height, int* channels, int desiredChannels);
+std::vector<InstanceData> makeCubeGrid(int count, float spacing, float scale);
+void cubeGridPlacement(int index, int count, float spacing, float scale, glm::vec3& position, glm::quat& rotation);
+glm::vec3 setupGridBenchmarkView(FrameAllocator& frameData, int count, float spacing);
+Mesh makeSphereMesh(int segments, int rings);
+void makeWorldCell(int x, int z, const ClipmapTerrain& terrain, CellContent& content);
+bool decodeJpegAtSimdLevels(const unsigned char* bytes, size_t length, int frames, double milliseconds[3], size_t differences[3],
+    int& width, int& height);
+void makeJpegTestImage(int width, int height, int channels, unsigned int seed, std::vector<unsigned char>& pixels);
+void runJpegBenchmark();
+void runObjBenchmark();
+void runMeshCacheBenchmark(GeometryBuffer& geometry);
+void runInstancingBenchmark(Shader& shader, GeometryBuffer& geometry, const MeshRange& mesh, InstanceBuffer& instances, FrameAllocator& frameData);
+void runMultiDrawBenchmark(Shader& shader, GeometryBuffer& geometry, const MeshRange& mesh, InstanceBuffer& instances, FrameAllocator& frameData);
+void runLodBenchmark(Shader& shader, GeometryBuffer& geometry, InstanceBuffer& instances, FrameAllocator& frameData);
+void runMeshletBenchmark(Shader& shader, GeometryBuffer& geometry, FrameAllocator& frameData);
+void runSceneBenchmark();
+void runBvhBenchmark();
+void runPickingBenchmark();
+void runCollisionBenchmark();
+void makeRollingSurface(int side, float size, std::vector<glm::vec3>& positions, std::vector<unsigned int>& indices);
+float rollingSurfaceHeight(float x, float z, float size);
+void runRenderQueueBenchmark();
+void runVisibilityBenchmark();
+void runStreamingBenchmark(GeometryBuffer& geometry, const ClipmapTerrain& terrain);
+void runImpostorBenchmark(Shader& shader, Shader& impostorShader, Shader& bakeShader, GeometryBuffer& geometry, InstanceBuffer& instances,
+    FrameAllocator& frameData);
+void runDynamicTextureBenchmark();
+Aabb meshBounds(const MeshRange& mesh, const glm::mat4& model);
 
 /////////////////////// Global Settings //////////////////////////////////////////
 const int screenHeight = 1200;
 const int screenWidth = 1600;
 float angle = 0.0f;
+// how many times the floor image repeats across 100 units of ground
+const float floorRepeat = 50.0f;
+// press V to swap the crate's checkered overlay for a live streamed texture
+bool showLiveTexture = false;
+// warn when textures and buffers grow past this, press P to print the current numbers
+const size_t gpuMemoryBudget = 256 * 1024 * 1024;
+bool printStatsRequested = false;
+// set by a left click, the frame then picks the object under the cursor
+bool pickRequested = false;
+// the cube shares the floor with a cubeFieldSize x cubeFieldSize grid of copies, all drawn with one instanced draw
+const int cubeFieldSize = 32;
+const float cubeFieldSpacing = 3.0f;
+// press L to draw everything at full detail instead of the LOD that keeps the error under lodPixelThreshold pixels
+bool lodEnabled = true;
+const float lodPixelThreshold = 1.0f;
+// press C to draw every object instead of only those whose box the BVH finds in the view frustum
+bool cullingEnabled = true;
+// press O to stop hiding objects behind the ground and the nearest cubes, occluderCubes of them are rasterized on the CPU
+// with a terrainOccluderCells square of ground cells terrainOccluderSpacing apart
+bool occlusionEnabled = true;
+const int occluderCubes = 32;
+const int terrainOccluderCells = 32;
+const float terrainOccluderSpacing = 8.0f;
+// press G to let GL occlusion queries on the boxes decide instead, one draw per object under last frame's answers
+bool occlusionQueriesEnabled = false;
+// press K to keep the frustum answers the camera hasn't moved enough to change instead of querying the BVH every frame,
+// which only pays off from around a million instances (--bench visibility)
+bool visibilityCacheEnabled = false;
+// press I to draw every object at full detail instead of turning the ones smaller on screen than a view of their impostor
+// into a single quad
+bool impostorsEnabled = true;
+// past the cube field the world is rocks streamed in a worldCellSize cell at a time, the cells within worldLoadRadius of
+// where the camera is heading, and never more than worldStreamingBudget of their meshes and textures at once
+const float worldCellSize = 64.0f;
+const float worldLoadRadius = 320.0f;
+const size_t worldStreamingBudget = 32 * 1024 * 1024;
+// bytes of meshes the geometry heap may move per frame while compacting
+const size_t geometryCompactionBudget = 4 * 1024 * 1024;
+
+// Every shader and texture is looked up in here first, loose files are only used when the pack is missing
+AssetPack assets;
 
 ////////////////////// Camera ////////////////////////////////////////////
 
@@ -49,16 +161,6 @@ float lastFrame = 0.0f;
 
 /////////////////////// Global Data ////////////////////////////////////////////
 // Vertex Data for our Cube
-float planeVertices[] = {
-    0.5f, 0.0f, 0.5f, 50.0f, 50.0f,
-    0.5f, 0.0f, -0.5f, 50.0f, 0.0f,
-    -0.5f, 0.0f, -0.5f, 0.0f, 0.0f,
-    -0.5f, 0.0f, 0.5f, 0.0f, 50.0f
-};
-unsigned int planeIndices[] = {
-    0, 1, 3,
-    1, 2, 3  
-};
 float boxVertices[] = {
     -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
      0.5f, -0.5f, -0.5f,  1.0f, 0.0f,
@@ -102,12 +204,21 @@ float boxVertices[] = {
     -0.5f,  0.5f,  0.5f,  0.0f, 0.0f,
     -0.5f,  0.5f, -0.5f,  0.0f, 1.0f
 };
-// Position data for our cube
-glm::vec3 cubePosition(0, 0.5, 0);  
 /////////////////////////// Main Program ///////////////////
 
-int main()
+int main(int argc, char** argv)
 {
+    // usage: "3D Camera" [model.obj|model.gltf|model.glb] [--bench jpeg|obj|meshcache|instancing|multidraw|lod|meshlets|scene|bvh|picking|collision|renderqueue|visibility|streaming|impostors|dynamictexture]
+    const char* modelPath = NULL;
+    const char* benchmark = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+            benchmark = argv[++i];
+        else
+            modelPath = argv[i];
+    }
+
     //initialize GLFW
     if (!glfwInit())
     {
@@ -166,6 +277,8 @@ int main()
 
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
 
 
     // Start glad and load all openGL function pointers (for whichever specific system and archritecture our program is running on)
@@ -184,49 +297,287 @@ int main()
     ////////////////////////////////////////////////////////////////////////////////////////
 
 
-    Shader ourShader("shader.vs", "shader.fs");
-
-
-
-    //declare our Vertex Buffer Object, Vertex Attricute Object, and Element Buffer Object
-    unsigned int boxVBO, boxVAO, planeVBO, planeVAO, planeEBO;
-    //Generate VAO, VBO,EBO
-    glGenVertexArrays(1, &boxVAO);
-    glGenBuffers(1, &boxVBO);
-
-    glGenVertexArrays(1, &planeVAO);
-    glGenBuffers(1, &planeVBO);
-    glGenBuffers(1, &planeEBO);
-    // First, Bind our Vertex Array Object
-    glBindVertexArray(boxVAO);
-    // Bind our VBO now that we have a VAO
-    glBindBuffer(GL_ARRAY_BUFFER, boxVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(boxVertices), boxVertices, GL_STATIC_DRAW); //Static Draw for data reused many times without changing
-
-    //Specify how our Vertex Data is laid out. (x,y,z position coordinates) 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-
-    //Specify how our Vertex Data is laid out. (u,v texture Coords) 
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-
-
-
-    glBindVertexArray(planeVAO);
+    // every GL allocation is tracked, going over budget prints the breakdown so VRAM regressions show up right away
+    gpuMemory().setBudget(gpuMemoryBudget, [](const GpuMemoryTracker& tracker, size_t used, size_t budget)
+    {
+        std::cout << "GPU memory over budget: " << GpuMemoryTracker::megabytes(used) << " MB of "
+            << GpuMemoryTracker::megabytes(budget) << " MB" << std::endl;
+        tracker.print(std::cout);
+    });
+
+    // one open and one mapping for every asset, built by the AssetPacker project
+    if (assets.open("Assets.pack"))
+        std::cout << "Loaded asset pack with " << assets.count() << " assets" << std::endl;
+    else
+        std::cout << "No Assets.pack found, loading loose files" << std::endl;
+
+    Shader ourShader = loadShader("shader.vs", "shader.fs");
+    Shader floorShader = loadShader("terrain.vs", "virtual.fs");
+    Shader feedbackShader = loadShader("terrain.vs", "vt_feedback.fs");
+    Shader impostorShader = loadShader("impostor.vs", "impostor.fs");
+    Shader impostorBakeShader = loadShader("impostor_bake.vs", "impostor_bake.fs");
+
+
+
+    // index the built in meshes and reorder them for the post-transform cache, overdraw and vertex fetch
+    Mesh boxMesh = MeshOptimizer::buildIndexedMesh(boxVertices, sizeof(boxVertices) / (5 * sizeof(float)), 5);
+    MeshOptimizer::optimizeMesh(boxMesh, "box");
+
+    // snorm16 positions and half float uvs, 12 bytes a vertex instead of 20. Every static mesh is suballocated from the
+    // same large buffers, the per mesh dequantization travels with each draw command.
+    VertexLayout vertexLayout = VertexLayout::compact();
+    std::unique_ptr<GeometryBuffer> sceneGeometry(new GeometryBuffer(vertexLayout));
+    MeshRange box = sceneGeometry->add(boxMesh);
+    std::cout << "Vertex layout: " << vertexLayout.stride() << " bytes per vertex (was " << VertexLayout::standard().stride() << ")" << std::endl;
+
+    // an OBJ or glTF model passed on the command line is drawn next to the cube, scaled to fit in a 2 unit box
+    MeshRange loadedModel;
+    std::vector<glm::vec3> loadedModelPositions;
+    std::vector<unsigned int> loadedModelIndices;
+    float loadedModelScale = 1.0f;
+    int loadedModelLod = 0;
+    bool hasLoadedModel = false;
+    if (modelPath)
+    {
+        double loadStart = glfwGetTime();
+        hasLoadedModel = loadGpuMesh(modelPath, *sceneGeometry, loadedModel, loadedModelPositions, loadedModelIndices);
+        if (hasLoadedModel)
+        {
+            std::cout << "Loaded " << modelPath << " (" << loadedModel.IndexCount / 3 << " triangles, "
+                << sceneGeometry->lods(loadedModel.Id).size() << " LODs) in "
+                << (glfwGetTime() - loadStart) * 1000.0 << " ms" << std::endl;
+            glm::vec3 extent = loadedModel.Quantization.Scale;
+            float fit = 1.0f / std::max(extent.x, std::max(extent.y, extent.z));
+            loadedModelScale = fit;
+        }
+    }
+    // the ground, nested rings of grid around the camera that take their heights from a streamed clipmap
+    std::unique_ptr<ClipmapTerrain> terrain(new ClipmapTerrain(*sceneGeometry));
+    std::cout << "Terrain: " << terrain->vertexCount() << " vertices a frame wherever the camera goes" << std::endl;
+    // the rest of the world, made up a cell at a time on the streamer's thread and uploaded as the camera gets close
+    const ClipmapTerrain& ground = *terrain;
+    std::unique_ptr<WorldStreamer> world(new WorldStreamer(*sceneGeometry, worldCellSize, worldLoadRadius, worldStreamingBudget,
+        [&ground](int x, int z, CellContent& content) { makeWorldCell(x, z, ground, content); }));
+
+    // every object's transform: the cube the arrow keys spin, the field of cubes around it (children of one root) and the
+    // loaded model, scaled to fit and standing next to the cube
+    Scene scene;
+    Entity spinningCube = scene.create(NoEntity, glm::vec3(0.0f, 0.5f, 0.0f));
+    Entity cubeFieldRoot = scene.create();
+    for (int i = 0; i < cubeFieldSize * cubeFieldSize; i++)
+    {
+        glm::vec3 position;
+        glm::quat rotation;
+        cubeGridPlacement(i, cubeFieldSize * cubeFieldSize, cubeFieldSpacing, 1.0f, position, rotation);
+        scene.create(cubeFieldRoot, position, rotation);
+    }
+    Entity loadedModelEntity = NoEntity;
+    if (hasLoadedModel)
+        loadedModelEntity = scene.create(NoEntity, glm::vec3(3.0f, 1.0f, 0.0f) - loadedModelScale * loadedModel.Quantization.Offset,
+            glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(loadedModelScale));
+    scene.update();
+
+    // instance 0 is the spinning cube, then the field and the loaded model, in the order the entities were created
+    const GLuint NoInstance = 0xffffffffu;
+    std::vector<GLuint> instanceOf(scene.size(), NoInstance);
+    std::vector<InstanceData> sceneInstances;
+    for (Entity entity = 0; entity < (Entity)scene.size(); entity++)
+    {
+        if (entity == cubeFieldRoot)
+            continue;
+        instanceOf[entity] = (GLuint)sceneInstances.size();
+        sceneInstances.push_back(InstanceData());
+        sceneInstances.back().Model = scene.world(entity);
+        sceneInstances.back().Material = entity == spinningCube || entity == loadedModelEntity ? 0 : (unsigned int)((entity - cubeFieldRoot - 1) % 4);
+    }
+    GLuint cubeCount = 1 + cubeFieldSize * cubeFieldSize;
+    GLuint loadedModelInstance = hasLoadedModel ? instanceOf[loadedModelEntity] : 0;
+    std::unique_ptr<InstanceBuffer> instanceBuffer(new InstanceBuffer());
+    instanceBuffer->upload(sceneInstances);
+    float cubeAngle = angle;
+    // instances written this frame, copied into the instance buffer from the frame allocator
+    std::vector<GLuint> dirtyInstances;
+
+    // the rocks of the streamed cells are instances too, after the fixed ones, in slots handed out again once their cell
+    // is evicted. A free slot has no triangles and an empty box.
+    struct StreamedInstance
+    {
+        unsigned int Mesh;
+        unsigned int Texture;
+        const TriangleBvh* Triangles;
+    };
+    const GLuint firstStreamedInstance = (GLuint)sceneInstances.size();
+    std::vector<StreamedInstance> streamedInstances;
+    std::vector<GLuint> freeStreamedInstances;
+    // slots the streamer filled or freed since the instance buffer and the scene tree last caught up
+    std::vector<GLuint> changedStreamedInstances;
+    world->OnUpload = [&](WorldCell& cell)
+    {
+        cell.Instances.resize(cell.Objects.size());
+        for (size_t o = 0; o < cell.Objects.size(); o++)
+        {
+            GLuint instance;
+            if (freeStreamedInstances.empty())
+            {
+                instance = (GLuint)sceneInstances.size();
+                sceneInstances.push_back(InstanceData());
+                streamedInstances.push_back(StreamedInstance());
+            }
+            else
+            {
+                instance = freeStreamedInstances.back();
+                freeStreamedInstances.pop_back();
+            }
+            const StreamedObject& object = cell.Objects[o];
+            StreamedInstance streamed = { cell.Meshes[object.Mesh].Id, cell.Textures[object.Image], &cell.Triangles[object.Mesh] };
+            streamedInstances[instance - firstStreamedInstance] = streamed;
+            sceneInstances[instance].Model = object.Model;
+            sceneInstances[instance].Material = 0;
+            cell.Instances[o] = instance;
+            changedStreamedInstances.push_back(instance);
+        }
+    };
+    world->OnEvict = [&](WorldCell& cell)
+    {
+        for (size_t o = 0; o < cell.Instances.size(); o++)
+        {
+            streamedInstances[cell.Instances[o] - firstStreamedInstance].Triangles = NULL;
+            freeStreamedInstances.push_back(cell.Instances[o]);
+            changedStreamedInstances.push_back(cell.Instances[o]);
+        }
+    };
+    auto isFreeSlot = [&](GLuint instance)
+    {
+        return instance >= firstStreamedInstance && !streamedInstances[instance - firstStreamedInstance].Triangles;
+    };
 
-    glBindBuffer(GL_ARRAY_BUFFER, planeVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(planeVertices), planeVertices, GL_STATIC_DRAW);
+    // world space boxes of the instances, culled against the view every frame
+    auto instanceBounds = [&](GLuint instance)
+    {
+        if (instance >= firstStreamedInstance)
+        {
+            const StreamedInstance& streamed = streamedInstances[instance - firstStreamedInstance];
+            return streamed.Triangles ? meshBounds(sceneGeometry->range(streamed.Mesh), sceneInstances[instance].Model) : Aabb();
+        }
+        return meshBounds(instance == loadedModelInstance && hasLoadedModel ? loadedModel : box, sceneInstances[instance].Model);
+    };
+    std::vector<Aabb> instanceBoxes(sceneInstances.size());
+    for (GLuint i = 0; i < (GLuint)sceneInstances.size(); i++)
+        instanceBoxes[i] = instanceBounds(i);
+    Bvh sceneBvh;
+    sceneBvh.build(instanceBoxes);
+
+    // the triangles of the crate and the loaded model in model space, for picking and for the camera to collide with
+    TriangleBvh boxTriangles, loadedModelTriangles;
+    {
+        std::vector<glm::vec3> positions(boxMesh.vertexCount());
+        for (size_t v = 0; v < positions.size(); v++)
+            positions[v] = glm::vec3(boxMesh.vertex(v)[0], boxMesh.vertex(v)[1], boxMesh.vertex(v)[2]);
+        boxTriangles.build(positions, boxMesh.Indices);
+    }
+    if (hasLoadedModel)
+    {
+        CpuTimer buildTimer;
+        loadedModelTriangles.build(loadedModelPositions, loadedModelIndices);
+        std::cout << "Picking BVH over " << loadedModelTriangles.triangleCount() << " triangles built in " << buildTimer.milliseconds() << " ms" << std::endl;
+        loadedModelPositions.clear();
+        loadedModelIndices.clear();
+    }
+    // NULL for a free slot, whose empty box no ray or query ever reaches
+    auto meshOf = [&](unsigned int instance) -> const TriangleBvh*
+    {
+        if (instance >= firstStreamedInstance)
+            return streamedInstances[instance - firstStreamedInstance].Triangles;
+        return hasLoadedModel && instance == loadedModelInstance ? &loadedModelTriangles : &boxTriangles;
+    };
+    auto transformOf = [&](unsigned int instance) { return sceneInstances[instance].Model; };
+
+    // the camera is a sphere that slides along the scene's triangles and stays above the ground
+    CameraCollision cameraCollision;
+    cameraCollision.setGround([&](float x, float z) { return terrain->heightAt(x, z); });
+    // last frames' frustum answers, kept for the instances the camera hasn't moved enough to change
+    VisibilityCache visibilityCache;
+    std::vector<unsigned int> visibleInstances, drawnInstances;
+
+    // the crate is its own box, so the box of its vertices is an exact occluder. The ground's occluder follows the
+    // camera and is only rebuilt when the camera crosses into another of its cells.
+    const Aabb cubeOccluder(box.Quantization.Offset - box.Quantization.Scale, box.Quantization.Offset + box.Quantization.Scale);
+    OcclusionCuller occlusion;
+    std::vector<glm::vec3> groundOccluderPositions;
+    std::vector<unsigned int> groundOccluderIndices;
+    int groundOccluderX = INT_MIN, groundOccluderZ = INT_MIN;
+    std::vector<std::pair<float, unsigned int>> occluderCandidates;
+    // the GPU path, one query per instance
+    std::unique_ptr<OcclusionQueries> occlusionQueries(new OcclusionQueries());
+    occlusionQueries->resize(sceneInstances.size());
+
+    // the ids the render queue sorts by, and what its packets draw. The terrain's program sorts first so the ground is in
+    // the depth buffer before the objects it hides are drawn inside their occlusion queries.
+    enum { TERRAIN_PROGRAM, SCENE_PROGRAM, IMPOSTOR_PROGRAM };
+    // STREAMED_TEXTURES + n is the texture of the n-th streamed bucket
+    enum { CRATE_TEXTURES, FLOOR_TEXTURES, IMPOSTOR_TEXTURES, STREAMED_TEXTURES };
+    enum { DRAW_SCENE_BATCH, DRAW_INSTANCE, DRAW_TERRAIN, DRAW_OCCLUSION_QUERIES, DRAW_STREAMED_BATCH, DRAW_IMPOSTORS };
+    RenderQueue renderQueue;
+
+    // one multi-draw per shader and texture state, the terrain keeps its own. The rocks in view get a bucket for each of
+    // their cells' textures, from a pool of buckets that only grows.
+    std::unique_ptr<MultiDrawBatch> sceneDraws(new MultiDrawBatch());
+    int texturedBucket = sceneDraws->addBucket();
+    std::vector<int> streamedBuckets;
+    std::vector<unsigned int> streamedTextures;
+    std::unordered_map<unsigned int, unsigned int> streamedTextureSlot;
+    auto streamedBucket = [&](unsigned int texture)
+    {
+        std::unordered_map<unsigned int, unsigned int>::const_iterator it = streamedTextureSlot.find(texture);
+        if (it != streamedTextureSlot.end())
+            return streamedBuckets[it->second];
+        unsigned int slot = (unsigned int)streamedTextures.size();
+        if (slot == streamedBuckets.size())
+            streamedBuckets.push_back(sceneDraws->addBucket());
+        streamedTextureSlot[texture] = slot;
+        streamedTextures.push_back(texture);
+        return streamedBuckets[slot];
+    };
+    // rebuilt when the visible set changes, when cells come or go and whenever compacting the geometry heap moves meshes.
+    // Visible cubes with consecutive instances share a command, and so do consecutive slots of the same rock. The commands
+    // go to the GPU through the frame allocator every frame, see MultiDrawBatch::upload.
+    auto buildSceneDraws = [&]()
+    {
+        sceneDraws->clear();
+        streamedTextures.clear();
+        streamedTextureSlot.clear();
+        MeshRange cube = sceneGeometry->range(box.Id);
+        for (size_t i = 0; i < drawnInstances.size();)
+        {
+            GLuint first = drawnInstances[i];
+            if (first >= firstStreamedInstance)
+            {
+                const StreamedInstance& streamed = streamedInstances[first - firstStreamedInstance];
+                size_t run = 1;
+                while (i + run < drawnInstances.size() && drawnInstances[i + run] == first + run
+                    && streamedInstances[first + run - firstStreamedInstance].Mesh == streamed.Mesh
+                    && streamedInstances[first + run - firstStreamedInstance].Texture == streamed.Texture)
+                    run++;
+                sceneDraws->add(streamedBucket(streamed.Texture), sceneGeometry->range(streamed.Mesh), (GLuint)run, first);
+                i += run;
+                continue;
+            }
+            if (first >= cubeCount)
+            {
+                sceneDraws->add(texturedBucket, sceneGeometry->lod(loadedModel.Id, loadedModelLod), 1, loadedModelInstance);
+                i++;
+                continue;
+            }
+            size_t run = 1;
+            while (i + run < drawnInstances.size() && drawnInstances[i + run] == first + run && first + run < cubeCount)
+                run++;
+            sceneDraws->add(texturedBucket, cube, (GLuint)run, first);
+            i += run;
+        }
+    };
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, planeEBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(planeIndices), planeIndices, GL_STATIC_DRAW);
-    
-    // position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    // color attribute
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    // everything that changes every frame and isn't worth a buffer of its own
+    std::unique_ptr<FrameAllocator> frameData(new FrameAllocator());
     
     
     ////Unbind VBO
@@ -246,7 +597,7 @@ int main()
 
         // load and create a texture 
     // -------------------------
-    unsigned int texture1, texture2, texture3;
+    unsigned int texture1, texture2;
     // texture 1
     // ---------
     glGenTextures(1, &texture1);
@@ -261,18 +612,18 @@ int main()
     int width, height, nrChannels;
     stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
     // The FileSystem::getPath(...) is part of the GitHub repository so we can find files on any IDE/platform; replace it with your own image path.
-    unsigned char* data = stbi_load("Resources/Textures/crate.jpg", &width, &height, &nrChannels, 0);
+    unsigned char* data = loadImage("Resources/Textures/crate.jpg", &width, &height, &nrChannels, 0);
     if (data)
     {
         if (nrChannels == 3)
         {
             // note that the awesomeface.png has transparency and thus an alpha channel, so make sure to tell OpenGL the data type is of GL_RGBA
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+            gpuTexImage2D(texture1, GL_RGBA8, width, height, GL_RGB, GL_UNSIGNED_BYTE, data, true);
         }
         else if (nrChannels == 4)
         {
             // note that the awesomeface.png has transparency and thus an alpha channel, so make sure to tell OpenGL the data type is of GL_RGBA
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+            gpuTexImage2D(texture1, GL_RGBA8, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data, true);
         }
         glGenerateMipmap(GL_TEXTURE_2D);
     }
@@ -292,18 +643,18 @@ int main()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     // load image, create texture and generate mipmaps
-    data = stbi_load("Resources/Textures/checkered.png", &width, &height, &nrChannels, 0);
+    data = loadImage("Resources/Textures/checkered.png", &width, &height, &nrChannels, 0);
     if (data)
     {
         if (nrChannels == 3)
         {
             // note that the awesomeface.png has transparency and thus an alpha channel, so make sure to tell OpenGL the data type is of GL_RGBA
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+            gpuTexImage2D(texture2, GL_RGBA8, width, height, GL_RGB, GL_UNSIGNED_BYTE, data, true);
         }
         else if (nrChannels == 4)
         {
             // note that the awesomeface.png has transparency and thus an alpha channel, so make sure to tell OpenGL the data type is of GL_RGBA
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+            gpuTexImage2D(texture2, GL_RGBA8, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data, true);
         }
         glGenerateMipmap(GL_TEXTURE_2D);
     }
@@ -313,44 +664,165 @@ int main()
     }
     stbi_image_free(data);
 
-    // texture 3
-// ---------
-    glGenTextures(1, &texture3);
-    glBindTexture(GL_TEXTURE_2D, texture3);
-    // set the texture wrapping parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    // set texture filtering parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load image, create texture and generate mipmaps
-    // The FileSystem::getPath(...) is part of the GitHub repository so we can find files on any IDE/platform; replace it with your own image path.
-    data = stbi_load("Resources/Textures/Floor.jpg", &width, &height, &nrChannels, 0);
+    ////////////////////// Virtual Texture for the floor //////////////////////////////////////////////
+    // The floor image is kept on the CPU and the virtual texture pulls pages out of it as the camera needs them,
+    // so the GPU only ever holds the fixed size page cache no matter how large the virtual texture is.
+    int floorWidth, floorHeight, floorChannels;
+    std::vector<unsigned char> floorPixels;
+    data = loadImage("Resources/Textures/Floor.jpg", &floorWidth, &floorHeight, &floorChannels, 4);
     if (data)
     {
-        if (nrChannels == 3)
-        {
-            // note that the awesomeface.png has transparency and thus an alpha channel, so make sure to tell OpenGL the data type is of GL_RGBA
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        }
-        else if (nrChannels == 4)
-        {
-            // note that the awesomeface.png has transparency and thus an alpha channel, so make sure to tell OpenGL the data type is of GL_RGBA
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-        }
-        glGenerateMipmap(GL_TEXTURE_2D);
+        floorPixels.assign(data, data + floorWidth * floorHeight * 4);
     }
     else
     {
         std::cout << "Failed to load texture" << std::endl;
+        floorWidth = floorHeight = 1;
+        floorPixels.assign(4, 255);
     }
     stbi_image_free(data);
+    const int vtVirtualPages = 128;
+    const int vtPageSize = 128;
+    const int vtCachePages = 16;
+    // the old floor repeated the image 50 times, keep the same texel density across the whole virtual texture
+    const float vtTexelScale = (float)floorWidth * floorRepeat / (float)(vtVirtualPages * (vtPageSize - 2));
+    std::unique_ptr<VirtualTexture> floorTexture(new VirtualTexture(vtVirtualPages, vtPageSize, vtCachePages, screenWidth / 8, screenHeight / 8,
+        [=](int mip, int x0, int y0, int w, int h, unsigned char* rgba)
+        {
+            // box filter over the source texels covered by one texel of this mip
+            float footprint = vtTexelScale * (float)(1 << mip);
+            int taps = std::max(1, std::min((int)std::ceil(footprint), 4));
+            for (int y = 0; y < h; y++)
+            {
+                for (int x = 0; x < w; x++)
+                {
+                    int sum[4] = { 0, 0, 0, 0 };
+                    for (int ty = 0; ty < taps; ty++)
+                    {
+                        for (int tx = 0; tx < taps; tx++)
+                        {
+                            int sx = (int)std::floor(((x0 + x) + (tx + 0.5f) / taps) * footprint);
+                            int sy = (int)std::floor(((y0 + y) + (ty + 0.5f) / taps) * footprint);
+                            sx = ((sx % floorWidth) + floorWidth) % floorWidth;
+                            sy = ((sy % floorHeight) + floorHeight) % floorHeight;
+                            const unsigned char* texel = floorPixels.data() + (sy * floorWidth + sx) * 4;
+                            for (int c = 0; c < 4; c++)
+                                sum[c] += texel[c];
+                        }
+                    }
+                    for (int c = 0; c < 4; c++)
+                        rgba[(y * w + x) * 4 + c] = (unsigned char)(sum[c] / (taps * taps));
+                }
+            }
+        }));
+
+    ////////////////////// Live texture ////////////////////////////////////////////////////////////////
+    // Stands in for a video or sensor feed: a worker thread renders frames into the upload ring on its own schedule
+    // and the render loop just picks up whatever frame is newest.
+    std::unique_ptr<DynamicTexture> liveTexture(new DynamicTexture(512, 512));
+    std::atomic<bool> liveFeedRunning(true);
+    std::thread liveFeed([&liveTexture, &liveFeedRunning]()
+    {
+        int frame = 0;
+        while (liveFeedRunning)
+        {
+            unsigned char* pixels = liveTexture->beginWrite(100);
+            if (!pixels && !liveTexture->writable())
+                return;
+            if (!pixels)
+                continue;
+            int width = liveTexture->Width;
+            int height = liveTexture->Height;
+            float time = frame++ / 60.0f;
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    float u = (float)x / width - 0.5f;
+                    float v = (float)y / height - 0.5f;
+                    float rings = std::sin(std::sqrt(u * u + v * v) * 40.0f - time * 4.0f);
+                    float sweep = std::sin(u * 10.0f + time) * std::cos(v * 10.0f - time * 0.7f);
+                    unsigned char* pixel = pixels + (y * width + x) * 4;
+                    pixel[0] = (unsigned char)(127.5f + 127.5f * rings);
+                    pixel[1] = (unsigned char)(127.5f + 127.5f * sweep);
+                    pixel[2] = (unsigned char)(127.5f - 127.5f * rings * sweep);
+                    pixel[3] = 255;
+                }
+            }
+            liveTexture->endWrite();
+            std::this_thread::sleep_for(std::chrono::milliseconds(16));
+        }
+    });
 
     //set variables in our Shader Object
     ourShader.use(); // don't forget to activate/use the shader before setting uniforms!
     ourShader.setInt("texture1", 0);
     ourShader.setInt("texture2", 1);
 
+    ////////////////////// Impostors ////////////////////////////////////////////////////////////////////
+    // The crate and the loaded model from every direction of an octahedral grid, with the same textures they are drawn with
+    std::unique_ptr<ImpostorAtlas> impostors(new ImpostorAtlas(2));
+    int boxImpostor = -1, loadedModelImpostor = -1;
+    {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture1);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, texture2);
+        impostorBakeShader.use();
+        impostorBakeShader.setInt("texture1", 0);
+        impostorBakeShader.setInt("texture2", 1);
+        CpuTimer bakeTimer;
+        boxImpostor = impostors->bake(impostorBakeShader, *sceneGeometry, box);
+        if (hasLoadedModel)
+            loadedModelImpostor = impostors->bake(impostorBakeShader, *sceneGeometry, sceneGeometry->lod(loadedModel.Id, 0));
+        glFinish();
+        std::cout << "Baked " << impostors->layerCount() << " impostors of " << impostors->Views * impostors->Views << " views in "
+            << bakeTimer.milliseconds() << " ms" << std::endl;
+    }
+
+    if (benchmark)
+    {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture1);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, texture2);
+        if (strcmp(benchmark, "jpeg") == 0)
+            runJpegBenchmark();
+        else if (strcmp(benchmark, "obj") == 0)
+            runObjBenchmark();
+        else if (strcmp(benchmark, "meshcache") == 0)
+            runMeshCacheBenchmark(*sceneGeometry);
+        else if (strcmp(benchmark, "instancing") == 0)
+            runInstancingBenchmark(ourShader, *sceneGeometry, box, *instanceBuffer, *frameData);
+        else if (strcmp(benchmark, "multidraw") == 0)
+            runMultiDrawBenchmark(ourShader, *sceneGeometry, box, *instanceBuffer, *frameData);
+        else if (strcmp(benchmark, "lod") == 0)
+            runLodBenchmark(ourShader, *sceneGeometry, *instanceBuffer, *frameData);
+        else if (strcmp(benchmark, "meshlets") == 0)
+            runMeshletBenchmark(ourShader, *sceneGeometry, *frameData);
+        else if (strcmp(benchmark, "scene") == 0)
+            runSceneBenchmark();
+        else if (strcmp(benchmark, "bvh") == 0)
+            runBvhBenchmark();
+        else if (strcmp(benchmark, "picking") == 0)
+            runPickingBenchmark();
+        else if (strcmp(benchmark, "collision") == 0)
+            runCollisionBenchmark();
+        else if (strcmp(benchmark, "renderqueue") == 0)
+            runRenderQueueBenchmark();
+        else if (strcmp(benchmark, "visibility") == 0)
+            runVisibilityBenchmark();
+        else if (strcmp(benchmark, "streaming") == 0)
+            runStreamingBenchmark(*sceneGeometry, *terrain);
+        else if (strcmp(benchmark, "impostors") == 0)
+            runImpostorBenchmark(ourShader, impostorShader, impostorBakeShader, *sceneGeometry, *instanceBuffer, *frameData);
+        else if (strcmp(benchmark, "dynamictexture") == 0)
+            runDynamicTextureBenchmark();
+        else
+            std::cout << "Unknown benchmark " << benchmark << std::endl;
+        glfwSetWindowShouldClose(window, true);
+    }
+
 
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -360,7 +832,7 @@ int main()
 
 
     // Start Render Loop here
-    do
+    while (!glfwWindowShouldClose(window))
     {
         //calculate delta time
         float currentFrame = static_cast<float>(glfwGetTime());
@@ -369,69 +841,391 @@ int main()
 
 
         //input
+        glm::vec3 previousPosition = camera.Position;
         keyboardInput(window);
         camera.ProcessMouseMovement(xNorm, -yNorm);
+        camera.Position = cameraCollision.move(sceneBvh, previousPosition, camera.Position, meshOf, transformOf);
+        camera.updateViewMatrix();
 
-        //clear the backbuffer to set colour
-        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        int framebufferWidth, framebufferHeight;
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)screenWidth / (float)screenHeight, 0.1f, 1000.0f);
+        glm::mat4 view = camera.GetViewMatrix();
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture1);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, texture2);
+        // everything this frame writes for the GPU is bump allocated from here on
+        frameData->beginFrame();
 
+        // the arrow keys turn the cube, only entities whose world matrix changed are written to the instance buffer
+        if (angle != cubeAngle)
+        {
+            scene.setRotation(spinningCube, glm::angleAxis(glm::radians(angle), glm::normalize(glm::vec3(1.0f, 0.3f, 0.5f))));
+            cubeAngle = angle;
+        }
+        scene.update();
+        const std::vector<Entity>& moved = scene.changed();
+        dirtyInstances.clear();
+        for (size_t i = 0; i < moved.size(); i++)
+        {
+            GLuint instance = instanceOf[moved[i]];
+            if (instance == NoInstance)
+                continue;
+            sceneInstances[instance].Model = scene.world(moved[i]);
+            dirtyInstances.push_back(instance);
+            sceneBvh.setBounds(instance, instanceBounds(instance));
+            visibilityCache.invalidate(instance);
+        }
 
-        // draw our first triangle
-        ourShader.use();
+        // rocks whose cell was uploaded or evicted. New slots grow the instance buffer and need the tree rebuilt, reused and
+        // freed ones are refit like anything that moved.
+        world->update(camera.Position, camera.Front, deltaTime);
+        bool streamedChanged = !changedStreamedInstances.empty();
+        if (sceneInstances.size() > sceneBvh.size())
+        {
+            instanceBuffer->upload(sceneInstances);
+            std::vector<Aabb> boxes(sceneInstances.size());
+            for (GLuint i = 0; i < (GLuint)boxes.size(); i++)
+                boxes[i] = instanceBounds(i);
+            sceneBvh.build(boxes);
+            occlusionQueries->resize(sceneInstances.size());
+            dirtyInstances.clear();
+        }
+        else
+        {
+            for (size_t i = 0; i < changedStreamedInstances.size(); i++)
+            {
+                GLuint instance = changedStreamedInstances[i];
+                if (!isFreeSlot(instance))
+                    dirtyInstances.push_back(instance);
+                sceneBvh.setBounds(instance, instanceBounds(instance));
+                visibilityCache.invalidate(instance);
+            }
+        }
+        changedStreamedInstances.clear();
+        // written into this frame's region and copied over on the GPU, one copy per run of consecutive instances
+        if (!dirtyInstances.empty())
+        {
+            std::sort(dirtyInstances.begin(), dirtyInstances.end());
+            dirtyInstances.erase(std::unique(dirtyInstances.begin(), dirtyInstances.end()), dirtyInstances.end());
+            FrameAllocation staged = frameData->allocate(dirtyInstances.size() * sizeof(InstanceData), BUFFER_USAGE_STORAGE);
+            for (size_t i = 0; i < dirtyInstances.size();)
+            {
+                size_t run = 1;
+                while (i + run < dirtyInstances.size() && dirtyInstances[i + run] == dirtyInstances[i] + run)
+                    run++;
+                if (staged.Data)
+                {
+                    std::memcpy((InstanceData*)staged.Data + i, &sceneInstances[dirtyInstances[i]], run * sizeof(InstanceData));
+                    instanceBuffer->update(dirtyInstances[i], frameData->ID, staged.Offset + (GLintptr)(i * sizeof(InstanceData)), run);
+                }
+                else
+                    instanceBuffer->update(dirtyInstances[i], &sceneInstances[dirtyInstances[i]], run);
+                i += run;
+            }
+        }
+        instanceBuffer->bind();
+        sceneBvh.update();
 
-        ///////////////////////////////////////////////////////////////////////////////////////////
-        //create variables for our cube's transformation
-        ///////////////////////////////////////////////////////////////////////////////////////////
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)screenWidth / (float)screenHeight, 0.1f, 100.0f);
-        glm::mat4 view = camera.GetViewMatrix();
-        //Set our Shader's variables
-        ourShader.setMat4("projection", projection);
-        ourShader.setMat4("view", view);
+        // a click picks the closest triangle under the cursor, the cursor is in window coordinates and the ray is cast
+        // through the framebuffer pixel under it
+        if (pickRequested)
+        {
+            pickRequested = false;
+            double cursorX, cursorY;
+            int windowWidth, windowHeight;
+            glfwGetCursorPos(window, &cursorX, &cursorY);
+            glfwGetWindowSize(window, &windowWidth, &windowHeight);
+            if (windowWidth > 0 && windowHeight > 0 && framebufferWidth > 0 && framebufferHeight > 0)
+            {
+                Ray ray = camera.Unproject((float)(cursorX * framebufferWidth / windowWidth), (float)(cursorY * framebufferHeight / windowHeight),
+                    framebufferWidth, framebufferHeight, projection);
+                CpuTimer pickTimer;
+                PickHit hit;
+                bool found = pick(sceneBvh, ray, 1000.0f, meshOf, transformOf, hit);
+                double pickMicroseconds = pickTimer.milliseconds() * 1000.0;
+                if (found)
+                    std::cout << "Picked " << (hit.Object >= firstStreamedInstance ? "a rock" : hasLoadedModel && hit.Object == loadedModelInstance ? "the model" : "cube") << " (instance "
+                        << hit.Object << ", triangle " << hit.Triangle << ") " << hit.Distance << " away in " << pickMicroseconds << " us" << std::endl;
+                else
+                    std::cout << "Nothing under the cursor (" << pickMicroseconds << " us)" << std::endl;
+            }
+        }
+
+        // only instances the BVH, or the cache of its earlier answers, finds in the view go into the draw lists
+        visibleInstances.clear();
+        if (cullingEnabled && visibilityCacheEnabled)
+            visibilityCache.query(sceneBvh, projection, view, visibleInstances);
+        else if (cullingEnabled)
+            sceneBvh.queryFrustum(Frustum::fromMatrix(projection * view), visibleInstances);
+        else
+            for (unsigned int i = 0; i < (unsigned int)sceneInstances.size(); i++)
+                visibleInstances.push_back(i);
+        // free slots stay in the tree with an empty box, but a node entirely in view is taken whole
+        if (!freeStreamedInstances.empty())
+            visibleInstances.erase(std::remove_if(visibleInstances.begin(), visibleInstances.end(), isFreeSlot), visibleInstances.end());
+        std::sort(visibleInstances.begin(), visibleInstances.end());
+
+        // of those, drop the ones hidden behind the ground and the cubes closest to the camera
+        bool queryOcclusion = cullingEnabled && occlusionQueriesEnabled;
+        if (cullingEnabled && occlusionEnabled && !queryOcclusion)
+        {
+            occlusion.beginFrame(projection * view);
+            int cellX = (int)std::floor(camera.Position.x / terrainOccluderSpacing), cellZ = (int)std::floor(camera.Position.z / terrainOccluderSpacing);
+            if (cellX != groundOccluderX || cellZ != groundOccluderZ)
+            {
+                terrain->occluderMesh(camera.Position, terrainOccluderCells, terrainOccluderSpacing, groundOccluderPositions, groundOccluderIndices);
+                groundOccluderX = cellX;
+                groundOccluderZ = cellZ;
+            }
+            occlusion.addOccluder(glm::mat4(1.0f), groundOccluderPositions.data(), groundOccluderPositions.size(),
+                groundOccluderIndices.data(), groundOccluderIndices.size());
+            occluderCandidates.clear();
+            for (size_t i = 0; i < visibleInstances.size(); i++)
+            {
+                if (visibleInstances[i] >= cubeCount)
+                    continue;
+                glm::vec3 offset = glm::vec3(sceneInstances[visibleInstances[i]].Model[3]) - camera.Position;
+                occluderCandidates.push_back(std::make_pair(glm::dot(offset, offset), visibleInstances[i]));
+            }
+            size_t occluders = std::min(occluderCandidates.size(), (size_t)occluderCubes);
+            std::partial_sort(occluderCandidates.begin(), occluderCandidates.begin() + occluders, occluderCandidates.end());
+            for (size_t i = 0; i < occluders; i++)
+                occlusion.addBox(sceneInstances[occluderCandidates[i].second].Model, cubeOccluder);
+            occlusion.rasterize();
+            visibleInstances.erase(std::remove_if(visibleInstances.begin(), visibleInstances.end(),
+                [&](unsigned int instance) { return !occlusion.isVisible(sceneBvh.bounds(instance)); }), visibleInstances.end());
+        }
 
-        // world transformation
-        glm::mat4 model = glm::mat4(1.0f);
-        ourShader.setMat4("model", model);
+        // the ones too small on screen for their mesh to show more than a view of their impostor become a quad
+        if (impostorsEnabled)
+            impostors->select(visibleInstances, camera.Position, Simplifier::pixelsPerRadian(camera.Zoom, (float)framebufferHeight),
+                [&](unsigned int instance)
+                {
+                    if (instance >= firstStreamedInstance)
+                        return -1;
+                    return hasLoadedModel && instance == loadedModelInstance ? loadedModelImpostor : boxImpostor;
+                },
+                [&](unsigned int instance) { return sceneBvh.bounds(instance); });
+        else
+            impostors->clear();
+
+        // the camera goes to every shader through one uniform block in this frame's region of the frame allocator
+        FrameUniforms frameUniforms = { view, projection };
+        frameData->bind(GL_UNIFORM_BUFFER, FrameUniformBinding, frameData->allocate(frameUniforms, BUFFER_USAGE_UNIFORM));
 
-        glBindVertexArray(boxVAO); // seeing as we only have a single VAO there's no need to bind it every time, but we'll do so to keep things a bit more organized
+        bool rebuildDraws = sceneGeometry->update(geometryCompactionBudget) || streamedChanged;
 
-            // calculate the model matrix for each object and pass it to shader before drawing
-            model = glm::mat4(1.0f);
-            model = glm::translate(model, cubePosition);
-            model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
-            ourShader.setMat4("model", model);
+        // the loaded model's detail follows its distance, the error of the chosen LOD stays under a pixel on screen
+        if (hasLoadedModel)
+        {
+            const std::vector<LodRange>& lods = sceneGeometry->lods(loadedModel.Id);
+            std::vector<float> errors(lods.size());
+            for (size_t i = 0; i < lods.size(); i++)
+                errors[i] = lods[i].Error;
+            glm::vec3 center = glm::vec3(scene.world(loadedModelEntity) * glm::vec4(loadedModel.Quantization.Offset, 1.0f));
+            int lod = lodEnabled ? Simplifier::selectLod(errors.data(), (int)errors.size(), loadedModelScale,
+                glm::length(camera.Position - center), Simplifier::pixelsPerRadian(camera.Zoom, (float)framebufferHeight), lodPixelThreshold) : 0;
+            if (lod != loadedModelLod)
+            {
+                loadedModelLod = lod;
+                rebuildDraws = true;
+            }
+        }
+        if (rebuildDraws)
+            terrain->rebuildDraws();
+        if (rebuildDraws || visibleInstances != drawnInstances)
+        {
+            drawnInstances.swap(visibleInstances);
+            buildSceneDraws();
+        }
+        sceneDraws->upload(*frameData);
+        terrain->update(camera.Position, *frameData);
+
+        // stream in the floor pages requested by last frame's feedback
+        floorTexture->update();
+
+        // feedback pass, tells the virtual texture which pages and mips of the floor are visible
+        floorTexture->beginFeedback();
+        feedbackShader.use();
+        feedbackShader.setFloat("vtVirtualPages", (float)floorTexture->VirtualPages);
+        feedbackShader.setFloat("vtPageSize", (float)floorTexture->PageSize);
+        feedbackShader.setFloat("vtPageBorder", (float)floorTexture->PageBorder);
+        feedbackShader.setFloat("vtMaxMip", (float)floorTexture->MaxMip);
+        feedbackShader.setFloat("vtUvScale", 1.0f / floorRepeat);
+        feedbackShader.setFloat("vtFeedbackBias", floorTexture->feedbackBias(framebufferWidth));
+        terrain->draw(feedbackShader, *frameData);
+        floorTexture->endFeedback(framebufferWidth, framebufferHeight);
 
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+        //clear the backbuffer to set colour
+        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-            glBindVertexArray(planeVAO);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, texture3);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, texture3);
-           model = glm::mat4(1.0f);
-           // model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f));
-            unsigned int maxVal = 0;
-            maxVal--;
-            model = glm::scale(model, glm::vec3(100, 1, 100));
-            ourShader.setMat4("model", model);
-            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        // kicks off the upload of the newest live frame, if the feed produced one
+        liveTexture->update();
 
+        // everything drawn this frame goes through the queue, sorted by state and, within a state, front to back
+        MeshRange cube = sceneGeometry->range(box.Id);
+        MeshRange model = hasLoadedModel ? sceneGeometry->lod(loadedModel.Id, loadedModelLod) : cube;
+        auto drawnMesh = [&](GLuint instance)
+        {
+            if (instance >= firstStreamedInstance)
+                return sceneGeometry->range(streamedInstances[instance - firstStreamedInstance].Mesh);
+            return instance >= cubeCount ? model : cube;
+        };
+        renderQueue.clear();
+        if (queryOcclusion)
+        {
+            occlusionQueries->beginFrame();
+            for (size_t i = 0; i < drawnInstances.size(); i++)
+            {
+                GLuint instance = drawnInstances[i];
+                unsigned int textures = instance >= firstStreamedInstance
+                    ? STREAMED_TEXTURES + streamedTextureSlot[streamedInstances[instance - firstStreamedInstance].Texture] : CRATE_TEXTURES;
+                float depth = glm::length(sceneBvh.bounds(instance).center() - camera.Position);
+                renderQueue.add(RENDER_PASS_OPAQUE, SCENE_PROGRAM, textures, drawnMesh(instance).Arena, depth, DRAW_INSTANCE, instance);
+            }
+            renderQueue.add(RENDER_PASS_OCCLUSION_QUERY, SCENE_PROGRAM, CRATE_TEXTURES, cube.Arena, 0.0f, DRAW_OCCLUSION_QUERIES);
+        }
+        else
+        {
+            renderQueue.add(RENDER_PASS_OPAQUE, SCENE_PROGRAM, CRATE_TEXTURES, RenderQueue::OwnVertexArray, 0.0f, DRAW_SCENE_BATCH);
+            for (unsigned int slot = 0; slot < (unsigned int)streamedTextures.size(); slot++)
+                renderQueue.add(RENDER_PASS_OPAQUE, SCENE_PROGRAM, STREAMED_TEXTURES + slot, RenderQueue::OwnVertexArray, 0.0f,
+                    DRAW_STREAMED_BATCH, slot);
+        }
+        renderQueue.add(RENDER_PASS_OPAQUE, TERRAIN_PROGRAM, FLOOR_TEXTURES, RenderQueue::OwnVertexArray, 0.0f, DRAW_TERRAIN);
+        if (impostors->impostorCount() > 0)
+            renderQueue.add(RENDER_PASS_OPAQUE, IMPOSTOR_PROGRAM, IMPOSTOR_TEXTURES, RenderQueue::OwnVertexArray, 0.0f, DRAW_IMPOSTORS);
+        renderQueue.sort();
+
+        // the mesh whose dequantization is in ourShader's model uniform, so DRAW_INSTANCE only sets it when the mesh changes
+        const unsigned int NoMesh = 0xffffffffu;
+        unsigned int modelUniformMesh = NoMesh;
+        renderQueue.submit([&](const RenderPacket& packet, unsigned int changes)
+        {
+            Shader& shader = packet.Program == TERRAIN_PROGRAM ? floorShader : packet.Program == IMPOSTOR_PROGRAM ? impostorShader : ourShader;
+            if (changes & RENDER_STATE_PROGRAM)
+            {
+                shader.use();
+                // DRAW_INSTANCE takes its transforms from the instance buffer, the multi-draws ignore the flag
+                if (packet.Program == SCENE_PROGRAM)
+                    ourShader.setBool("instanced", true);
+            }
+            if (changes & RENDER_STATE_TEXTURES)
+            {
+                if (packet.Textures == FLOOR_TEXTURES)
+                {
+                    // the terrain samples its virtual texture through the page table
+                    floorShader.setFloat("vtUvScale", 1.0f / floorRepeat);
+                    floorTexture->bind(floorShader, 0, 1);
+                }
+                else if (packet.Textures == IMPOSTOR_TEXTURES)
+                {
+                    impostors->bind(impostorShader, 0, 1);
+                }
+                else if (packet.Textures == CRATE_TEXTURES)
+                {
+                    glActiveTexture(GL_TEXTURE0);
+                    glBindTexture(GL_TEXTURE_2D, texture1);
+                    glActiveTexture(GL_TEXTURE1);
+                    glBindTexture(GL_TEXTURE_2D, showLiveTexture ? liveTexture->ID : texture2);
+                }
+                else if (packet.Textures >= STREAMED_TEXTURES)
+                {
+                    // a rock's cell texture on both of the crate's samplers
+                    unsigned int texture = streamedTextures[packet.Textures - STREAMED_TEXTURES];
+                    glActiveTexture(GL_TEXTURE0);
+                    glBindTexture(GL_TEXTURE_2D, texture);
+                    glActiveTexture(GL_TEXTURE1);
+                    glBindTexture(GL_TEXTURE_2D, texture);
+                }
+            }
+            if ((changes & RENDER_STATE_VERTEX_ARRAY) && packet.VertexArray != RenderQueue::OwnVertexArray)
+                sceneGeometry->bind(packet.VertexArray);
+        }, [&](const RenderPacket& packet)
+        {
+            switch (packet.Command)
+            {
+            case DRAW_SCENE_BATCH:
+                // every cube and the loaded model in one call
+                sceneDraws->draw(texturedBucket, ourShader, *sceneGeometry);
+                break;
+            case DRAW_STREAMED_BATCH:
+                // the rocks in view with one texture
+                sceneDraws->draw(streamedBuckets[packet.Object], ourShader, *sceneGeometry);
+                break;
+            case DRAW_INSTANCE:
+                // one draw per object when the occlusion queries decide, each in its own query
+                occlusionQueries->drawObject(packet.Object, [&](unsigned int instance)
+                {
+                    MeshRange mesh = drawnMesh(instance);
+                    if (mesh.Id != modelUniformMesh)
+                    {
+                        ourShader.setMat4("model", mesh.Quantization.matrix());
+                        modelUniformMesh = mesh.Id;
+                    }
+                    glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, mesh.IndexCount, GL_UNSIGNED_INT,
+                        (const void*)(mesh.FirstIndex * sizeof(unsigned int)), 1, mesh.BaseVertex, instance);
+                });
+                break;
+            case DRAW_TERRAIN:
+                terrain->draw(floorShader, *frameData);
+                break;
+            case DRAW_OCCLUSION_QUERIES:
+                // with the ground in the depth buffer too, ask about the box of every object skipped as hidden. The crate
+                // mesh spans [-1, 1] before dequantization, so a box is its center and half extent.
+                ourShader.setBool("instanced", false);
+                modelUniformMesh = NoMesh;
+                occlusionQueries->issueQueries(drawnInstances.data(), drawnInstances.size(),
+                    [&](unsigned int instance) { return sceneBvh.bounds(instance); }, camera.Position, 0.1f, [&](const Aabb& bounds)
+                {
+                    glm::vec3 center = bounds.center(), extent = bounds.extent();
+                    glm::mat4 boxModel(1.0f);
+                    boxModel[0][0] = extent.x;
+                    boxModel[1][1] = extent.y;
+                    boxModel[2][2] = extent.z;
+                    boxModel[3] = glm::vec4(center, 1.0f);
+                    ourShader.setMat4("model", boxModel);
+                    glDrawElementsBaseVertex(GL_TRIANGLES, cube.IndexCount, GL_UNSIGNED_INT, (const void*)(cube.FirstIndex * sizeof(unsigned int)),
+                        cube.BaseVertex);
+                });
+                break;
+            case DRAW_IMPOSTORS:
+                impostors->draw(impostorShader, *frameData);
+                break;
+            }
+        });
+
+        if (printStatsRequested)
+        {
+            printStats(*sceneGeometry, *frameData, *terrain, scene, sceneBvh, occlusion, *occlusionQueries, renderQueue, cameraCollision, visibilityCache, *world, *impostors);
+            printStatsRequested = false;
+        }
 
+        frameData->endFrame();
 
         //Swap buffers
         glfwSwapBuffers(window);
         // poll windows events, call callback functions for events
         glfwPollEvents();
-    } while (!glfwWindowShouldClose(window));
+    }
+
+    printStats(*sceneGeometry, *frameData, *terrain, scene, sceneBvh, occlusion, *occlusionQueries, renderQueue, cameraCollision, visibilityCache, *world, *impostors);
 
     //Delete our Buffers
-    glDeleteVertexArrays(1, &boxVAO);
-    glDeleteBuffers(1, &boxVBO);
+    frameData.reset();
+    world.reset();
+    terrain.reset();
+    sceneDraws.reset();
+    impostors.reset();
+    occlusionQueries.reset();
+    instanceBuffer.reset();
+    sceneGeometry.reset();
+    gpuDeleteTextures(1, &texture1);
+    gpuDeleteTextures(1, &texture2);
+    floorTexture.reset();
+    liveFeedRunning = false;
+    liveFeed.join();
+    liveTexture.reset();
 
 
 
@@ -508,6 +1302,36 @@ void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
     camera.ProcessMouseMovement(xNorm, yNorm);
 }
 
+// Function callback for single key presses, used for toggles that shouldn't repeat every frame while held
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action != GLFW_PRESS)
+        return;
+    if (key == GLFW_KEY_V)
+        showLiveTexture = !showLiveTexture;
+    if (key == GLFW_KEY_P)
+        printStatsRequested = true;
+    if (key == GLFW_KEY_L)
+        lodEnabled = !lodEnabled;
+    if (key == GLFW_KEY_C)
+        cullingEnabled = !cullingEnabled;
+    if (key == GLFW_KEY_O)
+        occlusionEnabled = !occlusionEnabled;
+    if (key == GLFW_KEY_G)
+        occlusionQueriesEnabled = !occlusionQueriesEnabled;
+    if (key == GLFW_KEY_K)
+        visibilityCacheEnabled = !visibilityCacheEnabled;
+    if (key == GLFW_KEY_I)
+        impostorsEnabled = !impostorsEnabled;
+}
+
+// Function callback for mouse buttons, a left click asks the next frame to pick
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+        pickRequested = true;
+}
+
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
     camera.ProcessMouseScroll(static_cast<float>(yoffset));
@@ -528,6 +1352,1557 @@ void windowCloseCallback(GLFWwindow* window)
 
 
 
+// Prints the renderer's statistics to the console
+void printStats(const GeometryBuffer& geometry, const FrameAllocator& frameData, const ClipmapTerrain& terrain, const Scene& scene, const Bvh& sceneBvh,
+    const OcclusionCuller& occlusion, const OcclusionQueries& occlusionQueries, const RenderQueue& renderQueue,
+    const CameraCollision& cameraCollision, const VisibilityCache& visibilityCache, const WorldStreamer& world, const ImpostorAtlas& impostors)
+{
+    std::cout << "---------------- Stats ----------------" << std::endl;
+    gpuMemory().print(std::cout);
+    std::cout << "Geometry heap:" << std::endl;
+    geometry.stats().print(std::cout);
+    std::cout << "Frame allocator:" << std::endl;
+    frameData.print(std::cout);
+    std::cout << "Terrain:" << std::endl;
+    terrain.print(std::cout);
+    std::cout << "Scene:" << std::endl;
+    scene.print(std::cout);
+    std::cout << "Scene BVH:" << std::endl;
+    sceneBvh.print(std::cout);
+    std::cout << "Occlusion culling:" << std::endl;
+    occlusion.print(std::cout);
+    std::cout << "Occlusion queries:" << std::endl;
+    occlusionQueries.print(std::cout);
+    std::cout << "Render queue:" << std::endl;
+    renderQueue.print(std::cout);
+    std::cout << "Camera collision:" << std::endl;
+    cameraCollision.print(std::cout);
+    std::cout << "Visibility cache:" << std::endl;
+    visibilityCache.print(std::cout);
+    std::cout << "World streaming:" << std::endl;
+    world.print(std::cout);
+    std::cout << "Impostors:" << std::endl;
+    impostors.print(std::cout);
+}
+
+// Where cube index of a count cube square grid centered on the origin stands on the floor, each turned a little differently
+void cubeGridPlacement(int index, int count, float spacing, float scale, glm::vec3& position, glm::quat& rotation)
+{
+    int side = (int)std::ceil(std::sqrt((double)count));
+    float x = (index % side - (side - 1) * 0.5f) * spacing;
+    float z = (index / side - (side - 1) * 0.5f) * spacing;
+    position = glm::vec3(x, 0.5f * scale, z);
+    rotation = glm::angleAxis(glm::radians((float)(index * 37 % 360)), glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+// World space box of a mesh drawn with model, from the box its vertices were quantized into
+Aabb meshBounds(const MeshRange& mesh, const glm::mat4& model)
+{
+    const VertexQuantization& q = mesh.Quantization;
+    return Aabb(q.Offset - q.Scale, q.Offset + q.Scale).transformed(model);
+}
+
+// count cubes on a square grid centered on the origin, standing on the floor, each turned a little differently
+std::vector<InstanceData> makeCubeGrid(int count, float spacing, float scale)
+{
+    std::vector<InstanceData> instances(count);
+    for (int i = 0; i < count; i++)
+    {
+        glm::vec3 position;
+        glm::quat rotation;
+        cubeGridPlacement(i, count, spacing, scale, position, rotation);
+        instances[i].Model = Scene::compose(position, rotation, glm::vec3(scale));
+        instances[i].Material = (unsigned int)(i % 4);
+    }
+    return instances;
+}
+
+// Camera above a square grid of count cubes looking at its center, returns the camera's position
+glm::vec3 setupGridBenchmarkView(FrameAllocator& frameData, int count, float spacing)
+{
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)screenWidth / (float)screenHeight, 0.1f, 5000.0f);
+    float side = std::ceil(std::sqrt((float)count)) * spacing;
+    glm::vec3 eye(0.0f, side * 0.7f + 3.0f, side * 0.7f + 3.0f);
+    glm::mat4 view = glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    // stays bound for the configuration's frames, the region isn't reused until two more setups have gone by
+    frameData.beginFrame();
+    FrameUniforms frameUniforms = { view, projection };
+    frameData.bind(GL_UNIFORM_BUFFER, FrameUniformBinding, frameData.allocate(frameUniforms, BUFFER_USAGE_UNIFORM));
+    frameData.endFrame();
+    return eye;
+}
+
+// Decodes one JPEG frames times at each of stb_image's SIMD levels (generic C, SSE2, AVX2). milliseconds gets the
+// average per decode, differences the bytes each level's pixels differ from level 0's in. False if it doesn't decode
+bool decodeJpegAtSimdLevels(const unsigned char* bytes, size_t length, int frames, double milliseconds[3], size_t differences[3],
+    int& width, int& height)
+{
+    std::vector<unsigned char> reference;
+    int channels = 0;
+    for (int level = 0; level < 3; level++)
+    {
+        stbi_set_jpeg_simd_level(level);
+        unsigned char* pixels = NULL;
+        CpuTimer timer;
+        for (int f = 0; f < frames; f++)
+        {
+            stbi_image_free(pixels);
+            pixels = stbi_load_from_memory(bytes, (int)length, &width, &height, &channels, 0);
+        }
+        milliseconds[level] = timer.milliseconds() / frames;
+        differences[level] = 0;
+        if (!pixels)
+            return false;
+        size_t size = (size_t)width * height * channels;
+        if (level == 0)
+            reference.assign(pixels, pixels + size);
+        else
+            for (size_t i = 0; i < size; i++)
+                differences[level] += pixels[i] != reference[i];
+        stbi_image_free(pixels);
+    }
+    return true;
+}
+
+// Test image for the generated corpus: a gradient, rings, a checkerboard with hard edges and noise, mixed differently
+// in each channel so the chroma planes aren't flat
+void makeJpegTestImage(int width, int height, int channels, unsigned int seed, std::vector<unsigned char>& pixels)
+{
+    pixels.resize((size_t)width * height * channels);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < channels; c++)
+            {
+                seed = seed * 1664525u + 1013904223u;
+                float gradient = 255.0f * (x + 0.5f) / width;
+                float dx = x - width * 0.4f, dy = y - height * 0.6f;
+                float rings = 127.5f + 127.5f * std::sin(std::sqrt(dx * dx + dy * dy) * (0.3f + 0.2f * c));
+                float checker = ((x / (5 + c) + y / (7 + c)) & 1) ? 230.0f : 20.0f;
+                float weights[3][3] = { { 0.5f, 0.3f, 0.2f }, { 0.2f, 0.5f, 0.3f }, { 0.3f, 0.2f, 0.5f } };
+                float value = weights[c][0] * gradient + weights[c][1] * rings + weights[c][2] * checker + (int)(seed >> 28) - 8;
+                pixels[((size_t)y * width + x) * channels + c] = (unsigned char)std::max(0.0f, std::min(255.0f, value));
+            }
+}
+
+// --bench jpeg: JPEGs decoded from memory with stb_image's generic C kernels, the SSE2 ones and the AVX2 ones (IDCT,
+// YCbCr to RGB, 2x2 chroma upsampling), milliseconds per decode. The SIMD decodes are compared byte for byte with the
+// generic one, the diff columns count the bytes that differ and should stay 0. A CPU without AVX2 gets the SSE2 kernels
+// in the AVX2 column. First the bundled textures, then a corpus written with JpegEncoder: sizes from 1x1 to 1920x1080,
+// most of them with partial MCUs at the right and bottom, in gray and in 4:4:4, 4:2:2 and 4:2:0 at four qualities. Each
+// row of the corpus sums the decodes and diffs of all its sizes.
+void runJpegBenchmark()
+{
+    const char* columns[] = { "Megapixels", "Generic ms", "SSE2 ms", "AVX2 ms", "AVX2 MP/s", "SSE2 diff", "AVX2 diff" };
+    printBenchmarkHeader("JPEG decoding", columns, 7);
+    const char* paths[] = { "Resources/Textures/crate.jpg", "Resources/Textures/Floor.jpg" };
+    for (int p = 0; p < 2; p++)
+    {
+        MappedFile file;
+        if (!file.open(paths[p]))
+        {
+            std::cout << "Could not open " << paths[p] << std::endl;
+            continue;
+        }
+        double results[3];
+        size_t differences[3];
+        int width = 0, height = 0;
+        if (!decodeJpegAtSimdLevels(file.bytes(), file.length(), 20, results, differences, width, height))
+        {
+            std::cout << "Could not decode " << paths[p] << std::endl;
+            continue;
+        }
+        double megapixels = width * height / 1.0e6;
+        printBenchmarkCell(megapixels);
+        for (int level = 0; level < 3; level++)
+            printBenchmarkCell(results[level]);
+        printBenchmarkCell(megapixels / (results[2] / 1000.0), 1);
+        printBenchmarkCell((double)differences[1], 0);
+        printBenchmarkCell((double)differences[2], 0);
+        std::cout << std::endl;
+    }
+
+    const char* corpusColumns[] = { "Chroma", "Quality", "Images", "Megapixels", "Generic ms", "SSE2 ms", "AVX2 ms", "SSE2 diff",
+        "AVX2 diff" };
+    printBenchmarkHeader("JPEG decoding, generated corpus", corpusColumns, 9);
+    const int sizes[][2] = { { 1, 1 }, { 7, 5 }, { 8, 8 }, { 15, 17 }, { 16, 16 }, { 33, 31 }, { 100, 75 }, { 257, 129 },
+        { 640, 480 }, { 1023, 769 }, { 1920, 1080 } };
+    const int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+    const int qualities[] = { 25, 75, 95, 100 };
+    // 400 is gray, the others are YCbCr with that chroma subsampling
+    const int chromas[] = { 400, 444, 422, 420 };
+    const JpegSubsampling subsamplings[] = { JPEG_SUBSAMPLING_444, JPEG_SUBSAMPLING_444, JPEG_SUBSAMPLING_422, JPEG_SUBSAMPLING_420 };
+    std::vector<unsigned char> pixels, encoded;
+    size_t failures = 0;
+    for (int c = 0; c < 4; c++)
+        for (int q = 0; q < 4; q++)
+        {
+            int channels = chromas[c] == 400 ? 1 : 3;
+            double totals[3] = { 0.0, 0.0, 0.0 };
+            size_t totalDifferences[3] = { 0, 0, 0 };
+            double megapixels = 0.0;
+            int images = 0;
+            for (int s = 0; s < sizeCount; s++)
+            {
+                makeJpegTestImage(sizes[s][0], sizes[s][1], channels, s * 16 + c * 4 + q, pixels);
+                encoded.clear();
+                encodeJpeg(encoded, pixels.data(), sizes[s][0], sizes[s][1], channels, qualities[q], subsamplings[c]);
+                double results[3];
+                size_t differences[3];
+                int width = 0, height = 0;
+                if (!decodeJpegAtSimdLevels(encoded.data(), encoded.size(), 3, results, differences, width, height))
+                {
+                    failures++;
+                    continue;
+                }
+                for (int level = 0; level < 3; level++)
+                {
+                    totals[level] += results[level];
+                    totalDifferences[level] += differences[level];
+                }
+                megapixels += width * height / 1.0e6;
+                images++;
+            }
+            printBenchmarkCell(chromas[c], 0);
+            printBenchmarkCell(qualities[q], 0);
+            printBenchmarkCell(images, 0);
+            printBenchmarkCell(megapixels);
+            for (int level = 0; level < 3; level++)
+                printBenchmarkCell(totals[level]);
+            printBenchmarkCell((double)totalDifferences[1], 0);
+            printBenchmarkCell((double)totalDifferences[2], 0);
+            std::cout << std::endl;
+        }
+    if (failures)
+        std::cout << failures << " generated images didn't decode" << std::endl;
+    stbi_set_jpeg_simd_level(2);
+}
+
+// --bench obj: a grid mesh written as OBJ text with every vertex first and the faces after them, even rows of quads with
+// relative (negative) indices and odd rows with absolute ones, from 100k to 1.6M triangles. Parse time on one thread and
+// on at least four, where almost every relative face refers to vertices of an earlier chunk. Mismatches counts the
+// corners either parse resolved differently from the indices written, it should stay 0.
+void runObjBenchmark()
+{
+    const char* columns[] = { "Triangles", "MB", "1 thread ms", "Chunked ms", "Chunked MB/s", "Mismatches" };
+    printBenchmarkHeader("OBJ parsing", columns, 6);
+    size_t threadCount = std::max(4u, std::thread::hardware_concurrency());
+    for (int side = 224; side <= 1415; side = side * 2 + 1)
+    {
+        std::string text;
+        std::vector<uint32_t> expected;
+        char line[128];
+        for (int y = 0; y < side; y++)
+            for (int x = 0; x < side; x++)
+            {
+                text.append(line, snprintf(line, sizeof(line), "v %d 0 %d\n", x, y));
+                text.append(line, snprintf(line, sizeof(line), "vt %.4f %.4f\n", x / (float)side, y / (float)side));
+            }
+        int total = side * side;
+        for (int y = 0; y + 1 < side; y++)
+            for (int x = 0; x + 1 < side; x++)
+            {
+                int quad[4] = { y * side + x + 1, y * side + x + 2, (y + 1) * side + x + 2, (y + 1) * side + x + 1 };
+                int written[4];
+                for (int k = 0; k < 4; k++)
+                    written[k] = y % 2 == 0 ? quad[k] - total - 1 : quad[k];
+                // the quad is split into a fan by the parser: 0 1 2, 0 2 3
+                text.append(line, snprintf(line, sizeof(line), "f %d/%d %d/%d %d/%d %d/%d\n", written[0], written[0], written[1], written[1],
+                    written[2], written[2], written[3], written[3]));
+                const int fan[6] = { 0, 1, 2, 0, 2, 3 };
+                for (int k = 0; k < 6; k++)
+                {
+                    expected.push_back((uint32_t)quad[fan[k]]);
+                    expected.push_back((uint32_t)quad[fan[k]]);
+                    expected.push_back(0);
+                }
+            }
+
+        std::vector<float> positions, texcoords, normals;
+        std::vector<uint32_t> corners;
+        double results[2];
+        size_t mismatches = 0;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            CpuTimer timer;
+            bool valid = MeshLoaderDetail::parseObj(text.data(), text.data() + text.size(), pass == 0 ? 1 : threadCount,
+                positions, texcoords, normals, corners);
+            results[pass] = timer.milliseconds();
+            if (!valid || corners.size() != expected.size())
+                mismatches += expected.size();
+            else
+                for (size_t c = 0; c < corners.size(); c++)
+                    mismatches += corners[c] != expected[c];
+        }
+
+        double megabytes = text.size() / (1024.0 * 1024.0);
+        printBenchmarkCell((double)(expected.size() / 9), 0);
+        printBenchmarkCell(megabytes, 1);
+        printBenchmarkCell(results[0]);
+        printBenchmarkCell(results[1]);
+        printBenchmarkCell(megabytes / (results[1] / 1000.0), 0);
+        printBenchmarkCell((double)mismatches, 0);
+        std::cout << std::endl;
+    }
+}
+
+// --bench meshcache: rolling grids of 1M and 10M triangles written as OBJ files, then loaded into the scene geometry
+// with loadGpuMesh. The cold load parses, optimizes, builds the LODs and writes the .meshcache; the warm loads (the
+// average of three) map that cache and upload from the mapping. Both include waiting for the upload with glFinish. The
+// files are deleted afterwards.
+void runMeshCacheBenchmark(GeometryBuffer& geometry)
+{
+    const char* columns[] = { "Triangles (M)", "OBJ MB", "Cache MB", "Cold ms", "Warm ms" };
+    printBenchmarkHeader("Mesh cache", columns, 5);
+    const int sides[] = { 708, 2237 };
+    const char* path = "meshcache_benchmark.obj";
+    std::string cachePath = std::string(path) + ".meshcache";
+    for (int s = 0; s < 2; s++)
+    {
+        int side = sides[s];
+        size_t objBytes = 0;
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            std::string text;
+            char line[128];
+            for (int z = 0; z < side; z++)
+            {
+                text.clear();
+                for (int x = 0; x < side; x++)
+                    text.append(line, snprintf(line, sizeof(line), "v %d %.3f %d\n", x, rollingSurfaceHeight((float)x, (float)z, 100.0f), z));
+                out.write(text.data(), (std::streamsize)text.size());
+                objBytes += text.size();
+            }
+            for (int z = 0; z + 1 < side; z++)
+            {
+                text.clear();
+                for (int x = 0; x + 1 < side; x++)
+                {
+                    int a = z * side + x + 1, b = a + 1, c = a + side, d = c + 1;
+                    text.append(line, snprintf(line, sizeof(line), "f %d %d %d\nf %d %d %d\n", a, c, b, b, c, d));
+                }
+                out.write(text.data(), (std::streamsize)text.size());
+                objBytes += text.size();
+            }
+            if (!out)
+            {
+                std::cout << "Could not write " << path << std::endl;
+                return;
+            }
+        }
+        std::remove(cachePath.c_str());
+
+        double results[2] = { 0.0, 0.0 };
+        bool loaded = true;
+        const int warmRuns = 3;
+        for (int run = 0; run <= warmRuns && loaded; run++)
+        {
+            MeshRange range;
+            CpuTimer timer;
+            loaded = loadGpuMesh(path, geometry, range);
+            glFinish();
+            double milliseconds = timer.milliseconds();
+            if (run == 0)
+                results[0] = milliseconds;
+            else
+                results[1] += milliseconds / warmRuns;
+            if (loaded)
+                geometry.remove(range);
+            glFinish();
+            geometry.update(0);
+        }
+        size_t cacheBytes = 0;
+        {
+            MappedFile cache;
+            if (cache.open(cachePath.c_str()))
+                cacheBytes = cache.length();
+        }
+        std::remove(path);
+        std::remove(cachePath.c_str());
+        if (!loaded)
+        {
+            std::cout << "Could not load " << path << std::endl;
+            return;
+        }
+
+        printBenchmarkCell(2.0 * (side - 1) * (side - 1) / 1.0e6);
+        printBenchmarkCell(objBytes / (1024.0 * 1024.0), 1);
+        printBenchmarkCell(cacheBytes / (1024.0 * 1024.0), 1);
+        printBenchmarkCell(results[0], 1);
+        printBenchmarkCell(results[1], 1);
+        std::cout << std::endl;
+    }
+}
+
+// --bench instancing: the same cube grid drawn with one instanced call and with one setMat4 + draw per cube,
+// from 1 to 1M cubes. Frame times in milliseconds, CPU is the time spent issuing the draws.
+void runInstancingBenchmark(Shader& shader, GeometryBuffer& geometry, const MeshRange& mesh, InstanceBuffer& instances, FrameAllocator& frameData)
+{
+    const char* columns[] = { "Cubes", "Instanced CPU", "Instanced GPU", "Per cube CPU", "Per cube GPU" };
+    printBenchmarkHeader("Instancing", columns, 5);
+    glfwSwapInterval(0);
+    shader.use();
+    geometry.bind(mesh.Arena);
+    glm::mat4 quantization = mesh.Quantization.matrix();
+    const void* firstIndex = (const void*)(mesh.FirstIndex * sizeof(unsigned int));
+    for (int count = 1; count <= 1000000; count *= 10)
+    {
+        const float spacing = 2.0f;
+        std::vector<InstanceData> grid = makeCubeGrid(count, spacing, 1.0f);
+        instances.upload(grid);
+        instances.bind();
+        setupGridBenchmarkView(frameData, count, spacing);
+
+        // a million separate draws takes a while, fewer frames are enough to average there
+        int frames = count >= 100000 ? 3 : 20;
+        double results[4];
+        timeFrames(frames, [&]()
+        {
+            shader.setBool("instanced", true);
+            shader.setMat4("model", quantization);
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, mesh.IndexCount, GL_UNSIGNED_INT, firstIndex, count, mesh.BaseVertex);
+        }, results[0], results[1]);
+        timeFrames(frames, [&]()
+        {
+            shader.setBool("instanced", false);
+            for (int i = 0; i < count; i++)
+            {
+                shader.setMat4("model", grid[i].Model * quantization);
+                glDrawElementsBaseVertex(GL_TRIANGLES, mesh.IndexCount, GL_UNSIGNED_INT, firstIndex, mesh.BaseVertex);
+            }
+        }, results[2], results[3]);
+
+        printBenchmarkCell((double)count, 0);
+        for (int i = 0; i < 4; i++)
+            printBenchmarkCell(results[i]);
+        std::cout << std::endl;
+    }
+    shader.setBool("instanced", false);
+}
+
+// --bench multidraw: count separate draw commands (one per cube, as if every cube were a different mesh) submitted
+// with one glMultiDrawElementsIndirect and with one setMat4 + draw each, from 1 to 100k draws.
+void runMultiDrawBenchmark(Shader& shader, GeometryBuffer& geometry, const MeshRange& mesh, InstanceBuffer& instances, FrameAllocator& frameData)
+{
+    const char* columns[] = { "Draws", "MDI CPU", "MDI GPU", "Per draw CPU", "Per draw GPU" };
+    printBenchmarkHeader("Multi-draw indirect", columns, 5);
+    glfwSwapInterval(0);
+    shader.use();
+    geometry.bind(mesh.Arena);
+    glm::mat4 quantization = mesh.Quantization.matrix();
+    const void* firstIndex = (const void*)(mesh.FirstIndex * sizeof(unsigned int));
+    MultiDrawBatch batch;
+    int bucket = batch.addBucket();
+    for (int count = 1; count <= 100000; count *= 10)
+    {
+        const float spacing = 2.0f;
+        std::vector<InstanceData> grid = makeCubeGrid(count, spacing, 1.0f);
+        instances.upload(grid);
+        instances.bind();
+        setupGridBenchmarkView(frameData, count, spacing);
+        batch.clear();
+        for (int i = 0; i < count; i++)
+            batch.add(bucket, mesh, 1, (GLuint)i);
+        batch.upload();
+
+        int frames = 20;
+        double results[4];
+        timeFrames(frames, [&]()
+        {
+            batch.draw(bucket, shader, geometry);
+        }, results[0], results[1]);
+        timeFrames(frames, [&]()
+        {
+            for (int i = 0; i < count; i++)
+            {
+                shader.setMat4("model", grid[i].Model * quantization);
+                glDrawElementsBaseVertex(GL_TRIANGLES, mesh.IndexCount, GL_UNSIGNED_INT, firstIndex, mesh.BaseVertex);
+            }
+        }, results[2], results[3]);
+
+        printBenchmarkCell((double)count, 0);
+        for (int i = 0; i < 4; i++)
+            printBenchmarkCell(results[i]);
+        std::cout << std::endl;
+    }
+}
+
+// Unit sphere of latitude rings and longitude segments with position and uv, the u = 0/1 meridian is a uv seam
+Mesh makeSphereMesh(int segments, int rings)
+{
+    Mesh mesh;
+    mesh.Stride = 5;
+    for (int r = 0; r <= rings; r++)
+        for (int s = 0; s <= segments; s++)
+        {
+            float theta = glm::pi<float>() * r / rings;
+            float phi = 2.0f * glm::pi<float>() * s / segments;
+            float vertex[5] = { std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi),
+                (float)s / segments, (float)r / rings };
+            mesh.Vertices.insert(mesh.Vertices.end(), vertex, vertex + 5);
+        }
+    for (int r = 0; r < rings; r++)
+        for (int s = 0; s < segments; s++)
+        {
+            unsigned int a = r * (segments + 1) + s, b = a + 1, c = a + segments + 1, d = c + 1;
+            // the rows at the poles are fans, their other triangle would have no area
+            if (r > 0)
+            {
+                unsigned int upper[3] = { a, c, b };
+                mesh.Indices.insert(mesh.Indices.end(), upper, upper + 3);
+            }
+            if (r < rings - 1)
+            {
+                unsigned int lower[3] = { b, c, d };
+                mesh.Indices.insert(mesh.Indices.end(), lower, lower + 3);
+            }
+        }
+    return mesh;
+}
+
+// What world cell (x, z) holds: three rocks, each a sphere with a lumpy radius, placed 16 times over the cell on the ground,
+// and a stone texture tinted for the cell. The rocks stay off the flat ground of the cube field. Runs on the streamer's
+// thread, which only reads the terrain's height function.
+void makeWorldCell(int x, int z, const ClipmapTerrain& terrain, CellContent& content)
+{
+    unsigned int seed = ((unsigned int)x * 73856093u) ^ ((unsigned int)z * 19349663u) ^ 0x9e3779b9u;
+    auto random = [&]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+
+    for (int shape = 0; shape < 3; shape++)
+    {
+        Mesh rock = makeSphereMesh(32, 16);
+        float phases[4] = { random() * 6.2831853f, random() * 6.2831853f, random() * 6.2831853f, random() * 6.2831853f };
+        for (size_t v = 0; v < rock.vertexCount(); v++)
+        {
+            // a function of the position only, so the uv seam stays closed
+            float* p = rock.vertex(v);
+            float radius = 1.0f + 0.2f * std::sin(3.0f * p[0] + phases[0]) * std::sin(3.0f * p[1] + phases[1])
+                + 0.1f * std::sin(7.0f * p[2] + phases[2]) * std::sin(5.0f * p[0] + phases[3]);
+            p[0] *= radius;
+            p[1] *= radius;
+            p[2] *= radius;
+        }
+        content.Meshes.push_back(rock);
+    }
+
+    StreamedImage stone;
+    stone.Width = stone.Height = 256;
+    stone.Pixels.resize(stone.Width * stone.Height * 4);
+    glm::vec3 tint(0.45f + 0.15f * random(), 0.4f + 0.1f * random(), 0.35f + 0.1f * random());
+    for (int ty = 0; ty < stone.Height; ty++)
+    {
+        for (int tx = 0; tx < stone.Width; tx++)
+        {
+            float shade = 0.55f + 0.4f * TerrainDetail::valueNoise(tx / 16.0f + x * 31.0f, ty / 16.0f + z * 17.0f)
+                + 0.2f * TerrainDetail::valueNoise(tx / 3.0f, ty / 3.0f + 57.0f);
+            unsigned char* texel = &stone.Pixels[(ty * stone.Width + tx) * 4];
+            for (int c = 0; c < 3; c++)
+                texel[c] = (unsigned char)std::min(255.0f, tint[c] * shade * 255.0f);
+            texel[3] = 255;
+        }
+    }
+    content.Images.push_back(stone);
+
+    for (int i = 0; i < 16; i++)
+    {
+        float px = ((float)x + random()) * worldCellSize;
+        float pz = ((float)z + random()) * worldCellSize;
+        float scale = 0.5f + 2.5f * random() * random();
+        float turn = random() * 6.2831853f;
+        unsigned int shape = (unsigned int)(random() * 3.0f) % 3;
+        if (std::max(std::fabs(px), std::fabs(pz)) < 60.0f)
+            continue;
+        StreamedObject rock;
+        rock.Mesh = shape;
+        rock.Image = 0;
+        rock.Model = glm::translate(glm::mat4(1.0f), glm::vec3(px, terrain.heightAt(px, pz) + 0.2f * scale, pz));
+        rock.Model = glm::rotate(rock.Model, turn, glm::vec3(0.0f, 1.0f, 0.0f));
+        rock.Model = glm::scale(rock.Model, glm::vec3(scale, scale * 0.7f, scale));
+        content.Objects.push_back(rock);
+    }
+}
+
+// --bench lod: a field of dense spheres drawn at full detail and with every sphere at the LOD whose error stays under
+// lodPixelThreshold pixels, from 100 to 10k spheres. Triangles are per frame, throughput is triangles per GPU second.
+void runLodBenchmark(Shader& shader, GeometryBuffer& geometry, InstanceBuffer& instances, FrameAllocator& frameData)
+{
+    // three tessellations, simplified on as many cores as there are
+    std::vector<Mesh> spheres;
+    spheres.push_back(makeSphereMesh(64, 32));
+    spheres.push_back(makeSphereMesh(128, 64));
+    spheres.push_back(makeSphereMesh(256, 128));
+    std::vector<const Mesh*> meshes;
+    for (size_t i = 0; i < spheres.size(); i++)
+    {
+        MeshOptimizer::optimizeMesh(spheres[i], "sphere", false);
+        meshes.push_back(&spheres[i]);
+    }
+    CpuTimer simplifyTimer;
+    std::vector<std::vector<MeshLod>> chains = Simplifier::buildLodChains(meshes);
+    std::cout << "Built LOD chains for " << meshes.size() << " meshes in " << simplifyTimer.milliseconds() << " ms" << std::endl;
+    for (size_t i = 0; i < chains.size(); i++)
+    {
+        std::cout << "  sphere " << i << ":";
+        for (size_t l = 0; l < chains[i].size(); l++)
+            std::cout << " " << chains[i][l].Indices.size() / 3;
+        std::cout << " triangles" << std::endl;
+    }
+    MeshRange sphere = geometry.add(spheres.back(), chains.back());
+    const std::vector<LodRange>& lods = geometry.lods(sphere.Id);
+    std::vector<float> errors(lods.size());
+    for (size_t i = 0; i < lods.size(); i++)
+        errors[i] = lods[i].Error;
+
+    const char* columns[] = { "Spheres", "Full tris (M)", "Full GPU", "Full Mtri/s", "LOD tris (M)", "LOD GPU", "LOD Mtri/s" };
+    printBenchmarkHeader("LOD", columns, 7);
+    glfwSwapInterval(0);
+    shader.use();
+    MultiDrawBatch batch;
+    int bucket = batch.addBucket();
+    float pixelsPerRadian = Simplifier::pixelsPerRadian(45.0f, (float)screenHeight);
+    for (int count = 100; count <= 10000; count *= 10)
+    {
+        const float spacing = 3.0f;
+        std::vector<InstanceData> grid = makeCubeGrid(count, spacing, 1.0f);
+        glm::vec3 eye = setupGridBenchmarkView(frameData, count, spacing);
+
+        // instances grouped by LOD, one draw command per LOD
+        std::vector<std::vector<InstanceData>> byLod(lods.size());
+        for (int i = 0; i < count; i++)
+        {
+            float distance = glm::length(glm::vec3(grid[i].Model[3]) - eye);
+            byLod[Simplifier::selectLod(errors.data(), (int)errors.size(), 1.0f, distance, pixelsPerRadian, lodPixelThreshold)].push_back(grid[i]);
+        }
+        std::vector<InstanceData> sorted;
+        double lodTriangles = 0.0;
+        for (size_t l = 0; l < byLod.size(); l++)
+        {
+            sorted.insert(sorted.end(), byLod[l].begin(), byLod[l].end());
+            lodTriangles += byLod[l].size() * (lods[l].IndexCount / 3.0);
+        }
+        double fullTriangles = count * (lods[0].IndexCount / 3.0);
+
+        int frames = 10;
+        double results[4];
+        instances.upload(grid);
+        instances.bind();
+        batch.clear();
+        batch.add(bucket, geometry.lod(sphere.Id, 0), (GLuint)count, 0);
+        batch.upload();
+        timeFrames(frames, [&]() { batch.draw(bucket, shader, geometry); }, results[0], results[1]);
+
+        instances.upload(sorted);
+        instances.bind();
+        batch.clear();
+        GLuint first = 0;
+        for (size_t l = 0; l < byLod.size(); l++)
+        {
+            if (!byLod[l].empty())
+                batch.add(bucket, geometry.lod(sphere.Id, (int)l), (GLuint)byLod[l].size(), first);
+            first += (GLuint)byLod[l].size();
+        }
+        batch.upload();
+        timeFrames(frames, [&]() { batch.draw(bucket, shader, geometry); }, results[2], results[3]);
+
+        printBenchmarkCell((double)count, 0);
+        printBenchmarkCell(fullTriangles / 1.0e6);
+        printBenchmarkCell(results[1]);
+        printBenchmarkCell(fullTriangles / 1.0e6 / (results[1] / 1000.0), 1);
+        printBenchmarkCell(lodTriangles / 1.0e6);
+        printBenchmarkCell(results[3]);
+        printBenchmarkCell(lodTriangles / 1.0e6 / (results[3] / 1000.0), 1);
+        std::cout << std::endl;
+    }
+    geometry.remove(sphere);
+}
+
+// --bench meshlets: a 12 x 12 field of dense spheres merged into one mesh, drawn whole and as the meshlets that survive
+// frustum and back face culling, from three viewpoints. Cull CPU includes writing the compacted index stream.
+void runMeshletBenchmark(Shader& shader, GeometryBuffer& geometry, FrameAllocator& frameData)
+{
+    const int side = 12;
+    const float spacing = 2.5f;
+    Mesh sphere = makeSphereMesh(128, 64);
+    Mesh field;
+    field.Stride = sphere.Stride;
+    for (int i = 0; i < side * side; i++)
+    {
+        unsigned int base = (unsigned int)field.vertexCount();
+        glm::vec3 offset((i % side) * spacing, 1.0f, (i / side) * spacing);
+        for (size_t v = 0; v < sphere.vertexCount(); v++)
+        {
+            const float* in = sphere.vertex(v);
+            float vertex[5] = { in[0] + offset.x, in[1] + offset.y, in[2] + offset.z, in[3], in[4] };
+            field.Vertices.insert(field.Vertices.end(), vertex, vertex + 5);
+        }
+        for (size_t j = 0; j < sphere.Indices.size(); j++)
+            field.Indices.push_back(sphere.Indices[j] + base);
+    }
+    CpuTimer buildTimer;
+    MeshletSet meshlets = MeshletBuilder::build(field);
+    std::cout << "Built " << meshlets.Meshlets.size() << " meshlets from " << field.Indices.size() / 3 << " triangles in "
+        << buildTimer.milliseconds() << " ms" << std::endl;
+    MeshRange mesh = geometry.add(field);
+    if (mesh.IndexCount == 0)
+    {
+        std::cout << "The sphere field doesn't fit in the geometry buffer" << std::endl;
+        return;
+    }
+
+    // vertices from the geometry buffer, indices from a stream the culler rewrites every frame
+    GLuint vao, stream;
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &stream);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, geometry.arenaBuffer(mesh.Arena));
+    geometry.layout().apply();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, stream);
+    GLsizeiptr streamBytes = (GLsizeiptr)(meshlets.IndexCount * sizeof(unsigned int));
+    gpuBufferData(stream, GL_ELEMENT_ARRAY_BUFFER, streamBytes, NULL, GL_STREAM_DRAW, GPU_MEMORY_STREAMING);
+    MeshletCuller culler;
+
+    struct View
+    {
+        const char* name;
+        glm::vec3 eye;
+        glm::vec3 target;
+    };
+    float middle = (side - 1) * spacing * 0.5f;
+    View views[] = {
+        { "overview", glm::vec3(middle, 40.0f, middle + 45.0f), glm::vec3(middle, 0.0f, middle) },
+        { "ground", glm::vec3(-3.0f, 1.5f, -3.0f), glm::vec3(middle, 1.0f, middle) },
+        { "close", glm::vec3(middle, 2.2f, middle - 1.8f), glm::vec3(middle, 1.0f, middle) },
+    };
+    const char* columns[] = { "View", "Meshlets", "Visible", "Tris (M)", "Drawn (M)", "Full GPU", "Cull CPU", "Culled GPU" };
+    printBenchmarkHeader("Meshlet culling", columns, 8);
+    glfwSwapInterval(0);
+    shader.use();
+    shader.setBool("instanced", false);
+    shader.setMat4("model", mesh.Quantization.matrix());
+    for (size_t v = 0; v < sizeof(views) / sizeof(views[0]); v++)
+    {
+        glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)screenWidth / (float)screenHeight, 0.1f, 1000.0f);
+        glm::mat4 view = glm::lookAt(views[v].eye, views[v].target, glm::vec3(0.0f, 1.0f, 0.0f));
+        frameData.beginFrame();
+        FrameUniforms frameUniforms = { view, projection };
+        frameData.bind(GL_UNIFORM_BUFFER, FrameUniformBinding, frameData.allocate(frameUniforms, BUFFER_USAGE_UNIFORM));
+        frameData.endFrame();
+        // the field is its own world space, so the frustum and camera need no model transform
+        Frustum frustum = Frustum::fromMatrix(projection * view);
+
+        int frames = 20;
+        double results[4];
+        geometry.bind(mesh.Arena);
+        timeFrames(frames, [&]()
+        {
+            glDrawElementsBaseVertex(GL_TRIANGLES, mesh.IndexCount, GL_UNSIGNED_INT, (const void*)(mesh.FirstIndex * sizeof(unsigned int)), mesh.BaseVertex);
+        }, results[0], results[1]);
+        glBindVertexArray(vao);
+        timeFrames(frames, [&]()
+        {
+            unsigned int* out = (unsigned int*)glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, streamBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            size_t count = out ? culler.cull(meshlets, field.Indices.data(), frustum, views[v].eye, out) : 0;
+            glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+            glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)count, GL_UNSIGNED_INT, 0, mesh.BaseVertex);
+        }, results[2], results[3]);
+
+        const MeshletCullStats& stats = culler.stats();
+        std::cout << std::setw(16) << views[v].name;
+        printBenchmarkCell((double)stats.Meshlets, 0);
+        printBenchmarkCell((double)(stats.Meshlets - stats.FrustumCulled - stats.BackfaceCulled), 0);
+        printBenchmarkCell(stats.Triangles / 1.0e6);
+        printBenchmarkCell(stats.DrawnTriangles / 1.0e6);
+        printBenchmarkCell(results[1]);
+        printBenchmarkCell(results[2]);
+        printBenchmarkCell(results[3]);
+        std::cout << std::endl;
+    }
+    glBindVertexArray(0);
+    glDeleteVertexArrays(1, &vao);
+    gpuDeleteBuffers(1, &stream);
+    geometry.remove(mesh);
+}
+
+// --bench scene: hierarchies of 100 entities (a root, 9 children, 90 grandchildren) from 10k to 1M entities, updated with
+// nothing moving, with every root turning (which moves everything below it) and with every entity turning. Milliseconds per update.
+void runSceneBenchmark()
+{
+    const char* columns[] = { "Entities", "Static", "Roots moving", "All moving" };
+    printBenchmarkHeader("Scene update", columns, 4);
+    for (int count = 10000; count <= 1000000; count *= 10)
+    {
+        Scene scene;
+        std::vector<Entity> roots;
+        for (int r = 0; r < count / 100; r++)
+        {
+            Entity root = scene.create(NoEntity, glm::vec3((r % 100) * 10.0f, 0.0f, (r / 100) * 10.0f));
+            roots.push_back(root);
+            for (int c = 0; c < 9; c++)
+            {
+                float turn = glm::radians(40.0f * c);
+                Entity child = scene.create(root, glm::vec3(std::cos(turn) * 3.0f, 1.0f, std::sin(turn) * 3.0f),
+                    glm::angleAxis(turn, glm::vec3(0.0f, 1.0f, 0.0f)), glm::vec3(0.5f));
+                for (int g = 0; g < 10; g++)
+                    scene.create(child, glm::vec3(0.0f, 0.5f * g, 1.0f), glm::angleAxis(glm::radians(36.0f * g), glm::vec3(1.0f, 0.0f, 0.0f)));
+            }
+        }
+        scene.update();
+
+        const int frames = 20;
+        double results[3] = { 0.0, 0.0, 0.0 };
+        for (int frame = 0; frame < frames; frame++)
+        {
+            CpuTimer timer;
+            scene.update();
+            results[0] += timer.milliseconds();
+        }
+        for (int frame = 0; frame < frames; frame++)
+        {
+            glm::quat turn = glm::angleAxis(0.01f * frame, glm::vec3(0.0f, 1.0f, 0.0f));
+            for (size_t r = 0; r < roots.size(); r++)
+                scene.setRotation(roots[r], turn);
+            CpuTimer timer;
+            scene.update();
+            results[1] += timer.milliseconds();
+        }
+        for (int frame = 0; frame < frames; frame++)
+        {
+            glm::quat turn = glm::angleAxis(0.01f * frame, glm::vec3(0.0f, 1.0f, 0.0f));
+            for (Entity entity = 0; entity < (Entity)scene.size(); entity++)
+                scene.setRotation(entity, turn);
+            CpuTimer timer;
+            scene.update();
+            results[2] += timer.milliseconds();
+        }
+
+        printBenchmarkCell((double)count, 0);
+        for (int i = 0; i < 3; i++)
+            printBenchmarkCell(results[i] / frames);
+        std::cout << std::endl;
+    }
+}
+
+// --bench bvh: boxes scattered over a 2 km square from 10k to 1M objects. Build time on one thread and on all of them,
+// refitting after a tenth of the objects moved, and the cost of frustum and ray queries against scanning every box.
+void runBvhBenchmark()
+{
+    const char* columns[] = { "Objects", "Build 1T ms", "Build ms", "Refit ms", "Frustum ms", "Scan ms", "Ray us", "Ray scan us" };
+    printBenchmarkHeader("BVH", columns, 8);
+    unsigned int seed = 12345;
+    auto random = [&]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+    for (int count = 10000; count <= 1000000; count *= 10)
+    {
+        std::vector<Aabb> boxes(count);
+        for (int i = 0; i < count; i++)
+        {
+            glm::vec3 center(random() * 2000.0f - 1000.0f, random() * 20.0f, random() * 2000.0f - 1000.0f);
+            glm::vec3 half(0.5f + random() * 2.0f, 0.5f + random() * 4.0f, 0.5f + random() * 2.0f);
+            boxes[i] = Aabb(center - half, center + half);
+        }
+        double results[7];
+        {
+            Bvh serial(1);
+            CpuTimer timer;
+            serial.build(boxes);
+            results[0] = timer.milliseconds();
+        }
+        Bvh bvh;
+        CpuTimer buildTimer;
+        bvh.build(boxes);
+        results[1] = buildTimer.milliseconds();
+
+        for (int i = 0; i < count / 10; i++)
+        {
+            unsigned int object = (unsigned int)(random() * (count - 1));
+            glm::vec3 step(random() * 4.0f - 2.0f, 0.0f, random() * 4.0f - 2.0f);
+            bvh.setBounds(object, Aabb(bvh.bounds(object).Min + step, bvh.bounds(object).Max + step));
+        }
+        CpuTimer refitTimer;
+        bvh.refit();
+        results[2] = refitTimer.milliseconds();
+
+        // views from just above the ground looking along it, 300 m deep like a far plane
+        const int views = 16;
+        std::vector<unsigned int> visible;
+        results[3] = results[4] = 0.0;
+        for (int v = 0; v < views; v++)
+        {
+            glm::vec3 eye(random() * 1600.0f - 800.0f, 10.0f, random() * 1600.0f - 800.0f);
+            float heading = random() * 6.2831853f;
+            glm::mat4 view = glm::lookAt(eye, eye + glm::vec3(std::cos(heading), -0.1f, std::sin(heading)), glm::vec3(0.0f, 1.0f, 0.0f));
+            Frustum frustum = Frustum::fromMatrix(glm::perspective(glm::radians(45.0f), (float)screenWidth / (float)screenHeight, 0.1f, 300.0f) * view);
+            visible.clear();
+            CpuTimer queryTimer;
+            bvh.queryFrustum(frustum, visible);
+            results[3] += queryTimer.milliseconds() / views;
+            visible.clear();
+            CpuTimer scanTimer;
+            for (int i = 0; i < count; i++)
+                if (frustum.intersectsAabb(bvh.bounds(i)))
+                    visible.push_back(i);
+            results[4] += scanTimer.milliseconds() / views;
+        }
+
+        // rays from above the boxes down and across, like picking with the mouse
+        const int rays = 1000;
+        results[5] = results[6] = 0.0;
+        for (int r = 0; r < rays; r++)
+        {
+            glm::vec3 origin(random() * 1600.0f - 800.0f, 40.0f, random() * 1600.0f - 800.0f);
+            glm::vec3 direction = glm::normalize(glm::vec3(random() - 0.5f, -0.3f, random() - 0.5f));
+            BvhHit hit;
+            CpuTimer rayTimer;
+            bvh.raycast(origin, direction, 500.0f, hit);
+            results[5] += rayTimer.milliseconds() * 1000.0 / rays;
+            if (r % 10 != 0)
+                continue;
+            // scanning is slow enough to only sample
+            CpuTimer scanTimer;
+            BvhDetail::RayData ray = BvhDetail::makeRay(origin, direction);
+            float closest = 500.0f;
+            for (int i = 0; i < count; i++)
+            {
+                float distance;
+                if (BvhDetail::intersectBox(ray, bvh.bounds(i), closest, distance))
+                    closest = distance;
+            }
+            results[6] += scanTimer.milliseconds() * 1000.0 / (rays / 10);
+        }
+
+        printBenchmarkCell((double)count, 0);
+        for (int i = 0; i < 7; i++)
+            printBenchmarkCell(results[i]);
+        std::cout << std::endl;
+    }
+}
+
+// Height of the hills of makeRollingSurface, whole waves across the square so copies laid side by side meet seamlessly
+float rollingSurfaceHeight(float x, float z, float size)
+{
+    const float wave = 6.2831853f / size;
+    return 2.0f * std::sin(x * 5.0f * wave) * std::cos(z * 3.0f * wave);
+}
+
+// A size x size square of side x side quads over rolling hills, two triangles a quad
+void makeRollingSurface(int side, float size, std::vector<glm::vec3>& positions, std::vector<unsigned int>& indices)
+{
+    positions.clear();
+    indices.clear();
+    positions.reserve((size_t)(side + 1) * (side + 1));
+    indices.reserve((size_t)side * side * 6);
+    for (int z = 0; z <= side; z++)
+        for (int x = 0; x <= side; x++)
+        {
+            float px = x * size / side, pz = z * size / side;
+            positions.push_back(glm::vec3(px, rollingSurfaceHeight(px, pz, size), pz));
+        }
+    for (int z = 0; z < side; z++)
+        for (int x = 0; x < side; x++)
+        {
+            unsigned int a = z * (side + 1) + x, b = a + 1, c = a + side + 1, d = c + 1;
+            const unsigned int quad[6] = { a, c, b, b, c, d };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+}
+
+// --bench picking: 16 copies of a rolling grid mesh from 10k to 1M triangles each, laid out 4 x 4 under one scene Bvh,
+// picked with 1000 rays from above like mouse clicks. TriangleBvh build time, the average and worst pick, and every 50th
+// ray checked against testing every triangle of every copy.
+void runPickingBenchmark()
+{
+    const char* columns[] = { "Triangles", "Build ms", "Pick us", "Worst us", "Brute us", "Mismatches" };
+    printBenchmarkHeader("Picking", columns, 6);
+    unsigned int seed = 12345;
+    auto random = [&]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+    const int sides[] = { 71, 224, 708 };
+    const int copies = 4;
+    const float size = 100.0f;
+    for (int s = 0; s < 3; s++)
+    {
+        int side = sides[s];
+        std::vector<glm::vec3> positions;
+        std::vector<unsigned int> indices;
+        makeRollingSurface(side, size, positions, indices);
+
+        TriangleBvh mesh;
+        CpuTimer buildTimer;
+        mesh.build(positions, indices);
+        double buildMilliseconds = buildTimer.milliseconds();
+
+        std::vector<glm::mat4> transforms;
+        std::vector<Aabb> boxes;
+        Aabb meshBox;
+        for (size_t i = 0; i < positions.size(); i++)
+            meshBox.extend(positions[i]);
+        for (int z = 0; z < copies; z++)
+            for (int x = 0; x < copies; x++)
+            {
+                transforms.push_back(glm::translate(glm::mat4(1.0f), glm::vec3(x * size * 1.1f, 0.0f, z * size * 1.1f)));
+                boxes.push_back(meshBox.transformed(transforms.back()));
+            }
+        Bvh objects;
+        objects.build(boxes);
+        auto meshOf = [&mesh](unsigned int) { return &mesh; };
+        auto transformOf = [&transforms](unsigned int object) { return transforms[object]; };
+
+        const int rays = 1000;
+        double pickTotal = 0.0, pickWorst = 0.0, bruteTotal = 0.0;
+        int mismatches = 0, checked = 0;
+        float extent = copies * size * 1.1f;
+        for (int r = 0; r < rays; r++)
+        {
+            Ray ray(glm::vec3(random() * extent, 30.0f, random() * extent),
+                glm::normalize(glm::vec3(random() - 0.5f, -1.0f, random() - 0.5f)));
+            PickHit hit;
+            CpuTimer pickTimer;
+            bool found = pick(objects, ray, 1000.0f, meshOf, transformOf, hit);
+            double pickMicroseconds = pickTimer.milliseconds() * 1000.0;
+            pickTotal += pickMicroseconds;
+            pickWorst = std::max(pickWorst, pickMicroseconds);
+            if (r % 50 != 0)
+                continue;
+
+            // Moller-Trumbore against every triangle, both sides like TriangleBvh
+            CpuTimer bruteTimer;
+            float closest = 1000.0f;
+            for (size_t object = 0; object < transforms.size(); object++)
+                for (unsigned int t = 0; t < (unsigned int)mesh.triangleCount(); t++)
+                {
+                    glm::vec3 a, b, c;
+                    mesh.triangle(t, a, b, c);
+                    a = glm::vec3(transforms[object] * glm::vec4(a, 1.0f));
+                    glm::vec3 e1 = glm::vec3(transforms[object] * glm::vec4(b, 1.0f)) - a;
+                    glm::vec3 e2 = glm::vec3(transforms[object] * glm::vec4(c, 1.0f)) - a;
+                    glm::vec3 p = glm::cross(ray.Direction, e2);
+                    float determinant = glm::dot(e1, p);
+                    if (std::fabs(determinant) < 1e-12f)
+                        continue;
+                    float inverse = 1.0f / determinant;
+                    glm::vec3 toOrigin = ray.Origin - a;
+                    float u = glm::dot(toOrigin, p) * inverse;
+                    if (u < 0.0f || u > 1.0f)
+                        continue;
+                    glm::vec3 q = glm::cross(toOrigin, e1);
+                    float v = glm::dot(ray.Direction, q) * inverse;
+                    if (v < 0.0f || u + v > 1.0f)
+                        continue;
+                    float distance = glm::dot(e2, q) * inverse;
+                    if (distance > 0.0f && distance < closest)
+                        closest = distance;
+                }
+            bruteTotal += bruteTimer.milliseconds() * 1000.0;
+            checked++;
+            bool bruteFound = closest < 1000.0f;
+            if (found != bruteFound || (found && std::fabs(hit.Distance - closest) > 1e-3f * std::max(1.0f, closest)))
+                mismatches++;
+        }
+
+        printBenchmarkCell((double)mesh.triangleCount(), 0);
+        printBenchmarkCell(buildMilliseconds);
+        printBenchmarkCell(pickTotal / rays);
+        printBenchmarkCell(pickWorst);
+        printBenchmarkCell(bruteTotal / checked, 0);
+        printBenchmarkCell((double)mismatches, 0);
+        std::cout << std::endl;
+    }
+}
+
+// --bench collision: the camera sphere walked over 16 copies of a rolling surface of 10k to 1M triangles each (up to
+// 16M in the scene) with 400 tilted 2 m crates standing on it. 2000 moves of 0.3 m in a wandering direction, each also
+// pushing 0.15 m down into the ground, so most moves slide along the surface or a crate. Every 200th move the end
+// position is checked against every triangle of every object: it has to be at least the radius away from all of them.
+void runCollisionBenchmark()
+{
+    const char* columns[] = { "Triangles (M)", "Build ms", "Move us", "Worst us", "Gathered", "Closest / r", "Inside" };
+    printBenchmarkHeader("Camera collision", columns, 7);
+    unsigned int seed = 12345;
+    auto random = [&]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+    const int sides[] = { 71, 224, 708 };
+    const int copies = 4;
+    const float size = 100.0f;
+    const float extent = copies * size;
+
+    // a 2 m crate, shared by all of them
+    std::vector<glm::vec3> cubePositions;
+    for (int i = 0; i < 8; i++)
+        cubePositions.push_back(glm::vec3(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f));
+    const unsigned int cubeFaces[36] = { 0, 2, 1, 1, 2, 3, 4, 5, 6, 5, 7, 6, 0, 1, 4, 1, 5, 4, 2, 6, 3, 3, 6, 7, 0, 4, 2, 2, 4, 6, 1, 3, 5, 3, 7, 5 };
+    std::vector<unsigned int> cubeIndices(cubeFaces, cubeFaces + 36);
+    TriangleBvh cube;
+    cube.build(cubePositions, cubeIndices);
+
+    for (int s = 0; s < 3; s++)
+    {
+        std::vector<glm::vec3> positions;
+        std::vector<unsigned int> indices;
+        makeRollingSurface(sides[s], size, positions, indices);
+        TriangleBvh surface;
+        CpuTimer buildTimer;
+        surface.build(positions, indices);
+        double buildMilliseconds = buildTimer.milliseconds();
+
+        // the surfaces tile the ground, one after the other, then the crates
+        std::vector<const TriangleBvh*> meshes;
+        std::vector<glm::mat4> transforms;
+        std::vector<Aabb> boxes;
+        Aabb surfaceBox;
+        for (size_t i = 0; i < positions.size(); i++)
+            surfaceBox.extend(positions[i]);
+        for (int z = 0; z < copies; z++)
+            for (int x = 0; x < copies; x++)
+            {
+                meshes.push_back(&surface);
+                transforms.push_back(glm::translate(glm::mat4(1.0f), glm::vec3(x * size, 0.0f, z * size)));
+                boxes.push_back(surfaceBox.transformed(transforms.back()));
+            }
+        Aabb cubeBox(glm::vec3(-1.0f), glm::vec3(1.0f));
+        for (int i = 0; i < 400; i++)
+        {
+            float x = random() * extent, z = random() * extent;
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(x, rollingSurfaceHeight(x, z, size) + 0.5f, z));
+            model = glm::rotate(model, random() * 6.2831853f, glm::vec3(0.0f, 1.0f, 0.0f));
+            model = glm::rotate(model, random() * 0.5f, glm::vec3(1.0f, 0.0f, 0.0f));
+            meshes.push_back(&cube);
+            transforms.push_back(model);
+            boxes.push_back(cubeBox.transformed(model));
+        }
+        Bvh objects;
+        objects.build(boxes);
+        auto meshOf = [&meshes](unsigned int object) { return meshes[object]; };
+        auto transformOf = [&transforms](unsigned int object) { return transforms[object]; };
+        size_t sceneTriangles = copies * copies * surface.triangleCount() + 400 * cube.triangleCount();
+
+        CameraCollision collision;
+        const int moves = 2000;
+        double moveTotal = 0.0, moveWorst = 0.0, gathered = 0.0;
+        float closest = FLT_MAX;
+        int inside = 0;
+        glm::vec3 position(extent * 0.5f, 5.0f, extent * 0.5f);
+        float heading = 0.0f;
+        for (int m = 0; m < moves; m++)
+        {
+            heading += (random() - 0.5f) * 0.6f;
+            glm::vec3 target = position + glm::vec3(std::cos(heading) * 0.3f, -0.15f, std::sin(heading) * 0.3f);
+            position = collision.move(objects, position, target, meshOf, transformOf);
+            const CollisionStats& stats = collision.stats();
+            moveTotal += stats.Microseconds;
+            moveWorst = std::max(moveWorst, stats.Microseconds);
+            gathered += (double)stats.Triangles / moves;
+            // turn back towards the middle before walking off the surfaces
+            if (position.x < 20.0f || position.z < 20.0f || position.x > extent - 20.0f || position.z > extent - 20.0f)
+                heading = std::atan2(extent * 0.5f - position.z, extent * 0.5f - position.x);
+            if (m % 200 != 199)
+                continue;
+
+            float nearest = FLT_MAX;
+            for (size_t object = 0; object < meshes.size(); object++)
+            {
+                const TriangleBvh& mesh = *meshes[object];
+                glm::vec3 local = glm::vec3(glm::inverse(transforms[object]) * glm::vec4(position, 1.0f));
+                for (unsigned int t = 0; t < (unsigned int)mesh.triangleCount(); t++)
+                {
+                    glm::vec3 a, b, c;
+                    mesh.triangle(t, a, b, c);
+                    // the transforms are rigid, distances are the same in model space
+                    nearest = std::min(nearest, glm::length(local - CameraCollision::closestPoint(local, a, b, c)));
+                }
+            }
+            closest = std::min(closest, nearest / collision.Radius);
+            if (nearest < collision.Radius * 0.999f)
+                inside++;
+        }
+
+        printBenchmarkCell(sceneTriangles / 1.0e6);
+        printBenchmarkCell(buildMilliseconds);
+        printBenchmarkCell(moveTotal / moves);
+        printBenchmarkCell(moveWorst);
+        printBenchmarkCell(gathered, 1);
+        printBenchmarkCell(closest);
+        printBenchmarkCell((double)inside, 0);
+        std::cout << std::endl;
+    }
+}
+
+// --bench renderqueue: 1k to 1M packets with a spread of programs, texture sets and vertex arrays, a third of them
+// transparent. Milliseconds to build the keys, to radix sort them and to std::sort the same keys, and the state changes
+// submitting the sorted queue would cost against submitting the packets as they came.
+void runRenderQueueBenchmark()
+{
+    const char* columns[] = { "Packets", "Add ms", "Radix ms", "std::sort ms", "Changes", "Unsorted" };
+    printBenchmarkHeader("Render queue", columns, 6);
+    unsigned int seed = 12345;
+    auto random = [&]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return seed >> 8;
+    };
+    RenderQueue queue;
+    for (int count = 1000; count <= 1000000; count *= 10)
+    {
+        std::vector<RenderPacket> packets(count);
+        std::vector<float> depths(count);
+        for (int i = 0; i < count; i++)
+        {
+            RenderPacket packet = { random() % 3 == 0 ? (unsigned int)RENDER_PASS_TRANSPARENT : (unsigned int)RENDER_PASS_OPAQUE,
+                random() % 16, random() % 256, random() % 8, 0, (unsigned int)i };
+            packets[i] = packet;
+            depths[i] = (random() % 100000) * 0.01f;
+        }
+
+        const int runs = 10;
+        double results[5] = {};
+        std::vector<uint64_t> keys(count);
+        for (int run = 0; run < runs; run++)
+        {
+            CpuTimer addTimer;
+            queue.clear();
+            for (int i = 0; i < count; i++)
+                queue.add(packets[i].Pass, packets[i].Program, packets[i].Textures, packets[i].VertexArray, depths[i], 0, i);
+            results[0] += addTimer.milliseconds() / runs;
+            queue.sort();
+            results[1] += queue.stats().SortMilliseconds / runs;
+
+            for (int i = 0; i < count; i++)
+                keys[i] = RenderQueue::makeKey(packets[i].Pass, packets[i].Program, packets[i].Textures, packets[i].VertexArray, depths[i]) | (uint64_t)i;
+            CpuTimer sortTimer;
+            std::sort(keys.begin(), keys.end());
+            results[2] += sortTimer.milliseconds() / runs;
+        }
+
+        queue.submit([](const RenderPacket&, unsigned int) {}, [](const RenderPacket&) {});
+        const RenderQueueStats& stats = queue.stats();
+        results[3] = (double)(stats.ProgramChanges + stats.TextureChanges + stats.VertexArrayChanges);
+        for (int i = 0; i < count; i++)
+        {
+            const RenderPacket* last = i > 0 ? &packets[i - 1] : NULL;
+            results[4] += (!last || last->Program != packets[i].Program) + (!last || last->Textures != packets[i].Textures)
+                + (!last || last->VertexArray != packets[i].VertexArray);
+        }
+
+        printBenchmarkCell((double)count, 0);
+        for (int i = 0; i < 3; i++)
+            printBenchmarkCell(results[i]);
+        printBenchmarkCell(results[3], 0);
+        printBenchmarkCell(results[4], 0);
+        std::cout << std::endl;
+    }
+}
+
+// --bench visibility: a 600 frame flythrough over the boxes of --bench bvh, 10k to 1M of them. The camera flies 10 m/s
+// at 60 frames a second, weaving from side to side, looking around a little and spinning half a turn in a second now
+// and then. Milliseconds a frame for the BVH's frustum query and for the visibility cache, the share of objects the cache
+// answered without testing them, the objects it retested a frame and the objects the two disagree on, which has to be none.
+void runVisibilityBenchmark()
+{
+    const char* columns[] = { "Objects", "BVH ms", "Cache ms", "Cached %", "Retests", "Differ" };
+    printBenchmarkHeader("Visibility cache", columns, 6);
+    unsigned int seed = 12345;
+    auto random = [&]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+    const glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)screenWidth / (float)screenHeight, 0.1f, 300.0f);
+    for (int count = 10000; count <= 1000000; count *= 10)
+    {
+        std::vector<Aabb> boxes(count);
+        for (int i = 0; i < count; i++)
+        {
+            glm::vec3 center(random() * 2000.0f - 1000.0f, random() * 20.0f, random() * 2000.0f - 1000.0f);
+            glm::vec3 half(0.5f + random() * 2.0f, 0.5f + random() * 4.0f, 0.5f + random() * 2.0f);
+            boxes[i] = Aabb(center - half, center + half);
+        }
+        Bvh bvh;
+        bvh.build(boxes);
+        VisibilityCache cache;
+
+        const int frames = 600;
+        const float frameTime = 1.0f / 60.0f;
+        double results[5] = {};
+        std::vector<unsigned int> visible, cached;
+        std::vector<unsigned char> found(count);
+        glm::vec3 eye(-500.0f, 10.0f, 0.0f);
+        float heading = 0.0f;
+        for (int f = 0; f < frames; f++)
+        {
+            float time = f * frameTime;
+            // half a turn in the first second of every five, otherwise weaving
+            float turnRate = f % 300 < 60 ? 3.1415927f : 0.6f * std::sin(time * 0.8f);
+            heading += turnRate * frameTime;
+            glm::vec3 forward(std::cos(heading), 0.0f, std::sin(heading));
+            eye += forward * (10.0f * frameTime);
+            glm::vec3 look = forward + glm::vec3(0.0f, -0.1f + 0.05f * std::sin(time * 1.3f), 0.0f);
+            glm::mat4 view = glm::lookAt(eye, eye + look, glm::vec3(0.0f, 1.0f, 0.0f));
+
+            visible.clear();
+            CpuTimer bvhTimer;
+            bvh.queryFrustum(Frustum::fromMatrix(projection * view), visible);
+            results[0] += bvhTimer.milliseconds() / frames;
+
+            cached.clear();
+            cache.query(bvh, projection, view, cached);
+            results[1] += cache.stats().Milliseconds / frames;
+            results[3] += (double)cache.stats().Retests / frames;
+
+            // both have to find the same objects
+            std::fill(found.begin(), found.end(), 0);
+            for (size_t i = 0; i < visible.size(); i++)
+                found[visible[i]] = 1;
+            for (size_t i = 0; i < cached.size(); i++)
+                found[cached[i]] ^= 2;
+            for (int i = 0; i < count; i++)
+                if (found[i] == 1 || found[i] == 2)
+                    results[4]++;
+        }
+        results[2] = cache.hitRate() * 100.0;
+
+        printBenchmarkCell((double)count, 0);
+        for (int i = 0; i < 4; i++)
+            printBenchmarkCell(results[i]);
+        printBenchmarkCell(results[4], 0);
+        std::cout << std::endl;
+    }
+}
+
+// --bench streaming: 10 seconds of flying over the streamed world at 40 m/s and 60 frames a second, a quarter turn every
+// 2.5 seconds, after standing still for 2 seconds while the first cells load. With the view's budget and half of it, and
+// without and with prefetching along the view. Load latency from request to upload, the cells within NeededRadius that
+// weren't resident yet (a hit rate over cells and frames), the most memory resident and the cells evicted.
+void runStreamingBenchmark(GeometryBuffer& geometry, const ClipmapTerrain& terrain)
+{
+    const char* columns[] = { "Budget MB", "Prefetch s", "Latency ms", "Worst ms", "Misses", "Hit %", "Peak MB", "Evicted" };
+    printBenchmarkHeader("World streaming", columns, 8);
+    const size_t budgets[] = { worldStreamingBudget, worldStreamingBudget / 2 };
+    const float prefetches[] = { 0.0f, 2.0f };
+    const float frameTime = 1.0f / 60.0f;
+    for (int b = 0; b < 2; b++)
+    {
+        for (int p = 0; p < 2; p++)
+        {
+            WorldStreamer world(geometry, worldCellSize, worldLoadRadius, budgets[b],
+                [&terrain](int x, int z, CellContent& content) { makeWorldCell(x, z, terrain, content); });
+            world.PrefetchSeconds = prefetches[p];
+            glm::vec3 eye(200.0f, 10.0f, 0.0f);
+            float heading = 0.0f;
+            for (int f = 0; f < 120; f++)
+            {
+                world.update(eye, glm::vec3(1.0f, 0.0f, 0.0f), frameTime);
+                std::this_thread::sleep_for(std::chrono::microseconds(16667));
+            }
+            world.resetStats();
+            for (int f = 0; f < 600; f++)
+            {
+                // the quarter turns take half a second
+                if (f % 150 >= 120)
+                    heading += 3.1415927f * frameTime;
+                glm::vec3 forward(std::cos(heading), 0.0f, std::sin(heading));
+                eye += forward * (40.0f * frameTime);
+                world.update(eye, forward, frameTime);
+                std::this_thread::sleep_for(std::chrono::microseconds(16667));
+            }
+            const WorldStreamerStats& stats = world.statistics();
+            printBenchmarkCell(GpuMemoryTracker::megabytes(budgets[b]), 0);
+            printBenchmarkCell(prefetches[p], 0);
+            printBenchmarkCell(world.averageLatency());
+            printBenchmarkCell(stats.LatencyMax);
+            printBenchmarkCell((double)stats.Misses, 0);
+            printBenchmarkCell(world.hitRate() * 100.0);
+            printBenchmarkCell(GpuMemoryTracker::megabytes(stats.PeakBytes));
+            printBenchmarkCell((double)stats.Evictions, 0);
+            std::cout << std::endl;
+        }
+    }
+}
+
+// --bench impostors: crowds of 1k to 100k spheres drawn all as meshes with one draw command, and with the ones too
+// small on screen swapped for the quads of a baked impostor. Vertices are the mesh vertices fed to the vertex shader.
+void runImpostorBenchmark(Shader& shader, Shader& impostorShader, Shader& bakeShader, GeometryBuffer& geometry, InstanceBuffer& instances,
+    FrameAllocator& frameData)
+{
+    Mesh sphereMesh = makeSphereMesh(64, 32);
+    MeshOptimizer::optimizeMesh(sphereMesh, "sphere", false);
+    MeshRange sphere = geometry.add(sphereMesh);
+    ImpostorAtlas atlas(1);
+    CpuTimer bakeTimer;
+    int layer = atlas.bake(bakeShader, geometry, sphere);
+    glFinish();
+    std::cout << "Baked the sphere's " << atlas.Views * atlas.Views << " views in " << bakeTimer.milliseconds() << " ms" << std::endl;
+
+    const char* columns[] = { "Spheres", "Mesh verts (M)", "Mesh GPU", "Impostors", "Draws", "Mixed verts (M)", "Mixed GPU" };
+    printBenchmarkHeader("Impostors", columns, 7);
+    glfwSwapInterval(0);
+    MultiDrawBatch batch;
+    int bucket = batch.addBucket();
+    float pixelsPerRadian = Simplifier::pixelsPerRadian(45.0f, (float)screenHeight);
+    for (int count = 1000; count <= 100000; count *= 10)
+    {
+        const float spacing = 3.0f;
+        std::vector<InstanceData> grid = makeCubeGrid(count, spacing, 1.0f);
+        glm::vec3 eye = setupGridBenchmarkView(frameData, count, spacing);
+        FrameUniforms frameUniforms = { glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)),
+            glm::perspective(glm::radians(45.0f), (float)screenWidth / (float)screenHeight, 0.1f, 5000.0f) };
+
+        // nearest first, so the spheres that stay meshes are the first instances and one command draws them
+        std::sort(grid.begin(), grid.end(), [&eye](const InstanceData& a, const InstanceData& b)
+        {
+            return glm::length(glm::vec3(a.Model[3]) - eye) < glm::length(glm::vec3(b.Model[3]) - eye);
+        });
+        instances.upload(grid);
+        instances.bind();
+        std::vector<unsigned int> meshInstances(count);
+        for (int i = 0; i < count; i++)
+            meshInstances[i] = (unsigned int)i;
+        atlas.select(meshInstances, eye, pixelsPerRadian, [layer](unsigned int) { return layer; },
+            [&grid](unsigned int i) { return Aabb(glm::vec3(grid[i].Model[3]) - glm::vec3(1.0f), glm::vec3(grid[i].Model[3]) + glm::vec3(1.0f)); });
+
+        int frames = 20;
+        double results[4];
+        shader.use();
+        batch.clear();
+        batch.add(bucket, sphere, (GLuint)count, 0);
+        batch.upload();
+        timeFrames(frames, [&]() { batch.draw(bucket, shader, geometry); }, results[0], results[1]);
+
+        batch.clear();
+        if (!meshInstances.empty())
+            batch.add(bucket, sphere, (GLuint)meshInstances.size(), 0);
+        batch.upload();
+        // the impostor lists go through the frame allocator, a region a frame like the main loop
+        timeFrames(frames, [&]()
+        {
+            frameData.beginFrame();
+            frameData.bind(GL_UNIFORM_BUFFER, FrameUniformBinding, frameData.allocate(frameUniforms, BUFFER_USAGE_UNIFORM));
+            if (!meshInstances.empty())
+            {
+                shader.use();
+                batch.draw(bucket, shader, geometry);
+            }
+            impostorShader.use();
+            atlas.bind(impostorShader, 2, 3);
+            atlas.draw(impostorShader, frameData);
+            frameData.endFrame();
+        }, results[2], results[3]);
+        const ImpostorStats& stats = atlas.stats();
+
+        printBenchmarkCell((double)count, 0);
+        printBenchmarkCell((double)count * sphere.VertexCount / 1.0e6);
+        printBenchmarkCell(results[1]);
+        printBenchmarkCell((double)stats.Impostors, 0);
+        printBenchmarkCell((double)((meshInstances.empty() ? 0 : 1) + (stats.Impostors > 0 ? 1 : 0)), 0);
+        printBenchmarkCell(((double)meshInstances.size() * sphere.VertexCount + 4.0 * stats.Impostors) / 1.0e6);
+        printBenchmarkCell(results[3]);
+        std::cout << std::endl;
+    }
+    geometry.remove(sphere);
+}
+
+// --bench dynamictexture: a producer thread writes 1080p and 4K frames into a DynamicTexture as fast as the ring lets
+// it while the render thread runs 600 frames paced at 60 Hz, calling update() once a frame. The producer only stamps
+// each frame with memset so the numbers are the upload path's: the render thread's time in update(), the GPU time
+// of the copy it issues, and how many frames per second reach the texture.
+void runDynamicTextureBenchmark()
+{
+    const char* columns[] = { "Width", "Height", "Update ms", "Worst ms", "Copy GPU ms", "Uploaded fps", "Produced fps", "Dropped" };
+    printBenchmarkHeader("Dynamic texture", columns, 8);
+    const int sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+    for (int s = 0; s < 2; s++)
+    {
+        DynamicTexture texture(sizes[s][0], sizes[s][1]);
+        size_t frameBytes = (size_t)texture.Width * texture.Height * 4;
+        std::atomic<bool> running(true);
+        std::atomic<int> produced(0);
+        std::thread producer([&]()
+        {
+            while (running)
+            {
+                unsigned char* pixels = texture.beginWrite(100);
+                if (!pixels && !texture.writable())
+                    return;
+                if (!pixels)
+                    continue;
+                memset(pixels, produced & 0xff, frameBytes);
+                texture.endWrite();
+                produced++;
+            }
+        });
+
+        const int frames = 600;
+        GpuTimer gpuTimer;
+        double updateTotal = 0.0, updateWorst = 0.0, gpuTotal = 0.0;
+        int copies = 0;
+        unsigned long long firstUploaded = texture.framesUploaded();
+        unsigned long long firstDropped = texture.framesDropped();
+        int firstProduced = produced;
+        CpuTimer elapsed;
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames; f++)
+        {
+            CpuTimer updateTimer;
+            gpuTimer.begin();
+            bool uploaded = texture.update();
+            gpuTimer.end();
+            double update = updateTimer.milliseconds();
+            updateTotal += update;
+            updateWorst = std::max(updateWorst, update);
+            // reading the query waits for the copy, which a real frame wouldn't, so it stays out of the update time
+            if (uploaded)
+            {
+                gpuTotal += gpuTimer.milliseconds();
+                copies++;
+            }
+            next += std::chrono::microseconds(16667);
+            std::this_thread::sleep_until(next);
+        }
+        double seconds = elapsed.milliseconds() / 1000.0;
+        running = false;
+        producer.join();
+
+        printBenchmarkCell(texture.Width, 0);
+        printBenchmarkCell(texture.Height, 0);
+        printBenchmarkCell(updateTotal / frames);
+        printBenchmarkCell(updateWorst);
+        printBenchmarkCell(copies ? gpuTotal / copies : 0.0);
+        printBenchmarkCell((texture.framesUploaded() - firstUploaded) / seconds, 1);
+        printBenchmarkCell((produced - firstProduced) / seconds, 1);
+        printBenchmarkCell((double)(texture.framesDropped() - firstDropped), 0);
+        std::cout << std::endl;
+    }
+}
+
+// Builds a shader program from the asset pack when it has both sources, otherwise from the files on disk
+Shader loadShader(const char* vertexPath, const char* fragmentPath)
+{
+    AssetView vertex, fragment;
+    if (assets.find(vertexPath, vertex) && assets.find(fragmentPath, fragment))
+        return Shader((const char*)vertex.data, (int)vertex.size, (const char*)fragment.data, (int)fragment.size);
+    return Shader(vertexPath, fragmentPath);
+}
+
+// Decodes an image straight out of the mapped asset pack, or from the file on disk when it isn't packed.
+// Either way the result is freed with stbi_image_free.
+unsigned char* loadImage(const char* path, int* width, int* height, int* channels, int desiredChannels)
+{
+    AssetView image;
+    if (assets.find(path, image))
+        return stbi_load_from_memory(image.data, (int)image.size, width, height, channels, desiredChannels);
+    return stbi_load(path, width, height, channels, desiredChannels);
+}
+
 //Function for when screen is resized
 void framebufferSizeCallback(GLFWwindow* window, int width, int height)
 {
@@ -0,0 +1,22 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// CPU side indexed triangle mesh ///////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Vertices are interleaved floats, Stride floats per vertex, and always start with the x,y,z position.
+// Whatever follows (texture coordinates, normals) is carried along untouched by the mesh processing code.
+struct Mesh
+{
+    std::vector<float> Vertices;
+    std::vector<unsigned int> Indices;
+    int Stride;
+
+    Mesh() : Stride(3) {}
+
+    size_t vertexCount() const { return Stride > 0 ? Vertices.size() / Stride : 0; }
+    size_t triangleCount() const { return Indices.size() / 3; }
+    const float* vertex(size_t index) const { return &Vertices[index * Stride]; }
+    float* vertex(size_t index) { return &Vertices[index * Stride]; }
+};
@@ -0,0 +1,991 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <cctype>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "Mesh.h"
+#include "MappedFile.h"
+#include "MeshOptimizer.h"
+#include "Simplifier.h"
+#include "VertexLayout.h"
+#include "GeometryBuffer.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Model loading: OBJ, glTF 2.0 and a binary cache //////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// loadModel() parses a file into a Mesh with Stride 8: position, uv, normal.
+//   .obj         the file is mapped and split into one chunk per core at line boundaries. Every chunk is parsed on its
+//                own thread, then the chunks are stitched together and the v/vt/vn triples deduplicated.
+//   .gltf/.glb   the JSON is parsed and every buffer is mapped, accessors are read straight out of the mappings.
+//                All triangle primitives of all meshes are merged, node transforms are not applied.
+// loadGpuMesh() is the one to use at runtime, into its own buffers or into a GeometryBuffer. The first load parses,
+// optimizes, builds the LOD chain and encodes the model and writes "<file>.meshcache" next to it. Later loads map that cache and hand the
+// mapping to glBufferData with no parsing at all.
+// The cache is rebuilt when the source file's size or modification time or the vertex layout changes.
+
+const int ModelStride = 8;
+
+namespace MeshLoaderDetail
+{
+    ///////////////////////////////////// Number parsing ///////////////////////////////////////////////
+    inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    inline const char* skipSpaces(const char* s, const char* end)
+    {
+        while (s < end && isSpace(*s))
+            s++;
+        return s;
+    }
+
+    inline const char* nextLine(const char* s, const char* end)
+    {
+        const char* newline = (const char*)memchr(s, '\n', end - s);
+        return newline ? newline + 1 : end;
+    }
+
+    inline double powerOfTen(int exponent)
+    {
+        static const double table[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+        if (exponent >= 0 && exponent <= 22)
+            return table[exponent];
+        if (exponent < 0 && exponent >= -22)
+            return 1.0 / table[-exponent];
+        return std::pow(10.0, exponent);
+    }
+
+    // Decimal number without locale or strtod overhead. Integers up to 2^53 come out exact, fractions to within an ulp of
+    // float which is plenty for geometry.
+    inline const char* parseDouble(const char* s, const char* end, double& value)
+    {
+        s = skipSpaces(s, end);
+        bool negative = false;
+        if (s < end && (*s == '-' || *s == '+'))
+            negative = *s++ == '-';
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        for (; s < end && isDigit(*s); s++)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*s - '0');
+                if (mantissa)
+                    digits++;
+            }
+            else
+                exponent++;
+        }
+        if (s < end && *s == '.')
+        {
+            for (s++; s < end && isDigit(*s); s++)
+            {
+                if (digits < 19)
+                {
+                    mantissa = mantissa * 10 + (*s - '0');
+                    if (mantissa)
+                        digits++;
+                    exponent--;
+                }
+            }
+        }
+        if (s < end && (*s == 'e' || *s == 'E'))
+        {
+            s++;
+            bool negativeExponent = false;
+            if (s < end && (*s == '-' || *s == '+'))
+                negativeExponent = *s++ == '-';
+            int e = 0;
+            for (; s < end && isDigit(*s); s++)
+                e = std::min(e * 10 + (*s - '0'), 10000);
+            exponent += negativeExponent ? -e : e;
+        }
+        double result = (double)mantissa;
+        if (exponent < 0)
+            result /= powerOfTen(-exponent);
+        else if (exponent > 0)
+            result *= powerOfTen(exponent);
+        value = negative ? -result : result;
+        return s;
+    }
+
+    inline const char* parseFloat(const char* s, const char* end, float& value)
+    {
+        double result;
+        s = parseDouble(s, end, result);
+        value = (float)result;
+        return s;
+    }
+
+    inline const char* parseInt(const char* s, const char* end, int& value)
+    {
+        bool negative = false;
+        if (s < end && (*s == '-' || *s == '+'))
+            negative = *s++ == '-';
+        int result = 0;
+        for (; s < end && isDigit(*s); s++)
+            result = result * 10 + (*s - '0');
+        value = negative ? -result : result;
+        return s;
+    }
+
+    ///////////////////////////////////// OBJ //////////////////////////////////////////////////////////
+    // Face corners keep the raw file indices. Positive ones are global and 1 based, 0 = missing. Negative (relative) ones
+    // are turned into their 0 based index from the start of the chunk minus ObjRelativeBias. That index is negative when
+    // the corner refers to a vertex of an earlier chunk, so it can only be resolved once the chunk's base offset is known.
+    const int ObjRelativeBias = 1 << 30;
+
+    struct ObjChunk
+    {
+        std::vector<float> positions;
+        std::vector<float> texcoords;
+        std::vector<float> normals;
+        std::vector<int> corners;   // p, t, n per corner, three corners per triangle
+    };
+
+    inline int objLocalIndex(int raw, size_t localCount)
+    {
+        if (raw >= 0)
+            return raw;
+        // out of range either way past half the bias, clamped so the sum stays clear of 0 and the positive indices
+        const int limit = ObjRelativeBias / 2;
+        return (int)std::min(localCount, (size_t)limit) + std::max(raw, -limit) - ObjRelativeBias;
+    }
+
+    inline void parseObjChunk(const char* s, const char* end, ObjChunk& chunk)
+    {
+        std::vector<int> face;
+        while (s < end)
+        {
+            s = skipSpaces(s, end);
+            const char* lineEnd = nextLine(s, end);
+            if (s + 1 < end && s[0] == 'v' && isSpace(s[1]))
+            {
+                float x, y, z;
+                s = parseFloat(s + 1, lineEnd, x);
+                s = parseFloat(s, lineEnd, y);
+                parseFloat(s, lineEnd, z);
+                chunk.positions.push_back(x);
+                chunk.positions.push_back(y);
+                chunk.positions.push_back(z);
+            }
+            else if (s + 2 < end && s[0] == 'v' && s[1] == 't' && isSpace(s[2]))
+            {
+                float u, v;
+                s = parseFloat(s + 2, lineEnd, u);
+                parseFloat(s, lineEnd, v);
+                chunk.texcoords.push_back(u);
+                chunk.texcoords.push_back(v);
+            }
+            else if (s + 2 < end && s[0] == 'v' && s[1] == 'n' && isSpace(s[2]))
+            {
+                float x, y, z;
+                s = parseFloat(s + 2, lineEnd, x);
+                s = parseFloat(s, lineEnd, y);
+                parseFloat(s, lineEnd, z);
+                chunk.normals.push_back(x);
+                chunk.normals.push_back(y);
+                chunk.normals.push_back(z);
+            }
+            else if (s + 1 < end && s[0] == 'f' && isSpace(s[1]))
+            {
+                face.clear();
+                s++;
+                while (true)
+                {
+                    s = skipSpaces(s, lineEnd);
+                    if (s >= lineEnd || !(isDigit(*s) || *s == '-' || *s == '+'))
+                        break;
+                    int p = 0, t = 0, n = 0;
+                    s = parseInt(s, lineEnd, p);
+                    if (s < lineEnd && *s == '/')
+                    {
+                        s++;
+                        if (s < lineEnd && *s != '/')
+                            s = parseInt(s, lineEnd, t);
+                        if (s < lineEnd && *s == '/')
+                            s = parseInt(s + 1, lineEnd, n);
+                    }
+                    face.push_back(objLocalIndex(p, chunk.positions.size() / 3));
+                    face.push_back(objLocalIndex(t, chunk.texcoords.size() / 2));
+                    face.push_back(objLocalIndex(n, chunk.normals.size() / 3));
+                }
+                // polygons become triangle fans
+                for (size_t corner = 2; corner < face.size() / 3; corner++)
+                {
+                    chunk.corners.insert(chunk.corners.end(), face.begin(), face.begin() + 3);
+                    chunk.corners.insert(chunk.corners.end(), face.begin() + (corner - 1) * 3, face.begin() + (corner + 1) * 3);
+                }
+            }
+            s = lineEnd;
+        }
+    }
+
+    // Fills in smooth normals for meshes that don't have any
+    inline void generateNormals(Mesh& mesh)
+    {
+        for (size_t v = 0; v < mesh.vertexCount(); v++)
+            mesh.vertex(v)[5] = mesh.vertex(v)[6] = mesh.vertex(v)[7] = 0.0f;
+        for (size_t t = 0; t < mesh.triangleCount(); t++)
+        {
+            float* a = mesh.vertex(mesh.Indices[t * 3]);
+            float* b = mesh.vertex(mesh.Indices[t * 3 + 1]);
+            float* c = mesh.vertex(mesh.Indices[t * 3 + 2]);
+            float e0[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            float e1[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+            float n[3] = { e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0] };
+            for (int k = 0; k < 3; k++)
+            {
+                a[5 + k] += n[k];
+                b[5 + k] += n[k];
+                c[5 + k] += n[k];
+            }
+        }
+        for (size_t v = 0; v < mesh.vertexCount(); v++)
+        {
+            float* n = mesh.vertex(v) + 5;
+            float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (length > 0.0f)
+                for (int k = 0; k < 3; k++)
+                    n[k] /= length;
+        }
+    }
+
+    // Parses the OBJ text in begin..end on threadCount threads, one chunk each cut at line starts, and stitches the chunks
+    // together. corners gets p, t, n per triangle corner, 1 based into the concatenated arrays, 0 for a missing t or n.
+    inline bool parseObj(const char* begin, const char* end, size_t threadCount, std::vector<float>& positions,
+        std::vector<float>& texcoords, std::vector<float>& normals, std::vector<uint32_t>& corners)
+    {
+        threadCount = std::max<size_t>(threadCount, 1);
+        std::vector<const char*> cuts(1, begin);
+        for (size_t i = 1; i < threadCount; i++)
+        {
+            const char* cut = std::max(begin + (end - begin) * i / threadCount, cuts.back());
+            cuts.push_back(nextLine(cut, end));
+        }
+        cuts.push_back(end);
+
+        std::vector<ObjChunk> chunks(threadCount);
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < threadCount; i++)
+            workers.push_back(std::thread(parseObjChunk, cuts[i], cuts[i + 1], std::ref(chunks[i])));
+        parseObjChunk(cuts[0], cuts[1], chunks[0]);
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+
+        // stitch the chunks together, relative corners resolve against everything before them
+        positions.clear();
+        texcoords.clear();
+        normals.clear();
+        corners.clear();
+        size_t cornerTotal = 0;
+        for (size_t i = 0; i < chunks.size(); i++)
+            cornerTotal += chunks[i].corners.size();
+        corners.reserve(cornerTotal);
+        bool valid = true;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            ObjChunk& chunk = chunks[i];
+            int64_t base[3] = { (int64_t)positions.size() / 3, (int64_t)texcoords.size() / 2, (int64_t)normals.size() / 3 };
+            positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+            texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            int64_t count[3] = { (int64_t)positions.size() / 3, (int64_t)texcoords.size() / 2, (int64_t)normals.size() / 3 };
+            for (size_t c = 0; c < chunk.corners.size(); c++)
+            {
+                int raw = chunk.corners[c];
+                int kind = (int)(c % 3);
+                // stored 1 based so 0 still means "not given"
+                int64_t index = raw >= 0 ? raw : base[kind] + ((int64_t)raw + ObjRelativeBias) + 1;
+                if (index > count[kind] || index < (raw < 0 || kind == 0 ? 1 : 0))
+                {
+                    valid = false;
+                    index = 0;
+                }
+                corners.push_back((uint32_t)index);
+            }
+            ObjChunk().positions.swap(chunk.positions);
+            ObjChunk().corners.swap(chunk.corners);
+        }
+        return valid;
+    }
+
+    inline bool loadObj(const char* path, Mesh& mesh)
+    {
+        MappedFile file;
+        if (!file.open(path))
+        {
+            std::cout << "Could not open model " << path << std::endl;
+            return false;
+        }
+        const char* begin = (const char*)file.bytes();
+        const char* end = begin + file.length();
+
+        // one chunk per core, small files aren't worth the threads
+        size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+        threadCount = std::min(threadCount, file.length() / (1 << 20) + 1);
+        std::vector<float> positions, texcoords, normals;
+        std::vector<uint32_t> corners;
+        if (!parseObj(begin, end, threadCount, positions, texcoords, normals, corners))
+        {
+            std::cout << "Model " << path << " has faces referencing missing vertices" << std::endl;
+            return false;
+        }
+
+        // one vertex per distinct p/t/n triple, found through a list per position
+        size_t positionCount = positions.size() / 3;
+        std::vector<uint32_t> first(positionCount, ~0u);
+        std::vector<uint32_t> next;
+        std::vector<uint32_t> keys;
+        mesh = Mesh();
+        mesh.Stride = ModelStride;
+        mesh.Indices.resize(corners.size() / 3);
+        bool hasNormals = !normals.empty();
+        for (size_t c = 0; c < corners.size(); c += 3)
+        {
+            uint32_t p = corners[c] - 1, t = corners[c + 1], n = corners[c + 2];
+            uint32_t vertex = first[p];
+            while (vertex != ~0u && (keys[vertex * 2] != t || keys[vertex * 2 + 1] != n))
+                vertex = next[vertex];
+            if (vertex == ~0u)
+            {
+                vertex = (uint32_t)next.size();
+                next.push_back(first[p]);
+                first[p] = vertex;
+                keys.push_back(t);
+                keys.push_back(n);
+                float data[ModelStride] = { positions[p * 3], positions[p * 3 + 1], positions[p * 3 + 2], 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+                if (t)
+                {
+                    data[3] = texcoords[(t - 1) * 2];
+                    data[4] = texcoords[(t - 1) * 2 + 1];
+                }
+                if (n)
+                {
+                    data[5] = normals[(n - 1) * 3];
+                    data[6] = normals[(n - 1) * 3 + 1];
+                    data[7] = normals[(n - 1) * 3 + 2];
+                }
+                mesh.Vertices.insert(mesh.Vertices.end(), data, data + ModelStride);
+            }
+            mesh.Indices[c / 3] = vertex;
+        }
+        if (!hasNormals)
+            generateNormals(mesh);
+        return true;
+    }
+
+    ///////////////////////////////////// Minimal JSON for glTF ////////////////////////////////////////
+    struct Json
+    {
+        enum Type { Null, Bool, Number, String, Array, Object };
+        Type type;
+        double number;
+        std::string string;
+        std::vector<Json> items;                // array elements or object values
+        std::vector<std::string> keys;          // object keys, parallel to items
+
+        Json() : type(Null), number(0.0) {}
+
+        const Json& operator[](const char* key) const
+        {
+            static const Json none;
+            for (size_t i = 0; i < keys.size(); i++)
+                if (keys[i] == key)
+                    return items[i];
+            return none;
+        }
+        const Json& operator[](size_t index) const
+        {
+            static const Json none;
+            return index < items.size() ? items[index] : none;
+        }
+        size_t size() const { return items.size(); }
+        bool has(const char* key) const { return (*this)[key].type != Null; }
+        int asInt(int fallback = 0) const { return type == Number ? (int)number : fallback; }
+        size_t asSize(size_t fallback = 0) const { return type == Number && number >= 0.0 ? (size_t)number : fallback; }
+    };
+
+    struct JsonParser
+    {
+        const char* s;
+        const char* end;
+
+        void skip()
+        {
+            while (s < end && (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n'))
+                s++;
+        }
+
+        bool parse(Json& value)
+        {
+            skip();
+            if (s >= end)
+                return false;
+            if (*s == '{')
+            {
+                value.type = Json::Object;
+                s++;
+                skip();
+                if (s < end && *s == '}')
+                    return ++s, true;
+                while (true)
+                {
+                    Json key;
+                    skip();
+                    if (s >= end || *s != '"' || !parseString(key.string))
+                        return false;
+                    skip();
+                    if (s >= end || *s++ != ':')
+                        return false;
+                    value.keys.push_back(key.string);
+                    value.items.push_back(Json());
+                    if (!parse(value.items.back()))
+                        return false;
+                    skip();
+                    if (s < end && *s == ',')
+                        s++;
+                    else if (s < end && *s == '}')
+                        return ++s, true;
+                    else
+                        return false;
+                }
+            }
+            if (*s == '[')
+            {
+                value.type = Json::Array;
+                s++;
+                skip();
+                if (s < end && *s == ']')
+                    return ++s, true;
+                while (true)
+                {
+                    value.items.push_back(Json());
+                    if (!parse(value.items.back()))
+                        return false;
+                    skip();
+                    if (s < end && *s == ',')
+                        s++;
+                    else if (s < end && *s == ']')
+                        return ++s, true;
+                    else
+                        return false;
+                }
+            }
+            if (*s == '"')
+            {
+                value.type = Json::String;
+                return parseString(value.string);
+            }
+            if (end - s >= 4 && strncmp(s, "true", 4) == 0)
+            {
+                value.type = Json::Bool;
+                value.number = 1.0;
+                return s += 4, true;
+            }
+            if (end - s >= 5 && strncmp(s, "false", 5) == 0)
+            {
+                value.type = Json::Bool;
+                return s += 5, true;
+            }
+            if (end - s >= 4 && strncmp(s, "null", 4) == 0)
+                return s += 4, true;
+            if (*s == '-' || isDigit(*s))
+            {
+                // as a double, byte offsets and counts past 2^24 have to stay exact
+                value.type = Json::Number;
+                s = parseDouble(s, end, value.number);
+                return true;
+            }
+            return false;
+        }
+
+        // glTF only needs ASCII names and uris, \u escapes are kept as they are
+        bool parseString(std::string& out)
+        {
+            s++;
+            while (s < end && *s != '"')
+            {
+                if (*s == '\\' && s + 1 < end)
+                {
+                    s++;
+                    switch (*s)
+                    {
+                    case 'n': out.push_back('\n'); break;
+                    case 't': out.push_back('\t'); break;
+                    case 'r': out.push_back('\r'); break;
+                    case 'b': out.push_back('\b'); break;
+                    case 'f': out.push_back('\f'); break;
+                    case 'u': out.push_back('\\'); out.push_back('u'); break;
+                    default: out.push_back(*s); break;
+                    }
+                }
+                else
+                    out.push_back(*s);
+                s++;
+            }
+            if (s >= end)
+                return false;
+            s++;
+            return true;
+        }
+    };
+
+    ///////////////////////////////////// glTF /////////////////////////////////////////////////////////
+    struct GltfBuffer
+    {
+        const unsigned char* data;
+        size_t size;
+    };
+
+    // Where an accessor's elements are in its buffer, checked to fit
+    struct GltfAccessor
+    {
+        const unsigned char* data;  // the first element
+        size_t stride;
+        size_t count;
+        int componentType;
+        size_t componentSize;
+        bool normalized;
+    };
+
+    inline bool locateAccessor(const Json& gltf, const std::vector<GltfBuffer>& buffers, int index, int components, GltfAccessor& out)
+    {
+        const Json& accessor = gltf["accessors"][index];
+        const Json& view = gltf["bufferViews"][accessor["bufferView"].asInt(-1)];
+        int bufferIndex = view["buffer"].asInt(-1);
+        if (accessor.type != Json::Object || view.type != Json::Object || bufferIndex < 0 || bufferIndex >= (int)buffers.size())
+            return false;
+        out.componentType = accessor["componentType"].asInt();
+        out.componentSize = out.componentType == 5126 || out.componentType == 5125 ? 4 : out.componentType == 5123 || out.componentType == 5122 ? 2 : 1;
+        out.count = accessor["count"].asSize();
+        size_t offset = view["byteOffset"].asSize() + accessor["byteOffset"].asSize();
+        out.stride = view.has("byteStride") ? view["byteStride"].asSize() : out.componentSize * components;
+        out.normalized = accessor["normalized"].type == Json::Bool && accessor["normalized"].number != 0.0;
+        const GltfBuffer& buffer = buffers[bufferIndex];
+        if (out.count == 0 || out.count > buffer.size || offset > buffer.size ||
+            offset + out.stride * (out.count - 1) + out.componentSize * components > buffer.size)
+            return false;
+        out.data = buffer.data + offset;
+        return true;
+    }
+
+    // Reads `components` values per element of an accessor as floats, honouring byteStride and normalized integers
+    inline bool readAccessor(const Json& gltf, const std::vector<GltfBuffer>& buffers, int index, int components,
+        std::vector<float>& out, size_t& count)
+    {
+        GltfAccessor accessor;
+        if (!locateAccessor(gltf, buffers, index, components, accessor))
+            return false;
+        count = accessor.count;
+        bool normalized = accessor.normalized;
+        out.resize(count * components);
+        for (size_t i = 0; i < count; i++)
+        {
+            const unsigned char* element = accessor.data + accessor.stride * i;
+            for (int c = 0; c < components; c++)
+            {
+                const unsigned char* p = element + c * accessor.componentSize;
+                float value = 0.0f;
+                switch (accessor.componentType)
+                {
+                case 5126: memcpy(&value, p, 4); break;
+                case 5125: { uint32_t v; memcpy(&v, p, 4); value = (float)v; } break;
+                case 5123: { uint16_t v; memcpy(&v, p, 2); value = normalized ? v / 65535.0f : (float)v; } break;
+                case 5122: { int16_t v; memcpy(&v, p, 2); value = normalized ? std::max(v / 32767.0f, -1.0f) : (float)v; } break;
+                case 5121: value = normalized ? *p / 255.0f : (float)*p; break;
+                case 5120: { int8_t v = (int8_t)*p; value = normalized ? std::max(v / 127.0f, -1.0f) : (float)v; } break;
+                default: return false;
+                }
+                out[i * components + c] = value;
+            }
+        }
+        return true;
+    }
+
+    // Reads an index accessor as integers, floats can't hold indices past 2^24. glTF indices are unsigned bytes, shorts or ints.
+    inline bool readIndexAccessor(const Json& gltf, const std::vector<GltfBuffer>& buffers, int index, std::vector<uint32_t>& out, size_t& count)
+    {
+        GltfAccessor accessor;
+        if (!locateAccessor(gltf, buffers, index, 1, accessor))
+            return false;
+        count = accessor.count;
+        out.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const unsigned char* p = accessor.data + accessor.stride * i;
+            switch (accessor.componentType)
+            {
+            case 5125: memcpy(&out[i], p, 4); break;
+            case 5123: { uint16_t v; memcpy(&v, p, 2); out[i] = v; } break;
+            case 5121: out[i] = *p; break;
+            default: return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool loadGltf(const char* path, Mesh& mesh)
+    {
+        MappedFile file;
+        if (!file.open(path))
+        {
+            std::cout << "Could not open model " << path << std::endl;
+            return false;
+        }
+
+        // .glb: 12 byte header, then a JSON chunk and an optional BIN chunk
+        const char* json = (const char*)file.bytes();
+        size_t jsonSize = file.length();
+        GltfBuffer binChunk = { NULL, 0 };
+        if (file.length() >= 20 && memcmp(file.bytes(), "glTF", 4) == 0)
+        {
+            uint32_t chunkLength, chunkType;
+            memcpy(&chunkLength, file.bytes() + 12, 4);
+            memcpy(&chunkType, file.bytes() + 16, 4);
+            if (chunkType != 0x4E4F534A || 20 + (size_t)chunkLength > file.length())
+            {
+                std::cout << "Model " << path << " is not a valid glb file" << std::endl;
+                return false;
+            }
+            json = (const char*)file.bytes() + 20;
+            jsonSize = chunkLength;
+            size_t binOffset = 20 + ((chunkLength + 3) & ~3u);
+            if (binOffset + 8 <= file.length())
+            {
+                memcpy(&chunkLength, file.bytes() + binOffset, 4);
+                if (binOffset + 8 + chunkLength <= file.length())
+                {
+                    binChunk.data = file.bytes() + binOffset + 8;
+                    binChunk.size = chunkLength;
+                }
+            }
+        }
+
+        Json gltf;
+        JsonParser parser = { json, json + jsonSize };
+        if (!parser.parse(gltf) || gltf.type != Json::Object)
+        {
+            std::cout << "Model " << path << " has malformed JSON" << std::endl;
+            return false;
+        }
+
+        // external buffers are mapped too, paths are relative to the .gltf
+        std::string directory(path);
+        size_t slash = directory.find_last_of("/\\");
+        directory = slash == std::string::npos ? std::string() : directory.substr(0, slash + 1);
+        std::vector<std::unique_ptr<MappedFile> > mappings;
+        std::vector<GltfBuffer> buffers;
+        const Json& bufferList = gltf["buffers"];
+        for (size_t i = 0; i < bufferList.size(); i++)
+        {
+            const Json& uri = bufferList[i]["uri"];
+            if (uri.type != Json::String)
+            {
+                buffers.push_back(binChunk);
+                continue;
+            }
+            if (uri.string.compare(0, 5, "data:") == 0)
+            {
+                std::cout << "Model " << path << " uses embedded base64 buffers, which aren't supported" << std::endl;
+                return false;
+            }
+            mappings.push_back(std::unique_ptr<MappedFile>(new MappedFile()));
+            if (!mappings.back()->open((directory + uri.string).c_str()))
+            {
+                std::cout << "Could not open buffer " << uri.string << " of model " << path << std::endl;
+                return false;
+            }
+            GltfBuffer buffer = { mappings.back()->bytes(), mappings.back()->length() };
+            buffers.push_back(buffer);
+        }
+
+        mesh = Mesh();
+        mesh.Stride = ModelStride;
+        bool hasNormals = true;
+        std::vector<float> positions, texcoords, normals;
+        std::vector<uint32_t> indices;
+        const Json& meshes = gltf["meshes"];
+        for (size_t m = 0; m < meshes.size(); m++)
+        {
+            const Json& primitives = meshes[m]["primitives"];
+            for (size_t p = 0; p < primitives.size(); p++)
+            {
+                const Json& primitive = primitives[p];
+                const Json& attributes = primitive["attributes"];
+                if (primitive["mode"].asInt(4) != 4 || !attributes.has("POSITION"))
+                    continue;
+                size_t vertexCount = 0, count = 0;
+                if (!readAccessor(gltf, buffers, attributes["POSITION"].asInt(), 3, positions, vertexCount))
+                {
+                    std::cout << "Model " << path << " has an unreadable POSITION accessor" << std::endl;
+                    return false;
+                }
+                bool uvs = attributes.has("TEXCOORD_0") && readAccessor(gltf, buffers, attributes["TEXCOORD_0"].asInt(), 2, texcoords, count) && count == vertexCount;
+                bool primitiveNormals = attributes.has("NORMAL") && readAccessor(gltf, buffers, attributes["NORMAL"].asInt(), 3, normals, count) && count == vertexCount;
+                hasNormals = hasNormals && primitiveNormals;
+
+                size_t base = mesh.vertexCount();
+                for (size_t v = 0; v < vertexCount; v++)
+                {
+                    // glTF puts the uv origin top left, our textures are flipped on load so it goes bottom left
+                    float data[ModelStride] = { positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2],
+                        uvs ? texcoords[v * 2] : 0.0f, uvs ? 1.0f - texcoords[v * 2 + 1] : 0.0f,
+                        primitiveNormals ? normals[v * 3] : 0.0f, primitiveNormals ? normals[v * 3 + 1] : 0.0f, primitiveNormals ? normals[v * 3 + 2] : 0.0f };
+                    mesh.Vertices.insert(mesh.Vertices.end(), data, data + ModelStride);
+                }
+                if (primitive.has("indices"))
+                {
+                    if (!readIndexAccessor(gltf, buffers, primitive["indices"].asInt(), indices, count))
+                    {
+                        std::cout << "Model " << path << " has an unreadable index accessor" << std::endl;
+                        return false;
+                    }
+                    for (size_t i = 0; i + 2 < count; i += 3)
+                    {
+                        if (indices[i] >= vertexCount || indices[i + 1] >= vertexCount || indices[i + 2] >= vertexCount)
+                            continue;
+                        for (int k = 0; k < 3; k++)
+                            mesh.Indices.push_back((unsigned int)(base + indices[i + k]));
+                    }
+                }
+                else
+                {
+                    // every three vertices are a triangle, a trailing partial one is dropped like in the indexed path
+                    for (size_t i = 0; i + 2 < vertexCount; i += 3)
+                        for (int k = 0; k < 3; k++)
+                            mesh.Indices.push_back((unsigned int)(base + i + k));
+                }
+            }
+        }
+        if (mesh.Indices.empty())
+        {
+            std::cout << "Model " << path << " has no triangle meshes" << std::endl;
+            return false;
+        }
+        if (!hasNormals)
+            generateNormals(mesh);
+        return true;
+    }
+
+    ///////////////////////////////////// Binary cache /////////////////////////////////////////////////
+    const uint32_t MeshCacheMagic = 0x4853454D; // "MESH"
+    const uint32_t MeshCacheVersion = 2;
+    const size_t MeshCacheMaxAttributes = 8;
+    const size_t MeshCacheMaxLods = 8;
+    const uint64_t MeshCacheAlignment = 64;
+
+    struct MeshCacheHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        uint32_t attributeCount;
+        uint32_t vertexStride;
+        uint32_t attributes[MeshCacheMaxAttributes][3];  // location, format, source offset
+        float scale[3];
+        float offset[3];
+        uint64_t vertexCount;
+        uint64_t indexCount;
+        uint64_t vertexOffset;
+        uint64_t indexOffset;
+        uint32_t lodCount;                          // the LODs' index lists follow each other
+        uint32_t lodIndexCounts[MeshCacheMaxLods];
+        float lodErrors[MeshCacheMaxLods];
+    };
+
+    inline bool sourceStamp(const char* path, uint64_t& size, int64_t& time)
+    {
+        struct stat info;
+        if (stat(path, &info) != 0)
+            return false;
+        size = (uint64_t)info.st_size;
+        time = (int64_t)info.st_mtime;
+        return true;
+    }
+
+    inline void describeLayout(const VertexLayout& layout, MeshCacheHeader& header)
+    {
+        header.attributeCount = (uint32_t)layout.Attributes.size();
+        header.vertexStride = (uint32_t)layout.stride();
+        memset(header.attributes, 0, sizeof(header.attributes));
+        for (size_t i = 0; i < layout.Attributes.size() && i < MeshCacheMaxAttributes; i++)
+        {
+            header.attributes[i][0] = layout.Attributes[i].Location;
+            header.attributes[i][1] = (uint32_t)layout.Attributes[i].Format;
+            header.attributes[i][2] = (uint32_t)layout.Attributes[i].SourceOffset;
+        }
+    }
+
+    inline uint64_t alignCache(uint64_t value) { return (value + MeshCacheAlignment - 1) & ~(MeshCacheAlignment - 1); }
+}
+
+// Parses an OBJ or glTF file into a Mesh with ModelStride floats per vertex (position, uv, normal)
+inline bool loadModel(const char* path, Mesh& mesh)
+{
+    std::string name(path);
+    size_t dot = name.find_last_of('.');
+    std::string extension = dot == std::string::npos ? std::string() : name.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+    if (extension == "obj")
+        return MeshLoaderDetail::loadObj(path, mesh);
+    if (extension == "gltf" || extension == "glb")
+        return MeshLoaderDetail::loadGltf(path, mesh);
+    std::cout << "Unknown model format " << path << std::endl;
+    return false;
+}
+
+// Called with the encoded vertices and indices of a model, the pointers may be into the mapped cache and are only
+// valid for the duration of the call. indices holds every LOD's index list, as described by lods.
+typedef std::function<void(const void* vertices, size_t vertexCount, const unsigned int* indices, size_t indexCount,
+    const VertexQuantization& quantization, const std::vector<LodRange>& lods)> EncodedMeshCallback;
+
+// Produces a model and its LOD chain in the layout's encoding through its binary cache, (re)building the cache when it
+// is missing or stale
+inline bool loadEncodedMesh(const char* path, const VertexLayout& layout, const EncodedMeshCallback& upload)
+{
+    using namespace MeshLoaderDetail;
+    MeshCacheHeader expected;
+    memset(&expected, 0, sizeof(expected));
+    if (!sourceStamp(path, expected.sourceSize, expected.sourceTime))
+    {
+        std::cout << "Could not open model " << path << std::endl;
+        return false;
+    }
+    describeLayout(layout, expected);
+    std::string cachePath = std::string(path) + ".meshcache";
+
+    // warm path: map the cache and upload straight from the mapping
+    {
+        MappedFile cache;
+        if (cache.open(cachePath.c_str()) && cache.length() >= sizeof(MeshCacheHeader))
+        {
+            const MeshCacheHeader* header = (const MeshCacheHeader*)cache.bytes();
+            bool current = header->magic == MeshCacheMagic && header->version == MeshCacheVersion &&
+                header->sourceSize == expected.sourceSize && header->sourceTime == expected.sourceTime &&
+                header->attributeCount == expected.attributeCount && header->vertexStride == expected.vertexStride &&
+                memcmp(header->attributes, expected.attributes, sizeof(expected.attributes)) == 0 &&
+                header->vertexOffset + header->vertexCount * header->vertexStride <= cache.length() &&
+                header->indexOffset + header->indexCount * sizeof(unsigned int) <= cache.length() &&
+                header->lodCount >= 1 && header->lodCount <= MeshCacheMaxLods;
+            if (current)
+            {
+                VertexQuantization quantization;
+                quantization.Scale = glm::vec3(header->scale[0], header->scale[1], header->scale[2]);
+                quantization.Offset = glm::vec3(header->offset[0], header->offset[1], header->offset[2]);
+                std::vector<LodRange> lods(header->lodCount);
+                GLuint first = 0;
+                for (size_t i = 0; i < lods.size(); i++)
+                {
+                    LodRange lod = { first, header->lodIndexCounts[i], header->lodErrors[i] };
+                    lods[i] = lod;
+                    first += lod.IndexCount;
+                }
+                if (first == header->indexCount)
+                {
+                    upload(cache.bytes() + header->vertexOffset, (size_t)header->vertexCount,
+                        (const unsigned int*)(cache.bytes() + header->indexOffset), (size_t)header->indexCount, quantization, lods);
+                    return true;
+                }
+            }
+        }
+    }
+
+    // cold path: parse, optimize, simplify, encode, then write the cache for next time
+    Mesh mesh;
+    if (!loadModel(path, mesh))
+        return false;
+    MeshOptimizer::optimizeMesh(mesh, path);
+    std::vector<MeshLod> chain = Simplifier::buildLodChain(mesh, (int)MeshCacheMaxLods);
+    std::vector<unsigned int> indices;
+    std::vector<LodRange> lods;
+    for (size_t i = 0; i < chain.size(); i++)
+    {
+        LodRange lod = { (GLuint)indices.size(), (GLuint)chain[i].Indices.size(), chain[i].Error };
+        lods.push_back(lod);
+        indices.insert(indices.end(), chain[i].Indices.begin(), chain[i].Indices.end());
+    }
+    VertexQuantization quantization;
+    std::vector<unsigned char> vertices = layout.encode(mesh, quantization);
+
+    MeshCacheHeader header = expected;
+    header.magic = MeshCacheMagic;
+    header.version = MeshCacheVersion;
+    for (int k = 0; k < 3; k++)
+    {
+        header.scale[k] = quantization.Scale[k];
+        header.offset[k] = quantization.Offset[k];
+    }
+    header.vertexCount = mesh.vertexCount();
+    header.indexCount = indices.size();
+    header.lodCount = (uint32_t)lods.size();
+    for (size_t i = 0; i < lods.size(); i++)
+    {
+        header.lodIndexCounts[i] = lods[i].IndexCount;
+        header.lodErrors[i] = lods[i].Error;
+    }
+    header.vertexOffset = alignCache(sizeof(MeshCacheHeader));
+    header.indexOffset = alignCache(header.vertexOffset + vertices.size());
+
+    std::ofstream out(cachePath.c_str(), std::ios::binary | std::ios::trunc);
+    if (out)
+    {
+        static const char zeros[MeshCacheAlignment] = {};
+        out.write((const char*)&header, sizeof(header));
+        out.write(zeros, (std::streamsize)(header.vertexOffset - sizeof(header)));
+        out.write((const char*)vertices.data(), (std::streamsize)vertices.size());
+        out.write(zeros, (std::streamsize)(header.indexOffset - header.vertexOffset - vertices.size()));
+        out.write((const char*)indices.data(), (std::streamsize)(indices.size() * sizeof(unsigned int)));
+    }
+    if (!out)
+        std::cout << "Could not write mesh cache " << cachePath << std::endl;
+
+    upload(vertices.data(), mesh.vertexCount(), indices.data(), indices.size(), quantization, lods);
+    return true;
+}
+
+// Loads a model's full detail LOD into its own VAO and buffers
+inline bool loadGpuMesh(const char* path, const VertexLayout& layout, GpuMesh& gpu)
+{
+    return loadEncodedMesh(path, layout, [&](const void* vertices, size_t vertexCount, const unsigned int* indices, size_t,
+        const VertexQuantization& quantization, const std::vector<LodRange>& lods)
+    {
+        gpu = uploadEncodedMesh(vertices, vertexCount * layout.stride(), indices, lods[0].IndexCount, layout, quantization);
+    });
+}
+
+// Loads a model and its LODs into the shared scene buffers
+inline bool loadGpuMesh(const char* path, GeometryBuffer& geometry, MeshRange& range)
+{
+    return loadEncodedMesh(path, geometry.layout(), [&](const void* vertices, size_t vertexCount, const unsigned int* indices, size_t indexCount,
+        const VertexQuantization& quantization, const std::vector<LodRange>& lods)
+    {
+        range = geometry.addEncoded(vertices, vertexCount, indices, indexCount, quantization, lods);
+    });
+}
+
+// Same, and keeps the full detail triangles on the CPU in model space, for picking and collision
+inline bool loadGpuMesh(const char* path, GeometryBuffer& geometry, MeshRange& range, std::vector<glm::vec3>& positions,
+    std::vector<unsigned int>& triangleIndices)
+{
+    return loadEncodedMesh(path, geometry.layout(), [&](const void* vertices, size_t vertexCount, const unsigned int* indices, size_t indexCount,
+        const VertexQuantization& quantization, const std::vector<LodRange>& lods)
+    {
+        range = geometry.addEncoded(vertices, vertexCount, indices, indexCount, quantization, lods);
+        geometry.layout().decodePositions(vertices, vertexCount, quantization, positions);
+        triangleIndices.assign(indices + lods[0].FirstIndex, indices + lods[0].FirstIndex + lods[0].IndexCount);
+    });
+}
@@ -0,0 +1,340 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include "Mesh.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Mesh processing for the GPU's vertex pipeline /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Four stages, run in this order by optimizeMesh():
+//   1. buildIndexedMesh     - merges identical vertices of a triangle soup into an index buffer
+//   2. optimizeVertexCache  - Tipsify (Sander et al. 2007), reorders triangles so the post-transform cache gets reused
+//   3. optimizeOverdraw     - splits the Tipsify order into clusters and draws outward facing clusters first
+//   4. optimizeVertexFetch  - renumbers vertices in first use order so vertex fetches walk memory linearly
+// ACMR (cache misses per triangle) and ATVR (cache misses per vertex, 1.0 is optimal) measure the result.
+
+const int VertexCacheSize = 16;
+
+struct VertexCacheStats
+{
+    float ACMR;
+    float ATVR;
+};
+
+namespace MeshOptimizer
+{
+    ///////////////////////////////////// Analysis ////////////////////////////////////////////////////
+    // Simulates a FIFO post-transform cache of the given size
+    inline VertexCacheStats analyzeVertexCache(const std::vector<unsigned int>& indices, size_t vertexCount, int cacheSize = VertexCacheSize)
+    {
+        std::vector<unsigned int> cachedAt(vertexCount, 0);
+        unsigned int time = (unsigned int)cacheSize + 1;
+        size_t misses = 0;
+        for (size_t i = 0; i < indices.size(); i++)
+        {
+            unsigned int v = indices[i];
+            if (time - cachedAt[v] > (unsigned int)cacheSize)
+            {
+                cachedAt[v] = time++;
+                misses++;
+            }
+        }
+        VertexCacheStats stats;
+        stats.ACMR = indices.empty() ? 0.0f : (float)misses / (float)(indices.size() / 3);
+        stats.ATVR = vertexCount == 0 ? 0.0f : (float)misses / (float)vertexCount;
+        return stats;
+    }
+
+    ///////////////////////////////////// 1. Indexing ////////////////////////////////////////////////
+    // Turns a triangle soup (every three vertices one triangle) into an indexed mesh. Vertices are compared bitwise.
+    inline Mesh buildIndexedMesh(const float* vertices, size_t vertexCount, int stride)
+    {
+        struct VertexHash
+        {
+            const float* data;
+            int stride;
+            size_t operator()(unsigned int index) const
+            {
+                // FNV-1a over the vertex bytes
+                const unsigned char* bytes = (const unsigned char*)(data + (size_t)index * stride);
+                size_t hash = 2166136261u;
+                for (size_t i = 0; i < stride * sizeof(float); i++)
+                    hash = (hash ^ bytes[i]) * 16777619u;
+                return hash;
+            }
+        };
+        struct VertexEqual
+        {
+            const float* data;
+            int stride;
+            bool operator()(unsigned int a, unsigned int b) const
+            {
+                return memcmp(data + (size_t)a * stride, data + (size_t)b * stride, stride * sizeof(float)) == 0;
+            }
+        };
+
+        Mesh mesh;
+        mesh.Stride = stride;
+        mesh.Indices.resize(vertexCount);
+        VertexHash hasher = { vertices, stride };
+        VertexEqual equal = { vertices, stride };
+        std::unordered_map<unsigned int, unsigned int, VertexHash, VertexEqual> unique(vertexCount, hasher, equal);
+        for (size_t i = 0; i < vertexCount; i++)
+        {
+            std::pair<std::unordered_map<unsigned int, unsigned int, VertexHash, VertexEqual>::iterator, bool> result =
+                unique.insert(std::make_pair((unsigned int)i, (unsigned int)mesh.vertexCount()));
+            if (result.second)
+                mesh.Vertices.insert(mesh.Vertices.end(), vertices + i * stride, vertices + (i + 1) * stride);
+            mesh.Indices[i] = result.first->second;
+        }
+        return mesh;
+    }
+
+    ///////////////////////////////////// 2. Vertex cache /////////////////////////////////////////////
+    // Tipsify. Optionally returns the first triangle of every "hard" cluster, the points where the fanning had to jump
+    // to an unrelated part of the mesh, which is what the overdraw pass splits on.
+    inline void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount, int cacheSize = VertexCacheSize,
+        std::vector<size_t>* clusters = NULL)
+    {
+        size_t triangleCount = indices.size() / 3;
+        if (triangleCount == 0)
+            return;
+
+        // vertex -> triangle adjacency, stored as offsets into one array
+        std::vector<unsigned int> liveTriangles(vertexCount, 0);
+        for (size_t i = 0; i < indices.size(); i++)
+            liveTriangles[indices[i]]++;
+        std::vector<unsigned int> adjacencyOffset(vertexCount + 1, 0);
+        for (size_t v = 0; v < vertexCount; v++)
+            adjacencyOffset[v + 1] = adjacencyOffset[v] + liveTriangles[v];
+        std::vector<unsigned int> adjacency(indices.size());
+        std::vector<unsigned int> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+        for (size_t t = 0; t < triangleCount; t++)
+            for (int k = 0; k < 3; k++)
+                adjacency[fill[indices[t * 3 + k]]++] = (unsigned int)t;
+
+        std::vector<unsigned int> cachedAt(vertexCount, 0);
+        std::vector<char> emitted(triangleCount, 0);
+        std::vector<unsigned int> deadEnds;
+        std::vector<unsigned int> candidates;
+        std::vector<unsigned int> result;
+        result.reserve(indices.size());
+        unsigned int time = (unsigned int)cacheSize + 1;
+        size_t cursor = 0;
+        int fanning = (int)indices[0];
+        if (clusters)
+            clusters->assign(1, 0);
+
+        while (fanning >= 0)
+        {
+            candidates.clear();
+            for (unsigned int a = adjacencyOffset[fanning]; a < adjacencyOffset[fanning + 1]; a++)
+            {
+                unsigned int t = adjacency[a];
+                if (emitted[t])
+                    continue;
+                for (int k = 0; k < 3; k++)
+                {
+                    unsigned int v = indices[t * 3 + k];
+                    result.push_back(v);
+                    deadEnds.push_back(v);
+                    candidates.push_back(v);
+                    liveTriangles[v]--;
+                    if (time - cachedAt[v] > (unsigned int)cacheSize)
+                        cachedAt[v] = time++;
+                }
+                emitted[t] = 1;
+            }
+
+            // next fanning vertex: the candidate that stays in the cache while its remaining triangles are emitted,
+            // preferring the oldest one
+            int next = -1;
+            unsigned int bestPriority = 0;
+            for (size_t c = 0; c < candidates.size(); c++)
+            {
+                unsigned int v = candidates[c];
+                if (liveTriangles[v] == 0)
+                    continue;
+                unsigned int priority = 0;
+                if (time - cachedAt[v] + 2 * liveTriangles[v] <= (unsigned int)cacheSize)
+                    priority = time - cachedAt[v];
+                if (next < 0 || priority > bestPriority)
+                {
+                    bestPriority = priority;
+                    next = (int)v;
+                }
+            }
+
+            if (next < 0)
+            {
+                // dead end, go back through recently used vertices and then scan for anything left
+                while (!deadEnds.empty() && next < 0)
+                {
+                    unsigned int v = deadEnds.back();
+                    deadEnds.pop_back();
+                    if (liveTriangles[v] > 0)
+                        next = (int)v;
+                }
+                while (next < 0 && cursor < vertexCount)
+                {
+                    if (liveTriangles[cursor] > 0)
+                        next = (int)cursor;
+                    cursor++;
+                }
+                if (next >= 0 && clusters && result.size() / 3 < triangleCount)
+                    clusters->push_back(result.size() / 3);
+            }
+            fanning = next;
+        }
+        indices.swap(result);
+    }
+
+    ///////////////////////////////////// 3. Overdraw /////////////////////////////////////////////////
+    // Sander et al. 2007: splits the cache optimized order into clusters and sorts them so the clusters facing away
+    // from the mesh center (the ones most likely to occlude the rest) are drawn first. Clusters are cut wherever the
+    // running ACMR is within `threshold` of the whole mesh, so the cache efficiency only drops by that factor.
+    inline void optimizeOverdraw(std::vector<unsigned int>& indices, const Mesh& mesh, float threshold = 1.05f, int cacheSize = VertexCacheSize)
+    {
+        size_t triangleCount = indices.size() / 3;
+        if (triangleCount < 2)
+            return;
+        std::vector<size_t> hardClusters;
+        optimizeVertexCache(indices, mesh.vertexCount(), cacheSize, &hardClusters);
+        hardClusters.push_back(triangleCount);
+        float meshACMR = analyzeVertexCache(indices, mesh.vertexCount(), cacheSize).ACMR;
+
+        // soft boundaries inside every hard cluster
+        std::vector<size_t> clusters;
+        std::vector<unsigned int> cachedAt(mesh.vertexCount(), 0);
+        unsigned int time = (unsigned int)cacheSize + 1;
+        for (size_t h = 0; h + 1 < hardClusters.size(); h++)
+        {
+            size_t start = hardClusters[h];
+            clusters.push_back(start);
+            size_t misses = 0;
+            size_t clusterStart = start;
+            for (size_t t = start; t < hardClusters[h + 1]; t++)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    unsigned int v = indices[t * 3 + k];
+                    if (time - cachedAt[v] > (unsigned int)cacheSize)
+                    {
+                        cachedAt[v] = time++;
+                        misses++;
+                    }
+                }
+                size_t clusterTriangles = t + 1 - clusterStart;
+                if (t + 1 < hardClusters[h + 1] && (float)misses / clusterTriangles <= threshold * meshACMR)
+                {
+                    clusters.push_back(t + 1);
+                    clusterStart = t + 1;
+                    misses = 0;
+                    time += (unsigned int)cacheSize + 1; // new cluster starts with a cold cache
+                }
+            }
+        }
+        clusters.push_back(triangleCount);
+
+        // mesh centroid
+        double center[3] = { 0.0, 0.0, 0.0 };
+        for (size_t v = 0; v < mesh.vertexCount(); v++)
+            for (int k = 0; k < 3; k++)
+                center[k] += mesh.vertex(v)[k];
+        for (int k = 0; k < 3; k++)
+            center[k] /= (double)std::max<size_t>(mesh.vertexCount(), 1);
+
+        // sort key per cluster: area weighted centroid offset along the average normal
+        struct Cluster
+        {
+            size_t begin, end;
+            float sortKey;
+        };
+        std::vector<Cluster> sorted;
+        for (size_t c = 0; c + 1 < clusters.size(); c++)
+        {
+            double centroid[3] = { 0.0, 0.0, 0.0 };
+            double normal[3] = { 0.0, 0.0, 0.0 };
+            double area = 0.0;
+            for (size_t t = clusters[c]; t < clusters[c + 1]; t++)
+            {
+                const float* a = mesh.vertex(indices[t * 3 + 0]);
+                const float* b = mesh.vertex(indices[t * 3 + 1]);
+                const float* d = mesh.vertex(indices[t * 3 + 2]);
+                double e0[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+                double e1[3] = { d[0] - a[0], d[1] - a[1], d[2] - a[2] };
+                double n[3] = { e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0] };
+                double triangleArea = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                for (int k = 0; k < 3; k++)
+                {
+                    centroid[k] += (a[k] + b[k] + d[k]) / 3.0 * triangleArea;
+                    normal[k] += n[k];
+                }
+                area += triangleArea;
+            }
+            double length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+            float key = 0.0f;
+            if (area > 0.0 && length > 0.0)
+            {
+                for (int k = 0; k < 3; k++)
+                    key += (float)((centroid[k] / area - center[k]) * normal[k] / length);
+            }
+            Cluster cluster = { clusters[c], clusters[c + 1], key };
+            sorted.push_back(cluster);
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), [](const Cluster& a, const Cluster& b) { return a.sortKey > b.sortKey; });
+
+        std::vector<unsigned int> result;
+        result.reserve(indices.size());
+        for (size_t c = 0; c < sorted.size(); c++)
+            result.insert(result.end(), indices.begin() + sorted[c].begin * 3, indices.begin() + sorted[c].end * 3);
+        indices.swap(result);
+    }
+
+    ///////////////////////////////////// 4. Vertex fetch /////////////////////////////////////////////
+    // Renumbers vertices in the order the index buffer first touches them. Unreferenced vertices are dropped.
+    inline void optimizeVertexFetch(Mesh& mesh)
+    {
+        const unsigned int unused = ~0u;
+        std::vector<unsigned int> remap(mesh.vertexCount(), unused);
+        std::vector<float> vertices;
+        vertices.reserve(mesh.Vertices.size());
+        unsigned int next = 0;
+        for (size_t i = 0; i < mesh.Indices.size(); i++)
+        {
+            unsigned int& target = remap[mesh.Indices[i]];
+            if (target == unused)
+            {
+                target = next++;
+                const float* v = mesh.vertex(mesh.Indices[i]);
+                vertices.insert(vertices.end(), v, v + mesh.Stride);
+            }
+            mesh.Indices[i] = target;
+        }
+        mesh.Vertices.swap(vertices);
+    }
+
+    ///////////////////////////////////// Full pipeline //////////////////////////////////////////////
+    // Runs the cache, overdraw and fetch passes on an already indexed mesh and prints ACMR/ATVR before and after
+    inline void optimizeMesh(Mesh& mesh, const std::string& name, bool report = true)
+    {
+        VertexCacheStats before = analyzeVertexCache(mesh.Indices, mesh.vertexCount());
+        optimizeVertexCache(mesh.Indices, mesh.vertexCount());
+        optimizeOverdraw(mesh.Indices, mesh);
+        optimizeVertexFetch(mesh);
+        VertexCacheStats after = analyzeVertexCache(mesh.Indices, mesh.vertexCount());
+        if (report)
+        {
+            std::cout << std::fixed << std::setprecision(3) << "Optimized " << name << ": " << mesh.vertexCount() << " vertices, "
+                << mesh.triangleCount() << " triangles, ACMR " << before.ACMR << " -> " << after.ACMR
+                << ", ATVR " << before.ATVR << " -> " << after.ATVR << std::endl;
+        }
+    }
+}
@@ -0,0 +1,415 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <glm.hpp>
+#include "Mesh.h"
+#include "Geometry.h"
+#include "Simd.h"
+#include "JobPool.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Meshlets and cluster culling /////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A mesh is split into meshlets of at most 64 vertices and 124 triangles, grown greedily from neighbouring triangles so
+// each one is a compact patch of surface. Every meshlet keeps a bounding sphere and a cone around its triangles' normals.
+// Each frame MeshletCuller tests four meshlets at a time against the frustum (sphere against the six planes) and against the
+// camera (a meshlet whose whole cone faces away can't have a visible front face), then copies the indices of the
+// survivors back to back into one index stream that is drawn with a single call.
+//
+// Everything is in the mesh's own space: pass Frustum::fromMatrix(projection * view * model) and the camera position
+// brought into the mesh with inverse(model). Back facing clusters are only invisible for closed meshes with counter
+// clockwise front faces.
+
+struct Meshlet
+{
+    glm::vec3 Center;           // bounding sphere
+    float Radius;
+    glm::vec3 ConeAxis;         // average facing of the triangles
+    float ConeCutoff;           // sine of the widest angle between a triangle's normal and the axis, 1 never culls
+    unsigned int FirstIndex;    // into the reordered index buffer
+    unsigned int TriangleCount;
+    unsigned int VertexCount;
+};
+
+struct MeshletSet
+{
+    std::vector<Meshlet> Meshlets;
+    // the bounds again as arrays padded to a multiple of 4, the layout the culling kernel reads
+    std::vector<float> CenterX, CenterY, CenterZ, Radius, AxisX, AxisY, AxisZ, Cutoff;
+    size_t IndexCount;
+
+    MeshletSet() : IndexCount(0) {}
+};
+
+namespace MeshletBuilder
+{
+    const size_t MaxVertices = 64;
+    const size_t MaxTriangles = 124;
+
+    // Sphere and normal cone of the triangles indices[0..triangleCount * 3)
+    inline void computeBounds(const Mesh& mesh, const unsigned int* indices, size_t triangleCount, const std::vector<unsigned int>& vertices, Meshlet& meshlet)
+    {
+        std::vector<float> positions(vertices.size() * 3);
+        for (size_t i = 0; i < vertices.size(); i++)
+            memcpy(&positions[i * 3], mesh.vertex(vertices[i]), 3 * sizeof(float));
+        boundingSphere(positions.data(), vertices.size(), 3, meshlet.Center, meshlet.Radius);
+
+        std::vector<glm::vec3> normals;
+        normals.reserve(triangleCount);
+        glm::vec3 sum(0.0f);
+        for (size_t t = 0; t < triangleCount; t++)
+        {
+            const float* a = mesh.vertex(indices[t * 3 + 0]);
+            const float* b = mesh.vertex(indices[t * 3 + 1]);
+            const float* c = mesh.vertex(indices[t * 3 + 2]);
+            glm::vec3 n = glm::cross(glm::vec3(b[0] - a[0], b[1] - a[1], b[2] - a[2]), glm::vec3(c[0] - a[0], c[1] - a[1], c[2] - a[2]));
+            float area = glm::length(n);
+            if (area <= 0.0f)
+                continue;
+            normals.push_back(n / area);
+            sum += normals.back();
+        }
+        meshlet.ConeAxis = glm::vec3(0.0f, 1.0f, 0.0f);
+        meshlet.ConeCutoff = 1.0f;
+        float length = glm::length(sum);
+        if (normals.empty() || length < 1.0e-6f)
+            return;
+        meshlet.ConeAxis = sum / length;
+        float minDot = 1.0f;
+        for (size_t i = 0; i < normals.size(); i++)
+            minDot = std::min(minDot, glm::dot(normals[i], meshlet.ConeAxis));
+        // past about 84 degrees the cone almost never points away from the camera, leave it uncullable
+        if (minDot > 0.1f)
+            meshlet.ConeCutoff = std::sqrt(1.0f - minDot * minDot);
+    }
+
+    // Splits mesh into meshlets, reordering mesh.Indices so that every meshlet's triangles are contiguous
+    inline MeshletSet build(Mesh& mesh, size_t maxVertices = MaxVertices, size_t maxTriangles = MaxTriangles)
+    {
+        MeshletSet set;
+        const std::vector<unsigned int>& indices = mesh.Indices;
+        size_t triangleCount = indices.size() / 3;
+        size_t vertexCount = mesh.vertexCount();
+        maxVertices = std::max<size_t>(maxVertices, 3);
+        maxTriangles = std::max<size_t>(maxTriangles, 1);
+
+        // triangles around each vertex, and how many of them are still waiting for a meshlet
+        std::vector<unsigned int> adjacencyOffsets(vertexCount + 1, 0);
+        for (size_t i = 0; i < triangleCount * 3; i++)
+            adjacencyOffsets[indices[i] + 1]++;
+        for (size_t v = 0; v < vertexCount; v++)
+            adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+        std::vector<unsigned int> live(vertexCount);
+        for (size_t v = 0; v < vertexCount; v++)
+            live[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+        std::vector<unsigned int> adjacency(triangleCount * 3);
+        {
+            std::vector<unsigned int> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+            for (size_t i = 0; i < triangleCount * 3; i++)
+                adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+        }
+
+        auto triangleCenter = [&](size_t t)
+        {
+            const float* a = mesh.vertex(indices[t * 3]);
+            const float* b = mesh.vertex(indices[t * 3 + 1]);
+            const float* c = mesh.vertex(indices[t * 3 + 2]);
+            return glm::vec3(a[0] + b[0] + c[0], a[1] + b[1] + c[1], a[2] + b[2] + c[2]) * (1.0f / 3.0f);
+        };
+        std::vector<unsigned char> emitted(triangleCount, 0);
+        // meshlet a vertex was last added to, so membership is a compare instead of a set
+        std::vector<unsigned int> owner(vertexCount, ~0u);
+        std::vector<unsigned int> reordered;
+        reordered.reserve(indices.size());
+        std::vector<unsigned int> meshletVertices;
+        size_t seed = 0;
+        for (;;)
+        {
+            while (seed < triangleCount && emitted[seed])
+                seed++;
+            if (seed == triangleCount)
+                break;
+
+            unsigned int id = (unsigned int)set.Meshlets.size();
+            Meshlet meshlet;
+            meshlet.FirstIndex = (unsigned int)reordered.size();
+            meshlet.TriangleCount = 0;
+            meshletVertices.clear();
+            // vertices triangle t would add to the meshlet
+            auto newVertices = [&](size_t t)
+            {
+                unsigned int a = indices[t * 3], b = indices[t * 3 + 1], c = indices[t * 3 + 2];
+                return (owner[a] != id ? 1u : 0u) + (owner[b] != id && b != a ? 1u : 0u) + (owner[c] != id && c != a && c != b ? 1u : 0u);
+            };
+
+            size_t current = seed;
+            glm::vec3 centroid(0.0f);
+            for (;;)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    unsigned int v = indices[current * 3 + k];
+                    if (owner[v] != id)
+                    {
+                        owner[v] = id;
+                        meshletVertices.push_back(v);
+                    }
+                    live[v]--;
+                    reordered.push_back(v);
+                }
+                emitted[current] = 1;
+                centroid += triangleCenter(current);
+                meshlet.TriangleCount++;
+                if (meshlet.TriangleCount == maxTriangles)
+                    break;
+
+                // next, the neighbour that adds the fewest vertices, then the one closest to the meshlet's middle so it
+                // grows as a round patch (tighter spheres and cones than a strip), then the one whose vertices have the
+                // fewest triangles left so no slivers are left behind
+                glm::vec3 middle = centroid / (float)meshlet.TriangleCount;
+                size_t best = triangleCount;
+                unsigned int bestNew = 4, bestLive = ~0u;
+                float bestDistance = FLT_MAX;
+                auto consider = [&](unsigned int v)
+                {
+                    for (unsigned int j = adjacencyOffsets[v]; j < adjacencyOffsets[v + 1]; j++)
+                    {
+                        unsigned int t = adjacency[j];
+                        if (emitted[t])
+                            continue;
+                        unsigned int added = newVertices(t);
+                        if (meshletVertices.size() + added > maxVertices)
+                            continue;
+                        // a triangle that is the last one left around one of its vertices goes first, else it ends up
+                        // stranded in a meshlet of its own
+                        unsigned int a = indices[t * 3], b = indices[t * 3 + 1], c = indices[t * 3 + 2];
+                        if (added > 0 && (live[a] == 1 || live[b] == 1 || live[c] == 1))
+                            added--;
+                        if (added > bestNew)
+                            continue;
+                        glm::vec3 d = triangleCenter(t) - middle;
+                        float distance = glm::dot(d, d);
+                        unsigned int remaining = live[indices[t * 3]] + live[indices[t * 3 + 1]] + live[indices[t * 3 + 2]];
+                        if (added < bestNew || distance < bestDistance || (distance == bestDistance && remaining < bestLive))
+                        {
+                            best = t;
+                            bestNew = added;
+                            bestDistance = distance;
+                            bestLive = remaining;
+                        }
+                    }
+                };
+                for (int k = 0; k < 3; k++)
+                    consider(indices[current * 3 + k]);
+                // the last triangle was closed in, look around the rest of the meshlet's border
+                if (best == triangleCount)
+                    for (size_t i = 0; i < meshletVertices.size(); i++)
+                        consider(meshletVertices[i]);
+                if (best == triangleCount)
+                    break;
+                current = best;
+            }
+
+            meshlet.VertexCount = (unsigned int)meshletVertices.size();
+            computeBounds(mesh, &reordered[meshlet.FirstIndex], meshlet.TriangleCount, meshletVertices, meshlet);
+            set.Meshlets.push_back(meshlet);
+        }
+        mesh.Indices.swap(reordered);
+        set.IndexCount = mesh.Indices.size();
+
+        size_t padded = (set.Meshlets.size() + 3) & ~(size_t)3;
+        std::vector<float>* columns[] = { &set.CenterX, &set.CenterY, &set.CenterZ, &set.Radius, &set.AxisX, &set.AxisY, &set.AxisZ, &set.Cutoff };
+        for (int c = 0; c < 8; c++)
+            columns[c]->assign(padded, 0.0f);
+        for (size_t i = 0; i < set.Meshlets.size(); i++)
+        {
+            const Meshlet& m = set.Meshlets[i];
+            set.CenterX[i] = m.Center.x;
+            set.CenterY[i] = m.Center.y;
+            set.CenterZ[i] = m.Center.z;
+            set.Radius[i] = m.Radius;
+            set.AxisX[i] = m.ConeAxis.x;
+            set.AxisY[i] = m.ConeAxis.y;
+            set.AxisZ[i] = m.ConeAxis.z;
+            set.Cutoff[i] = m.ConeCutoff;
+        }
+        return set;
+    }
+}
+
+struct MeshletCullStats
+{
+    size_t Meshlets;
+    size_t FrustumCulled;
+    size_t BackfaceCulled;
+    size_t Triangles;
+    size_t DrawnTriangles;
+};
+
+class MeshletCuller
+{
+public:
+    // meshlets one call to cull() hands to a thread at a time, and the least it splits across threads
+    static const size_t ChunkSize = 1024;
+    static const size_t MeshletsPerThread = 4096;
+
+    explicit MeshletCuller(unsigned int threads = 0)
+        : threadCount(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+    {
+        memset(&lastStats, 0, sizeof(lastStats));
+    }
+
+    // Writes the indices of every meshlet of set that passes the frustum and back face tests to out, which has room for
+    // set.IndexCount, and returns how many it wrote. indices is the mesh's index buffer as reordered by build().
+    size_t cull(const MeshletSet& set, const unsigned int* indices, const Frustum& frustum, const glm::vec3& cameraPosition, unsigned int* out)
+    {
+        size_t count = set.Meshlets.size();
+        size_t chunks = (count + ChunkSize - 1) / ChunkSize;
+        visible.resize(count);
+        chunkStats.assign(chunks, Counts());
+        chunkOffsets.resize(chunks + 1);
+
+        forEachChunk(chunks, count, [&](size_t chunk)
+        {
+            size_t begin = chunk * ChunkSize;
+            size_t end = std::min(begin + ChunkSize, count);
+            classify(set, frustum, cameraPosition, begin, end, chunkStats[chunk]);
+            size_t indexCount = 0;
+            for (size_t i = begin; i < end; i++)
+                if (visible[i])
+                    indexCount += set.Meshlets[i].TriangleCount * 3;
+            chunkStats[chunk].indices = indexCount;
+        });
+        chunkOffsets[0] = 0;
+        for (size_t c = 0; c < chunks; c++)
+            chunkOffsets[c + 1] = chunkOffsets[c] + chunkStats[c].indices;
+
+        // copy runs of neighbouring visible meshlets, which are neighbours in the index buffer too
+        forEachChunk(chunks, count, [&](size_t chunk)
+        {
+            size_t begin = chunk * ChunkSize;
+            size_t end = std::min(begin + ChunkSize, count);
+            unsigned int* target = out + chunkOffsets[chunk];
+            size_t i = begin;
+            while (i < end)
+            {
+                if (!visible[i])
+                {
+                    i++;
+                    continue;
+                }
+                size_t first = set.Meshlets[i].FirstIndex;
+                size_t length = 0;
+                while (i < end && visible[i])
+                    length += set.Meshlets[i++].TriangleCount * 3;
+                memcpy(target, indices + first, length * sizeof(unsigned int));
+                target += length;
+            }
+        });
+
+        lastStats.Meshlets = count;
+        lastStats.FrustumCulled = 0;
+        lastStats.BackfaceCulled = 0;
+        for (size_t c = 0; c < chunks; c++)
+        {
+            lastStats.FrustumCulled += chunkStats[c].frustumCulled;
+            lastStats.BackfaceCulled += chunkStats[c].backfaceCulled;
+        }
+        lastStats.Triangles = set.IndexCount / 3;
+        lastStats.DrawnTriangles = chunkOffsets[chunks] / 3;
+        return chunkOffsets[chunks];
+    }
+
+    const MeshletCullStats& stats() const { return lastStats; }
+
+private:
+    struct Counts
+    {
+        size_t frustumCulled;
+        size_t backfaceCulled;
+        size_t indices;
+        Counts() : frustumCulled(0), backfaceCulled(0), indices(0) {}
+    };
+
+    unsigned int threadCount;
+    std::vector<unsigned char> visible;
+    std::vector<Counts> chunkStats;
+    std::vector<size_t> chunkOffsets;
+    MeshletCullStats lastStats;
+
+    // Runs work(chunk) for every chunk, spread over the pool's threads once there are enough meshlets to be worth it
+    template <typename Work>
+    void forEachChunk(size_t chunks, size_t meshlets, const Work& work)
+    {
+        JobPool::shared().forEach(chunks, std::min<size_t>(threadCount, meshlets / MeshletsPerThread), work);
+    }
+
+    // Sets visible[begin..end), four meshlets per step
+    void classify(const MeshletSet& set, const Frustum& frustum, const glm::vec3& camera, size_t begin, size_t end, Counts& counts)
+    {
+#ifdef SIMD_SSE2
+        __m128 planes[Frustum::PLANE_COUNT][4];
+        for (int p = 0; p < Frustum::PLANE_COUNT; p++)
+        {
+            planes[p][0] = _mm_set1_ps(frustum.Planes[p].x);
+            planes[p][1] = _mm_set1_ps(frustum.Planes[p].y);
+            planes[p][2] = _mm_set1_ps(frustum.Planes[p].z);
+            planes[p][3] = _mm_set1_ps(frustum.Planes[p].w);
+        }
+        const __m128 cameraX = _mm_set1_ps(camera.x);
+        const __m128 cameraY = _mm_set1_ps(camera.y);
+        const __m128 cameraZ = _mm_set1_ps(camera.z);
+        const __m128 zero = _mm_setzero_ps();
+        // begin is a multiple of the chunk size so every step reads a whole padded group of four
+        for (size_t i = begin; i < end; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(&set.CenterX[i]);
+            __m128 y = _mm_loadu_ps(&set.CenterY[i]);
+            __m128 z = _mm_loadu_ps(&set.CenterZ[i]);
+            __m128 r = _mm_loadu_ps(&set.Radius[i]);
+            __m128 negativeR = _mm_sub_ps(zero, r);
+            __m128 inside = _mm_cmpeq_ps(zero, zero);
+            for (int p = 0; p < Frustum::PLANE_COUNT; p++)
+            {
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], x), _mm_mul_ps(planes[p][1], y)),
+                    _mm_add_ps(_mm_mul_ps(planes[p][2], z), planes[p][3]));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negativeR));
+            }
+            __m128 vx = _mm_sub_ps(x, cameraX);
+            __m128 vy = _mm_sub_ps(y, cameraY);
+            __m128 vz = _mm_sub_ps(z, cameraZ);
+            __m128 along = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_loadu_ps(&set.AxisX[i])), _mm_mul_ps(vy, _mm_loadu_ps(&set.AxisY[i]))),
+                _mm_mul_ps(vz, _mm_loadu_ps(&set.AxisZ[i])));
+            __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+            __m128 backfacing = _mm_cmpge_ps(along, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&set.Cutoff[i]), distance), r));
+            int insideMask = _mm_movemask_ps(inside);
+            int backMask = _mm_movemask_ps(backfacing);
+            size_t lanes = std::min<size_t>(4, end - i);
+            for (size_t lane = 0; lane < lanes; lane++)
+            {
+                bool in = ((insideMask >> lane) & 1) != 0;
+                bool back = ((backMask >> lane) & 1) != 0;
+                visible[i + lane] = in && !back;
+                counts.frustumCulled += in ? 0 : 1;
+                counts.backfaceCulled += in && back ? 1 : 0;
+            }
+        }
+#else
+        for (size_t i = begin; i < end; i++)
+        {
+            glm::vec3 center(set.CenterX[i], set.CenterY[i], set.CenterZ[i]);
+            float r = set.Radius[i];
+            bool in = frustum.intersectsSphere(center, r);
+            glm::vec3 v = center - camera;
+            bool back = glm::dot(v, glm::vec3(set.AxisX[i], set.AxisY[i], set.AxisZ[i])) >= set.Cutoff[i] * glm::length(v) + r;
+            visible[i] = in && !back;
+            counts.frustumCulled += in ? 0 : 1;
+            counts.backfaceCulled += in && back ? 1 : 0;
+        }
+#endif
+    }
+};
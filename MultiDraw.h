@@ -0,0 +1,248 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <glad/glad.h>
+#include <glm.hpp>
+#include "GeometryBuffer.h"
+#include "GpuMemory.h"
+#include "FrameAllocator.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Indirect draw lists over a GeometryBuffer ////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Draws are grouped into buckets, one bucket per shader/texture state, and every bucket is submitted with a single
+// glMultiDrawElementsIndirect per GeometryBuffer arena it touches (almost always one). shader.vs (with `indirect` set) finds the mesh's
+// dequantization in draws[drawOffset + gl_DrawID] and the instance transform in instances[gl_BaseInstance + gl_InstanceID].
+// Lists that stay the same for many frames are uploaded once into the batch's own buffers. Lists drawn every frame are
+// written into that frame's region of a FrameAllocator instead, through the mapping and with no GL calls.
+
+const GLuint DrawDataBinding = 1;
+
+// Layout fixed by GL for glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+    GLuint Count;
+    GLuint InstanceCount;
+    GLuint FirstIndex;
+    GLint BaseVertex;
+    GLuint BaseInstance;
+};
+
+// Matches the std430 Draw struct in shader.vs
+struct DrawData
+{
+    glm::mat4 Dequantize;
+};
+
+class MultiDrawBatch
+{
+public:
+    MultiDrawBatch() : commandCapacity(0), grouped(true), commandSource(0), commandOffset(0), dataSource(0), dataOffset(0), dataSize(0)
+    {
+        glGenBuffers(1, &indirectBuffer);
+        glGenBuffers(1, &drawDataBuffer);
+    }
+
+    ~MultiDrawBatch()
+    {
+        gpuDeleteBuffers(1, &indirectBuffer);
+        gpuDeleteBuffers(1, &drawDataBuffer);
+    }
+
+    // Returns the new bucket's index
+    int addBucket()
+    {
+        buckets.push_back(Bucket());
+        return (int)buckets.size() - 1;
+    }
+
+    // instanceCount instances of mesh, taking their transforms from instances[baseInstance...]
+    void add(int bucket, const MeshRange& mesh, GLuint instanceCount, GLuint baseInstance)
+    {
+        DrawElementsIndirectCommand command = { mesh.IndexCount, instanceCount, mesh.FirstIndex, mesh.BaseVertex, baseInstance };
+        DrawData data = { mesh.Quantization.matrix() };
+        buckets[bucket].commands.push_back(command);
+        buckets[bucket].data.push_back(data);
+        buckets[bucket].arenas.push_back(mesh.Arena);
+        grouped = false;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            buckets[i].commands.clear();
+            buckets[i].data.clear();
+            buckets[i].arenas.clear();
+            buckets[i].runs.clear();
+        }
+        grouped = false;
+    }
+
+    // Packs every bucket back to back into the batch's indirect and draw data buffers, call after changing the lists
+    void upload()
+    {
+        size_t total = pack();
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawDataBuffer);
+        if (total > commandCapacity)
+        {
+            commandCapacity = std::max(total, commandCapacity * 2);
+            gpuBufferData(indirectBuffer, GL_DRAW_INDIRECT_BUFFER, commandCapacity * sizeof(DrawElementsIndirectCommand), NULL, GL_DYNAMIC_DRAW, GPU_MEMORY_OTHER);
+            gpuBufferData(drawDataBuffer, GL_SHADER_STORAGE_BUFFER, commandCapacity * sizeof(DrawData), NULL, GL_DYNAMIC_DRAW, GPU_MEMORY_OTHER);
+        }
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            if (buckets[i].commands.empty())
+                continue;
+            glBufferSubData(GL_DRAW_INDIRECT_BUFFER, buckets[i].offset * sizeof(DrawElementsIndirectCommand),
+                buckets[i].commands.size() * sizeof(DrawElementsIndirectCommand), buckets[i].commands.data());
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, buckets[i].offset * sizeof(DrawData),
+                buckets[i].data.size() * sizeof(DrawData), buckets[i].data.data());
+        }
+        commandSource = indirectBuffer;
+        commandOffset = 0;
+        dataSource = drawDataBuffer;
+        dataOffset = 0;
+        dataSize = (GLsizeiptr)(commandCapacity * sizeof(DrawData));
+    }
+
+    // Packs every bucket into this frame's region of frameData instead. Call every frame the batch is drawn in, after
+    // frameData.beginFrame(); if the region is full nothing is drawn that frame.
+    void upload(FrameAllocator& frameData)
+    {
+        size_t total = pack();
+        dataSize = 0;
+        if (total == 0)
+            return;
+        FrameAllocation commands = frameData.allocate(total * sizeof(DrawElementsIndirectCommand), BUFFER_USAGE_INDIRECT);
+        FrameAllocation data = frameData.allocate(total * sizeof(DrawData), BUFFER_USAGE_STORAGE);
+        if (!commands.Data || !data.Data)
+            return;
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            if (buckets[i].commands.empty())
+                continue;
+            std::memcpy((DrawElementsIndirectCommand*)commands.Data + buckets[i].offset, buckets[i].commands.data(),
+                buckets[i].commands.size() * sizeof(DrawElementsIndirectCommand));
+            std::memcpy((DrawData*)data.Data + buckets[i].offset, buckets[i].data.data(), buckets[i].data.size() * sizeof(DrawData));
+        }
+        commandSource = frameData.ID;
+        commandOffset = commands.Offset;
+        dataSource = frameData.ID;
+        dataOffset = data.Offset;
+        dataSize = data.Size;
+    }
+
+    // One call per arena for the whole bucket, the shader has to be in use. Leaves the last arena's VAO bound.
+    template <typename ShaderType>
+    void draw(int bucket, ShaderType& shader, GeometryBuffer& geometry) const
+    {
+        const Bucket& b = buckets[bucket];
+        if (b.commands.empty() || dataSize == 0)
+            return;
+        shader.setBool("indirect", true);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, DrawDataBinding, dataSource, dataOffset, dataSize);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandSource);
+        for (size_t i = 0; i < b.runs.size(); i++)
+        {
+            const Run& run = b.runs[i];
+            size_t first = b.offset + run.first;
+            geometry.bind(run.arena);
+            shader.setInt("drawOffset", (int)first);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const void*)(commandOffset + first * sizeof(DrawElementsIndirectCommand)),
+                (GLsizei)run.count, 0);
+        }
+        shader.setBool("indirect", false);
+    }
+
+    size_t drawCount(int bucket) const { return buckets[bucket].commands.size(); }
+
+private:
+    // owns GL objects
+    MultiDrawBatch(const MultiDrawBatch&);
+    MultiDrawBatch& operator=(const MultiDrawBatch&);
+
+    // Commands of a bucket that draw from the same arena
+    struct Run
+    {
+        unsigned int arena;
+        size_t first;
+        size_t count;
+    };
+
+    struct Bucket
+    {
+        std::vector<DrawElementsIndirectCommand> commands;
+        std::vector<DrawData> data;
+        std::vector<unsigned int> arenas;
+        std::vector<Run> runs;
+        size_t offset = 0;
+    };
+
+    std::vector<Bucket> buckets;
+    unsigned int indirectBuffer;
+    unsigned int drawDataBuffer;
+    size_t commandCapacity;
+    // the lists haven't changed since they were last grouped by arena
+    bool grouped;
+    // where the last upload put the commands and the draw data, the batch's own buffers or a frame allocation
+    GLuint commandSource;
+    GLintptr commandOffset;
+    GLuint dataSource;
+    GLintptr dataOffset;
+    GLsizeiptr dataSize;
+
+    // Groups the buckets by arena if the lists changed and gives each its offset, returns the number of commands
+    size_t pack()
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            if (!grouped)
+                groupByArena(buckets[i]);
+            buckets[i].offset = total;
+            total += buckets[i].commands.size();
+        }
+        grouped = true;
+        return total;
+    }
+
+    // Sorts the bucket's commands by arena, keeping their order within an arena, and records the runs
+    static void groupByArena(Bucket& b)
+    {
+        b.runs.clear();
+        if (b.commands.empty())
+            return;
+        bool sorted = std::is_sorted(b.arenas.begin(), b.arenas.end());
+        if (!sorted)
+        {
+            std::vector<size_t> order(b.commands.size());
+            for (size_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            std::stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) { return b.arenas[x] < b.arenas[y]; });
+            std::vector<DrawElementsIndirectCommand> commands(order.size());
+            std::vector<DrawData> data(order.size());
+            std::vector<unsigned int> arenas(order.size());
+            for (size_t i = 0; i < order.size(); i++)
+            {
+                commands[i] = b.commands[order[i]];
+                data[i] = b.data[order[i]];
+                arenas[i] = b.arenas[order[i]];
+            }
+            b.commands.swap(commands);
+            b.data.swap(data);
+            b.arenas.swap(arenas);
+        }
+        for (size_t i = 0; i < b.arenas.size(); i++)
+        {
+            if (b.runs.empty() || b.runs.back().arena != b.arenas[i])
+            {
+                Run run = { b.arenas[i], i, 0 };
+                b.runs.push_back(run);
+            }
+            b.runs.back().count++;
+        }
+    }
+};
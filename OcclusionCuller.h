@@ -0,0 +1,405 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <iostream>
+#include <cmath>
+#include <cfloat>
+#include <glm.hpp>
+#include "Geometry.h"
+#include "Benchmark.h"
+#include "Simd.h"
+#include "JobPool.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Software occlusion culling ///////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A few large, simple occluders are rasterized on the CPU into a small depth buffer, and the boxes of objects are then
+// tested against it before anything is submitted to GL. An object whose box is behind the occluders at every pixel it
+// covers is hidden, whatever is inside the box.
+//
+// Occluder triangles are clipped against the near plane, back faces dropped, and binned into screen tiles. The tiles
+// don't share pixels, so each one is rasterized by whichever thread takes it, eight pixels at a time with AVX2 when the
+// CPU has it and four with SSE2 otherwise. Depth is NDC z mapped to [0, 1] and every pixel keeps the nearest occluder.
+// Afterwards every 8x8 block records its farthest pixel, so most boxes are decided from a handful of blocks without
+// looking at pixels. Occluders have to lie inside what they stand for (a box inside the object, terrain under the ground),
+// otherwise objects they should not hide disappear.
+
+struct OcclusionStats
+{
+    size_t OccluderTriangles;   // submitted this frame
+    size_t Rasterized;          // left after clipping, back face and off-screen rejection
+    size_t Tested;
+    size_t Occluded;
+    double SetupMilliseconds;   // transforming, clipping and binning
+    double RasterMilliseconds;  // the tiles, including the block depths
+};
+
+namespace OcclusionDetail
+{
+    // A screen space triangle ready to rasterize: edge functions that are >= 0 inside and depth as a plane, all in pixels
+    struct Triangle
+    {
+        float EdgeA[3], EdgeB[3], EdgeC[3];
+        float DepthA, DepthB, DepthC;
+        int MinX, MinY, MaxX, MaxY;
+    };
+
+    // A clip space vertex on either side of the near plane gives the point where the edge between them crosses it
+    inline glm::vec4 nearCrossing(const glm::vec4& a, const glm::vec4& b)
+    {
+        float da = a.z + a.w, db = b.z + b.w;
+        float t = da / (da - db);
+        return a + (b - a) * t;
+    }
+}
+
+class OcclusionCuller
+{
+public:
+    // the depth buffer, a fraction of the window whatever its size, split into tiles and 8x8 blocks
+    static const int Width = 256;
+    static const int Height = 192;
+    static const int TileWidth = 64;
+    static const int TileHeight = 32;
+    static const int BlockSize = 8;
+    static const int TilesX = Width / TileWidth;
+    static const int TilesY = Height / TileHeight;
+    static const int BlocksX = Width / BlockSize;
+    static const int BlocksY = Height / BlockSize;
+
+    explicit OcclusionCuller(unsigned int threads = 0)
+        : threadCount(threads ? threads : std::max(1u, std::thread::hardware_concurrency())), useAvx2(cpuHasAVX2()),
+        depth((size_t)Width * Height, 1.0f), blockDepth((size_t)BlocksX * BlocksY, 1.0f), bins(TilesX * TilesY), viewProjection(1.0f)
+    {
+        resetStats();
+    }
+
+    // Starts a frame seen through viewProjection, with no occluders yet
+    void beginFrame(const glm::mat4& viewProjection)
+    {
+        this->viewProjection = viewProjection;
+        triangles.clear();
+        for (size_t i = 0; i < bins.size(); i++)
+            bins[i].clear();
+        resetStats();
+    }
+
+    // Triangles of positions (counter-clockwise when seen from outside) placed with model
+    void addOccluder(const glm::mat4& model, const glm::vec3* positions, size_t vertexCount, const unsigned int* indices, size_t indexCount)
+    {
+        CpuTimer timer;
+        glm::mat4 transform = viewProjection * model;
+        clipVertices.resize(vertexCount);
+        for (size_t i = 0; i < vertexCount; i++)
+            clipVertices[i] = transform * glm::vec4(positions[i], 1.0f);
+        for (size_t i = 0; i + 2 < indexCount; i += 3)
+            addTriangle(clipVertices[indices[i]], clipVertices[indices[i + 1]], clipVertices[indices[i + 2]]);
+        frameStats.OccluderTriangles += indexCount / 3;
+        frameStats.SetupMilliseconds += timer.milliseconds();
+    }
+
+    // The box placed with model, a solid occluder as long as the box is inside the object
+    void addBox(const glm::mat4& model, const Aabb& box)
+    {
+        glm::vec3 corners[8];
+        for (int i = 0; i < 8; i++)
+            corners[i] = glm::vec3(i & 1 ? box.Max.x : box.Min.x, i & 2 ? box.Max.y : box.Min.y, i & 4 ? box.Max.z : box.Min.z);
+        // two triangles per face, counter-clockwise from outside
+        static const unsigned int faces[36] = {
+            0, 2, 1, 1, 2, 3,   4, 5, 6, 5, 7, 6,   0, 1, 4, 1, 5, 4,
+            2, 6, 3, 3, 6, 7,   0, 4, 2, 2, 4, 6,   1, 3, 5, 3, 7, 5
+        };
+        addOccluder(model, corners, 8, faces, 36);
+    }
+
+    // Rasterizes every occluder added since beginFrame() and builds the block depths, the tiles spread over threads
+    void rasterize()
+    {
+        CpuTimer timer;
+        forEachTile([&](int tile)
+        {
+            int tileX = (tile % TilesX) * TileWidth;
+            int tileY = (tile / TilesX) * TileHeight;
+            for (int y = tileY; y < tileY + TileHeight; y++)
+                std::fill(depth.begin() + (size_t)y * Width + tileX, depth.begin() + (size_t)y * Width + tileX + TileWidth, 1.0f);
+            const std::vector<unsigned int>& bin = bins[tile];
+            for (size_t i = 0; i < bin.size(); i++)
+            {
+#ifdef SIMD_SSE2
+                if (useAvx2)
+                    rasterizeAvx2(triangles[bin[i]], tileX, tileY);
+                else
+                    rasterizeSse2(triangles[bin[i]], tileX, tileY);
+#else
+                rasterizeScalar(triangles[bin[i]], tileX, tileY);
+#endif
+            }
+            updateBlocks(tileX, tileY);
+        });
+        frameStats.Rasterized = triangles.size();
+        frameStats.RasterMilliseconds = timer.milliseconds();
+    }
+
+    // False when the box is hidden behind the occluders everywhere on screen, or entirely off it
+    bool isVisible(const Aabb& box)
+    {
+        frameStats.Tested++;
+        float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, nearest = FLT_MAX;
+        for (int i = 0; i < 8; i++)
+        {
+            glm::vec4 corner = viewProjection * glm::vec4(i & 1 ? box.Max.x : box.Min.x, i & 2 ? box.Max.y : box.Min.y, i & 4 ? box.Max.z : box.Min.z, 1.0f);
+            // reaching through the near plane, nothing sensible to test
+            if (corner.z < -corner.w || corner.w <= 0.0f)
+                return true;
+            float x = (corner.x / corner.w * 0.5f + 0.5f) * Width;
+            float y = (corner.y / corner.w * 0.5f + 0.5f) * Height;
+            minX = std::min(minX, x);
+            maxX = std::max(maxX, x);
+            minY = std::min(minY, y);
+            maxY = std::max(maxY, y);
+            nearest = std::min(nearest, corner.z / corner.w * 0.5f + 0.5f);
+        }
+        // every pixel the box's screen rectangle touches
+        int x0 = std::max((int)std::floor(minX), 0), x1 = std::min((int)std::floor(maxX), Width - 1);
+        int y0 = std::max((int)std::floor(minY), 0), y1 = std::min((int)std::floor(maxY), Height - 1);
+        if (x0 > x1 || y0 > y1)
+        {
+            frameStats.Occluded++;
+            return false;
+        }
+        for (int by = y0 / BlockSize; by <= y1 / BlockSize; by++)
+        {
+            for (int bx = x0 / BlockSize; bx <= x1 / BlockSize; bx++)
+            {
+                if (nearest > blockDepth[(size_t)by * BlocksX + bx])
+                    continue;
+                // the block has something farther than the box somewhere, look at the pixels the box covers
+                int px0 = std::max(x0, bx * BlockSize), px1 = std::min(x1, bx * BlockSize + BlockSize - 1);
+                int py0 = std::max(y0, by * BlockSize), py1 = std::min(y1, by * BlockSize + BlockSize - 1);
+                for (int y = py0; y <= py1; y++)
+                    for (int x = px0; x <= px1; x++)
+                        if (nearest <= depth[(size_t)y * Width + x])
+                            return true;
+            }
+        }
+        frameStats.Occluded++;
+        return false;
+    }
+
+    // Row major from the bottom left, 1 where no occluder was drawn
+    const float* depthBuffer() const { return depth.data(); }
+    const OcclusionStats& stats() const { return frameStats; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << frameStats.OccluderTriangles << " occluder triangles, " << frameStats.Rasterized << " rasterized at "
+            << Width << "x" << Height << (useAvx2 ? " with AVX2" : " with SSE2") << " in " << frameStats.SetupMilliseconds << " + "
+            << frameStats.RasterMilliseconds << " ms, " << frameStats.Occluded << " of " << frameStats.Tested << " boxes hidden" << std::endl;
+    }
+
+private:
+    unsigned int threadCount;
+    bool useAvx2;
+    std::vector<float> depth;
+    // the farthest depth in each 8x8 block
+    std::vector<float> blockDepth;
+    std::vector<OcclusionDetail::Triangle> triangles;
+    // triangles overlapping each tile
+    std::vector<std::vector<unsigned int>> bins;
+    std::vector<glm::vec4> clipVertices;
+    glm::mat4 viewProjection;
+    OcclusionStats frameStats;
+
+    void resetStats()
+    {
+        OcclusionStats empty = {};
+        frameStats = empty;
+    }
+
+    // Clips against the near plane, then sets up and bins the one or two triangles that leaves
+    void addTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c)
+    {
+        // all three outside the same side plane
+        if ((a.x > a.w && b.x > b.w && c.x > c.w) || (a.x < -a.w && b.x < -b.w && c.x < -c.w) ||
+            (a.y > a.w && b.y > b.w && c.y > c.w) || (a.y < -a.w && b.y < -b.w && c.y < -c.w))
+            return;
+        const glm::vec4* in[3] = { &a, &b, &c };
+        glm::vec4 polygon[4];
+        int count = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            const glm::vec4& p = *in[i];
+            const glm::vec4& q = *in[(i + 1) % 3];
+            bool pInside = p.z >= -p.w, qInside = q.z >= -q.w;
+            if (pInside)
+                polygon[count++] = p;
+            if (pInside != qInside)
+                polygon[count++] = OcclusionDetail::nearCrossing(p, q);
+        }
+        if (count < 3)
+            return;
+        setup(polygon[0], polygon[1], polygon[2]);
+        if (count == 4)
+            setup(polygon[0], polygon[2], polygon[3]);
+    }
+
+    void setup(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c)
+    {
+        const glm::vec4* vertices[3] = { &a, &b, &c };
+        float x[3], y[3], z[3];
+        for (int i = 0; i < 3; i++)
+        {
+            const glm::vec4& v = *vertices[i];
+            float w = std::max(v.w, 1e-6f);
+            x[i] = (v.x / w * 0.5f + 0.5f) * Width;
+            y[i] = (v.y / w * 0.5f + 0.5f) * Height;
+            z[i] = v.z / w * 0.5f + 0.5f;
+        }
+        // counter-clockwise on screen is a front face, anything else is dropped
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (!(area > 0.0f))
+            return;
+
+        // pixels whose centers are inside the triangle's bounds
+        OcclusionDetail::Triangle triangle;
+        triangle.MinX = std::max((int)std::ceil(std::min(x[0], std::min(x[1], x[2])) - 0.5f), 0);
+        triangle.MaxX = std::min((int)std::floor(std::max(x[0], std::max(x[1], x[2])) - 0.5f), Width - 1);
+        triangle.MinY = std::max((int)std::ceil(std::min(y[0], std::min(y[1], y[2])) - 0.5f), 0);
+        triangle.MaxY = std::min((int)std::floor(std::max(y[0], std::max(y[1], y[2])) - 0.5f), Height - 1);
+        if (triangle.MinX > triangle.MaxX || triangle.MinY > triangle.MaxY)
+            return;
+        for (int i = 0; i < 3; i++)
+        {
+            int j = (i + 1) % 3;
+            triangle.EdgeA[i] = y[i] - y[j];
+            triangle.EdgeB[i] = x[j] - x[i];
+            triangle.EdgeC[i] = -(triangle.EdgeA[i] * x[i] + triangle.EdgeB[i] * y[i]);
+        }
+        triangle.DepthA = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+        triangle.DepthB = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+        triangle.DepthC = z[0] - triangle.DepthA * x[0] - triangle.DepthB * y[0];
+
+        unsigned int index = (unsigned int)triangles.size();
+        triangles.push_back(triangle);
+        for (int ty = triangle.MinY / TileHeight; ty <= triangle.MaxY / TileHeight; ty++)
+            for (int tx = triangle.MinX / TileWidth; tx <= triangle.MaxX / TileWidth; tx++)
+                bins[ty * TilesX + tx].push_back(index);
+    }
+
+    // The rows and columns of the triangle inside the tile
+    static void clampToTile(const OcclusionDetail::Triangle& t, int tileX, int tileY, int& x0, int& x1, int& y0, int& y1)
+    {
+        x0 = std::max(t.MinX, tileX);
+        x1 = std::min(t.MaxX, tileX + TileWidth - 1);
+        y0 = std::max(t.MinY, tileY);
+        y1 = std::min(t.MaxY, tileY + TileHeight - 1);
+    }
+
+    void rasterizeScalar(const OcclusionDetail::Triangle& t, int tileX, int tileY)
+    {
+        int x0, x1, y0, y1;
+        clampToTile(t, tileX, tileY, x0, x1, y0, y1);
+        for (int y = y0; y <= y1; y++)
+        {
+            float py = y + 0.5f;
+            float* row = depth.data() + (size_t)y * Width;
+            for (int x = x0; x <= x1; x++)
+            {
+                float px = x + 0.5f;
+                if (t.EdgeA[0] * px + t.EdgeB[0] * py + t.EdgeC[0] >= 0.0f && t.EdgeA[1] * px + t.EdgeB[1] * py + t.EdgeC[1] >= 0.0f &&
+                    t.EdgeA[2] * px + t.EdgeB[2] * py + t.EdgeC[2] >= 0.0f)
+                    row[x] = std::min(row[x], t.DepthA * px + t.DepthB * py + t.DepthC);
+            }
+        }
+    }
+
+#ifdef SIMD_SSE2
+    // Four pixels at a time from a multiple of four, the tiles are too so every group stays inside the tile
+    void rasterizeSse2(const OcclusionDetail::Triangle& t, int tileX, int tileY)
+    {
+        int x0, x1, y0, y1;
+        clampToTile(t, tileX, tileY, x0, x1, y0, y1);
+        x0 &= ~3;
+        const __m128 lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        __m128 a0 = _mm_set1_ps(t.EdgeA[0]), a1 = _mm_set1_ps(t.EdgeA[1]), a2 = _mm_set1_ps(t.EdgeA[2]), da = _mm_set1_ps(t.DepthA);
+        for (int y = y0; y <= y1; y++)
+        {
+            float py = y + 0.5f;
+            __m128 r0 = _mm_set1_ps(t.EdgeB[0] * py + t.EdgeC[0]);
+            __m128 r1 = _mm_set1_ps(t.EdgeB[1] * py + t.EdgeC[1]);
+            __m128 r2 = _mm_set1_ps(t.EdgeB[2] * py + t.EdgeC[2]);
+            __m128 rz = _mm_set1_ps(t.DepthB * py + t.DepthC);
+            float* row = depth.data() + (size_t)y * Width;
+            for (int x = x0; x <= x1; x += 4)
+            {
+                __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), r0), _mm_setzero_ps()),
+                    _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), r1), _mm_setzero_ps())), _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), r2), _mm_setzero_ps()));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+                __m128 current = _mm_loadu_ps(row + x);
+                __m128 nearer = _mm_min_ps(current, _mm_add_ps(_mm_mul_ps(da, px), rz));
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, current)));
+            }
+        }
+    }
+
+    // The same eight pixels at a time
+    SIMD_AVX2_TARGET void rasterizeAvx2(const OcclusionDetail::Triangle& t, int tileX, int tileY)
+    {
+        int x0, x1, y0, y1;
+        clampToTile(t, tileX, tileY, x0, x1, y0, y1);
+        x0 &= ~7;
+        const __m256 lanes = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+        __m256 a0 = _mm256_set1_ps(t.EdgeA[0]), a1 = _mm256_set1_ps(t.EdgeA[1]), a2 = _mm256_set1_ps(t.EdgeA[2]), da = _mm256_set1_ps(t.DepthA);
+        for (int y = y0; y <= y1; y++)
+        {
+            float py = y + 0.5f;
+            __m256 r0 = _mm256_set1_ps(t.EdgeB[0] * py + t.EdgeC[0]);
+            __m256 r1 = _mm256_set1_ps(t.EdgeB[1] * py + t.EdgeC[1]);
+            __m256 r2 = _mm256_set1_ps(t.EdgeB[2] * py + t.EdgeC[2]);
+            __m256 rz = _mm256_set1_ps(t.DepthB * py + t.DepthC);
+            float* row = depth.data() + (size_t)y * Width;
+            for (int x = x0; x <= x1; x += 8)
+            {
+                __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), lanes);
+                __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(_mm256_fmadd_ps(a0, px, r0), _mm256_setzero_ps(), _CMP_GE_OQ),
+                    _mm256_cmp_ps(_mm256_fmadd_ps(a1, px, r1), _mm256_setzero_ps(), _CMP_GE_OQ)),
+                    _mm256_cmp_ps(_mm256_fmadd_ps(a2, px, r2), _mm256_setzero_ps(), _CMP_GE_OQ));
+                if (_mm256_movemask_ps(inside) == 0)
+                    continue;
+                __m256 current = _mm256_loadu_ps(row + x);
+                __m256 nearer = _mm256_min_ps(current, _mm256_fmadd_ps(da, px, rz));
+                _mm256_storeu_ps(row + x, _mm256_blendv_ps(current, nearer, inside));
+            }
+        }
+    }
+#endif
+
+    // The farthest pixel of every block in the tile
+    void updateBlocks(int tileX, int tileY)
+    {
+        for (int by = tileY / BlockSize; by < (tileY + TileHeight) / BlockSize; by++)
+        {
+            for (int bx = tileX / BlockSize; bx < (tileX + TileWidth) / BlockSize; bx++)
+            {
+                float farthest = 0.0f;
+                for (int y = by * BlockSize; y < (by + 1) * BlockSize; y++)
+                {
+                    const float* row = depth.data() + (size_t)y * Width + bx * BlockSize;
+                    for (int x = 0; x < BlockSize; x++)
+                        farthest = std::max(farthest, row[x]);
+                }
+                blockDepth[(size_t)by * BlocksX + bx] = farthest;
+            }
+        }
+    }
+
+    // Runs work(tile) for every tile on the pool's threads
+    template <typename Work>
+    void forEachTile(const Work& work)
+    {
+        JobPool::shared().forEach(TilesX * TilesY, threadCount, [&work](size_t tile) { work((int)tile); });
+    }
+};
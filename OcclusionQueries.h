@@ -0,0 +1,174 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm.hpp>
+#include "Geometry.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Hardware occlusion queries ///////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The GPU alternative to OcclusionCuller. Every candidate gets a GL_ANY_SAMPLES_PASSED_CONSERVATIVE query, and the
+// answer decides next frame's draw:
+//  - an object drawn plainly is its own query: the draw itself is wrapped in it, so it is tested against the depth of
+//    what was drawn before it and never against its own faces;
+//  - an object skipped as hidden isn't in the depth buffer, so after the scene its bounding box is drawn with color and
+//    depth writes off inside the query, to notice when it comes back into view;
+//  - a result that has come back is read without waiting and remembered, a hidden object is then not drawn at all;
+//  - a query still in flight is left to the GPU, the object is drawn inside glBeginConditionalRender with
+//    GL_QUERY_NO_WAIT, which skips it if it turned out hidden and draws it if the answer isn't there yet.
+// Neither path ever waits on the GPU. An object that wasn't a candidate last frame, or whose box the camera is in, counts
+// as visible until a query says otherwise, so nothing pops in a frame late when it comes into view. Candidates are best
+// drawn front to back, an object only hides the ones drawn after it.
+
+struct OcclusionQueryStats
+{
+    size_t Candidates;      // objects offered this frame
+    size_t Drawn;           // known visible, drawn plainly
+    size_t Conditional;     // drawn under conditional render because the query was still in flight
+    size_t Skipped;         // known hidden, no draw submitted
+    size_t Queries;         // draws and boxes issued inside a query this frame
+};
+
+class OcclusionQueries
+{
+public:
+    OcclusionQueries() : frame(0)
+    {
+        frameStats = OcclusionQueryStats();
+    }
+
+    ~OcclusionQueries()
+    {
+        if (!queries.empty())
+            glDeleteQueries((GLsizei)queries.size(), queries.data());
+    }
+
+    // One query per object, objects are the indices below count
+    void resize(size_t count)
+    {
+        size_t old = queries.size();
+        if (count <= old)
+            return;
+        queries.resize(count);
+        glGenQueries((GLsizei)(count - old), queries.data() + old);
+        pending.resize(count, 0);
+        visible.resize(count, 1);
+        lastCandidate.resize(count, 0);
+    }
+
+    // Picks up the answers that have arrived since last frame, without waiting for the rest
+    void beginFrame()
+    {
+        frame++;
+        frameStats = OcclusionQueryStats();
+        for (size_t i = 0; i < queries.size(); i++)
+        {
+            if (!pending[i])
+                continue;
+            GLuint available = 0;
+            glGetQueryObjectuiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                continue;
+            GLuint passed = 0;
+            glGetQueryObjectuiv(queries[i], GL_QUERY_RESULT, &passed);
+            visible[i] = passed ? 1 : 0;
+            pending[i] = 0;
+        }
+    }
+
+    // Draws the object with draw(object) unless it is known to be hidden, under conditional rendering if its query is
+    // still in flight and inside a new query otherwise
+    template <typename Draw>
+    void drawObject(unsigned int object, const Draw& draw)
+    {
+        frameStats.Candidates++;
+        // out of view last frame, whatever it answered before is stale. The next query on the same object replaces a
+        // result still in flight.
+        if (lastCandidate[object] + 1 != frame)
+        {
+            visible[object] = 1;
+            pending[object] = 0;
+        }
+        lastCandidate[object] = frame;
+
+        if (pending[object])
+        {
+            glBeginConditionalRender(queries[object], GL_QUERY_NO_WAIT);
+            draw(object);
+            glEndConditionalRender();
+            frameStats.Conditional++;
+        }
+        else if (visible[object])
+        {
+            glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, queries[object]);
+            draw(object);
+            glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+            pending[object] = 1;
+            frameStats.Drawn++;
+            frameStats.Queries++;
+        }
+        else
+            frameStats.Skipped++;
+    }
+
+    // Issues a box query for every object drawObject() skipped as hidden this frame, drawBox(box) has to draw the world
+    // space box with whatever shader is in use. Call after everything that can hide them is in the depth buffer. An
+    // object whose box, grown by nearPlane, holds the camera is visible without a query since its front faces would be
+    // clipped away.
+    template <typename Bounds, typename DrawBox>
+    void issueQueries(const unsigned int* objects, size_t count, const Bounds& bounds, const glm::vec3& cameraPosition, float nearPlane,
+        const DrawBox& drawBox)
+    {
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glDepthMask(GL_FALSE);
+        GLboolean culling = glIsEnabled(GL_CULL_FACE);
+        glDisable(GL_CULL_FACE);
+        for (size_t i = 0; i < count; i++)
+        {
+            unsigned int object = objects[i];
+            if (pending[object] || visible[object])
+                continue;
+            Aabb box = bounds(object);
+            Aabb grown(box.Min - glm::vec3(nearPlane), box.Max + glm::vec3(nearPlane));
+            if (grown.contains(cameraPosition))
+            {
+                visible[object] = 1;
+                continue;
+            }
+            glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, queries[object]);
+            drawBox(box);
+            glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+            pending[object] = 1;
+            frameStats.Queries++;
+        }
+        if (culling)
+            glEnable(GL_CULL_FACE);
+        glDepthMask(GL_TRUE);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    }
+
+    const OcclusionQueryStats& stats() const { return frameStats; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << frameStats.Candidates << " candidates: " << frameStats.Drawn << " drawn, " << frameStats.Conditional
+            << " conditional, " << frameStats.Skipped << " draws skipped, " << frameStats.Queries << " queries issued" << std::endl;
+    }
+
+private:
+    // owns GL objects
+    OcclusionQueries(const OcclusionQueries&);
+    OcclusionQueries& operator=(const OcclusionQueries&);
+
+    std::vector<GLuint> queries;
+    // a query was issued and its result hasn't been read
+    std::vector<unsigned char> pending;
+    // the last answer read back
+    std::vector<unsigned char> visible;
+    // the frame each object was last offered in
+    std::vector<unsigned int> lastCandidate;
+    unsigned int frame;
+    OcclusionQueryStats frameStats;
+};
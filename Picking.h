@@ -0,0 +1,221 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <glm.hpp>
+#include "Geometry.h"
+#include "Bvh.h"
+#include "Simd.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Ray picking //////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Two levels of Bvh: the scene's tree over object boxes in world space, and a TriangleBvh per mesh in model space that
+// many objects can share. pick() walks the scene tree and, for every object box the ray enters before the closest hit so
+// far, moves the ray into the object's model space and walks the mesh's tree. The direction isn't renormalized there, so
+// distances come back in world units and stay comparable across objects.
+//
+// TriangleBvh keeps its triangles in the tree's leaf order as a vertex and two edges, one array per component. A leaf's
+// triangles are then consecutive and the four of a leaf are tested at once with SSE (Moller-Trumbore, both sides).
+
+struct PickHit
+{
+    unsigned int Object;
+    unsigned int Triangle;
+    float Distance;
+    glm::vec3 Position;
+};
+
+class TriangleBvh
+{
+public:
+    explicit TriangleBvh(unsigned int threads = 0) : tree(threads), padded(0) {}
+
+    // Triangles of indices into positions, the positions in the space the rays will be given in
+    void build(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& indices)
+    {
+        size_t count = indices.size() / 3;
+        std::vector<Aabb> boxes(count);
+        for (size_t t = 0; t < count; t++)
+        {
+            boxes[t].extend(positions[indices[t * 3 + 0]]);
+            boxes[t].extend(positions[indices[t * 3 + 1]]);
+            boxes[t].extend(positions[indices[t * 3 + 2]]);
+        }
+        tree.build(boxes);
+
+        // three spare lanes at the end so the last leaf can be loaded four wide
+        padded = count + 3;
+        components.assign(9 * padded, 0.0f);
+        positionOf.resize(count);
+        for (size_t p = 0; p < count; p++)
+        {
+            unsigned int t = tree.objectAt((unsigned int)p);
+            positionOf[t] = (unsigned int)p;
+            glm::vec3 a = positions[indices[t * 3 + 0]];
+            glm::vec3 e1 = positions[indices[t * 3 + 1]] - a;
+            glm::vec3 e2 = positions[indices[t * 3 + 2]] - a;
+            const float values[9] = { a.x, a.y, a.z, e1.x, e1.y, e1.z, e2.x, e2.y, e2.z };
+            for (int c = 0; c < 9; c++)
+                components[c * padded + p] = values[c];
+        }
+    }
+
+    size_t triangleCount() const { return tree.size(); }
+    const Bvh& bvh() const { return tree; }
+
+    // The corners of a triangle, as given to build()
+    void triangle(unsigned int t, glm::vec3& a, glm::vec3& b, glm::vec3& c) const
+    {
+        unsigned int p = positionOf[t];
+        a = glm::vec3(*component(0, p), *component(1, p), *component(2, p));
+        b = a + glm::vec3(*component(3, p), *component(4, p), *component(5, p));
+        c = a + glm::vec3(*component(6, p), *component(7, p), *component(8, p));
+    }
+
+    // The closest triangle the ray hits within maxDistance, distances are in units of direction's length
+    bool raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, unsigned int& triangle, float& distance) const
+    {
+        BvhHit hit;
+        if (!tree.raycastLeaves(origin, direction, maxDistance, [&](unsigned int first, unsigned int count, float closest, unsigned int& object)
+            {
+                float nearest = -1.0f;
+                for (unsigned int group = first; group < first + count; group += 4)
+                {
+                    unsigned int lane = 0;
+                    float d = intersectFour(group, std::min(4u, first + count - group), origin, direction, closest, lane);
+                    if (d >= 0.0f)
+                    {
+                        closest = nearest = d;
+                        object = tree.objectAt(group + lane);
+                    }
+                }
+                return nearest;
+            }, hit))
+            return false;
+        triangle = hit.Object;
+        distance = hit.Distance;
+        return true;
+    }
+
+private:
+    Bvh tree;
+    // v0.xyz, edge1.xyz, edge2.xyz, each padded floats long and in leaf order
+    std::vector<float> components;
+    size_t padded;
+    // where each triangle ended up in leaf order
+    std::vector<unsigned int> positionOf;
+
+    const float* component(int c, unsigned int position) const { return &components[c * padded + position]; }
+
+    // The closest of the count triangles from position first the ray hits before closest, and which lane it was in
+    float intersectFour(unsigned int first, unsigned int count, const glm::vec3& origin, const glm::vec3& direction, float closest,
+        unsigned int& lane) const
+    {
+#ifdef SIMD_SSE2
+        __m128 ax = _mm_loadu_ps(component(0, first)), ay = _mm_loadu_ps(component(1, first)), az = _mm_loadu_ps(component(2, first));
+        __m128 e1x = _mm_loadu_ps(component(3, first)), e1y = _mm_loadu_ps(component(4, first)), e1z = _mm_loadu_ps(component(5, first));
+        __m128 e2x = _mm_loadu_ps(component(6, first)), e2y = _mm_loadu_ps(component(7, first)), e2z = _mm_loadu_ps(component(8, first));
+        __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+
+        // p = d x e2, det = e1 . p
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 inverse = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+        // s = o - v0, u = s . p / det
+        __m128 sx = _mm_sub_ps(_mm_set1_ps(origin.x), ax), sy = _mm_sub_ps(_mm_set1_ps(origin.y), ay), sz = _mm_sub_ps(_mm_set1_ps(origin.z), az);
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverse);
+
+        // q = s x e1, v = d . q / det, t = e2 . q / det
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverse);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverse);
+
+        __m128 zero = _mm_setzero_ps();
+        __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+        __m128 hit = _mm_and_ps(_mm_cmpgt_ps(absDet, _mm_set1_ps(1e-20f)), _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, _mm_set1_ps(closest))));
+        int mask = _mm_movemask_ps(hit) & ((1 << count) - 1);
+        if (!mask)
+            return -1.0f;
+        float distances[4];
+        _mm_storeu_ps(distances, t);
+        float nearest = -1.0f;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if ((mask & (1 << i)) && (nearest < 0.0f || distances[i] < nearest))
+            {
+                nearest = distances[i];
+                lane = i;
+            }
+        }
+        return nearest;
+#else
+        float nearest = -1.0f;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            unsigned int p = first + i;
+            glm::vec3 a(*component(0, p), *component(1, p), *component(2, p));
+            glm::vec3 e1(*component(3, p), *component(4, p), *component(5, p));
+            glm::vec3 e2(*component(6, p), *component(7, p), *component(8, p));
+            glm::vec3 pv = glm::cross(direction, e2);
+            float det = glm::dot(e1, pv);
+            if (std::fabs(det) <= 1e-20f)
+                continue;
+            float inverse = 1.0f / det;
+            glm::vec3 s = origin - a;
+            float u = glm::dot(s, pv) * inverse;
+            glm::vec3 q = glm::cross(s, e1);
+            float v = glm::dot(direction, q) * inverse;
+            float t = glm::dot(e2, q) * inverse;
+            if (u < 0.0f || v < 0.0f || u + v > 1.0f || t < 0.0f || t >= closest)
+                continue;
+            closest = nearest = t;
+            lane = i;
+        }
+        return nearest;
+#endif
+    }
+};
+
+// The closest triangle of any object in objects along the ray. meshOf(object) returns the object's TriangleBvh, or NULL
+// to count its box as the hit, and transformOf(object) its model matrix.
+template <typename MeshOf, typename TransformOf>
+bool pick(const Bvh& objects, const Ray& ray, float maxDistance, const MeshOf& meshOf, const TransformOf& transformOf, PickHit& hit)
+{
+    BvhDetail::RayData boxRay = BvhDetail::makeRay(ray.Origin, ray.Direction);
+    unsigned int hitTriangle = 0xffffffffu;
+    BvhHit objectHit;
+    if (!objects.raycast(ray.Origin, ray.Direction, maxDistance, [&](unsigned int object, float closest)
+        {
+            const TriangleBvh* mesh = meshOf(object);
+            if (!mesh)
+            {
+                float distance;
+                if (!BvhDetail::intersectBox(boxRay, objects.bounds(object), closest, distance) || distance >= closest)
+                    return -1.0f;
+                hitTriangle = 0xffffffffu;
+                return distance;
+            }
+            glm::mat4 toModel = glm::inverse(transformOf(object));
+            glm::vec3 origin = glm::vec3(toModel * glm::vec4(ray.Origin, 1.0f));
+            glm::vec3 direction = glm::vec3(toModel * glm::vec4(ray.Direction, 0.0f));
+            unsigned int triangle;
+            float distance;
+            if (!mesh->raycast(origin, direction, closest, triangle, distance))
+                return -1.0f;
+            hitTriangle = triangle;
+            return distance;
+        }, objectHit))
+        return false;
+    hit.Object = objectHit.Object;
+    hit.Distance = objectHit.Distance;
+    hit.Position = ray.at(objectHit.Distance);
+    hit.Triangle = hitTriangle;
+    return true;
+}
@@ -0,0 +1,251 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <iostream>
+#include "Benchmark.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Sorted render queue //////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Draws are collected as packets during the frame, each with a 64 bit key built from the state it needs, then sorted
+// once and submitted in key order so that GL state only changes where the key does. Opaque keys put the depth after
+// pass, program, textures and vertex array, so within one state the nearest objects go first and the depth test rejects
+// what they hide. Transparent passes put the depth right after the pass and invert it, back to front, which blending
+// needs more than it needs fewer state changes.
+//
+//   opaque       pass:2 | program:6 | textures:10 | vertex array:8 | depth:16 | packet:22
+//   transparent  pass:2 | ~depth:16 | program:6 | textures:10 | vertex array:8 | packet:22
+//
+// The packet's index fills the low bits, so the sort moves nothing but the keys and packets with the same state and
+// depth keep the order they were added in. Depth is the top 16 bits of the float, 1/256 relative precision is plenty to
+// order draws by. The sort is an LSD radix sort on 11 bit digits over the 42 key bits: all four histograms come from one
+// pass over the keys and digits every key shares are skipped, so a frame with one pass and a few programs sorts in two
+// or three passes over the keys.
+// Ids that don't fit their field would sort with the wrong state, add() refuses those packets instead of folding them
+// onto another id: it asserts in debug builds and counts them as rejected otherwise.
+
+enum RenderPass
+{
+    RENDER_PASS_OPAQUE = 0,
+    // after everything opaque, nothing visible is drawn here, see OcclusionQueries
+    RENDER_PASS_OCCLUSION_QUERY = 1,
+    // passes from here on sort back to front
+    RENDER_PASS_TRANSPARENT = 2
+};
+
+// Which parts of the state changed before a packet, handed to the bind callback of RenderQueue::submit
+enum RenderStateChange
+{
+    RENDER_STATE_PASS = 1,
+    RENDER_STATE_PROGRAM = 2,
+    RENDER_STATE_TEXTURES = 4,
+    RENDER_STATE_VERTEX_ARRAY = 8
+};
+
+// Program, texture set and vertex array are small ids the caller hands out (below 64, 1024 and 255, see
+// RenderQueue::MaxProgram and the others), the queue only compares them. A packet whose draw binds its own vertex arrays uses RenderQueue::OwnVertexArray, the next packet then
+// always gets a bind.
+struct RenderPacket
+{
+    unsigned int Pass;
+    unsigned int Program;
+    unsigned int Textures;
+    unsigned int VertexArray;
+    // what to draw, for the caller's draw callback
+    unsigned int Command;
+    unsigned int Object;
+};
+
+struct RenderQueueStats
+{
+    size_t Packets;
+    // packets add() refused, out of room or with an id too large for its key field
+    size_t Rejected;
+    size_t ProgramChanges;
+    size_t TextureChanges;
+    size_t VertexArrayChanges;
+    double SortMilliseconds;
+};
+
+namespace RenderQueueDetail
+{
+    const int IndexBits = 22;
+    const int DigitBits = 11;
+    const int Digits = 4;
+    const uint64_t IndexMask = (1ull << IndexBits) - 1;
+    const int ProgramBits = 6;
+    const int TextureBits = 10;
+    const int VertexArrayBits = 8;
+}
+
+class RenderQueue
+{
+public:
+    static const unsigned int OwnVertexArray = (1u << RenderQueueDetail::VertexArrayBits) - 1;
+    // largest ids the key has room for
+    static const unsigned int MaxPass = 3;
+    static const unsigned int MaxProgram = (1u << RenderQueueDetail::ProgramBits) - 1;
+    static const unsigned int MaxTextures = (1u << RenderQueueDetail::TextureBits) - 1;
+    static const unsigned int MaxVertexArray = OwnVertexArray - 1;
+    // packets a frame can hold, the rest are rejected
+    static const size_t MaxPackets = (size_t)1 << RenderQueueDetail::IndexBits;
+
+    RenderQueue()
+    {
+        frameStats = RenderQueueStats();
+    }
+
+    void clear()
+    {
+        keys.clear();
+        packets.clear();
+        frameStats.Rejected = 0;
+    }
+
+    // depth is any distance that grows away from the camera, view space z or the distance to the object's center.
+    // Returns false when the packet was rejected, see MaxPackets and MaxProgram and the others
+    bool add(unsigned int pass, unsigned int program, unsigned int textures, unsigned int vertexArray, float depth,
+        unsigned int command, unsigned int object = 0)
+    {
+        bool fits = pass <= MaxPass && program <= MaxProgram && textures <= MaxTextures &&
+            (vertexArray <= MaxVertexArray || vertexArray == OwnVertexArray);
+        assert(fits && "render packet id too large for its key field");
+        if (!fits || packets.size() >= MaxPackets)
+        {
+            frameStats.Rejected++;
+            return false;
+        }
+        RenderPacket packet = { pass, program, textures, vertexArray, command, object };
+        keys.push_back(makeKey(pass, program, textures, vertexArray, depth) | packets.size());
+        packets.push_back(packet);
+        return true;
+    }
+
+    size_t size() const { return packets.size(); }
+
+    // Orders the packets by key, call once after the last add of the frame
+    void sort()
+    {
+        using namespace RenderQueueDetail;
+        CpuTimer timer;
+        size_t n = keys.size();
+        scratch.resize(n);
+
+        const size_t buckets = (size_t)1 << DigitBits;
+        counts.assign(Digits * buckets, 0);
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t key = keys[i] >> IndexBits;
+            for (int digit = 0; digit < Digits; digit++)
+                counts[digit * buckets + ((key >> (digit * DigitBits)) & (buckets - 1))]++;
+        }
+
+        uint64_t* from = keys.data();
+        uint64_t* to = scratch.data();
+        for (int digit = 0; digit < Digits; digit++)
+        {
+            uint32_t* count = &counts[digit * buckets];
+            int shift = IndexBits + digit * DigitBits;
+            // every key has the same digit here, the pass wouldn't move anything
+            if (n == 0 || count[(from[0] >> shift) & (buckets - 1)] == n)
+                continue;
+            uint32_t offset = 0;
+            for (size_t b = 0; b < buckets; b++)
+            {
+                uint32_t c = count[b];
+                count[b] = offset;
+                offset += c;
+            }
+            for (size_t i = 0; i < n; i++)
+            {
+                uint64_t key = from[i];
+                to[count[(key >> shift) & (buckets - 1)]++] = key;
+            }
+            std::swap(from, to);
+        }
+        if (from != keys.data())
+            keys.swap(scratch);
+        frameStats.Packets = n;
+        frameStats.SortMilliseconds = timer.milliseconds();
+    }
+
+    // Goes through the sorted packets, calling bind(packet, changes) with a mask of RenderStateChange whenever the pass,
+    // program, texture set or vertex array differs from the last packet's, then draw(packet)
+    template <typename Bind, typename Draw>
+    void submit(const Bind& bind, const Draw& draw)
+    {
+        frameStats.ProgramChanges = 0;
+        frameStats.TextureChanges = 0;
+        frameStats.VertexArrayChanges = 0;
+        const unsigned int none = 0xffffffffu;
+        unsigned int pass = none, program = none, textures = none, vertexArray = none;
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            const RenderPacket& packet = packets[keys[i] & RenderQueueDetail::IndexMask];
+            unsigned int changes = 0;
+            if (packet.Pass != pass)
+                changes |= RENDER_STATE_PASS;
+            if (packet.Program != program)
+            {
+                changes |= RENDER_STATE_PROGRAM;
+                frameStats.ProgramChanges++;
+            }
+            if (packet.Textures != textures)
+            {
+                changes |= RENDER_STATE_TEXTURES;
+                frameStats.TextureChanges++;
+            }
+            if (packet.VertexArray != vertexArray || packet.VertexArray == OwnVertexArray)
+            {
+                changes |= RENDER_STATE_VERTEX_ARRAY;
+                frameStats.VertexArrayChanges++;
+            }
+            if (changes)
+                bind(packet, changes);
+            draw(packet);
+            pass = packet.Pass;
+            program = packet.Program;
+            textures = packet.Textures;
+            vertexArray = packet.VertexArray;
+        }
+    }
+
+    const RenderQueueStats& stats() const { return frameStats; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << frameStats.Packets << " packets sorted in " << frameStats.SortMilliseconds << " ms, " << frameStats.ProgramChanges
+            << " program, " << frameStats.TextureChanges << " texture and " << frameStats.VertexArrayChanges << " vertex array changes" << std::endl;
+        if (frameStats.Rejected)
+            out << "  " << frameStats.Rejected << " packets rejected" << std::endl;
+    }
+
+    // The key without the packet index, the ids have to be in range (add() checks)
+    static uint64_t makeKey(unsigned int pass, unsigned int program, unsigned int textures, unsigned int vertexArray, float depth)
+    {
+        using namespace RenderQueueDetail;
+        // positive floats order like their bits, and so do the top 16 of the 31
+        uint32_t depthBits = 0;
+        if (depth > 0.0f)
+            memcpy(&depthBits, &depth, sizeof(depthBits));
+        uint64_t quantized = depthBits >> 15;
+        uint64_t state = ((uint64_t)program << (TextureBits + VertexArrayBits)) | ((uint64_t)textures << VertexArrayBits) | vertexArray;
+        uint64_t key = (uint64_t)pass << 40;
+        if (pass >= RENDER_PASS_TRANSPARENT)
+            key |= ((~quantized & 0xffff) << 24) | state;
+        else
+            key |= (state << 16) | quantized;
+        return key << IndexBits;
+    }
+
+private:
+    // packet keys, in key order after sort(), and the other half of the radix sort's ping-pong
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> scratch;
+    std::vector<uint32_t> counts;
+    std::vector<RenderPacket> packets;
+    RenderQueueStats frameStats;
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <iostream>
+#include <glm.hpp>
+#include <gtc/quaternion.hpp>
+#include "Simd.h"
+#include "JobPool.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Entities and the transform hierarchy ////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Every entity is an index into parallel component arrays (position, rotation, scale, parent, world matrix), one array per
+// component rather than one struct per entity. Entities are also listed by depth in the hierarchy, and update() walks
+// those levels from the roots down so a parent's world matrix is always final before its children read it. The entities
+// of one level don't depend on each other, large levels are split across threads.
+//
+// Setting a component marks the entity dirty. An entity is recomputed when it is dirty or its parent changed this update,
+// levels with nothing to do are skipped, so a scene that doesn't move costs nothing per frame.
+
+typedef unsigned int Entity;
+const Entity NoEntity = 0xffffffffu;
+
+class Scene
+{
+public:
+    // entities one thread takes at a time, and the least a level needs per thread before it is split
+    static const size_t ChunkSize = 2048;
+    static const size_t EntitiesPerThread = 8192;
+
+    explicit Scene(unsigned int threads = 0)
+        : threadCount(threads ? threads : std::max(1u, std::thread::hardware_concurrency())), generation(0), pending(0)
+    {
+    }
+
+    // A new entity below parent (NoEntity for a root), the parent has to exist already
+    Entity create(Entity parent = NoEntity, const glm::vec3& position = glm::vec3(0.0f), const glm::quat& rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f),
+        const glm::vec3& scale = glm::vec3(1.0f))
+    {
+        Entity entity = (Entity)positions.size();
+        unsigned int depth = parent == NoEntity ? 0 : depths[parent] + 1;
+        positions.push_back(position);
+        rotations.push_back(rotation);
+        scales.push_back(scale);
+        parents.push_back(parent);
+        depths.push_back(depth);
+        worlds.push_back(glm::mat4(1.0f));
+        dirty.push_back(0);
+        changedIn.push_back(0);
+        if (depth >= levels.size())
+        {
+            levels.resize(depth + 1);
+            levelDirty.resize(depth + 1, 0);
+        }
+        levels[depth].push_back(entity);
+        markDirty(entity);
+        return entity;
+    }
+
+    void setPosition(Entity entity, const glm::vec3& position) { positions[entity] = position; markDirty(entity); }
+    void setRotation(Entity entity, const glm::quat& rotation) { rotations[entity] = rotation; markDirty(entity); }
+    void setScale(Entity entity, const glm::vec3& scale) { scales[entity] = scale; markDirty(entity); }
+
+    const glm::vec3& position(Entity entity) const { return positions[entity]; }
+    const glm::quat& rotation(Entity entity) const { return rotations[entity]; }
+    const glm::vec3& scale(Entity entity) const { return scales[entity]; }
+    Entity parent(Entity entity) const { return parents[entity]; }
+    // As of the last update()
+    const glm::mat4& world(Entity entity) const { return worlds[entity]; }
+
+    size_t size() const { return positions.size(); }
+    size_t levelCount() const { return levels.size(); }
+
+    // Recomputes the world matrix of every dirty entity and everything below it, level by level
+    void update()
+    {
+        changedList.clear();
+        if (pending == 0)
+            return;
+        generation++;
+        bool parentsChanged = false;
+        for (size_t depth = 0; depth < levels.size(); depth++)
+        {
+            if (levelDirty[depth] == 0 && !parentsChanged)
+                continue;
+            const std::vector<Entity>& level = levels[depth];
+            size_t chunks = (level.size() + ChunkSize - 1) / ChunkSize;
+            chunkChanged.resize(chunks);
+            forEachChunk(chunks, level.size(), [&](size_t chunk)
+            {
+                size_t begin = chunk * ChunkSize;
+                size_t end = std::min(begin + ChunkSize, level.size());
+                std::vector<Entity>& changed = chunkChanged[chunk];
+                changed.clear();
+                for (size_t i = begin; i < end; i++)
+                {
+                    Entity entity = level[i];
+                    Entity p = parents[entity];
+                    if (!dirty[entity] && (p == NoEntity || changedIn[p] != generation))
+                        continue;
+                    glm::mat4 local = compose(positions[entity], rotations[entity], scales[entity]);
+                    if (p == NoEntity)
+                        worlds[entity] = local;
+                    else
+                        multiply(worlds[p], local, worlds[entity]);
+                    dirty[entity] = 0;
+                    changedIn[entity] = generation;
+                    changed.push_back(entity);
+                }
+            });
+            size_t before = changedList.size();
+            for (size_t c = 0; c < chunks; c++)
+                changedList.insert(changedList.end(), chunkChanged[c].begin(), chunkChanged[c].end());
+            parentsChanged = changedList.size() > before;
+            levelDirty[depth] = 0;
+        }
+        pending = 0;
+    }
+
+    // Entities whose world matrix the last update() changed, parents before their children
+    const std::vector<Entity>& changed() const { return changedList; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << size() << " entities in " << levels.size() << " levels, " << changedList.size()
+            << " world matrices updated last frame" << std::endl;
+    }
+
+    // Rotation + uniform or non-uniform scale + translation, as glm::translate * glm::mat4_cast * glm::scale would build it
+    static glm::mat4 compose(const glm::vec3& position, const glm::quat& q, const glm::vec3& scale)
+    {
+        float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+        float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+        float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+        glm::mat4 m;
+        m[0] = glm::vec4((1.0f - 2.0f * (yy + zz)) * scale.x, 2.0f * (xy + wz) * scale.x, 2.0f * (xz - wy) * scale.x, 0.0f);
+        m[1] = glm::vec4(2.0f * (xy - wz) * scale.y, (1.0f - 2.0f * (xx + zz)) * scale.y, 2.0f * (yz + wx) * scale.y, 0.0f);
+        m[2] = glm::vec4(2.0f * (xz + wy) * scale.z, 2.0f * (yz - wx) * scale.z, (1.0f - 2.0f * (xx + yy)) * scale.z, 0.0f);
+        m[3] = glm::vec4(position.x, position.y, position.z, 1.0f);
+        return m;
+    }
+
+    // out = a * b, one column of out per four broadcasts
+    static void multiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& out)
+    {
+#ifdef SIMD_SSE2
+        const float* pa = &a[0][0];
+        const float* pb = &b[0][0];
+        float* po = &out[0][0];
+        __m128 a0 = _mm_loadu_ps(pa), a1 = _mm_loadu_ps(pa + 4), a2 = _mm_loadu_ps(pa + 8), a3 = _mm_loadu_ps(pa + 12);
+        for (int c = 0; c < 4; c++)
+        {
+            __m128 column = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(pb[c * 4 + 0])), _mm_mul_ps(a1, _mm_set1_ps(pb[c * 4 + 1]))),
+                _mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(pb[c * 4 + 2])), _mm_mul_ps(a3, _mm_set1_ps(pb[c * 4 + 3]))));
+            _mm_storeu_ps(po + c * 4, column);
+        }
+#else
+        out = a * b;
+#endif
+    }
+
+private:
+    unsigned int threadCount;
+    // components, indexed by entity
+    std::vector<glm::vec3> positions;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::vec3> scales;
+    std::vector<Entity> parents;
+    std::vector<unsigned int> depths;
+    std::vector<glm::mat4> worlds;
+    std::vector<unsigned char> dirty;
+    // the update() an entity's world matrix last changed in, compared against generation so nothing needs clearing
+    std::vector<unsigned int> changedIn;
+    unsigned int generation;
+    // entities by depth, and how many of each level are dirty
+    std::vector<std::vector<Entity>> levels;
+    std::vector<size_t> levelDirty;
+    size_t pending;
+    std::vector<std::vector<Entity>> chunkChanged;
+    std::vector<Entity> changedList;
+
+    void markDirty(Entity entity)
+    {
+        if (dirty[entity])
+            return;
+        dirty[entity] = 1;
+        levelDirty[depths[entity]]++;
+        pending++;
+    }
+
+    // Runs work(chunk) for every chunk, spread over the pool's threads once there are enough entities to be worth it
+    template <typename Work>
+    void forEachChunk(size_t chunks, size_t entities, const Work& work)
+    {
+        JobPool::shared().forEach(chunks, std::min<size_t>(threadCount, entities / EntitiesPerThread), work);
+    }
+};
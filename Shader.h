@@ -50,41 +50,14 @@ public:
             std::cout << "Error occurred while attempting to read a Shader File:" << e.what() << std::endl;
         }
 
-        //Convert our ShaderCode Strings into cStrings.
-        const char* vShaderCode = vertexCode.c_str();
-        const char* fShaderCode = fragmentCode.c_str();
-        //Declare our Shaders
-        unsigned int vertex, fragment;
-        // create Vertex Shader
-        vertex = glCreateShader(GL_VERTEX_SHADER);
-        //Specify where Shader Code is located
-        glShaderSource(vertex, 1, &vShaderCode, NULL);
-        //Compile Shader Code
-        glCompileShader(vertex);
-        //Check for Errors
-        checkCompileErrors(vertex, "VERTEX");
-        // Create fragment Shader
-        fragment = glCreateShader(GL_FRAGMENT_SHADER);
-        //Specify where Shader Code is located
-        glShaderSource(fragment, 1, &fShaderCode, NULL);
-        //Compile Shader Code
-        glCompileShader(fragment);
-        //Check for Errors
-        checkCompileErrors(fragment, "FRAGMENT");
-        
-        //Create actual Program
-        ID = glCreateProgram();
-        //attach Vertex Shader
-        glAttachShader(ID, vertex);
-        //Attach Fragment Shader
-        glAttachShader(ID, fragment);
-        //Link Program
-        glLinkProgram(ID);
-        //Check for errors
-        checkCompileErrors(ID, "PROGRAM");
-        // Delete our Shader Proograms, now that they are already linked
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
+        compile(vertexCode.c_str(), (int)vertexCode.size(), fragmentCode.c_str(), (int)fragmentCode.size());
+    }
+
+    ///////////////////////// Constructor Function for sources already in memory /////////////////////
+    // The sources don't have to be null terminated, so they can point straight into a memory mapped asset pack
+    Shader(const char* vertexCode, int vertexLength, const char* fragmentCode, int fragmentLength)
+    {
+        compile(vertexCode, vertexLength, fragmentCode, fragmentLength);
     }
 
 
@@ -151,6 +124,43 @@ public:
         glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
     }
 private:
+    ///////////////////////////////////////// Compile and Link both Shaders //////////////////////////////////
+    void compile(const char* vertexCode, GLint vertexLength, const char* fragmentCode, GLint fragmentLength)
+    {
+        //Declare our Shaders
+        unsigned int vertex, fragment;
+        // create Vertex Shader
+        vertex = glCreateShader(GL_VERTEX_SHADER);
+        //Specify where Shader Code is located
+        glShaderSource(vertex, 1, &vertexCode, &vertexLength);
+        //Compile Shader Code
+        glCompileShader(vertex);
+        //Check for Errors
+        checkCompileErrors(vertex, "VERTEX");
+        // Create fragment Shader
+        fragment = glCreateShader(GL_FRAGMENT_SHADER);
+        //Specify where Shader Code is located
+        glShaderSource(fragment, 1, &fragmentCode, &fragmentLength);
+        //Compile Shader Code
+        glCompileShader(fragment);
+        //Check for Errors
+        checkCompileErrors(fragment, "FRAGMENT");
+        
+        //Create actual Program
+        ID = glCreateProgram();
+        //attach Vertex Shader
+        glAttachShader(ID, vertex);
+        //Attach Fragment Shader
+        glAttachShader(ID, fragment);
+        //Link Program
+        glLinkProgram(ID);
+        //Check for errors
+        checkCompileErrors(ID, "PROGRAM");
+        // Delete our Shader Proograms, now that they are already linked
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+    }
+
     ///////////////////////////////////////// Check for specific Errors ///////////////////////////////////////
     void checkCompileErrors(unsigned int shader, std::string type)
     {
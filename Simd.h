@@ -0,0 +1,76 @@
+#pragma once
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// SIMD helpers shared by the CPU side kernels //////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// SSE2 is part of every x64 target so it is used unconditionally. Anything newer (F16C, AVX2) is compiled into functions
+// marked with the matching SIMD_*_TARGET attribute and only called after the runtime check below says the CPU has it.
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef SIMD_SSE2
+#ifdef _MSC_VER
+// MSVC lets every intrinsic through regardless of /arch
+#define SIMD_F16C_TARGET
+#define SIMD_AVX2_TARGET
+
+inline bool simdOsSavesYmm()
+{
+    int info[4];
+    __cpuid(info, 1);
+    // AVX + OSXSAVE, and the OS has enabled the XMM and YMM state
+    if (((info[2] >> 27) & 1) == 0 || ((info[2] >> 28) & 1) == 0)
+        return false;
+    return (_xgetbv(0) & 6) == 6;
+}
+
+inline bool cpuHasF16C()
+{
+    static const bool supported = []()
+    {
+        int info[4];
+        __cpuid(info, 1);
+        return simdOsSavesYmm() && ((info[2] >> 29) & 1) != 0;
+    }();
+    return supported;
+}
+
+inline bool cpuHasAVX2()
+{
+    static const bool supported = []()
+    {
+        int info[4], features[4];
+        __cpuidex(info, 7, 0);
+        __cpuid(features, 1);
+        // the AVX2 kernels use FMA too, a separate feature bit
+        return simdOsSavesYmm() && ((info[1] >> 5) & 1) != 0 && ((features[2] >> 12) & 1) != 0;
+    }();
+    return supported;
+}
+#else
+#define SIMD_F16C_TARGET __attribute__((target("f16c")))
+#define SIMD_AVX2_TARGET __attribute__((target("avx2,fma")))
+
+inline bool cpuHasF16C()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("f16c");
+}
+
+inline bool cpuHasAVX2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+#else
+inline bool cpuHasF16C() { return false; }
+inline bool cpuHasAVX2() { return false; }
+#endif
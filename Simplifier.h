@@ -0,0 +1,475 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <glm.hpp>
+#include "Mesh.h"
+#include "MeshOptimizer.h"
+#include "JobPool.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Quadric error mesh simplification and LOD chains //////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Edge collapse simplification with quadric error metrics (Garland & Heckbert 1997). Every position accumulates the planes
+// of its triangles, and a collapse of one vertex onto a neighbour costs the squared distance of the neighbour's position
+// to those planes. Vertices are only ever collapsed onto existing vertices, so the vertex buffer is shared by every LOD.
+// Each vertex is classified once:
+//   manifold  interior, may collapse onto any neighbour
+//   border    on an open edge, only slides along the border (plus border planes in its quadric keep the outline)
+//   seam      one of two vertices at a position where the uvs or normals split, both sides collapse together along the seam
+//   locked    corners, seams that meet borders, positions with more than two attribute sets: never moves
+// Errors are distances in the mesh's own units. selectLod() turns them into pixels with the camera's field of view.
+
+struct MeshLod
+{
+    std::vector<unsigned int> Indices;
+    float Error;    // how far (in mesh units) this LOD's surface may be from the full detail one
+};
+
+namespace SimplifierDetail
+{
+    enum VertexKind
+    {
+        KindManifold,
+        KindBorder,
+        KindSeam,
+        KindLocked,
+        KindCount
+    };
+
+    // can a vertex of the row's kind collapse onto a vertex of the column's kind
+    const bool CanCollapse[KindCount][KindCount] =
+    {
+        { true, true, true, true },
+        { false, true, false, false },
+        { false, false, true, false },
+        { false, false, false, false },
+    };
+
+    // edges between these kinds show up in two triangles, so only one of them needs to be looked at
+    const bool HasOpposite[KindCount][KindCount] =
+    {
+        { true, true, true, true },
+        { true, false, true, false },
+        { true, true, true, true },
+        { true, false, true, false },
+    };
+
+    const unsigned int None = ~0u;
+    const float BorderWeight = 10.0f;
+
+    // Symmetric 4x4 matrix of the sum of w * (n.p + d)^2 over planes, and the total weight to turn sums into averages
+    struct Quadric
+    {
+        double a00, a11, a22, a01, a02, a12, b0, b1, b2, c, w;
+
+        Quadric() : a00(0), a11(0), a22(0), a01(0), a02(0), a12(0), b0(0), b1(0), b2(0), c(0), w(0) {}
+
+        Quadric(const glm::dvec3& n, double d, double weight)
+            : a00(weight * n.x * n.x), a11(weight * n.y * n.y), a22(weight * n.z * n.z),
+              a01(weight * n.x * n.y), a02(weight * n.x * n.z), a12(weight * n.y * n.z),
+              b0(weight * n.x * d), b1(weight * n.y * d), b2(weight * n.z * d), c(weight * d * d), w(weight) {}
+
+        void add(const Quadric& q)
+        {
+            a00 += q.a00; a11 += q.a11; a22 += q.a22; a01 += q.a01; a02 += q.a02; a12 += q.a12;
+            b0 += q.b0; b1 += q.b1; b2 += q.b2; c += q.c; w += q.w;
+        }
+
+        // mean squared distance to the planes
+        double error(const glm::dvec3& p) const
+        {
+            double rx = a00 * p.x + a01 * p.y + a02 * p.z + b0;
+            double ry = a01 * p.x + a11 * p.y + a12 * p.z + b1;
+            double rz = a02 * p.x + a12 * p.y + a22 * p.z + b2;
+            double e = p.x * rx + p.y * ry + p.z * rz + (b0 * p.x + b1 * p.y + b2 * p.z) + c;
+            return w > 0.0 ? std::max(e, 0.0) / w : 0.0;
+        }
+    };
+
+    struct Collapse
+    {
+        unsigned int v0, v1;    // v0 moves onto v1
+        bool bidirectional;
+        double error;
+    };
+
+    // Outgoing half-edges per vertex, to find open edges (half-edges whose twin is missing)
+    struct EdgeAdjacency
+    {
+        std::vector<unsigned int> offsets;
+        std::vector<unsigned int> targets;
+
+        void build(const std::vector<unsigned int>& indices, size_t vertexCount)
+        {
+            offsets.assign(vertexCount + 1, 0);
+            for (size_t i = 0; i < indices.size(); i++)
+                offsets[indices[i] + 1]++;
+            for (size_t v = 0; v < vertexCount; v++)
+                offsets[v + 1] += offsets[v];
+            targets.resize(indices.size());
+            std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+            for (size_t t = 0; t < indices.size(); t += 3)
+                for (int e = 0; e < 3; e++)
+                    targets[fill[indices[t + e]]++] = indices[t + (e + 1) % 3];
+        }
+
+        bool hasEdge(unsigned int a, unsigned int b) const
+        {
+            for (unsigned int i = offsets[a]; i < offsets[a + 1]; i++)
+                if (targets[i] == b)
+                    return true;
+            return false;
+        }
+    };
+
+    // openOut[v] is the end of v's one open outgoing edge, None without one and v itself with several; openIn likewise
+    inline void findOpenEdges(const EdgeAdjacency& adjacency, size_t vertexCount, std::vector<unsigned int>& openIn,
+        std::vector<unsigned int>& openOut)
+    {
+        openIn.assign(vertexCount, None);
+        openOut.assign(vertexCount, None);
+        for (unsigned int a = 0; a < vertexCount; a++)
+            for (unsigned int i = adjacency.offsets[a]; i < adjacency.offsets[a + 1]; i++)
+            {
+                unsigned int b = adjacency.targets[i];
+                if (adjacency.hasEdge(b, a))
+                    continue;
+                openOut[a] = openOut[a] == None ? b : a;
+                openIn[b] = openIn[b] == None ? a : b;
+            }
+    }
+
+    // remap[v] is the first vertex at v's position, wedge[] links the vertices at a position in a ring
+    inline void buildPositionRemap(const Mesh& mesh, std::vector<unsigned int>& remap, std::vector<unsigned int>& wedge)
+    {
+        struct PositionHash
+        {
+            size_t operator()(const glm::vec3& p) const
+            {
+                uint32_t bits[3];
+                memcpy(bits, &p, sizeof(bits));
+                return (size_t)((bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u));
+            }
+        };
+        size_t vertexCount = mesh.vertexCount();
+        std::unordered_map<glm::vec3, unsigned int, PositionHash> first;
+        first.reserve(vertexCount);
+        remap.resize(vertexCount);
+        wedge.resize(vertexCount);
+        for (unsigned int v = 0; v < vertexCount; v++)
+        {
+            const float* p = mesh.vertex(v);
+            auto inserted = first.insert(std::make_pair(glm::vec3(p[0], p[1], p[2]), v));
+            unsigned int r = inserted.first->second;
+            remap[v] = r;
+            if (r == v)
+                wedge[v] = v;
+            else
+            {
+                wedge[v] = wedge[r];
+                wedge[r] = v;
+            }
+        }
+    }
+
+    inline void classifyVertices(const std::vector<unsigned int>& remap, const std::vector<unsigned int>& wedge,
+        const std::vector<unsigned int>& openIn, const std::vector<unsigned int>& openOut, std::vector<unsigned char>& kinds)
+    {
+        size_t vertexCount = remap.size();
+        kinds.assign(vertexCount, KindLocked);
+        for (unsigned int v = 0; v < vertexCount; v++)
+        {
+            unsigned int in = openIn[v], out = openOut[v];
+            if (wedge[v] == v)
+            {
+                if (in == None && out == None)
+                    kinds[v] = KindManifold;
+                else if (in != None && out != None && in != v && out != v)
+                    kinds[v] = KindBorder;
+            }
+            else if (wedge[wedge[v]] == v)
+            {
+                // a seam: each side has exactly one open edge in and out, and they run along the other side's
+                unsigned int w = wedge[v];
+                unsigned int inW = openIn[w], outW = openOut[w];
+                bool single = in != None && out != None && inW != None && outW != None && in != v && out != v && inW != w && outW != w;
+                if (single && remap[in] == remap[outW] && remap[out] == remap[inW])
+                    kinds[v] = KindSeam;
+            }
+        }
+    }
+
+    inline bool isOpenEdge(unsigned int v0, unsigned int v1, const std::vector<unsigned int>& openIn, const std::vector<unsigned int>& openOut)
+    {
+        return openOut[v0] == v1 || openIn[v0] == v1;
+    }
+
+    // Does moving v0 onto v1 turn any triangle of v0 (that survives the collapse) around
+    inline bool flipsTriangles(unsigned int v0, unsigned int v1, const std::vector<glm::dvec3>& positions,
+        const std::vector<unsigned int>& remap, const std::vector<unsigned int>& indices,
+        const std::vector<unsigned int>& triangleOffsets, const std::vector<unsigned int>& triangles)
+    {
+        unsigned int r0 = remap[v0], r1 = remap[v1];
+        const glm::dvec3& target = positions[r1];
+        for (unsigned int i = triangleOffsets[r0]; i < triangleOffsets[r0 + 1]; i++)
+        {
+            unsigned int t = triangles[i];
+            unsigned int a = remap[indices[t * 3]], b = remap[indices[t * 3 + 1]], c = remap[indices[t * 3 + 2]];
+            if (a == r1 || b == r1 || c == r1)
+                continue;
+            // rotate so the moving corner comes first
+            if (b == r0) { unsigned int x = a; a = b; b = c; c = x; }
+            else if (c == r0) { unsigned int x = c; c = b; b = a; a = x; }
+            glm::dvec3 before = glm::cross(positions[b] - positions[a], positions[c] - positions[a]);
+            glm::dvec3 after = glm::cross(positions[b] - target, positions[c] - target);
+            if (glm::dot(before, after) <= 0.0)
+                return true;
+        }
+        return false;
+    }
+}
+
+namespace Simplifier
+{
+    // Collapses edges of an indexed triangle list over mesh's vertices until at most targetIndexCount indices are left,
+    // or no collapse is cheaper than maxError (in mesh units). Returns the new index list and the error it reached.
+    inline std::vector<unsigned int> simplify(const Mesh& mesh, const std::vector<unsigned int>& sourceIndices,
+        size_t targetIndexCount, float maxError, float* resultError = NULL)
+    {
+        using namespace SimplifierDetail;
+        std::vector<unsigned int> indices(sourceIndices);
+        size_t vertexCount = mesh.vertexCount();
+        if (resultError)
+            *resultError = 0.0f;
+        if (indices.size() <= targetIndexCount || vertexCount == 0)
+            return indices;
+
+        std::vector<unsigned int> remap, wedge;
+        buildPositionRemap(mesh, remap, wedge);
+
+        // positions scaled into a unit box, so thresholds don't depend on the model's size
+        glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+        for (size_t v = 0; v < vertexCount; v++)
+        {
+            glm::vec3 p(mesh.vertex(v)[0], mesh.vertex(v)[1], mesh.vertex(v)[2]);
+            lo = glm::min(lo, p);
+            hi = glm::max(hi, p);
+        }
+        double extent = std::max(std::max(hi.x - lo.x, hi.y - lo.y), std::max(hi.z - lo.z, 1e-12f));
+        std::vector<glm::dvec3> positions(vertexCount);
+        for (size_t v = 0; v < vertexCount; v++)
+        {
+            const float* p = mesh.vertex(v);
+            positions[v] = (glm::dvec3(p[0], p[1], p[2]) - glm::dvec3(lo)) / extent;
+        }
+
+        EdgeAdjacency adjacency;
+        adjacency.build(indices, vertexCount);
+        std::vector<unsigned int> openIn, openOut;
+        findOpenEdges(adjacency, vertexCount, openIn, openOut);
+        std::vector<unsigned char> kinds;
+        classifyVertices(remap, wedge, openIn, openOut, kinds);
+
+        // plane quadrics of the triangles, area weighted, plus planes through open edges to hold borders and seams in place
+        std::vector<Quadric> quadrics(vertexCount);
+        for (size_t t = 0; t < indices.size(); t += 3)
+        {
+            unsigned int corner[3] = { indices[t], indices[t + 1], indices[t + 2] };
+            const glm::dvec3& p0 = positions[remap[corner[0]]];
+            glm::dvec3 normal = glm::cross(positions[remap[corner[1]]] - p0, positions[remap[corner[2]]] - p0);
+            double area = glm::length(normal);
+            if (area <= 0.0)
+                continue;
+            normal /= area;
+            Quadric q(normal, -glm::dot(normal, p0), area);
+            for (int k = 0; k < 3; k++)
+                quadrics[remap[corner[k]]].add(q);
+
+            for (int e = 0; e < 3; e++)
+            {
+                unsigned int a = corner[e], b = corner[(e + 1) % 3];
+                if (openOut[a] != b)
+                    continue;
+                glm::dvec3 edge = positions[remap[b]] - positions[remap[a]];
+                double length = glm::length(edge);
+                if (length <= 0.0)
+                    continue;
+                glm::dvec3 edgeNormal = glm::normalize(glm::cross(edge, normal));
+                Quadric border(edgeNormal, -glm::dot(edgeNormal, positions[remap[a]]), length * length * BorderWeight);
+                quadrics[remap[a]].add(border);
+                quadrics[remap[b]].add(border);
+            }
+        }
+
+        double errorLimit = (double)maxError / extent;
+        errorLimit *= errorLimit;
+        double errorReached = 0.0;
+        std::vector<unsigned int> collapseRemap(vertexCount);
+        std::vector<unsigned char> locked(vertexCount);
+        std::vector<Collapse> collapses;
+        std::vector<unsigned int> triangleOffsets, triangles;
+
+        while (indices.size() > targetIndexCount)
+        {
+            // open edges move as the border is collapsed, the kinds stay as classified
+            adjacency.build(indices, vertexCount);
+            findOpenEdges(adjacency, vertexCount, openIn, openOut);
+
+            collapses.clear();
+            for (size_t t = 0; t < indices.size(); t += 3)
+                for (int e = 0; e < 3; e++)
+                {
+                    unsigned int v0 = indices[t + e], v1 = indices[t + (e + 1) % 3];
+                    unsigned char k0 = kinds[v0], k1 = kinds[v1];
+                    if (!CanCollapse[k0][k1] && !CanCollapse[k1][k0])
+                        continue;
+                    if (HasOpposite[k0][k1] && remap[v1] > remap[v0])
+                        continue;
+                    // borders and seams only collapse along themselves
+                    if (k0 == k1 && (k0 == KindBorder || k0 == KindSeam) && !isOpenEdge(v0, v1, openIn, openOut))
+                        continue;
+                    Collapse c;
+                    c.v0 = CanCollapse[k0][k1] ? v0 : v1;
+                    c.v1 = CanCollapse[k0][k1] ? v1 : v0;
+                    c.bidirectional = CanCollapse[k0][k1] && CanCollapse[k1][k0];
+                    c.error = quadrics[remap[c.v0]].error(positions[remap[c.v1]]);
+                    if (c.bidirectional)
+                    {
+                        double reverse = quadrics[remap[c.v1]].error(positions[remap[c.v0]]);
+                        if (reverse < c.error)
+                        {
+                            std::swap(c.v0, c.v1);
+                            c.error = reverse;
+                        }
+                    }
+                    collapses.push_back(c);
+                }
+            if (collapses.empty())
+                break;
+            std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+            // triangles around each position, for the flip test
+            triangleOffsets.assign(vertexCount + 1, 0);
+            for (size_t i = 0; i < indices.size(); i++)
+                triangleOffsets[remap[indices[i]] + 1]++;
+            for (size_t v = 0; v < vertexCount; v++)
+                triangleOffsets[v + 1] += triangleOffsets[v];
+            triangles.resize(indices.size());
+            std::vector<unsigned int> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+            for (size_t i = 0; i < indices.size(); i++)
+                triangles[fill[remap[indices[i]]]++] = (unsigned int)(i / 3);
+
+            // a collapse removes two triangles (one on a border); take the cheapest, never touching a position twice a
+            // pass, and leave the ones much worse than the cheap half for later passes once the mesh has settled
+            size_t triangleGoal = (indices.size() - targetIndexCount) / 3;
+            size_t edgeGoal = std::min(collapses.size() - 1, triangleGoal / 2);
+            double errorGoal = std::min(errorLimit, collapses[edgeGoal].error * 1.5 + 1e-12);
+            for (size_t v = 0; v < vertexCount; v++)
+                collapseRemap[v] = (unsigned int)v;
+            std::fill(locked.begin(), locked.end(), 0);
+            size_t collapsedTriangles = 0;
+            size_t collapsedEdges = 0;
+            for (size_t i = 0; i < collapses.size() && collapsedTriangles < triangleGoal; i++)
+            {
+                const Collapse& c = collapses[i];
+                if (c.error > errorGoal)
+                    break;
+                unsigned int r0 = remap[c.v0], r1 = remap[c.v1];
+                if (locked[r0] || locked[r1])
+                    continue;
+                if (flipsTriangles(c.v0, c.v1, positions, remap, indices, triangleOffsets, triangles))
+                    continue;
+
+                collapseRemap[c.v0] = c.v1;
+                if (kinds[c.v0] == KindSeam)
+                    collapseRemap[wedge[c.v0]] = wedge[c.v1];
+                quadrics[r1].add(quadrics[r0]);
+                locked[r0] = locked[r1] = 1;
+                collapsedTriangles += kinds[c.v0] == KindBorder ? 1 : 2;
+                collapsedEdges++;
+                errorReached = std::max(errorReached, c.error);
+            }
+            if (collapsedEdges == 0)
+                break;
+
+            // rewrite the triangles and drop the ones that collapsed to a line
+            size_t write = 0;
+            for (size_t t = 0; t < indices.size(); t += 3)
+            {
+                unsigned int a = collapseRemap[indices[t]], b = collapseRemap[indices[t + 1]], c = collapseRemap[indices[t + 2]];
+                if (remap[a] == remap[b] || remap[b] == remap[c] || remap[a] == remap[c])
+                    continue;
+                indices[write++] = a;
+                indices[write++] = b;
+                indices[write++] = c;
+            }
+            indices.resize(write);
+        }
+
+        if (resultError)
+            *resultError = (float)(std::sqrt(errorReached) * extent);
+        return indices;
+    }
+
+    // LOD 0 is the mesh itself, every following LOD has about `ratio` of the previous one's triangles. Stops at
+    // maxLods, when a level barely shrinks, or when a level would be off by more than maxError (mesh units).
+    inline std::vector<MeshLod> buildLodChain(const Mesh& mesh, int maxLods = 6, float ratio = 0.5f, float maxError = FLT_MAX)
+    {
+        std::vector<MeshLod> lods(1);
+        lods[0].Indices = mesh.Indices;
+        lods[0].Error = 0.0f;
+        while ((int)lods.size() < maxLods)
+        {
+            const MeshLod& previous = lods.back();
+            size_t target = (size_t)(previous.Indices.size() / 3 * ratio) * 3;
+            if (target < 36)
+                break;
+            // each level starts from the last, the errors add up
+            float error = 0.0f;
+            MeshLod lod;
+            lod.Indices = simplify(mesh, previous.Indices, target, maxError - previous.Error, &error);
+            lod.Error = previous.Error + error;
+            if (lod.Indices.size() > previous.Indices.size() * 9 / 10)
+                break;
+            MeshOptimizer::optimizeVertexCache(lod.Indices, mesh.vertexCount());
+            lods.push_back(lod);
+        }
+        return lods;
+    }
+
+    // buildLodChain for many meshes at once, the meshes are shared out between the cores
+    inline std::vector<std::vector<MeshLod>> buildLodChains(const std::vector<const Mesh*>& meshes, int maxLods = 6, float ratio = 0.5f)
+    {
+        std::vector<std::vector<MeshLod>> chains(meshes.size());
+        JobPool& pool = JobPool::shared();
+        pool.forEach(meshes.size(), pool.threadCount(), [&](size_t i) { chains[i] = buildLodChain(*meshes[i], maxLods, ratio); });
+        return chains;
+    }
+
+    // Pixels per unit of distance at one unit from the camera, for a vertical field of view (Camera::Zoom) in degrees
+    inline float pixelsPerRadian(float fovyDegrees, float viewportHeight)
+    {
+        return viewportHeight / (2.0f * std::tan(glm::radians(fovyDegrees) * 0.5f));
+    }
+
+    // Coarsest LOD whose error, scaled to world units and projected at distance, stays under pixelThreshold pixels
+    inline int selectLod(const float* errors, int lodCount, float worldScale, float distance, float pixelsPerRadian,
+        float pixelThreshold = 1.0f)
+    {
+        distance = std::max(distance, 1e-4f);
+        int lod = 0;
+        for (int i = 1; i < lodCount; i++)
+        {
+            float pixels = errors[i] * worldScale / distance * pixelsPerRadian;
+            if (pixels > pixelThreshold)
+                break;
+            lod = i;
+        }
+        return lod;
+    }
+}
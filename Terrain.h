@@ -0,0 +1,475 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <glad/glad.h>
+#include <glm.hpp>
+#include "Mesh.h"
+#include "GeometryBuffer.h"
+#include "MultiDraw.h"
+#include "FrameAllocator.h"
+#include "GpuMemory.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Geometry clipmap terrain /////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The ground is drawn as nested square rings of one regular grid, each level twice the spacing of the one inside it, all
+// centered on the camera. A handful of small grid meshes (a T x T tile, the arms that fill the ring's cross, the trims that
+// take up the odd row and column between levels and a ring of zero area triangles that closes the T-junctions) are placed
+// by per instance origins every frame, so the vertex count never changes with the size of the world.
+//
+// Every level has a ClipTexels x ClipTexels layer of heights addressed toroidally (texel = grid index & (ClipTexels - 1)).
+// When the camera moves only the rows and columns that came into view are generated and uploaded, the memory stays fixed.
+// terrain.vs reads the height with texelFetch and, near a level's outer edge, blends it into what the coarser level
+// interpolates there so neighbouring levels meet without cracks.
+
+const GLuint TerrainLevelBinding = 1;   // uniform block
+const GLuint TerrainPatchBinding = 2;   // shader storage block
+const int TerrainMaxLevels = 8;
+const int TerrainHeightUnit = 2;
+
+// Matches the std430 Patch struct in terrain.vs
+struct TerrainPatch
+{
+    glm::ivec2 Origin;  // grid index of the mesh's (0, 0) corner at its level's spacing
+    GLuint Level;
+    GLuint Padding;
+};
+
+// Matches the std140 Levels block in terrain.vs
+struct TerrainLevelData
+{
+    glm::vec4 Morph;    // xy center of the coarser level's hole, z its half size, w the width of the blend band
+    glm::vec4 Grid;     // x spacing
+};
+
+struct TerrainLevels
+{
+    TerrainLevelData Levels[TerrainMaxLevels];
+};
+
+namespace TerrainDetail
+{
+    // the ground's fBm: octaves of value noise from the longest wavelength down, each weaker by Persistence
+    const int Octaves = 9;
+    const float BaseWavelength = 160.0f;
+    const float Persistence = 0.45f;
+
+    inline float hash(int x, int z)
+    {
+        uint32_t h = (uint32_t)x * 374761393u + (uint32_t)z * 668265263u;
+        h = (h ^ (h >> 13)) * 1274126177u;
+        h ^= h >> 16;
+        return (float)(h & 0xffffff) / 16777215.0f;
+    }
+
+    // Smoothly interpolated lattice noise in [0,1]
+    inline float valueNoise(float x, float z)
+    {
+        float fx = std::floor(x);
+        float fz = std::floor(z);
+        int ix = (int)fx;
+        int iz = (int)fz;
+        float tx = x - fx;
+        float tz = z - fz;
+        tx = tx * tx * (3.0f - 2.0f * tx);
+        tz = tz * tz * (3.0f - 2.0f * tz);
+        float a = hash(ix, iz) + (hash(ix + 1, iz) - hash(ix, iz)) * tx;
+        float b = hash(ix, iz + 1) + (hash(ix + 1, iz + 1) - hash(ix, iz + 1)) * tx;
+        return a + (b - a) * tz;
+    }
+
+    inline int floorDiv(float x, float spacing) { return (int)std::floor(x / spacing); }
+
+    // Two triangles per quad of a (w + 1) x (h + 1) vertex grid, split along the (x+1, z) - (x, z+1) diagonal
+    inline void gridIndices(int w, int h, std::vector<unsigned int>& indices)
+    {
+        for (int z = 0; z < h; z++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                unsigned int a = z * (w + 1) + x;
+                unsigned int b = a + 1;
+                unsigned int c = a + (w + 1);
+                unsigned int d = c + 1;
+                unsigned int quad[6] = { a, c, b, b, c, d };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+    }
+
+    // A w x h grid of quads with its corner at the origin
+    inline Mesh makeGrid(int w, int h)
+    {
+        Mesh mesh;
+        mesh.Stride = 5;
+        for (int z = 0; z <= h; z++)
+        {
+            for (int x = 0; x <= w; x++)
+            {
+                float vertex[5] = { (float)x, 0.0f, (float)z, 0.0f, 0.0f };
+                mesh.Vertices.insert(mesh.Vertices.end(), vertex, vertex + 5);
+            }
+        }
+        gridIndices(w, h, mesh.Indices);
+        return mesh;
+    }
+
+    // Zero area triangles along the edges of an n x n square, every coarse edge (2i, 2i+2) gets a triangle through the
+    // fine vertex between them so both sides of the level boundary share the same edges
+    inline Mesh makeSeam(int n)
+    {
+        Mesh mesh;
+        mesh.Stride = 5;
+        for (int side = 0; side < 4; side++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                int x = side == 0 ? i : side == 1 ? n : side == 2 ? n - i : 0;
+                int z = side == 0 ? 0 : side == 1 ? i : side == 2 ? n : n - i;
+                float vertex[5] = { (float)x, 0.0f, (float)z, 0.0f, 0.0f };
+                mesh.Vertices.insert(mesh.Vertices.end(), vertex, vertex + 5);
+            }
+        }
+        unsigned int count = 4 * n;
+        for (unsigned int i = 0; i < count; i += 2)
+        {
+            unsigned int triangle[3] = { i, i + 1, (i + 2) % count };
+            mesh.Indices.insert(mesh.Indices.end(), triangle, triangle + 3);
+        }
+        return mesh;
+    }
+}
+
+class ClipmapTerrain
+{
+public:
+    static const int ClipTexels = 256;
+    // grid meshes, in the order of their draw commands
+    enum Piece { PIECE_TILE, PIECE_ARM_X, PIECE_ARM_Z, PIECE_CENTER, PIECE_TRIM_X, PIECE_TRIM_Z, PIECE_SEAM, PIECE_COUNT };
+
+    const int Levels;
+    const int TileSize;         // quads along a tile's side, a level is 4 * TileSize + 1 quads across
+    const float BaseSpacing;    // world units between the finest level's vertices
+    float HeightScale;
+
+    ///////////////////////// Constructor Function ////////////////////////////////////////////////
+    // Adds the grid meshes to geometry, which has to outlive the terrain
+    ClipmapTerrain(GeometryBuffer& geometry, int levels = 5, int tileSize = 48, float baseSpacing = 0.25f)
+        : Levels(std::max(1, std::min(levels, TerrainMaxLevels))), TileSize(std::max(1, std::min(tileSize, (ClipTexels - 8) / 4))),
+        BaseSpacing(baseSpacing), HeightScale(18.0f), geometry(geometry), texelsStreamed(0), framesStreamed(0)
+    {
+        int t = TileSize;
+        int hole = 4 * t + 2;
+        Mesh meshes[PIECE_COUNT] = {
+            TerrainDetail::makeGrid(t, t), TerrainDetail::makeGrid(t, 1), TerrainDetail::makeGrid(1, t),
+            TerrainDetail::makeGrid(2 * t + 1, 2 * t + 1), TerrainDetail::makeGrid(hole - 1, 1), TerrainDetail::makeGrid(1, hole),
+            TerrainDetail::makeSeam(hole)
+        };
+        GLuint perLevel = (GLuint)(Levels - 1);
+        GLuint counts[PIECE_COUNT] = { 12 * (GLuint)Levels, 2 * (GLuint)Levels, 2 * (GLuint)Levels, 1, perLevel, perLevel, perLevel };
+        GLuint base = 0;
+        vertices = 0;
+        for (int i = 0; i < PIECE_COUNT; i++)
+        {
+            pieces[i] = geometry.add(meshes[i]);
+            firstPatch[i] = base;
+            patchCounts[i] = counts[i];
+            base += counts[i];
+            vertices += meshes[i].vertexCount() * counts[i];
+        }
+        patchCount = base;
+        draws.addBucket();
+        rebuildDraws();
+
+        glGenTextures(1, &heights);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, heights);
+        gpuTexStorage3D(heights, GL_TEXTURE_2D_ARRAY, 1, GL_R32F, ClipTexels, ClipTexels, Levels);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        for (int l = 0; l < TerrainMaxLevels; l++)
+        {
+            windows[l] = glm::ivec2(0, 0);
+            resident[l] = false;
+        }
+        levelAllocation.Data = NULL;
+        patchAllocation.Data = NULL;
+    }
+
+    ~ClipmapTerrain()
+    {
+        for (int i = 0; i < PIECE_COUNT; i++)
+            geometry.remove(pieces[i]);
+        gpuDeleteTextures(1, &heights);
+    }
+
+    // Height of the ground at (x, z), leaving out the detail finer than minWavelength so a level never holds more
+    // frequencies than its grid can show
+    float heightAt(float x, float z, float minWavelength = 0.0f) const
+    {
+        float height = 0.0f;
+        float amplitude = 1.0f;
+        float wavelength = TerrainDetail::BaseWavelength;
+        for (int octave = 0; octave < TerrainDetail::Octaves && wavelength >= minWavelength; octave++)
+        {
+            height += amplitude * (TerrainDetail::valueNoise(x / wavelength + octave * 17.0f, z / wavelength) * 2.0f - 1.0f);
+            amplitude *= TerrainDetail::Persistence;
+            wavelength *= 0.5f;
+        }
+        // level around the origin where the cubes stand, rising into hills further out
+        float radius = std::sqrt(x * x + z * z);
+        float rise = std::min(std::max((radius - 60.0f) / 60.0f, 0.0f), 1.0f);
+        rise = rise * rise * (3.0f - 2.0f * rise);
+        return height * HeightScale * rise;
+    }
+
+    // A size x size cell grid around center for occlusion culling that stays under the ground: every vertex takes the
+    // lowest smoothed height around it, less the most the detail left out of the smoothing can dip. Faces up, CCW.
+    void occluderMesh(const glm::vec3& center, int size, float spacing, std::vector<glm::vec3>& positions, std::vector<unsigned int>& indices) const
+    {
+        float margin = 0.0f;
+        float amplitude = 1.0f;
+        float wavelength = TerrainDetail::BaseWavelength;
+        for (int octave = 0; octave < TerrainDetail::Octaves; octave++)
+        {
+            if (wavelength < 2.0f * spacing)
+                margin += amplitude;
+            amplitude *= TerrainDetail::Persistence;
+            wavelength *= 0.5f;
+        }
+        margin *= HeightScale;
+
+        // one sample more on every side so the edge vertices have neighbours too
+        int x0 = TerrainDetail::floorDiv(center.x, spacing) - size / 2;
+        int z0 = TerrainDetail::floorDiv(center.z, spacing) - size / 2;
+        int samples = size + 3;
+        std::vector<float> smooth((size_t)samples * samples);
+        for (int z = 0; z < samples; z++)
+            for (int x = 0; x < samples; x++)
+                smooth[(size_t)z * samples + x] = heightAt((x0 + x - 1) * spacing, (z0 + z - 1) * spacing, 2.0f * spacing);
+
+        positions.clear();
+        indices.clear();
+        for (int z = 0; z <= size; z++)
+        {
+            for (int x = 0; x <= size; x++)
+            {
+                float lowest = FLT_MAX;
+                for (int dz = 0; dz < 3; dz++)
+                    for (int dx = 0; dx < 3; dx++)
+                        lowest = std::min(lowest, smooth[(size_t)(z + dz) * samples + x + dx]);
+                positions.push_back(glm::vec3((x0 + x) * spacing, lowest - margin, (z0 + z) * spacing));
+            }
+        }
+        TerrainDetail::gridIndices(size, size, indices);
+    }
+
+    // Recenters every level on the camera, streams the heights that came into view and writes this frame's patches
+    void update(const glm::vec3& cameraPosition, FrameAllocator& frameData)
+    {
+        TerrainLevels levelData;
+        std::vector<TerrainPatch> patches(patchCount);
+        layout(cameraPosition, patches.data(), levelData);
+
+        for (int l = 0; l < Levels; l++)
+        {
+            float spacing = spacingOf(l);
+            glm::ivec2 center(TerrainDetail::floorDiv(cameraPosition.x, spacing), TerrainDetail::floorDiv(cameraPosition.z, spacing));
+            stream(l, glm::ivec2(center.x - ClipTexels / 2, center.y - ClipTexels / 2));
+        }
+
+        levelAllocation = frameData.allocate(levelData, BUFFER_USAGE_UNIFORM);
+        patchAllocation = frameData.allocate(patches.size() * sizeof(TerrainPatch), BUFFER_USAGE_STORAGE);
+        if (patchAllocation.Data)
+            std::copy(patches.begin(), patches.end(), (TerrainPatch*)patchAllocation.Data);
+    }
+
+    // Call when GeometryBuffer::update() moved meshes
+    void rebuildDraws()
+    {
+        draws.clear();
+        for (int i = 0; i < PIECE_COUNT; i++)
+            if (patchCounts[i] > 0)
+                draws.add(0, geometry.range(pieces[i].Id), patchCounts[i], firstPatch[i]);
+        draws.upload();
+    }
+
+    // The shader has to be in use and the Frame uniform block bound
+    template <typename ShaderType>
+    void draw(ShaderType& shader, FrameAllocator& frameData)
+    {
+        if (!levelAllocation.Data || !patchAllocation.Data)
+            return;
+        frameData.bind(GL_UNIFORM_BUFFER, TerrainLevelBinding, levelAllocation);
+        frameData.bind(GL_SHADER_STORAGE_BUFFER, TerrainPatchBinding, patchAllocation);
+        glActiveTexture(GL_TEXTURE0 + TerrainHeightUnit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, heights);
+        shader.setInt("terrainHeights", TerrainHeightUnit);
+        draws.draw(0, shader, geometry);
+    }
+
+    // Vertices drawn every frame, the same wherever the camera is
+    size_t vertexCount() const { return vertices; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << Levels << " levels of " << 4 * TileSize + 1 << " quads, " << vertices << " vertices a frame, "
+            << gpuTextureBytes(GL_R32F, 1, ClipTexels, ClipTexels, Levels) / 1024 << " KB of heights" << std::endl;
+        out << "  " << texelsStreamed << " height texels streamed over " << framesStreamed << " frames" << std::endl;
+    }
+
+private:
+    // owns GL objects and meshes in the geometry buffer
+    ClipmapTerrain(const ClipmapTerrain&);
+    ClipmapTerrain& operator=(const ClipmapTerrain&);
+
+    GeometryBuffer& geometry;
+    MultiDrawBatch draws;
+    MeshRange pieces[PIECE_COUNT];
+    GLuint firstPatch[PIECE_COUNT];
+    GLuint patchCounts[PIECE_COUNT];
+    GLuint patchCount;
+    size_t vertices;
+    unsigned int heights;
+    // grid index of each level's texel window corner, valid once resident
+    glm::ivec2 windows[TerrainMaxLevels];
+    bool resident[TerrainMaxLevels];
+    std::vector<float> scratch;
+    size_t texelsStreamed;
+    size_t framesStreamed;
+    FrameAllocation levelAllocation;
+    FrameAllocation patchAllocation;
+
+    float spacingOf(int level) const { return BaseSpacing * (float)(1 << level); }
+
+    // Where every piece goes this frame and the blend band of every level
+    void layout(const glm::vec3& cameraPosition, TerrainPatch* patches, TerrainLevels& levelData) const
+    {
+        const int t = TileSize;
+        GLuint next[PIECE_COUNT];
+        for (int i = 0; i < PIECE_COUNT; i++)
+            next[i] = firstPatch[i];
+        auto place = [&](Piece piece, int x, int z, int level)
+        {
+            TerrainPatch& patch = patches[next[piece]++];
+            patch.Origin = glm::ivec2(x, z);
+            patch.Level = (GLuint)level;
+            patch.Padding = 0;
+        };
+
+        for (int l = 0; l < TerrainMaxLevels; l++)
+        {
+            levelData.Levels[l].Morph = glm::vec4(0.0f, 0.0f, 1.0e30f, 1.0f);
+            levelData.Levels[l].Grid = glm::vec4(spacingOf(std::min(l, Levels - 1)), 0.0f, 0.0f, 0.0f);
+        }
+
+        for (int l = 0; l < Levels; l++)
+        {
+            float spacing = spacingOf(l);
+            int cx = TerrainDetail::floorDiv(cameraPosition.x, spacing);
+            int cz = TerrainDetail::floorDiv(cameraPosition.z, spacing);
+            int bx = cx - 2 * t;
+            int bz = cz - 2 * t;
+
+            // the ring: a 4 x 4 block of tiles without the middle 2 x 2, one quad apart across the middle
+            for (int j = 0; j < 4; j++)
+            {
+                for (int i = 0; i < 4; i++)
+                {
+                    if ((i == 1 || i == 2) && (j == 1 || j == 2))
+                        continue;
+                    place(PIECE_TILE, bx + i * t + (i >= 2 ? 1 : 0), bz + j * t + (j >= 2 ? 1 : 0), l);
+                }
+            }
+            place(PIECE_ARM_X, bx, bz + 2 * t, l);
+            place(PIECE_ARM_X, bx + 3 * t + 1, bz + 2 * t, l);
+            place(PIECE_ARM_Z, bx + 2 * t, bz, l);
+            place(PIECE_ARM_Z, bx + 2 * t, bz + 3 * t + 1, l);
+            if (l == 0)
+                place(PIECE_CENTER, bx + t, bz + t, l);
+
+            if (l == Levels - 1)
+                continue;
+            // the coarser level leaves a 4t + 2 quad hole, this level covers 4t + 1 of it and the trims the last column
+            // and row, on whichever side the camera's position inside the coarser cell leaves open
+            int holeX = 2 * (TerrainDetail::floorDiv(cameraPosition.x, 2.0f * spacing) - t);
+            int holeZ = 2 * (TerrainDetail::floorDiv(cameraPosition.z, 2.0f * spacing) - t);
+            int hole = 4 * t + 2;
+            int trimX = bx == holeX ? holeX + hole - 1 : holeX;
+            int trimZ = bz == holeZ ? holeZ + hole - 1 : holeZ;
+            place(PIECE_TRIM_Z, trimX, holeZ, l);
+            place(PIECE_TRIM_X, trimX == holeX ? holeX + 1 : holeX, trimZ, l);
+            place(PIECE_SEAM, holeX, holeZ, l);
+
+            float half = 0.5f * hole * spacing;
+            levelData.Levels[l].Morph = glm::vec4(holeX * spacing + half, holeZ * spacing + half, half, 0.25f * t * spacing);
+        }
+    }
+
+    // Moves a level's window to start at corner, generating only the texels that weren't in the old window
+    void stream(int level, glm::ivec2 corner)
+    {
+        if (resident[level] && windows[level].x == corner.x && windows[level].y == corner.y)
+            return;
+        glm::ivec2 old = windows[level];
+        int dx = corner.x - old.x;
+        int dz = corner.y - old.y;
+        if (!resident[level] || std::abs(dx) >= ClipTexels || std::abs(dz) >= ClipTexels)
+        {
+            upload(level, corner.x, corner.y, ClipTexels, ClipTexels);
+        }
+        else
+        {
+            // columns that came in on the side the camera moved towards, then rows across the whole new window
+            if (dx > 0)
+                upload(level, old.x + ClipTexels, corner.y, dx, ClipTexels);
+            else if (dx < 0)
+                upload(level, corner.x, corner.y, -dx, ClipTexels);
+            if (dz > 0)
+                upload(level, corner.x, old.y + ClipTexels, ClipTexels, dz);
+            else if (dz < 0)
+                upload(level, corner.x, corner.y, ClipTexels, -dz);
+        }
+        windows[level] = corner;
+        resident[level] = true;
+        framesStreamed++;
+    }
+
+    // Generates the w x h heights starting at grid index (x0, z0) and writes them where they wrap to in the layer
+    void upload(int level, int x0, int z0, int w, int h)
+    {
+        float spacing = spacingOf(level);
+        scratch.resize((size_t)w * h);
+        for (int z = 0; z < h; z++)
+            for (int x = 0; x < w; x++)
+                scratch[(size_t)z * w + x] = heightAt((x0 + x) * spacing, (z0 + z) * spacing, 2.0f * spacing);
+        texelsStreamed += scratch.size();
+
+        // the rectangle splits in up to four where it crosses the edges of the layer
+        const int mask = ClipTexels - 1;
+        glBindTexture(GL_TEXTURE_2D_ARRAY, heights);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+        for (int z = 0; z < h; )
+        {
+            int tz = (z0 + z) & mask;
+            int rows = std::min(h - z, ClipTexels - tz);
+            for (int x = 0; x < w; )
+            {
+                int tx = (x0 + x) & mask;
+                int columns = std::min(w - x, ClipTexels - tx);
+                glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+                glPixelStorei(GL_UNPACK_SKIP_ROWS, z);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, tx, tz, level, columns, rows, 1, GL_RED, GL_FLOAT, scratch.data());
+                x += columns;
+            }
+            z += rows;
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    }
+};
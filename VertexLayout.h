@@ -0,0 +1,433 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <glad/glad.h>
+#include <glm.hpp>
+#include <gtc/matrix_transform.hpp>
+#include "Mesh.h"
+#include "GpuMemory.h"
+#include "Simd.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Declarative vertex formats ///////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A VertexLayout lists which float range of a Mesh vertex goes to which shader location and how it is stored on the GPU.
+// The same description encodes the vertices and sets up the VAO, so the two can't disagree.
+//
+// Compact formats:
+//   VERTEX_SNORM16_POSITION  xyz quantized to the mesh bounds, 8 bytes. Shaders see [-1,1], GpuMesh::Quantization
+//                            holds the matrix that maps that back to model space (fold it into the model matrix).
+//   VERTEX_HALF2             two half floats, 4 bytes
+//   VERTEX_OCT_SNORM16       unit normal in octahedral encoding, 4 bytes. Decode in the shader with
+//                              vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+//                              if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+//                              n = normalize(n);
+
+enum VertexFormat
+{
+    VERTEX_FLOAT2,
+    VERTEX_FLOAT3,
+    VERTEX_SNORM16_POSITION,
+    VERTEX_HALF2,
+    VERTEX_OCT_SNORM16
+};
+
+struct VertexAttribute
+{
+    GLuint Location;
+    VertexFormat Format;
+    int SourceOffset;   // first float of this attribute inside a Mesh vertex
+};
+
+// Maps quantized [-1,1] positions back to model space
+struct VertexQuantization
+{
+    glm::vec3 Scale;
+    glm::vec3 Offset;
+
+    VertexQuantization() : Scale(1.0f), Offset(0.0f) {}
+    glm::mat4 matrix() const { return glm::scale(glm::translate(glm::mat4(1.0f), Offset), Scale); }
+};
+
+namespace VertexConvert
+{
+    ///////////////////////////////////// Scalar reference conversions ///////////////////////////////
+    // Round to nearest even, overflow goes to infinity
+    inline uint16_t floatToHalf(float value)
+    {
+        uint32_t f;
+        memcpy(&f, &value, sizeof(f));
+        uint16_t sign = (uint16_t)((f >> 16) & 0x8000);
+        f &= 0x7fffffff;
+        if (f >= 0x7f800000)
+            return sign | 0x7c00 | (f > 0x7f800000 ? 0x200 : 0);
+        if (f >= 0x477ff000)
+            return sign | 0x7c00;
+        if (f < 0x38800000)
+        {
+            // subnormal half, let the float adder do the rounding
+            float v;
+            memcpy(&v, &f, sizeof(v));
+            v += 0.5f;
+            uint32_t bits;
+            memcpy(&bits, &v, sizeof(bits));
+            return sign | (uint16_t)(bits - 0x3f000000);
+        }
+        uint32_t odd = (f >> 13) & 1;
+        f += 0xc8000fffu + odd; // rebias the exponent by 15 - 127 and round
+        return sign | (uint16_t)(f >> 13);
+    }
+
+    inline int16_t floatToSnorm16(float value)
+    {
+        value = std::max(-1.0f, std::min(1.0f, value));
+        return (int16_t)std::lrint(value * 32767.0f);
+    }
+
+    // What GL's normalized GL_SHORT fetch gives the shader
+    inline float snorm16ToFloat(int16_t value)
+    {
+        return std::max(-1.0f, value / 32767.0f);
+    }
+
+    inline void octahedralEncode(float x, float y, float z, int16_t* out)
+    {
+        float length = std::fabs(x) + std::fabs(y) + std::fabs(z);
+        if (length > 0.0f)
+        {
+            x /= length;
+            y /= length;
+        }
+        if (z < 0.0f)
+        {
+            float ox = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            float oy = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            x = ox;
+            y = oy;
+        }
+        out[0] = floatToSnorm16(x);
+        out[1] = floatToSnorm16(y);
+    }
+
+    ///////////////////////////////////// Batch conversions //////////////////////////////////////////
+    // All of these read tightly packed floats. out and outStride are in elements so results can be written straight
+    // into an interleaved vertex buffer.
+#ifdef SIMD_SSE2
+    SIMD_F16C_TARGET inline void floatToHalfF16C(const float* in, size_t count, uint16_t* out, size_t outStride)
+    {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i halves = _mm_cvtps_ph(_mm_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+            uint16_t packed[8];
+            _mm_storeu_si128((__m128i*)packed, halves);
+            for (int k = 0; k < 4; k++)
+                out[(i + k) * outStride] = packed[k];
+        }
+        for (; i < count; i++)
+            out[i * outStride] = floatToHalf(in[i]);
+    }
+#endif
+
+    inline void floatToHalf(const float* in, size_t count, uint16_t* out, size_t outStride)
+    {
+#ifdef SIMD_SSE2
+        if (cpuHasF16C())
+        {
+            floatToHalfF16C(in, count, out, outStride);
+            return;
+        }
+#endif
+        for (size_t i = 0; i < count; i++)
+            out[i * outStride] = floatToHalf(in[i]);
+    }
+
+    // snorm16((in - offset) * invScale)
+    inline void quantizeSnorm16(const float* in, size_t count, float offset, float invScale, int16_t* out, size_t outStride)
+    {
+        size_t i = 0;
+#ifdef SIMD_SSE2
+        const __m128 vOffset = _mm_set1_ps(offset);
+        const __m128 vScale = _mm_set1_ps(invScale * 32767.0f);
+        for (; i + 8 <= count; i += 8)
+        {
+            // _mm_packs_epi32 saturates, which is the clamp to [-32767, 32767] apart from -32768
+            __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(in + i), vOffset), vScale));
+            __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(in + i + 4), vOffset), vScale));
+            __m128i packed = _mm_max_epi16(_mm_packs_epi32(a, b), _mm_set1_epi16(-32767));
+            int16_t values[8];
+            _mm_storeu_si128((__m128i*)values, packed);
+            for (int k = 0; k < 8; k++)
+                out[(i + k) * outStride] = values[k];
+        }
+#endif
+        for (; i < count; i++)
+            out[i * outStride] = floatToSnorm16((in[i] - offset) * invScale);
+    }
+
+    // Normals come in as separate x, y and z arrays, out gets two snorm16 per normal
+    inline void octahedralEncode(const float* x, const float* y, const float* z, size_t count, int16_t* out, size_t outStride)
+    {
+        size_t i = 0;
+#ifdef SIMD_SSE2
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 snorm = _mm_set1_ps(32767.0f);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 vx = _mm_loadu_ps(x + i);
+            __m128 vy = _mm_loadu_ps(y + i);
+            __m128 vz = _mm_loadu_ps(z + i);
+            __m128 length = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, vx), _mm_andnot_ps(signMask, vy)), _mm_andnot_ps(signMask, vz));
+            __m128 valid = _mm_cmpgt_ps(length, _mm_setzero_ps());
+            __m128 invLength = _mm_div_ps(one, _mm_or_ps(_mm_and_ps(valid, length), _mm_andnot_ps(valid, one)));
+            vx = _mm_mul_ps(vx, invLength);
+            vy = _mm_mul_ps(vy, invLength);
+
+            // lower hemisphere folds over the diagonals, sign() counts 0 as positive like the scalar version
+            __m128 signX = _mm_or_ps(one, _mm_and_ps(_mm_cmplt_ps(vx, _mm_setzero_ps()), signMask));
+            __m128 signY = _mm_or_ps(one, _mm_and_ps(_mm_cmplt_ps(vy, _mm_setzero_ps()), signMask));
+            __m128 foldX = _mm_mul_ps(_mm_sub_ps(one, _mm_andnot_ps(signMask, vy)), signX);
+            __m128 foldY = _mm_mul_ps(_mm_sub_ps(one, _mm_andnot_ps(signMask, vx)), signY);
+            __m128 lower = _mm_cmplt_ps(vz, _mm_setzero_ps());
+            vx = _mm_or_ps(_mm_and_ps(lower, foldX), _mm_andnot_ps(lower, vx));
+            vy = _mm_or_ps(_mm_and_ps(lower, foldY), _mm_andnot_ps(lower, vy));
+
+            __m128i ix = _mm_cvtps_epi32(_mm_mul_ps(vx, snorm));
+            __m128i iy = _mm_cvtps_epi32(_mm_mul_ps(vy, snorm));
+            __m128i packed = _mm_packs_epi32(_mm_unpacklo_epi32(ix, iy), _mm_unpackhi_epi32(ix, iy));
+            int16_t values[8];
+            _mm_storeu_si128((__m128i*)values, packed);
+            for (int k = 0; k < 4; k++)
+            {
+                out[(i + k) * outStride] = values[k * 2];
+                out[(i + k) * outStride + 1] = values[k * 2 + 1];
+            }
+        }
+#endif
+        for (; i < count; i++)
+            octahedralEncode(x[i], y[i], z[i], out + i * outStride);
+    }
+}
+
+class VertexLayout
+{
+public:
+    std::vector<VertexAttribute> Attributes;
+
+    VertexLayout& add(GLuint location, VertexFormat format, int sourceOffset)
+    {
+        VertexAttribute attribute = { location, format, sourceOffset };
+        Attributes.push_back(attribute);
+        return *this;
+    }
+
+    // What the floor and cube always used: float3 position and float2 uv, 20 bytes
+    static VertexLayout standard()
+    {
+        VertexLayout layout;
+        layout.add(0, VERTEX_FLOAT3, 0).add(1, VERTEX_FLOAT2, 3);
+        return layout;
+    }
+
+    // snorm16 position and half uv, 12 bytes
+    static VertexLayout compact()
+    {
+        VertexLayout layout;
+        layout.add(0, VERTEX_SNORM16_POSITION, 0).add(1, VERTEX_HALF2, 3);
+        return layout;
+    }
+
+    static GLsizei formatSize(VertexFormat format)
+    {
+        switch (format)
+        {
+        case VERTEX_FLOAT2: return 8;
+        case VERTEX_FLOAT3: return 12;
+        case VERTEX_SNORM16_POSITION: return 8; // padded to four components to keep attributes 4 byte aligned
+        case VERTEX_HALF2: return 4;
+        case VERTEX_OCT_SNORM16: return 4;
+        default: return 0;
+        }
+    }
+
+    GLsizei stride() const
+    {
+        GLsizei size = 0;
+        for (size_t i = 0; i < Attributes.size(); i++)
+            size += formatSize(Attributes[i].Format);
+        return size;
+    }
+
+    GLsizei offsetOf(size_t attribute) const
+    {
+        GLsizei offset = 0;
+        for (size_t i = 0; i < attribute; i++)
+            offset += formatSize(Attributes[i].Format);
+        return offset;
+    }
+
+    // Points the bound VAO's attributes at the bound GL_ARRAY_BUFFER
+    void apply() const
+    {
+        GLsizei vertexStride = stride();
+        for (size_t i = 0; i < Attributes.size(); i++)
+        {
+            const VertexAttribute& attribute = Attributes[i];
+            const void* offset = (const void*)(size_t)offsetOf(i);
+            switch (attribute.Format)
+            {
+            case VERTEX_FLOAT2: glVertexAttribPointer(attribute.Location, 2, GL_FLOAT, GL_FALSE, vertexStride, offset); break;
+            case VERTEX_FLOAT3: glVertexAttribPointer(attribute.Location, 3, GL_FLOAT, GL_FALSE, vertexStride, offset); break;
+            case VERTEX_SNORM16_POSITION: glVertexAttribPointer(attribute.Location, 3, GL_SHORT, GL_TRUE, vertexStride, offset); break;
+            case VERTEX_HALF2: glVertexAttribPointer(attribute.Location, 2, GL_HALF_FLOAT, GL_FALSE, vertexStride, offset); break;
+            case VERTEX_OCT_SNORM16: glVertexAttribPointer(attribute.Location, 2, GL_SHORT, GL_TRUE, vertexStride, offset); break;
+            }
+            glEnableVertexAttribArray(attribute.Location);
+        }
+    }
+
+    // Converts the mesh vertices into this layout. quantization receives the bounds used for snorm16 positions.
+    std::vector<unsigned char> encode(const Mesh& mesh, VertexQuantization& quantization) const
+    {
+        size_t count = mesh.vertexCount();
+        GLsizei vertexStride = stride();
+        std::vector<unsigned char> bytes((size_t)vertexStride * count, 0);
+        std::vector<float> column[3];
+
+        for (size_t a = 0; a < Attributes.size(); a++)
+        {
+            const VertexAttribute& attribute = Attributes[a];
+            unsigned char* base = bytes.data() + offsetOf(a);
+            int components = attribute.Format == VERTEX_FLOAT2 || attribute.Format == VERTEX_HALF2 ? 2 : 3;
+
+            // deinterleave so the batch converters see plain arrays
+            for (int c = 0; c < components; c++)
+            {
+                column[c].resize(count);
+                for (size_t v = 0; v < count; v++)
+                    column[c][v] = mesh.vertex(v)[attribute.SourceOffset + c];
+            }
+
+            switch (attribute.Format)
+            {
+            case VERTEX_FLOAT2:
+            case VERTEX_FLOAT3:
+                for (size_t v = 0; v < count; v++)
+                    for (int c = 0; c < components; c++)
+                        memcpy(base + v * vertexStride + c * sizeof(float), &column[c][v], sizeof(float));
+                break;
+            case VERTEX_SNORM16_POSITION:
+                for (int c = 0; c < 3; c++)
+                {
+                    float low = count ? *std::min_element(column[c].begin(), column[c].end()) : 0.0f;
+                    float high = count ? *std::max_element(column[c].begin(), column[c].end()) : 0.0f;
+                    float extent = (high - low) * 0.5f;
+                    quantization.Offset[c] = (low + high) * 0.5f;
+                    // flat axes (the floor's y) still need a usable scale
+                    quantization.Scale[c] = extent > 0.0f ? extent : 1.0f;
+                    VertexConvert::quantizeSnorm16(column[c].data(), count, quantization.Offset[c], 1.0f / quantization.Scale[c],
+                        (int16_t*)(base + c * sizeof(int16_t)), vertexStride / sizeof(int16_t));
+                }
+                break;
+            case VERTEX_HALF2:
+                for (int c = 0; c < 2; c++)
+                    VertexConvert::floatToHalf(column[c].data(), count, (uint16_t*)(base + c * sizeof(uint16_t)), vertexStride / sizeof(uint16_t));
+                break;
+            case VERTEX_OCT_SNORM16:
+                VertexConvert::octahedralEncode(column[0].data(), column[1].data(), column[2].data(), count,
+                    (int16_t*)base, vertexStride / sizeof(int16_t));
+                break;
+            }
+        }
+        return bytes;
+    }
+
+    // Model space positions back out of vertices in this layout, the inverse of encode() for the position attribute
+    // (the one read from float 0 of a Mesh vertex)
+    void decodePositions(const void* vertices, size_t count, const VertexQuantization& quantization, std::vector<glm::vec3>& positions) const
+    {
+        positions.resize(count);
+        GLsizei vertexStride = stride();
+        for (size_t a = 0; a < Attributes.size(); a++)
+        {
+            if (Attributes[a].SourceOffset != 0)
+                continue;
+            const unsigned char* base = (const unsigned char*)vertices + offsetOf(a);
+            for (size_t v = 0; v < count; v++)
+            {
+                const unsigned char* vertex = base + v * vertexStride;
+                if (Attributes[a].Format == VERTEX_SNORM16_POSITION)
+                {
+                    int16_t q[3];
+                    memcpy(q, vertex, sizeof(q));
+                    for (int c = 0; c < 3; c++)
+                        positions[v][c] = VertexConvert::snorm16ToFloat(q[c]) * quantization.Scale[c] + quantization.Offset[c];
+                }
+                else
+                    memcpy(&positions[v][0], vertex, 3 * sizeof(float));
+            }
+            return;
+        }
+    }
+};
+
+/////////////////////////////////////// Mesh uploaded to the GPU ////////////////////////////////////////////
+struct GpuMesh
+{
+    unsigned int VAO;
+    unsigned int VBO;
+    unsigned int EBO;
+    GLsizei IndexCount;
+    GLsizei VertexStride;
+    VertexQuantization Quantization;
+
+    GpuMesh() : VAO(0), VBO(0), EBO(0), IndexCount(0), VertexStride(0) {}
+
+    void draw() const
+    {
+        glBindVertexArray(VAO);
+        glDrawElements(GL_TRIANGLES, IndexCount, GL_UNSIGNED_INT, 0);
+    }
+
+    void destroy()
+    {
+        glDeleteVertexArrays(1, &VAO);
+        gpuDeleteBuffers(1, &VBO);
+        gpuDeleteBuffers(1, &EBO);
+        VAO = VBO = EBO = 0;
+    }
+};
+
+// Builds a VAO, vertex and index buffer from vertices that are already in the layout's format
+inline GpuMesh uploadEncodedMesh(const void* vertices, size_t vertexBytes, const unsigned int* indices, size_t indexCount,
+    const VertexLayout& layout, const VertexQuantization& quantization)
+{
+    GpuMesh gpu;
+    gpu.Quantization = quantization;
+    gpu.IndexCount = (GLsizei)indexCount;
+    gpu.VertexStride = layout.stride();
+
+    glGenVertexArrays(1, &gpu.VAO);
+    glGenBuffers(1, &gpu.VBO);
+    glGenBuffers(1, &gpu.EBO);
+    glBindVertexArray(gpu.VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, gpu.VBO);
+    gpuBufferData(gpu.VBO, GL_ARRAY_BUFFER, vertexBytes, vertices, GL_STATIC_DRAW, GPU_MEMORY_VERTEX_DATA);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.EBO);
+    gpuBufferData(gpu.EBO, GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(unsigned int), indices, GL_STATIC_DRAW, GPU_MEMORY_INDEX_DATA);
+    layout.apply();
+    glBindVertexArray(0);
+    return gpu;
+}
+
+// Encodes the mesh with the layout and uploads it
+inline GpuMesh uploadMesh(const Mesh& mesh, const VertexLayout& layout)
+{
+    VertexQuantization quantization;
+    std::vector<unsigned char> vertices = layout.encode(mesh, quantization);
+    return uploadEncodedMesh(vertices.data(), vertices.size(), mesh.Indices.data(), mesh.Indices.size(), layout, quantization);
+}
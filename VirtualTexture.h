@@ -0,0 +1,415 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cmath>
+#include <iostream>
+#include <glad/glad.h>
+#include "GpuMemory.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Class used to stream a huge texture through a fixed-size page cache ///////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The virtual texture is split into square pages (with a 1 texel border so bilinear filtering works across pages).
+// Only the pages the Camera can actually see are kept in the physical cache texture, and the page table texture
+// tells the fragment shader where each virtual page currently lives. A low resolution feedback pass reports which
+// pages and mips are visible, and a background thread generates the missing ones through the PageProvider.
+class VirtualTexture
+{
+public:
+    // Fills an RGBA8 block of w*h texels starting at virtual texel (x0,y0) of the given mip level.
+    // Coordinates can be outside of the virtual texture (for page borders), the provider decides how to wrap them.
+    // Called from the loader thread, so it must not touch OpenGL.
+    typedef std::function<void(int mip, int x0, int y0, int w, int h, unsigned char* rgba)> PageProvider;
+
+    unsigned int PageTable;      // RGBA8, one texel per virtual page per mip: (cacheX, cacheY, residentMip, valid)
+    unsigned int PhysicalCache;  // RGBA8 atlas of CachePages x CachePages resident pages
+    unsigned int FeedbackTexture;
+    int VirtualPages;            // pages per side at mip 0 (power of two, at most 256)
+    int PageSize;                // texels per side of a page including the border
+    int PageBorder;
+    int CachePages;              // pages per side of the physical cache
+    int MaxMip;
+    int FeedbackWidth;
+    int FeedbackHeight;
+
+    ///////////////////////// Constructor Function ////////////////////////////////////////////////
+    VirtualTexture(int virtualPages, int pageSize, int cachePages, int feedbackWidth, int feedbackHeight, PageProvider provider)
+        : VirtualPages(virtualPages), PageSize(pageSize), PageBorder(1), CachePages(cachePages),
+          FeedbackWidth(feedbackWidth), FeedbackHeight(feedbackHeight), provider(provider), frame(0), pboIndex(0),
+          pageTableDirty(true), quit(false)
+    {
+        MaxMip = 0;
+        while ((1 << MaxMip) < VirtualPages)
+            MaxMip++;
+
+        // page table, nearest filtering so the shader can read exact entries with textureLod
+        glGenTextures(1, &PageTable);
+        glBindTexture(GL_TEXTURE_2D, PageTable);
+        gpuTexStorage2D(PageTable, MaxMip + 1, GL_RGBA8, VirtualPages, VirtualPages);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        pageTable.resize(MaxMip + 1);
+        for (int mip = 0; mip <= MaxMip; mip++)
+            pageTable[mip].assign(levelSize(mip) * levelSize(mip), 0);
+
+        // physical page cache, this is the only storage that grows with the amount of visible detail
+        glGenTextures(1, &PhysicalCache);
+        glBindTexture(GL_TEXTURE_2D, PhysicalCache);
+        gpuTexStorage2D(PhysicalCache, 1, GL_RGBA8, CachePages * PageSize, CachePages * PageSize);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        slots.resize(CachePages * CachePages);
+
+        // feedback render target, read back asynchronously through two pixel buffers
+        glGenTextures(1, &FeedbackTexture);
+        glBindTexture(GL_TEXTURE_2D, FeedbackTexture);
+        gpuTexStorage2D(FeedbackTexture, 1, GL_RGBA8, FeedbackWidth, FeedbackHeight, GPU_MEMORY_RENDER_TARGETS);
+        glGenRenderbuffers(1, &feedbackDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, feedbackDepth);
+        gpuRenderbufferStorage(feedbackDepth, GL_DEPTH_COMPONENT24, FeedbackWidth, FeedbackHeight);
+        glGenFramebuffers(1, &feedbackFBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, feedbackFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, FeedbackTexture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackDepth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Virtual texture feedback framebuffer is not complete" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glGenBuffers(2, feedbackPBO);
+        for (int i = 0; i < 2; i++)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackPBO[i]);
+            gpuBufferData(feedbackPBO[i], GL_PIXEL_PACK_BUFFER, FeedbackWidth * FeedbackHeight * 4, NULL, GL_STREAM_READ, GPU_MEMORY_STREAMING);
+            feedbackPending[i] = false;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        loader = std::thread(&VirtualTexture::loaderThread, this);
+
+        // the coarsest mip is a single page that stays resident, so every lookup always has something to fall back to
+        requestPage(pageKey(MaxMip, 0, 0));
+        waitForPage(pageKey(MaxMip, 0, 0));
+    }
+
+    ~VirtualTexture()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            quit = true;
+        }
+        queueSignal.notify_all();
+        loader.join();
+        gpuDeleteTextures(1, &PageTable);
+        gpuDeleteTextures(1, &PhysicalCache);
+        gpuDeleteTextures(1, &FeedbackTexture);
+        gpuDeleteRenderbuffers(1, &feedbackDepth);
+        glDeleteFramebuffers(1, &feedbackFBO);
+        gpuDeleteBuffers(2, feedbackPBO);
+    }
+
+    ////////////////////////// Feedback pass ////////////////////////////////////////////////////
+    // Bind the feedback target, draw the virtually textured geometry with the feedback shader, then call endFeedback
+    void beginFeedback()
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, feedbackFBO);
+        glViewport(0, 0, FeedbackWidth, FeedbackHeight);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    void endFeedback(int viewportWidth, int viewportHeight)
+    {
+        // kick off an asynchronous read, the result is consumed a frame later in update()
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackPBO[pboIndex]);
+        glReadPixels(0, 0, FeedbackWidth, FeedbackHeight, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        feedbackPending[pboIndex] = true;
+        pboIndex = 1 - pboIndex;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, viewportWidth, viewportHeight);
+    }
+
+    // Mip bias for the feedback shader, the feedback target is smaller than the screen so its derivatives are larger
+    float feedbackBias(int viewportWidth) const
+    {
+        return -std::log2((float)viewportWidth / (float)FeedbackWidth);
+    }
+
+    ////////////////////////// Per frame update //////////////////////////////////////////////////
+    // Reads last frame's feedback, queues missing pages and uploads the pages the loader finished
+    void update()
+    {
+        frame++;
+        processFeedback();
+        uploadFinishedPages();
+        if (pageTableDirty)
+            uploadPageTable();
+    }
+
+    ////////////////////////// Set the uniforms and texture units used by sampleVirtual() ////////
+    template <typename ShaderType>
+    void bind(ShaderType& shader, int pageTableUnit, int cacheUnit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + pageTableUnit);
+        glBindTexture(GL_TEXTURE_2D, PageTable);
+        glActiveTexture(GL_TEXTURE0 + cacheUnit);
+        glBindTexture(GL_TEXTURE_2D, PhysicalCache);
+        shader.setInt("vtPageTable", pageTableUnit);
+        shader.setInt("vtCache", cacheUnit);
+        shader.setFloat("vtVirtualPages", (float)VirtualPages);
+        shader.setFloat("vtPageSize", (float)PageSize);
+        shader.setFloat("vtPageBorder", (float)PageBorder);
+        shader.setFloat("vtCachePages", (float)CachePages);
+        shader.setFloat("vtMaxMip", (float)MaxMip);
+    }
+
+    int residentPages() const { return (int)resident.size(); }
+
+private:
+    struct Slot
+    {
+        uint32_t key = 0;
+        unsigned int lastUsed = 0;
+        bool used = false;
+    };
+    struct LoadedPage
+    {
+        uint32_t key;
+        std::vector<unsigned char> pixels;
+    };
+
+    static const int MaxRequestsPerFrame = 32;
+    static const int MaxUploadsPerFrame = 8;
+
+    PageProvider provider;
+    unsigned int feedbackFBO, feedbackDepth;
+    unsigned int feedbackPBO[2];
+    bool feedbackPending[2];
+    unsigned int frame;
+    int pboIndex;
+
+    std::vector<Slot> slots;
+    std::unordered_map<uint32_t, int> resident;   // page key -> cache slot
+    std::unordered_set<uint32_t> inFlight;         // requested from the loader but not uploaded yet
+    std::vector<std::vector<uint32_t> > pageTable; // CPU mirror of every page table mip
+    bool pageTableDirty;
+
+    std::thread loader;
+    std::mutex queueMutex;
+    std::condition_variable queueSignal;
+    std::condition_variable pageFinished;   // the loader pushed a page to finished
+    std::deque<uint32_t> requests;
+    std::vector<LoadedPage> finished;
+    bool quit;
+
+    int levelSize(int mip) const { return std::max(1, VirtualPages >> mip); }
+    int pageContent() const { return PageSize - 2 * PageBorder; }
+
+    static uint32_t pageKey(int mip, int x, int y) { return ((uint32_t)mip << 24) | ((uint32_t)y << 12) | (uint32_t)x; }
+    static int keyMip(uint32_t key) { return (int)(key >> 24); }
+    static int keyY(uint32_t key) { return (int)((key >> 12) & 0xFFF); }
+    static int keyX(uint32_t key) { return (int)(key & 0xFFF); }
+
+    //////////////////////////////// Loader thread ///////////////////////////////////////////////
+    void loaderThread()
+    {
+        for (;;)
+        {
+            uint32_t key;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueSignal.wait(lock, [this] { return quit || !requests.empty(); });
+                if (quit)
+                    return;
+                key = requests.front();
+                requests.pop_front();
+            }
+            LoadedPage page;
+            page.key = key;
+            page.pixels.resize(PageSize * PageSize * 4);
+            int content = pageContent();
+            provider(keyMip(key), keyX(key) * content - PageBorder, keyY(key) * content - PageBorder, PageSize, PageSize, page.pixels.data());
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                finished.push_back(std::move(page));
+            }
+            pageFinished.notify_one();
+        }
+    }
+
+    void requestPage(uint32_t key)
+    {
+        inFlight.insert(key);
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            requests.push_back(key);
+        }
+        queueSignal.notify_one();
+    }
+
+    void waitForPage(uint32_t key)
+    {
+        while (resident.find(key) == resident.end())
+        {
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                pageFinished.wait(lock, [this] { return !finished.empty(); });
+            }
+            uploadFinishedPages();
+        }
+        uploadPageTable();
+    }
+
+    //////////////////////////////// Feedback processing ///////////////////////////////////////////
+    void processFeedback()
+    {
+        // the buffer we are about to overwrite next was filled last frame, so mapping it will not stall
+        int readIndex = pboIndex;
+        if (!feedbackPending[readIndex])
+            return;
+        feedbackPending[readIndex] = false;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackPBO[readIndex]);
+        const unsigned char* pixels = (const unsigned char*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (!pixels)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            return;
+        }
+
+        std::unordered_map<uint32_t, int> wanted;
+        for (int i = 0; i < FeedbackWidth * FeedbackHeight; i++)
+        {
+            const unsigned char* p = pixels + i * 4;
+            if (p[3] == 0)
+                continue;
+            // walk up the mip chain so that the fallback pages are kept alive as well
+            int x = p[0], y = p[1];
+            for (int mip = std::min((int)p[2], MaxMip); mip <= MaxMip; mip++)
+            {
+                uint32_t key = pageKey(mip, x, y);
+                std::unordered_map<uint32_t, int>::iterator page = resident.find(key);
+                if (page != resident.end())
+                {
+                    slots[page->second].lastUsed = frame;
+                    break;
+                }
+                wanted[key]++;
+                x >>= 1;
+                y >>= 1;
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        // coarse pages first so there is always a close fallback, then the most visible pages
+        std::vector<std::pair<uint32_t, int> > missing;
+        for (std::unordered_map<uint32_t, int>::iterator it = wanted.begin(); it != wanted.end(); ++it)
+            if (inFlight.find(it->first) == inFlight.end())
+                missing.push_back(*it);
+        std::sort(missing.begin(), missing.end(), [](const std::pair<uint32_t, int>& a, const std::pair<uint32_t, int>& b)
+        {
+            if (keyMip(a.first) != keyMip(b.first))
+                return keyMip(a.first) > keyMip(b.first);
+            return a.second > b.second;
+        });
+        for (int i = 0; i < (int)missing.size() && i < MaxRequestsPerFrame; i++)
+            requestPage(missing[i].first);
+    }
+
+    //////////////////////////////// Page uploads //////////////////////////////////////////////////
+    void uploadFinishedPages()
+    {
+        std::vector<LoadedPage> ready;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            int count = std::min((int)finished.size(), MaxUploadsPerFrame);
+            ready.assign(std::make_move_iterator(finished.begin()), std::make_move_iterator(finished.begin() + count));
+            finished.erase(finished.begin(), finished.begin() + count);
+        }
+        if (ready.empty())
+            return;
+
+        glBindTexture(GL_TEXTURE_2D, PhysicalCache);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (size_t i = 0; i < ready.size(); i++)
+        {
+            inFlight.erase(ready[i].key);
+            int slot = findFreeSlot();
+            if (slot < 0)
+                continue;   // everything in the cache is visible right now, the page is requested again later
+            if (slots[slot].used)
+                resident.erase(slots[slot].key);
+            slots[slot].key = ready[i].key;
+            slots[slot].lastUsed = frame;
+            slots[slot].used = true;
+            resident[ready[i].key] = slot;
+
+            int cx = slot % CachePages;
+            int cy = slot / CachePages;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, cx * PageSize, cy * PageSize, PageSize, PageSize, GL_RGBA, GL_UNSIGNED_BYTE, ready[i].pixels.data());
+            pageTableDirty = true;
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+
+    // Least recently used slot that was not seen this frame. The coarsest mip page is never evicted.
+    int findFreeSlot() const
+    {
+        int best = -1;
+        for (int i = 0; i < (int)slots.size(); i++)
+        {
+            if (!slots[i].used)
+                return i;
+            if (keyMip(slots[i].key) == MaxMip || slots[i].lastUsed == frame)
+                continue;
+            if (best < 0 || slots[i].lastUsed < slots[best].lastUsed)
+                best = i;
+        }
+        return best;
+    }
+
+    // Rebuilds the page table from coarse to fine: a page that isn't resident points at its closest resident ancestor
+    void uploadPageTable()
+    {
+        for (int mip = MaxMip; mip >= 0; mip--)
+        {
+            int size = levelSize(mip);
+            std::vector<uint32_t>& level = pageTable[mip];
+            for (int y = 0; y < size; y++)
+            {
+                for (int x = 0; x < size; x++)
+                {
+                    uint32_t entry = 0;
+                    std::unordered_map<uint32_t, int>::const_iterator page = resident.find(pageKey(mip, x, y));
+                    if (page != resident.end())
+                    {
+                        uint32_t cx = page->second % CachePages;
+                        uint32_t cy = page->second / CachePages;
+                        entry = cx | (cy << 8) | ((uint32_t)mip << 16) | 0xFF000000u;
+                    }
+                    else if (mip < MaxMip)
+                    {
+                        entry = pageTable[mip + 1][(y >> 1) * levelSize(mip + 1) + (x >> 1)];
+                    }
+                    level[y * size + x] = entry;
+                }
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D, PageTable);
+        for (int mip = 0; mip <= MaxMip; mip++)
+            glTexSubImage2D(GL_TEXTURE_2D, mip, 0, 0, levelSize(mip), levelSize(mip), GL_RGBA, GL_UNSIGNED_BYTE, pageTable[mip].data());
+        pageTableDirty = false;
+    }
+};
@@ -0,0 +1,338 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <glm.hpp>
+#include "Geometry.h"
+#include "Bvh.h"
+#include "Benchmark.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Visibility cache /////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Frustum visibility that is only recomputed where the camera has moved enough to change it. A box tested against the
+// planes (the same test as Frustum::intersectsAabb) also gives how far it is from changing: outside is the smallest
+// distance over the planes of the box's furthest corner, negative exactly when the box is behind one of them, and |outside|
+// is the slack before that flips. The planes are fixed in the camera's frame, so a corner's distance to them can only
+// change as much as its position in view space does, which from the pose the box was tested at is at most
+//
+//   |eye - testedEye| + (|center - testedEye| + |half size|) * 2 sin(angle / 2)
+//
+// with angle that of the rotation between the two view matrices. While that stays below the slack, the cached answer is
+// still the one a test would give. The distance and angle of each recent pose are worked out once a frame, so checking
+// an answer is a multiply-add and a compare.
+//
+// Checking every object each frame would still cost more than the Bvh's frustum query, which skips whole subtrees, so the
+// cache keeps a level above the objects: runs of GroupSize objects in the Bvh's leaf order, which lie close together, with
+// the same kind of answer for the box around them - wholly outside, wholly inside, or crossing a plane. Only the objects of
+// groups that cross a plane are looked at one by one. A new projection or a rebuilt tree drops everything, an object that
+// moved drops its own answer and its group's.
+
+struct VisibilityCacheStats
+{
+    size_t Objects;
+    size_t Hits;            // answered from the cache, on their own or by their group
+    size_t Retests;         // objects tested against the frustum
+    size_t GroupRetests;
+    size_t Visible;
+    double Milliseconds;
+};
+
+namespace VisibilityCacheDetail
+{
+    // poses an answer can be checked against, older ones are retested. A power of two, a slot is the frame number's low bits.
+    const uint32_t MaxPoses = 256;
+    const unsigned int GroupSize = 64;
+    // added to the turn, it covers the rounding of float plane distances a long way from the origin
+    const float Tolerance = 1e-5f;
+
+    enum GroupState
+    {
+        GROUP_OUTSIDE,
+        GROUP_CROSSING,
+        GROUP_INSIDE
+    };
+}
+
+class VisibilityCache
+{
+public:
+    VisibilityCache() : frame(0), oldestValid(1), treeBuild(0), totalHits(0), totalLookups(0)
+    {
+        frameStats = VisibilityCacheStats();
+        memset(lastProjection, 0, sizeof(lastProjection));
+        poses.resize(VisibilityCacheDetail::MaxPoses);
+        moved.resize(VisibilityCacheDetail::MaxPoses);
+        turned.resize(VisibilityCacheDetail::MaxPoses);
+    }
+
+    // The object's box changed, call with the Bvh's setBounds
+    void invalidate(unsigned int object)
+    {
+        if (object >= positionOf.size())
+            return;
+        unsigned int position = positionOf[object];
+        unsigned int group = position / VisibilityCacheDetail::GroupSize;
+        movedPositions.push_back(position);
+        objects[position].TestedAt = 0;
+        groups[group].TestedAt = 0;
+        groupBoxes[group].Dirty = 1;
+    }
+
+    void invalidateAll() { oldestValid = frame + 1; }
+
+    // Appends the objects of bvh whose box is in the frustum of projection * view, in the tree's leaf order. The same
+    // objects as bvh.queryFrustum finds, view has to be a rigid transform, which lookAt is.
+    void query(const Bvh& bvh, const glm::mat4& projection, const glm::mat4& view, std::vector<unsigned int>& visible)
+    {
+        using namespace VisibilityCacheDetail;
+        CpuTimer timer;
+        frameStats = VisibilityCacheStats();
+        size_t count = bvh.size();
+        frameStats.Objects = count;
+
+        if (bvh.buildCount() != treeBuild || positionOf.size() != count)
+            rebuild(bvh);
+        for (size_t i = 0; i < movedPositions.size(); i++)
+            boxes[movedPositions[i]] = bvh.bounds(bvh.objectAt(movedPositions[i]));
+        movedPositions.clear();
+        if (memcmp(lastProjection, &projection[0][0], sizeof(lastProjection)) != 0)
+        {
+            memcpy(lastProjection, &projection[0][0], sizeof(lastProjection));
+            invalidateAll();
+        }
+        frame++;
+        Pose& current = poses[frame & (MaxPoses - 1)];
+        current.View = view;
+        // the eye is -R^T t for view = [R | t]
+        glm::vec3 t(view[3][0], view[3][1], view[3][2]);
+        current.Eye = -glm::vec3(view[0][0] * t.x + view[0][1] * t.y + view[0][2] * t.z,
+            view[1][0] * t.x + view[1][1] * t.y + view[1][2] * t.z,
+            view[2][0] * t.x + view[2][1] * t.y + view[2][2] * t.z);
+
+        // how far every pose still in use is from this one. For rotations |R - R'|^2 summed over the entries is
+        // 2 (3 - trace(R R'^T)) = 2 (2 sin(angle / 2))^2, taken from the differences since the trace loses small angles.
+        uint32_t first = std::max(oldestValid, frame >= MaxPoses ? frame - MaxPoses + 1 : 1u);
+        for (uint32_t f = first; f <= frame; f++)
+        {
+            uint32_t slot = f & (MaxPoses - 1);
+            const glm::mat4& old = poses[slot].View;
+            float difference = 0.0f;
+            for (int c = 0; c < 3; c++)
+                for (int r = 0; r < 3; r++)
+                    difference += (view[c][r] - old[c][r]) * (view[c][r] - old[c][r]);
+            moved[slot] = glm::length(current.Eye - poses[slot].Eye);
+            turned[slot] = std::sqrt(0.5f * difference) + Tolerance;
+        }
+
+        Frustum frustum = Frustum::fromMatrix(projection * view);
+        for (size_t g = 0; g < groups.size(); g++)
+        {
+            Entry& group = groups[g];
+            unsigned int begin = (unsigned int)g * GroupSize;
+            unsigned int end = std::min(begin + GroupSize, (unsigned int)count);
+            if (!valid(group.TestedAt, group.Slack, group.Reach, first))
+            {
+                GroupBox& box = groupBoxes[g];
+                if (box.Dirty)
+                {
+                    box.Box = Aabb();
+                    box.HasEmpty = 0;
+                    for (unsigned int p = begin; p < end; p++)
+                    {
+                        if (boxes[p].empty())
+                            box.HasEmpty = 1;
+                        else
+                            box.Box.extend(boxes[p]);
+                    }
+                    box.Dirty = 0;
+                }
+                float outside, inside;
+                if (box.Box.empty())
+                {
+                    outside = inside = -FLT_MAX;
+                    group.Reach = 0.0f;
+                }
+                else
+                    classify(frustum, box.Box, current.Eye, outside, inside, group.Reach);
+                if (outside < 0.0f)
+                {
+                    group.Value = GROUP_OUTSIDE;
+                    group.Slack = -outside;
+                }
+                else if (inside >= 0.0f)
+                {
+                    group.Value = GROUP_INSIDE;
+                    group.Slack = inside;
+                }
+                else
+                {
+                    group.Value = GROUP_CROSSING;
+                    group.Slack = std::min(outside, -inside);
+                }
+                group.TestedAt = frame;
+                frameStats.GroupRetests++;
+            }
+
+            if (group.Value != GROUP_CROSSING)
+            {
+                frameStats.Hits += end - begin;
+                if (group.Value == GROUP_INSIDE)
+                    for (unsigned int p = begin; p < end; p++)
+                        if (!groupBoxes[g].HasEmpty || !boxes[p].empty())
+                            visible.push_back(bvh.objectAt(p));
+                continue;
+            }
+
+            for (unsigned int p = begin; p < end; p++)
+            {
+                Entry& entry = objects[p];
+                unsigned int object = bvh.objectAt(p);
+                if (valid(entry.TestedAt, entry.Slack, entry.Reach, first))
+                    frameStats.Hits++;
+                else
+                {
+                    float outside, inside;
+                    const Aabb& box = boxes[p];
+                    if (box.empty())
+                    {
+                        outside = inside = -FLT_MAX;
+                        entry.Reach = 0.0f;
+                    }
+                    else
+                        classify(frustum, box, current.Eye, outside, inside, entry.Reach);
+                    entry.Slack = std::fabs(outside);
+                    entry.TestedAt = frame;
+                    entry.Value = outside >= 0.0f ? 1 : 0;
+                    frameStats.Retests++;
+                }
+                if (entry.Value)
+                    visible.push_back(object);
+            }
+        }
+
+        frameStats.Visible = visible.size();
+        frameStats.Milliseconds = timer.milliseconds();
+        totalHits += frameStats.Hits;
+        totalLookups += frameStats.Objects;
+    }
+
+    const VisibilityCacheStats& stats() const { return frameStats; }
+
+    // Share of lookups answered from the cache since the start
+    double hitRate() const { return totalLookups ? (double)totalHits / (double)totalLookups : 0.0; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << frameStats.Objects << " objects: " << frameStats.Hits << " cached, " << frameStats.Retests << " and "
+            << frameStats.GroupRetests << " groups retested, " << frameStats.Visible << " visible in " << frameStats.Milliseconds
+            << " ms, " << hitRate() * 100.0 << "% cached overall" << std::endl;
+    }
+
+private:
+    struct Pose
+    {
+        glm::mat4 View;
+        glm::vec3 Eye;
+    };
+
+    // An answer: how far it is from flipping, how far the box reaches from the eye it was tested from, the frame it was
+    // tested in (0 for never) and the answer itself, visible or not for an object and a GroupState for a group
+    struct Entry
+    {
+        float Slack;
+        float Reach;
+        uint32_t TestedAt;
+        unsigned int Value;
+    };
+
+    // Only needed when a group is retested, kept apart from the answers every frame walks through
+    struct GroupBox
+    {
+        Aabb Box;
+        unsigned int Dirty;
+        // a member has an empty box, which is never visible
+        unsigned int HasEmpty;
+    };
+
+    // per leaf order position, with a copy of the boxes so a group's are next to each other
+    std::vector<Entry> objects;
+    std::vector<Aabb> boxes;
+    std::vector<Entry> groups;
+    std::vector<GroupBox> groupBoxes;
+    std::vector<unsigned int> positionOf;
+    // whose boxes to copy again
+    std::vector<unsigned int> movedPositions;
+
+    // the last MaxPoses views and how far each is from the current one
+    std::vector<Pose> poses;
+    std::vector<float> moved;
+    std::vector<float> turned;
+    uint32_t frame;
+    // answers from before this frame are stale
+    uint32_t oldestValid;
+    unsigned int treeBuild;
+    float lastProjection[16];
+
+    size_t totalHits;
+    size_t totalLookups;
+    VisibilityCacheStats frameStats;
+
+    // The tree's leaf order changed, every answer is for a different object now
+    void rebuild(const Bvh& bvh)
+    {
+        size_t count = bvh.size();
+        treeBuild = bvh.buildCount();
+        positionOf.resize(count);
+        boxes.resize(count);
+        for (unsigned int p = 0; p < (unsigned int)count; p++)
+        {
+            positionOf[bvh.objectAt(p)] = p;
+            boxes[p] = bvh.bounds(bvh.objectAt(p));
+        }
+        movedPositions.clear();
+        Entry entry = {};
+        objects.assign(count, entry);
+        size_t groupCount = (count + VisibilityCacheDetail::GroupSize - 1) / VisibilityCacheDetail::GroupSize;
+        groups.assign(groupCount, entry);
+        GroupBox box;
+        box.Dirty = 1;
+        box.HasEmpty = 0;
+        groupBoxes.assign(groupCount, box);
+        invalidateAll();
+    }
+
+    bool valid(uint32_t testedAt, float slack, float reach, uint32_t first) const
+    {
+        if (testedAt < first)
+            return false;
+        uint32_t slot = testedAt & (VisibilityCacheDetail::MaxPoses - 1);
+        return moved[slot] + reach * turned[slot] < slack;
+    }
+
+    // The smallest distance over the planes of the box's corner furthest along each one's normal, picked the way
+    // Frustum::intersectsAabb does so the two agree to the last bit, and of the nearest corner. Also how far the box
+    // reaches from eye.
+    static void classify(const Frustum& frustum, const Aabb& box, const glm::vec3& eye, float& outside, float& inside, float& reach)
+    {
+        outside = inside = FLT_MAX;
+        for (int i = 0; i < Frustum::PLANE_COUNT; i++)
+        {
+            const glm::vec4& plane = frustum.Planes[i];
+            float x = plane.x > 0.0f ? box.Max.x : box.Min.x;
+            float y = plane.y > 0.0f ? box.Max.y : box.Min.y;
+            float z = plane.z > 0.0f ? box.Max.z : box.Min.z;
+            outside = std::min(outside, plane.x * x + plane.y * y + plane.z * z + plane.w);
+            x = plane.x > 0.0f ? box.Min.x : box.Max.x;
+            y = plane.y > 0.0f ? box.Min.y : box.Max.y;
+            z = plane.z > 0.0f ? box.Min.z : box.Max.z;
+            inside = std::min(inside, plane.x * x + plane.y * y + plane.z * z + plane.w);
+        }
+        glm::vec3 center = box.center();
+        reach = glm::length(center - eye) + glm::length(box.Max - center);
+    }
+};
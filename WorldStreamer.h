@@ -0,0 +1,556 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cmath>
+#include <iostream>
+#include <glad/glad.h>
+#include <glm.hpp>
+#include "Mesh.h"
+#include "Geometry.h"
+#include "GeometryBuffer.h"
+#include "GpuMemory.h"
+#include "Picking.h"
+#include "Benchmark.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////// Streams a world that doesn't fit in memory, one grid cell at a time ////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The ground plane is split into square cells of CellSize. A cell's meshes, textures and the objects placing them come from
+// the CellProvider on a background thread; the main thread uploads a few finished cells a frame and frees the cells that
+// are no longer wanted. Distances are measured from a cell's center to the segment from the camera to where it will be in
+// PrefetchSeconds, going along Front at the speed it has been moving, so cells ahead are asked for before they are close.
+//
+// Every frame the wanted cells (within LoadRadius) and the resident ones are ranked by that distance, resident cells as if
+// they were UnloadRadius - LoadRadius closer, and taken in order while their bytes fit BudgetBytes. Cells that didn't load
+// yet count with the average size of the cells loaded so far. Whatever doesn't fit is evicted, or not asked for, and the
+// loader's queue is replaced by the missing cells that made it, nearest first. The handicap is the hysteresis: a resident
+// cell is only dropped once it is past UnloadRadius or a cell that much closer needs its memory, so walking back and forth
+// across a border doesn't load and unload the same cells.
+//
+// The loader also builds a TriangleBvh for each of a cell's meshes, so a resident cell's objects can be picked and
+// collided with like any other. OnUpload and OnEvict tell the caller when a cell's objects come and go; that is where
+// they are added to and taken out of the caller's instances and scene tree, the streamer itself doesn't draw anything.
+
+// RGBA8 texels, rows from the bottom like every other texture we upload
+struct StreamedImage
+{
+    int Width;
+    int Height;
+    std::vector<unsigned char> Pixels;
+
+    StreamedImage() : Width(0), Height(0) {}
+};
+
+// One of the cell's meshes drawn with one of its images, Model is in world space
+struct StreamedObject
+{
+    unsigned int Mesh;
+    unsigned int Image;
+    glm::mat4 Model;
+};
+
+// What a provider fills for a cell, meshes in the Stride 5 position + uv layout of the built in ones
+struct CellContent
+{
+    std::vector<Mesh> Meshes;
+    std::vector<StreamedImage> Images;
+    std::vector<StreamedObject> Objects;
+};
+
+// A cell that is on the GPU. Compaction can move meshes around, draw with GeometryBuffer::range(Meshes[i].Id).
+struct WorldCell
+{
+    int X;
+    int Z;
+    std::vector<MeshRange> Meshes;
+    std::vector<unsigned int> Textures;
+    std::vector<StreamedObject> Objects;
+    std::vector<TriangleBvh> Triangles;     // per mesh, in model space
+    std::vector<unsigned int> Instances;    // the caller's ids for Objects, set in OnUpload
+    Aabb Bounds;        // of the objects, in world space
+    size_t Bytes;
+    float Rank;         // its place in the last update's order, smaller first
+};
+
+struct WorldStreamerStats
+{
+    size_t Requests;        // cells put in the loader's queue
+    size_t Cancelled;       // taken out of the queue again before the loader got to them
+    size_t Loads;           // cells uploaded
+    size_t Discarded;       // loaded, but no longer wanted or too big for the budget by the time they arrived
+    size_t Evictions;
+    size_t Hits;            // each frame, the cells within NeededRadius of the camera that were resident
+    size_t Misses;          // and those that weren't
+    double LatencyTotal;    // ms from the first request to the upload, over every load
+    double LatencyMax;
+    size_t PeakBytes;
+
+    WorldStreamerStats() : Requests(0), Cancelled(0), Loads(0), Discarded(0), Evictions(0), Hits(0), Misses(0), LatencyTotal(0.0),
+        LatencyMax(0.0), PeakBytes(0) {}
+};
+
+class WorldStreamer
+{
+public:
+    // Fills the content of cell (x, z), which covers [x, x + 1) * CellSize by [z, z + 1) * CellSize. Called from the loader
+    // thread, so it must not touch OpenGL.
+    typedef std::function<void(int x, int z, CellContent& content)> CellProvider;
+    // Called on the main thread with a cell that was just uploaded or is about to be evicted
+    typedef std::function<void(WorldCell& cell)> CellCallback;
+
+    float CellSize;
+    float LoadRadius;           // cells closer than this to the camera's path are wanted
+    float UnloadRadius;         // resident cells are kept up to here
+    float NeededRadius;         // cells this close to the camera should already be resident, the others count as misses
+    float PrefetchSeconds;      // how far ahead along Front to look, at the current speed
+    float MaxPrefetchDistance;
+    size_t BudgetBytes;
+    CellCallback OnUpload;
+    CellCallback OnEvict;
+
+    ///////////////////////// Constructor Function ////////////////////////////////////////////////
+    WorldStreamer(GeometryBuffer& geometry, float cellSize, float loadRadius, size_t budgetBytes, CellProvider provider)
+        : CellSize(cellSize), LoadRadius(loadRadius), UnloadRadius(loadRadius + cellSize), NeededRadius(cellSize * 1.5f),
+          PrefetchSeconds(2.0f), MaxPrefetchDistance(loadRadius), BudgetBytes(budgetBytes), geometry(geometry), provider(provider),
+          residentBytes(0), loadedBytes(0), speed(0.0f), hasPosition(false), quit(false)
+    {
+        loader = std::thread(&WorldStreamer::loaderThread, this);
+    }
+
+    ~WorldStreamer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            quit = true;
+        }
+        queueSignal.notify_all();
+        loader.join();
+        while (!resident.empty())
+            evict(resident.begin()->first);
+    }
+
+    ////////////////////////// Per frame update //////////////////////////////////////////////////
+    // Picks the cells to keep and to load around the camera, evicts the rest and uploads what the loader finished
+    void update(const glm::vec3& position, const glm::vec3& front, float deltaTime)
+    {
+        // speed over the ground, smoothed over about a quarter of a second
+        glm::vec2 here(position.x, position.z);
+        if (hasPosition && deltaTime > 0.0f)
+        {
+            float measured = glm::length(here - lastPosition) / deltaTime;
+            speed += (measured - speed) * std::min(deltaTime * 4.0f, 1.0f);
+        }
+        lastPosition = here;
+        hasPosition = true;
+
+        glm::vec2 ahead(front.x, front.z);
+        float aheadLength = glm::length(ahead);
+        glm::vec2 prefetch = here;
+        if (aheadLength > 1e-3f)
+            prefetch += ahead / aheadLength * std::min(speed * PrefetchSeconds, MaxPrefetchDistance);
+
+        rank(here, prefetch);
+        schedule();
+        uploadFinishedCells();
+        stats.PeakBytes = std::max(stats.PeakBytes, residentBytes);
+    }
+
+    // Calls visit(const WorldCell&) for every resident cell
+    template <typename Visit>
+    void forEachCell(const Visit& visit) const
+    {
+        for (std::unordered_map<uint64_t, WorldCell>::const_iterator it = resident.begin(); it != resident.end(); ++it)
+            visit(it->second);
+    }
+
+    size_t residentCells() const { return resident.size(); }
+    size_t residentByteCount() const { return residentBytes; }
+    size_t loadingCells() const { return requested.size(); }
+    const WorldStreamerStats& statistics() const { return stats; }
+    // Starts the counters over, what is resident stays
+    void resetStats() { stats = WorldStreamerStats(); }
+    double averageLatency() const { return stats.Loads ? stats.LatencyTotal / (double)stats.Loads : 0.0; }
+    double hitRate() const { return stats.Hits + stats.Misses ? (double)stats.Hits / (double)(stats.Hits + stats.Misses) : 1.0; }
+
+    void print(std::ostream& out) const
+    {
+        out << "  " << resident.size() << " cells resident, " << GpuMemoryTracker::megabytes(residentBytes) << " of " << GpuMemoryTracker::megabytes(BudgetBytes)
+            << " MB (peak " << GpuMemoryTracker::megabytes(stats.PeakBytes) << " MB), " << requested.size() << " loading" << std::endl;
+        out << "  " << stats.Requests << " requested, " << stats.Loads << " loaded, " << stats.Cancelled << " cancelled, "
+            << stats.Discarded << " discarded, " << stats.Evictions << " evicted" << std::endl;
+        out << "  load latency " << averageLatency() << " ms average, " << stats.LatencyMax << " ms worst" << std::endl;
+        out << "  " << hitRate() * 100.0 << "% of the cells around the camera were resident (" << stats.Misses << " misses)" << std::endl;
+    }
+
+private:
+    // owns GL objects
+    WorldStreamer(const WorldStreamer&);
+    WorldStreamer& operator=(const WorldStreamer&);
+
+    struct Candidate
+    {
+        uint64_t Key;
+        float Rank;
+        size_t Bytes;
+        bool Resident;
+    };
+    struct Request
+    {
+        double Time;    // when it was first asked for, on clock
+        float Rank;
+    };
+    struct LoadedCell
+    {
+        uint64_t Key;
+        CellContent Content;
+        std::vector<TriangleBvh> Triangles;
+    };
+
+    static const int MaxUploadsPerFrame = 2;
+
+    GeometryBuffer& geometry;
+    CellProvider provider;
+    CpuTimer clock;
+
+    std::unordered_map<uint64_t, WorldCell> resident;
+    size_t residentBytes;
+    size_t loadedBytes;                                 // over every load, for the size of cells not seen yet
+    std::unordered_map<uint64_t, Request> requested;    // queued, loading or finished but not uploaded
+    std::vector<Candidate> ranked;                      // this frame's order, resident and wanted cells
+    std::unordered_set<uint64_t> accepted;              // the ones that fit the budget
+    WorldStreamerStats stats;
+
+    glm::vec2 lastPosition;
+    float speed;
+    bool hasPosition;
+
+    std::thread loader;
+    std::mutex queueMutex;
+    std::condition_variable queueSignal;
+    std::deque<uint64_t> requests;
+    std::vector<LoadedCell> finished;
+    bool quit;
+
+    static uint64_t cellKey(int x, int z) { return ((uint64_t)(uint32_t)x << 32) | (uint64_t)(uint32_t)z; }
+    static int keyX(uint64_t key) { return (int)(uint32_t)(key >> 32); }
+    static int keyZ(uint64_t key) { return (int)(uint32_t)key; }
+
+    glm::vec2 cellCenter(uint64_t key) const
+    {
+        return glm::vec2(((float)keyX(key) + 0.5f) * CellSize, ((float)keyZ(key) + 0.5f) * CellSize);
+    }
+
+    static float distanceToSegment(const glm::vec2& point, const glm::vec2& a, const glm::vec2& b)
+    {
+        glm::vec2 ab = b - a;
+        float lengthSquared = glm::dot(ab, ab);
+        float t = lengthSquared > 0.0f ? std::min(std::max(glm::dot(point - a, ab) / lengthSquared, 0.0f), 1.0f) : 0.0f;
+        return glm::length(point - (a + ab * t));
+    }
+
+    size_t estimatedBytes() const { return stats.Loads ? loadedBytes / stats.Loads : 0; }
+
+    //////////////////////////////// Loader thread ///////////////////////////////////////////////
+    void loaderThread()
+    {
+        for (;;)
+        {
+            uint64_t key;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueSignal.wait(lock, [this] { return quit || !requests.empty(); });
+                if (quit)
+                    return;
+                key = requests.front();
+                requests.pop_front();
+            }
+            LoadedCell cell;
+            cell.Key = key;
+            provider(keyX(key), keyZ(key), cell.Content);
+            cell.Triangles.resize(cell.Content.Meshes.size());
+            for (size_t m = 0; m < cell.Content.Meshes.size(); m++)
+            {
+                const Mesh& mesh = cell.Content.Meshes[m];
+                std::vector<glm::vec3> positions(mesh.vertexCount());
+                for (size_t v = 0; v < positions.size(); v++)
+                    positions[v] = glm::vec3(mesh.vertex(v)[0], mesh.vertex(v)[1], mesh.vertex(v)[2]);
+                cell.Triangles[m].build(positions, mesh.Indices);
+            }
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                finished.push_back(std::move(cell));
+            }
+        }
+    }
+
+    //////////////////////////////// Choosing the cells ////////////////////////////////////////////
+    // Orders the resident cells and the ones within LoadRadius of the path, evicts what is past UnloadRadius or over
+    // budget, and counts the hits and misses around the camera
+    void rank(const glm::vec2& here, const glm::vec2& prefetch)
+    {
+        ranked.clear();
+        float handicap = UnloadRadius - LoadRadius;
+        std::vector<uint64_t> leaving;
+        for (std::unordered_map<uint64_t, WorldCell>::iterator it = resident.begin(); it != resident.end(); ++it)
+        {
+            float distance = distanceToSegment(cellCenter(it->first), here, prefetch);
+            if (distance > UnloadRadius)
+            {
+                leaving.push_back(it->first);
+                continue;
+            }
+            Candidate candidate = { it->first, distance - handicap, it->second.Bytes, true };
+            ranked.push_back(candidate);
+        }
+        for (size_t i = 0; i < leaving.size(); i++)
+            evict(leaving[i]);
+
+        int x0 = (int)std::floor((std::min(here.x, prefetch.x) - LoadRadius) / CellSize);
+        int x1 = (int)std::floor((std::max(here.x, prefetch.x) + LoadRadius) / CellSize);
+        int z0 = (int)std::floor((std::min(here.y, prefetch.y) - LoadRadius) / CellSize);
+        int z1 = (int)std::floor((std::max(here.y, prefetch.y) + LoadRadius) / CellSize);
+        size_t estimate = estimatedBytes();
+        for (int z = z0; z <= z1; z++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                uint64_t key = cellKey(x, z);
+                if (resident.find(key) != resident.end())
+                    continue;
+                float distance = distanceToSegment(cellCenter(key), here, prefetch);
+                if (distance > LoadRadius)
+                    continue;
+                Candidate candidate = { key, distance, estimate, false };
+                ranked.push_back(candidate);
+            }
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const Candidate& a, const Candidate& b) { return a.Rank < b.Rank; });
+
+        // strictly in order: once a cell doesn't fit, nothing after it is kept or loaded either
+        accepted.clear();
+        size_t used = 0;
+        bool full = false;
+        for (size_t i = 0; i < ranked.size(); i++)
+        {
+            full = full || used + ranked[i].Bytes > BudgetBytes;
+            if (!full)
+            {
+                used += ranked[i].Bytes;
+                accepted.insert(ranked[i].Key);
+                if (ranked[i].Resident)
+                    resident[ranked[i].Key].Rank = ranked[i].Rank;
+            }
+            else if (ranked[i].Resident)
+                evict(ranked[i].Key);
+        }
+
+        int n0 = (int)std::floor((here.x - NeededRadius) / CellSize), n1 = (int)std::floor((here.x + NeededRadius) / CellSize);
+        int m0 = (int)std::floor((here.y - NeededRadius) / CellSize), m1 = (int)std::floor((here.y + NeededRadius) / CellSize);
+        for (int z = m0; z <= m1; z++)
+        {
+            for (int x = n0; x <= n1; x++)
+            {
+                uint64_t key = cellKey(x, z);
+                if (glm::length(cellCenter(key) - here) > NeededRadius)
+                    continue;
+                if (resident.find(key) != resident.end())
+                    stats.Hits++;
+                else
+                    stats.Misses++;
+            }
+        }
+    }
+
+    // Replaces the loader's queue with the accepted cells that are neither resident nor already with the loader
+    void schedule()
+    {
+        double now = clock.milliseconds();
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            std::unordered_set<uint64_t> queued(requests.begin(), requests.end());
+            for (std::deque<uint64_t>::const_iterator it = requests.begin(); it != requests.end(); ++it)
+            {
+                if (accepted.find(*it) == accepted.end())
+                {
+                    requested.erase(*it);
+                    stats.Cancelled++;
+                }
+            }
+            requests.clear();
+            for (size_t i = 0; i < ranked.size(); i++)
+            {
+                const Candidate& candidate = ranked[i];
+                if (candidate.Resident || accepted.find(candidate.Key) == accepted.end())
+                    continue;
+                std::unordered_map<uint64_t, Request>::iterator request = requested.find(candidate.Key);
+                if (request == requested.end())
+                {
+                    Request fresh = { now, candidate.Rank };
+                    requested[candidate.Key] = fresh;
+                    stats.Requests++;
+                }
+                else
+                {
+                    request->second.Rank = candidate.Rank;
+                    if (queued.find(candidate.Key) == queued.end())
+                        continue;   // being loaded right now, or waiting to be uploaded
+                }
+                requests.push_back(candidate.Key);
+            }
+        }
+        queueSignal.notify_one();
+    }
+
+    //////////////////////////////// Uploads and evictions /////////////////////////////////////////
+    void uploadFinishedCells()
+    {
+        std::vector<LoadedCell> ready;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            int count = std::min((int)finished.size(), MaxUploadsPerFrame);
+            ready.assign(std::make_move_iterator(finished.begin()), std::make_move_iterator(finished.begin() + count));
+            finished.erase(finished.begin(), finished.begin() + count);
+        }
+        for (size_t i = 0; i < ready.size(); i++)
+        {
+            std::unordered_map<uint64_t, Request>::iterator request = requested.find(ready[i].Key);
+            if (request == requested.end() || accepted.find(ready[i].Key) == accepted.end())
+            {
+                if (request != requested.end())
+                    requested.erase(request);
+                stats.Discarded++;
+                continue;
+            }
+            Request done = request->second;
+            requested.erase(request);
+
+            // the estimate it was accepted with can be off, make room from the cells ranked after it
+            size_t bytes = contentBytes(ready[i].Content);
+            while (residentBytes + bytes > BudgetBytes && evictFarthest(done.Rank))
+            {
+            }
+            if (residentBytes + bytes > BudgetBytes || !upload(ready[i], bytes, done.Rank))
+            {
+                stats.Discarded++;
+                continue;
+            }
+            double latency = clock.milliseconds() - done.Time;
+            stats.Loads++;
+            stats.LatencyTotal += latency;
+            stats.LatencyMax = std::max(stats.LatencyMax, latency);
+            loadedBytes += bytes;
+        }
+    }
+
+    size_t contentBytes(const CellContent& content) const
+    {
+        size_t bytes = 0;
+        for (size_t m = 0; m < content.Meshes.size(); m++)
+            bytes += content.Meshes[m].vertexCount() * geometry.layout().stride() + content.Meshes[m].Indices.size() * sizeof(unsigned int);
+        for (size_t t = 0; t < content.Images.size(); t++)
+        {
+            const StreamedImage& image = content.Images[t];
+            bytes += gpuTextureBytes(GL_RGBA8, gpuMipLevels(image.Width, image.Height), image.Width, image.Height);
+        }
+        return bytes;
+    }
+
+    bool upload(LoadedCell& loaded, size_t bytes, float cellRank)
+    {
+        uint64_t key = loaded.Key;
+        const CellContent& content = loaded.Content;
+        WorldCell cell;
+        cell.X = keyX(key);
+        cell.Z = keyZ(key);
+        cell.Bytes = bytes;
+        cell.Rank = cellRank;
+        cell.Objects = content.Objects;
+        std::vector<Aabb> meshBoxes(content.Meshes.size());
+        for (size_t m = 0; m < content.Meshes.size(); m++)
+        {
+            const Mesh& mesh = content.Meshes[m];
+            MeshRange range = geometry.add(mesh);
+            if (range.IndexCount == 0 && !mesh.Indices.empty())
+            {
+                // the heap is full, give back what this cell already took
+                for (size_t r = 0; r < cell.Meshes.size(); r++)
+                    geometry.remove(cell.Meshes[r]);
+                return false;
+            }
+            cell.Meshes.push_back(range);
+            for (size_t v = 0; v < mesh.vertexCount(); v++)
+                meshBoxes[m].extend(glm::vec3(mesh.vertex(v)[0], mesh.vertex(v)[1], mesh.vertex(v)[2]));
+        }
+        for (size_t o = 0; o < cell.Objects.size(); o++)
+            cell.Bounds.extend(meshBoxes[cell.Objects[o].Mesh].transformed(cell.Objects[o].Model));
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (size_t t = 0; t < content.Images.size(); t++)
+        {
+            const StreamedImage& image = content.Images[t];
+            unsigned int texture;
+            glGenTextures(1, &texture);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            gpuTexStorage2D(texture, gpuMipLevels(image.Width, image.Height), GL_RGBA8, image.Width, image.Height);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.Width, image.Height, GL_RGBA, GL_UNSIGNED_BYTE, image.Pixels.data());
+            glGenerateMipmap(GL_TEXTURE_2D);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            cell.Textures.push_back(texture);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        cell.Triangles.swap(loaded.Triangles);
+        residentBytes += bytes;
+        WorldCell& added = resident[key] = std::move(cell);
+        if (OnUpload)
+            OnUpload(added);
+        return true;
+    }
+
+    void evict(uint64_t key)
+    {
+        std::unordered_map<uint64_t, WorldCell>::iterator it = resident.find(key);
+        if (it == resident.end())
+            return;
+        if (OnEvict)
+            OnEvict(it->second);
+        for (size_t m = 0; m < it->second.Meshes.size(); m++)
+            geometry.remove(it->second.Meshes[m]);
+        if (!it->second.Textures.empty())
+            gpuDeleteTextures((GLsizei)it->second.Textures.size(), it->second.Textures.data());
+        residentBytes -= it->second.Bytes;
+        resident.erase(it);
+        stats.Evictions++;
+    }
+
+    // Evicts the resident cell ranked last, as long as that is after the given rank
+    bool evictFarthest(float after)
+    {
+        uint64_t farthest = 0;
+        float farthestRank = after;
+        bool found = false;
+        for (std::unordered_map<uint64_t, WorldCell>::const_iterator it = resident.begin(); it != resident.end(); ++it)
+        {
+            if (it->second.Rank > farthestRank)
+            {
+                farthest = it->first;
+                farthestRank = it->second.Rank;
+                found = true;
+            }
+        }
+        if (found)
+            evict(farthest);
+        return found;
+    }
+};
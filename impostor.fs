@@ -0,0 +1,31 @@
+#version 460 core
+out vec4 FragColor;
+
+in vec2 TexCoord;
+in vec3 WorldPosition;
+flat in vec3 Facing;
+flat in float Reach;
+flat in vec3 Tint;
+
+layout (std140, binding = 0) uniform Frame
+{
+	mat4 view;
+	mat4 projection;
+};
+
+uniform sampler2DArray impostorColor;
+uniform sampler2DArray impostorDepth;
+uniform int impostorLayer;
+
+void main()
+{
+	vec4 color = texture(impostorColor, vec3(TexCoord, impostorLayer));
+	if (color.a < 0.5)
+		discard;
+	// the baked depth runs from Reach in front of the center to Reach behind it, put the fragment there
+	float depth = texture(impostorDepth, vec3(TexCoord, impostorLayer)).r;
+	vec4 clip = projection * view * vec4(WorldPosition + Facing * (Reach * (1.0 - 2.0 * depth)), 1.0);
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+	// the mips average the colors with the empty texels around the silhouette
+	FragColor = vec4(color.rgb / color.a * Tint, 1.0);
+}
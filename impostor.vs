@@ -0,0 +1,89 @@
+#version 460 core
+// A quad facing the camera for every instance in impostorInstances, showing the view of ImpostorAtlas's layer baked
+// from the direction closest to the camera's
+
+out vec2 TexCoord;
+out vec3 WorldPosition;
+flat out vec3 Facing;
+flat out float Reach;
+flat out vec3 Tint;
+
+// one entry per instance, written by InstanceBuffer
+struct Instance
+{
+	mat4 model;
+	uint material;
+	uint padding0, padding1, padding2;
+};
+layout (std430, binding = 0) readonly buffer Instances
+{
+	Instance instances[];
+};
+// the instances drawn with this layer, written by ImpostorAtlas::draw
+layout (std430, binding = 3) readonly buffer Impostors
+{
+	uint impostorInstances[];
+};
+
+// written once a frame into the FrameAllocator
+layout (std140, binding = 0) uniform Frame
+{
+	mat4 view;
+	mat4 projection;
+};
+
+uniform vec4 impostorBounds;	// xyz the model space center of the views, w their half size
+uniform int impostorViews;
+
+const vec3 materialTints[4] = vec3[](vec3(1.0), vec3(1.0, 0.75, 0.6), vec3(0.6, 0.85, 1.0), vec3(0.75, 1.0, 0.7));
+
+// the same octahedral mapping and view axes as ImpostorDetail in Impostor.h
+vec2 signNotZero(vec2 v)
+{
+	return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 octEncode(vec3 direction)
+{
+	vec2 p = direction.xz / (abs(direction.x) + abs(direction.y) + abs(direction.z));
+	return direction.y < 0.0 ? (1.0 - abs(p.yx)) * signNotZero(p) : p;
+}
+
+vec3 octDecode(vec2 p)
+{
+	vec3 direction = vec3(p.x, 1.0 - abs(p.x) - abs(p.y), p.y);
+	if (direction.y < 0.0)
+		direction.xz = (1.0 - abs(direction.zx)) * signNotZero(direction.xz);
+	return normalize(direction);
+}
+
+void main()
+{
+	uint instance = impostorInstances[gl_InstanceID];
+	mat4 model = instances[instance].model;
+	vec3 center = (model * vec4(impostorBounds.xyz, 1.0)).xyz;
+	vec3 eye = -transpose(mat3(view)) * view[3].xyz;
+	vec3 toEye = normalize(eye - center);
+
+	// the closest baked view, picked in model space so it turns with the object
+	vec3 local = normalize(inverse(mat3(model)) * toEye);
+	ivec2 cell = clamp(ivec2((octEncode(local) * 0.5 + 0.5) * float(impostorViews)), ivec2(0), ivec2(impostorViews - 1));
+	vec3 baked = octDecode((vec2(cell) + 0.5) / float(impostorViews) * 2.0 - 1.0);
+	vec3 reference = abs(baked.y) > 0.99 ? vec3(0.0, 0.0, -1.0) : vec3(0.0, 1.0, 0.0);
+	vec3 bakedUp = cross(baked, normalize(cross(reference, baked)));
+
+	// facing the camera, turned so that the view's up is up on screen too
+	vec3 up = mat3(model) * bakedUp;
+	up = normalize(up - dot(up, toEye) * toEye);
+	vec3 right = cross(up, toEye);
+	float scale = max(length(model[0].xyz), max(length(model[1].xyz), length(model[2].xyz)));
+	Reach = impostorBounds.w * scale;
+
+	// a triangle strip, gl_VertexID 0..3 are the corners (-1,-1), (1,-1), (-1,1), (1,1)
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+	WorldPosition = center + (right * corner.x + up * corner.y) * Reach;
+	gl_Position = projection * view * vec4(WorldPosition, 1.0);
+	TexCoord = (vec2(cell) + corner * 0.5 + 0.5) / float(impostorViews);
+	Facing = toEye;
+	Tint = materialTints[instances[instance].material % 4u];
+}
@@ -0,0 +1,16 @@
+#version 460 core
+layout (location = 0) out vec4 Color;
+layout (location = 1) out float Depth;
+
+in vec2 TexCoord;
+
+// the same textures and mix as shader.fs, the tint is applied when the impostor is drawn
+uniform sampler2D texture1;
+uniform sampler2D texture2;
+
+void main()
+{
+	Color = vec4(mix(texture(texture1, TexCoord), texture(texture2, TexCoord), 0.2).rgb, 1.0);
+	// the projection is orthographic, so this is linear across the bounding sphere
+	Depth = gl_FragCoord.z;
+}
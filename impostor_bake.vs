@@ -0,0 +1,14 @@
+#version 460 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aTexCoord;
+
+out vec2 TexCoord;
+
+// orthographic projection * view of one tile of the impostor layer * the mesh's dequantization
+uniform mat4 bakeMatrix;
+
+void main()
+{
+	gl_Position = bakeMatrix * vec4(aPos, 1.0f);
+	TexCoord = aTexCoord;
+}
@@ -1,7 +1,8 @@
-#version 330 core
+#version 460 core
 out vec4 FragColor;
 
 in vec2 TexCoord;
+flat in vec3 Tint;
 
 // texture samplers
 uniform sampler2D texture1;
@@ -9,6 +10,6 @@ uniform sampler2D texture2;
 
 void main()
 {
-	// linearly interpolate between both textures (80% container, 20% awesomeface)
-	FragColor = mix(texture(texture1, TexCoord), texture(texture2, TexCoord), 0.2);
-}
\ No newline at end of file
+	// linearly interpolate between both textures (80% container, 20% awesomeface), tinted by the instance's material
+	FragColor = mix(texture(texture1, TexCoord), texture(texture2, TexCoord), 0.2) * vec4(Tint, 1.0);
+}
@@ -1,15 +1,59 @@
-#version 330 core
+#version 460 core
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 aTexCoord;
 
 out vec2 TexCoord;
+flat out vec3 Tint;
+
+// one entry per instance, written by InstanceBuffer
+struct Instance
+{
+	mat4 model;
+	uint material;
+	uint padding0, padding1, padding2;
+};
+layout (std430, binding = 0) readonly buffer Instances
+{
+	Instance instances[];
+};
+// one entry per multi-draw command, written by MultiDrawBatch
+struct Draw
+{
+	mat4 dequantize;
+};
+layout (std430, binding = 1) readonly buffer Draws
+{
+	Draw draws[];
+};
+
+// written once a frame into the FrameAllocator
+layout (std140, binding = 0) uniform Frame
+{
+	mat4 view;
+	mat4 projection;
+};
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// instanced draws take their transform and material from the instance buffer, model then only dequantizes the mesh
+uniform bool instanced;
+// multi-draws are always instanced and take the mesh dequantization from draws[drawOffset + gl_DrawID] instead of model
+uniform bool indirect;
+uniform int drawOffset;
+
+const vec3 materialTints[4] = vec3[](vec3(1.0), vec3(1.0, 0.75, 0.6), vec3(0.6, 0.85, 1.0), vec3(0.75, 1.0, 0.7));
 
 void main()
 {
-	gl_Position = projection * view * model * vec4(aPos, 1.0f);
+	mat4 mesh = indirect ? draws[drawOffset + gl_DrawID].dequantize : model;
+	mat4 world = mesh;
+	Tint = vec3(1.0);
+	if (instanced || indirect)
+	{
+		// gl_InstanceID doesn't include the base instance
+		int instance = gl_BaseInstance + gl_InstanceID;
+		world = instances[instance].model * mesh;
+		Tint = materialTints[instances[instance].material % 4u];
+	}
+	gl_Position = projection * view * world * vec4(aPos, 1.0f);
 	TexCoord = vec2(aTexCoord.x, aTexCoord.y);
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+#version 460 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aTexCoord;
+
+out vec2 TexCoord;
+out float Shade;
+
+// one entry per multi-draw command, written by MultiDrawBatch
+struct Draw
+{
+	mat4 dequantize;
+};
+layout (std430, binding = 1) readonly buffer Draws
+{
+	Draw draws[];
+};
+// where each instance of a grid mesh goes this frame, written by ClipmapTerrain
+struct Patch
+{
+	ivec2 origin;
+	uint level;
+	uint padding;
+};
+layout (std430, binding = 2) readonly buffer Patches
+{
+	Patch patches[];
+};
+
+// written once a frame into the FrameAllocator
+layout (std140, binding = 0) uniform Frame
+{
+	mat4 view;
+	mat4 projection;
+};
+struct Level
+{
+	vec4 morph;	// xy center of the coarser level's hole, z its half size, w the blend band's width
+	vec4 grid;	// x spacing
+};
+layout (std140, binding = 1) uniform Levels
+{
+	Level levels[8];
+};
+
+uniform int drawOffset;
+// one toroidally addressed layer of heights per level
+uniform sampler2DArray terrainHeights;
+
+const vec3 lightDirection = normalize(vec3(0.4, 1.0, 0.3));
+
+float height(ivec2 cell, int level)
+{
+	ivec2 size = textureSize(terrainHeights, 0).xy;
+	return texelFetch(terrainHeights, ivec3(cell & (size - 1), level), 0).r;
+}
+
+// What the next coarser level shows at this fine vertex: its own height on shared vertices, the middle of the coarse
+// edge on the others. The odd/odd case follows the (x+1, z) - (x, z+1) diagonal the grid meshes are split along.
+float coarseHeight(ivec2 cell, int level)
+{
+	ivec2 odd = cell & 1;
+	if (odd.x == 0 && odd.y == 0)
+		return height(cell / 2, level + 1);
+	ivec2 a = odd.x == 1 && odd.y == 1 ? cell + ivec2(1, -1) : cell - odd;
+	ivec2 b = odd.x == 1 && odd.y == 1 ? cell + ivec2(-1, 1) : cell + odd;
+	return 0.5 * (height(a / 2, level + 1) + height(b / 2, level + 1));
+}
+
+void main()
+{
+	// the grid meshes hold integer coordinates, quantized exactly
+	vec3 local = (draws[drawOffset + gl_DrawID].dequantize * vec4(aPos, 1.0)).xyz;
+	Patch placement = patches[gl_BaseInstance + gl_InstanceID];
+	int level = int(placement.level);
+	ivec2 cell = placement.origin + ivec2(round(local.xz));
+	float spacing = levels[level].grid.x;
+	vec2 world = vec2(cell) * spacing;
+
+	// blend into the coarser level across the band inside this level's outer edge
+	vec4 morph = levels[level].morph;
+	vec2 offset = abs(world - morph.xy);
+	float alpha = clamp((max(offset.x, offset.y) - (morph.z - morph.w)) / morph.w, 0.0, 1.0);
+	float h = height(cell, level);
+	if (alpha > 0.0)
+		h = mix(h, coarseHeight(cell, level), alpha);
+
+	float dx = height(cell + ivec2(1, 0), level) - height(cell - ivec2(1, 0), level);
+	float dz = height(cell + ivec2(0, 1), level) - height(cell - ivec2(0, 1), level);
+	vec3 normal = normalize(vec3(-dx, 2.0 * spacing, -dz));
+	Shade = 0.35 + 0.65 * max(dot(normal, lightDirection), 0.0);
+
+	gl_Position = projection * view * vec4(world.x, h, world.y, 1.0);
+	// the same mapping the floor quad had, half a repeat of the floor image per world unit
+	TexCoord = world * 0.5 + 25.0;
+}
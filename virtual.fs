@@ -0,0 +1,38 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoord;
+// lighting from the terrain's slope
+in float Shade;
+
+// virtual texture
+uniform sampler2D vtPageTable;
+uniform sampler2D vtCache;
+uniform float vtVirtualPages;
+uniform float vtPageSize;
+uniform float vtPageBorder;
+uniform float vtCachePages;
+uniform float vtMaxMip;
+// maps the mesh's texture coordinates onto the [0,1] virtual texture
+uniform float vtUvScale;
+
+vec4 sampleVirtual(vec2 uv)
+{
+	float content = vtPageSize - 2.0 * vtPageBorder;
+	vec2 texel = uv * vtVirtualPages * content;
+	vec2 dx = dFdx(texel);
+	vec2 dy = dFdy(texel);
+	float mip = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy)))), 0.0, vtMaxMip);
+
+	// the page table already points at the closest resident ancestor when the wanted page isn't loaded yet
+	vec3 entry = floor(textureLod(vtPageTable, uv, mip).xyz * 255.0 + 0.5);
+	vec2 inPage = fract(uv * vtVirtualPages / exp2(entry.z));
+	vec2 physical = (entry.xy * vtPageSize + vtPageBorder + inPage * content) / (vtCachePages * vtPageSize);
+	return textureLod(vtCache, physical, 0.0);
+}
+
+void main()
+{
+	vec4 color = sampleVirtual(fract(TexCoord * vtUvScale));
+	FragColor = vec4(color.rgb * Shade, color.a);
+}
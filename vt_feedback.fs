@@ -0,0 +1,26 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoord;
+
+uniform float vtVirtualPages;
+uniform float vtPageSize;
+uniform float vtPageBorder;
+uniform float vtMaxMip;
+uniform float vtUvScale;
+// the feedback target is smaller than the screen, this brings the mip back to what the full resolution pass will pick
+uniform float vtFeedbackBias;
+
+void main()
+{
+	vec2 uv = fract(TexCoord * vtUvScale);
+	float content = vtPageSize - 2.0 * vtPageBorder;
+	vec2 texel = uv * vtVirtualPages * content;
+	vec2 dx = dFdx(texel);
+	vec2 dy = dFdy(texel);
+	float mip = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + vtFeedbackBias), 0.0, vtMaxMip);
+
+	// write the page (x, y, mip) this fragment needs, alpha marks the texel as valid
+	vec2 page = floor(uv * vtVirtualPages / exp2(mip));
+	FragColor = vec4(page, mip, 255.0) / 255.0;
+}